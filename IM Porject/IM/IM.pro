@@ -1,51 +1,91 @@
-#-------------------------------------------------
-#
-# Project created by QtCreator 2018-11-30T17:54:04
-#
-#-------------------------------------------------
-
-QT       += core gui network sql
-greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
-
-TARGET = IM
-TEMPLATE = app
-
-# The following define makes your compiler emit warnings if you use
-# any feature of Qt which has been marked as deprecated (the exact warnings
-# depend on your compiler). Please consult the documentation of the
-# deprecated API in order to know how to port your code away from it.
-DEFINES += QT_DEPRECATED_WARNINGS
-
-# You can also make your code fail to compile if you use deprecated APIs.
-# In order to do so, uncomment the following line.
-# You can also select to disable deprecated APIs only up to a certain version of Qt.
-#DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
-
-CONFIG += c++11
-
-SOURCES += \
-        main.cpp \
-        mainwindow.cpp \
-    imclient.cpp \
-    formlogin.cpp \
-    imdal.cpp
-
-HEADERS += \
-        mainwindow.h \
-    imclient.h \
-    protocol.h \
-    formlogin.h \
-    immessage.h \
-    imdal.h
-
-FORMS += \
-        mainwindow.ui \
-    formlogin.ui
-
-# Default rules for deployment.
-qnx: target.path = /tmp/$${TARGET}/bin
-else: unix:!android: target.path = /opt/$${TARGET}/bin
-!isEmpty(target.path): INSTALLS += target
-
-RESOURCES += \
-    resources.qrc
+#-------------------------------------------------
+#
+# Project created by QtCreator 2018-11-30T17:54:04
+#
+#-------------------------------------------------
+
+QT       += core gui network sql
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+
+TARGET = IM
+TEMPLATE = app
+
+# The following define makes your compiler emit warnings if you use
+# any feature of Qt which has been marked as deprecated (the exact warnings
+# depend on your compiler). Please consult the documentation of the
+# deprecated API in order to know how to port your code away from it.
+DEFINES += QT_DEPRECATED_WARNINGS
+
+# You can also make your code fail to compile if you use deprecated APIs.
+# In order to do so, uncomment the following line.
+# You can also select to disable deprecated APIs only up to a certain version of Qt.
+#DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
+
+CONFIG += c++11
+
+SOURCES += \
+        main.cpp \
+        mainwindow.cpp \
+    imclient.cpp \
+    imnetwork.cpp \
+    formlogin.cpp \
+    imdal.cpp \
+    imtransfer.cpp \
+    imdbwriter.cpp \
+    imchatmodel.cpp \
+    imchatdelegate.cpp \
+    imrostermodel.cpp \
+    imchatcache.cpp \
+    impresencestore.cpp \
+    imdbloader.cpp \
+    imstartuptrace.cpp \
+    imsegmentstore.cpp \
+    imarchive.cpp \
+    imlatencyoverlay.cpp
+
+HEADERS += \
+        mainwindow.h \
+    imclient.h \
+    imnetwork.h \
+    formlogin.h \
+    immessage.h \
+    imdal.h \
+    imtransfer.h \
+    imdbwriter.h \
+    imlockfreequeue.h \
+    imchatmodel.h \
+    imchatdelegate.h \
+    imrostermodel.h \
+    imchatcache.h \
+    impresencestore.h \
+    imdbloader.h \
+    imstartuptrace.h \
+    imsegmentstore.h \
+    imarchive.h \
+    imlatencyoverlay.h
+
+FORMS += \
+        mainwindow.ui \
+    formlogin.ui
+
+# Default rules for deployment.
+qnx: target.path = /tmp/$${TARGET}/bin
+else: unix:!android: target.path = /opt/$${TARGET}/bin
+!isEmpty(target.path): INSTALLS += target
+
+RESOURCES += \
+    resources.qrc
+
+# 协议静态库，与服务端共用
+win32:CONFIG(release, debug|release): LIBS += -L$$OUT_PWD/../IMProtocol/release/ -lIMProtocol
+else:win32:CONFIG(debug, debug|release): LIBS += -L$$OUT_PWD/../IMProtocol/debug/ -lIMProtocol
+else:unix: LIBS += -L$$OUT_PWD/../IMProtocol/ -lIMProtocol
+
+INCLUDEPATH += $$PWD/../IMProtocol
+DEPENDPATH += $$PWD/../IMProtocol
+
+win32-g++:CONFIG(release, debug|release): PRE_TARGETDEPS += $$OUT_PWD/../IMProtocol/release/libIMProtocol.a
+else:win32-g++:CONFIG(debug, debug|release): PRE_TARGETDEPS += $$OUT_PWD/../IMProtocol/debug/libIMProtocol.a
+else:win32:!win32-g++:CONFIG(release, debug|release): PRE_TARGETDEPS += $$OUT_PWD/../IMProtocol/release/IMProtocol.lib
+else:win32:!win32-g++:CONFIG(debug, debug|release): PRE_TARGETDEPS += $$OUT_PWD/../IMProtocol/debug/IMProtocol.lib
+else:unix: PRE_TARGETDEPS += $$OUT_PWD/../IMProtocol/libIMProtocol.a
@@ -0,0 +1,153 @@
+#include <QtEndian>
+#include <cstring>
+#include "imarchive.h"
+
+// 文件头的魔数与版本
+static const quint32 ArchiveMagic = 0x494D4152;
+static const quint32 ArchiveVersion = 2;
+// 文件头的长度
+static const qint64 HeaderSize = 8;
+// 消息中固定部分的长度：时间、消息编号、HLC时间、io、昵称长度
+static const int RecordFixedSize = 8 + 8 + 8 + 1 + 2;
+// 版本1的消息没有消息编号与HLC时间
+static const int RecordFixedSizeV1 = 8 + 1 + 2;
+
+IMArchiveWriter::IMArchiveWriter()
+    : m_ok(false)
+{
+}
+
+bool IMArchiveWriter::open(const QString &path)
+{
+    this->m_file.setFileName(path);
+    if (!this->m_file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+    uchar header[HeaderSize];
+    qToBigEndian<quint32>(ArchiveMagic, header);
+    qToBigEndian<quint32>(ArchiveVersion, header + 4);
+    this->m_ok = this->m_file.write(reinterpret_cast<const char *>(header), HeaderSize) == HeaderSize;
+    return this->m_ok;
+}
+
+bool IMArchiveWriter::write(const IMArchiveRecord &record)
+{
+    QByteArray user = record.user.toUtf8();
+    QByteArray content = record.content.toUtf8();
+    if (user.size() > 0xFFFF)
+        user.truncate(0xFFFF);
+    int length = RecordFixedSize + user.size() + content.size();
+
+    // 缓冲只会变大，之后的消息不再分配内存
+    this->m_buffer.resize(4 + length);
+    uchar *p = reinterpret_cast<uchar *>(this->m_buffer.data());
+    qToBigEndian<quint32>(quint32(length), p);
+    qToBigEndian<qint64>(record.time, p + 4);
+    qToBigEndian<quint64>(record.msgId, p + 12);
+    qToBigEndian<quint64>(record.hlc, p + 20);
+    p[28] = uchar(record.io.isEmpty() ? 'i' : record.io.at(0).toLatin1());
+    qToBigEndian<quint16>(quint16(user.size()), p + 29);
+    memcpy(p + 4 + RecordFixedSize, user.constData(), size_t(user.size()));
+    memcpy(p + 4 + RecordFixedSize + user.size(), content.constData(), size_t(content.size()));
+    if (this->m_file.write(this->m_buffer) != this->m_buffer.size())
+        this->m_ok = false;
+    return this->m_ok;
+}
+
+bool IMArchiveWriter::close()
+{
+    if (!this->m_file.isOpen())
+        return false;
+    uchar end[4];
+    qToBigEndian<quint32>(0, end);
+    if (this->m_file.write(reinterpret_cast<const char *>(end), 4) != 4 || !this->m_file.flush())
+        this->m_ok = false;
+    this->m_file.close();
+    return this->m_ok;
+}
+
+IMArchiveReader::IMArchiveReader()
+    : m_data(nullptr),
+      m_size(0),
+      m_pos(0),
+      m_version(0),
+      m_end(false)
+{
+}
+
+bool IMArchiveReader::open(const QString &path)
+{
+    this->m_file.setFileName(path);
+    if (!this->m_file.open(QIODevice::ReadOnly))
+    {
+        this->m_error = this->m_file.errorString();
+        return false;
+    }
+    this->m_size = this->m_file.size();
+    // 整个文件映射到内存，由系统按需读入，文件再大也不占用进程的堆内存
+    this->m_data = this->m_size > 0 ? this->m_file.map(0, this->m_size) : nullptr;
+    if (this->m_data == nullptr)
+    {
+        this->m_error = this->m_size > 0 ? this->m_file.errorString() : QString("empty file");
+        return false;
+    }
+    this->m_version = this->m_size < HeaderSize ? 0 : qFromBigEndian<quint32>(this->m_data + 4);
+    if (this->m_size < HeaderSize
+            || qFromBigEndian<quint32>(this->m_data) != ArchiveMagic
+            || this->m_version < 1 || this->m_version > ArchiveVersion)
+    {
+        this->m_error = "not an IM archive";
+        return false;
+    }
+    this->m_pos = HeaderSize;
+    this->m_end = false;
+    return true;
+}
+
+bool IMArchiveReader::next(IMArchiveRecord &record)
+{
+    if (this->m_data == nullptr || this->m_end || this->m_pos + 4 > this->m_size)
+        return false;
+    quint32 length = qFromBigEndian<quint32>(this->m_data + this->m_pos);
+    if (length == 0)
+    {
+        this->m_end = true;
+        return false;
+    }
+    const uchar *p = this->m_data + this->m_pos + 4;
+    int fixedSize = this->m_version >= 2 ? RecordFixedSize : RecordFixedSizeV1;
+    if (length < quint32(fixedSize) || this->m_pos + 4 + qint64(length) > this->m_size)
+    {
+        this->m_error = QString("truncated record at %1").arg(this->m_pos);
+        return false;
+    }
+    int userLength = qFromBigEndian<quint16>(p + fixedSize - 2);
+    if (quint32(fixedSize + userLength) > length)
+    {
+        this->m_error = QString("bad record at %1").arg(this->m_pos);
+        return false;
+    }
+    record.time = qFromBigEndian<qint64>(p);
+    record.msgId = this->m_version >= 2 ? qFromBigEndian<quint64>(p + 8) : 0;
+    record.hlc = this->m_version >= 2 ? qFromBigEndian<quint64>(p + 16) : 0;
+    record.io = QString(QChar::fromLatin1(char(p[fixedSize - 3])));
+    record.user = QString::fromUtf8(reinterpret_cast<const char *>(p + fixedSize), userLength);
+    record.content = QString::fromUtf8(reinterpret_cast<const char *>(p + fixedSize + userLength),
+                                       int(length) - fixedSize - userLength);
+    this->m_pos += 4 + qint64(length);
+    return true;
+}
+
+qint64 IMArchiveReader::count() const
+{
+    qint64 count = 0;
+    qint64 pos = this->m_pos;
+    while (this->m_data != nullptr && pos + 4 <= this->m_size)
+    {
+        quint32 length = qFromBigEndian<quint32>(this->m_data + pos);
+        if (length == 0 || pos + 4 + qint64(length) > this->m_size)
+            break;
+        pos += 4 + qint64(length);
+        ++count;
+    }
+    return count;
+}
@@ -0,0 +1,160 @@
+#ifndef IMARCHIVE_H
+#define IMARCHIVE_H
+
+#include <QString>
+#include <QByteArray>
+#include <QFile>
+
+/**
+ * @brief 导出文件中的一条消息
+ */
+struct IMArchiveRecord
+{
+    /**
+     * @brief time 毫秒时间戳
+     */
+    qint64 time = 0;
+
+    /**
+     * @brief io i收到消息 o发出消息 g群聊消息
+     */
+    QString io;
+
+    /**
+     * @brief user 私聊是对方昵称，群聊是发送者昵称
+     */
+    QString user;
+
+    /**
+     * @brief content 内容
+     */
+    QString content;
+
+    /**
+     * @brief msgId 服务端分配的消息编号，0表示没有
+     */
+    quint64 msgId = 0;
+
+    /**
+     * @brief hlc HLC时间，0表示没有
+     */
+    quint64 hlc = 0;
+};
+
+/***********************************
+ *
+ * 聊天记录的导出文件格式（大端序）
+ *
+ * [魔数 'IMAR'][版本]
+ * [长度][消息] [长度][消息] ...    长度是后面消息的字节数，不包括长度本身
+ * [0]                             长度为0表示结束，没有结束标记的文件是没写完的
+ *
+ * 每条消息：[时间 qint64][消息编号 quint64][HLC时间 quint64][io 1字节][昵称长度 quint16][昵称 UTF-8][内容 UTF-8，占满剩下的长度]
+ * 版本1的消息没有消息编号与HLC时间，读的时候当作0
+ *
+ * 每条消息都带长度，不用解析内容就能跳到下一条；
+ * 读的一方把整个文件映射到内存，直接在映射上解析，不用先读进缓冲区
+ *
+ **********************************/
+
+/***********************************
+ *
+ * Class IMArchiveWriter
+ * 一条一条追加写入导出文件，只保留一条消息的缓冲，内存占用与文件大小无关
+ *
+ **********************************/
+
+class IMArchiveWriter
+{
+public:
+    IMArchiveWriter();
+    Q_DISABLE_COPY(IMArchiveWriter)
+
+    /**
+     * @brief open 创建文件并写入文件头
+     * @param path 文件路径
+     * @return 是否成功
+     */
+    bool open(const QString &path);
+
+    /**
+     * @brief write 追加一条消息
+     * @return 是否成功
+     */
+    bool write(const IMArchiveRecord &record);
+
+    /**
+     * @brief close 写入结束标记并关闭文件
+     * @return 所有写入是否都成功
+     */
+    bool close();
+
+    /**
+     * @brief errorString 出错的原因
+     */
+    QString errorString() const { return m_file.errorString(); }
+
+private:
+    QFile m_file;
+    // 一条消息的编码缓冲，反复使用
+    QByteArray m_buffer;
+    // 之前的写入是否都成功
+    bool m_ok;
+};
+
+/***********************************
+ *
+ * Class IMArchiveReader
+ * 把导出文件映射到内存，按顺序读出每一条消息
+ *
+ **********************************/
+
+class IMArchiveReader
+{
+public:
+    IMArchiveReader();
+    Q_DISABLE_COPY(IMArchiveReader)
+
+    /**
+     * @brief open 打开并映射文件，检查文件头
+     * @param path 文件路径
+     * @return 是否成功
+     */
+    bool open(const QString &path);
+
+    /**
+     * @brief next 读出下一条消息
+     * @return 读到结束标记、文件不完整或者损坏时返回false
+     */
+    bool next(IMArchiveRecord &record);
+
+    /**
+     * @brief atEnd 是否读到了结束标记，next返回false后用来区分正常结束和文件损坏
+     */
+    bool atEnd() const { return m_end; }
+
+    /**
+     * @brief count 只按长度往后跳，数出文件中的消息条数，不改变读的位置
+     */
+    qint64 count() const;
+
+    /**
+     * @brief errorString 出错的原因
+     */
+    QString errorString() const { return m_error; }
+
+private:
+    QFile m_file;
+    // 映射的文件内容与大小
+    const uchar *m_data;
+    qint64 m_size;
+    // 下一条消息的位置
+    qint64 m_pos;
+    // 文件的版本
+    quint32 m_version;
+    // 是否读到了结束标记
+    bool m_end;
+    QString m_error;
+};
+
+#endif // IMARCHIVE_H
@@ -0,0 +1,322 @@
+#include <QDebug>
+#include "imchatcache.h"
+#include "imhybridclock.h"
+
+/**
+ * @brief 所有会话共用的发送者字符串池，只在界面线程中使用
+ * 每个昵称记下引用它的消息条数，会话被淘汰或者清空后没有引用的昵称回收，下标留给以后的新昵称
+ */
+struct IMSenderPool
+{
+    QVector<QString> names;
+    QVector<quint32> refs;
+    QHash<QString, quint32> indexes;
+    // 回收的下标
+    QVector<quint32> unused;
+
+    static IMSenderPool &instance()
+    {
+        static IMSenderPool pool;
+        return pool;
+    }
+};
+
+/**
+ * @brief 消息时间分段显示用到的日期，日期变化时代数加1，所有会话的第一行都作废
+ */
+struct IMRenderDay
+{
+    QDate today;
+    QDate yesterday;
+    QDate lastYear;
+    quint32 generation = 1;
+
+    static IMRenderDay &instance()
+    {
+        static IMRenderDay day;
+        return day;
+    }
+};
+
+bool IMChatRecord::setToday(const QDate &today)
+{
+    IMRenderDay &day = IMRenderDay::instance();
+    if (day.today == today)
+        return false;
+    day.today = today;
+    day.yesterday = today.addDays(-1);
+    day.lastYear = today.addYears(-1);
+    ++day.generation;
+    return true;
+}
+
+QString IMChatRecord::timeText(qint64 time)
+{
+    IMRenderDay &day = IMRenderDay::instance();
+    if (!day.today.isValid())
+        setToday(QDate::currentDate());
+    QDateTime dateTime = QDateTime::fromMSecsSinceEpoch(time);
+    // 选择时间的格式  如果是同一天，那么时间就按 12:00:00 这种格式显示
+    if (dateTime.date() > day.yesterday)
+        return dateTime.toString("HH:mm:ss");
+    // 否则如果超过一天，但是小于一年，则显示月份日期  12/10 12:00:00
+    else if (dateTime.date() > day.lastYear)
+        return dateTime.toString("MM/dd HH:mm:ss");
+    // 否则显示年份
+    else
+        return dateTime.toString("yyyy/MM.dd HH:mm:ss");
+}
+
+IMRenderedMessage &IMChatRecord::rendered(int i, const QString &peerName, const QString &selfName) const
+{
+    if (this->m_rendered.size() != this->m_entries.size())
+        this->m_rendered.resize(this->m_entries.size());
+    IMRenderedMessage &message = this->m_rendered[i];
+    quint32 generation = IMRenderDay::instance().generation;
+    if (message.day == generation)
+        return message;
+
+    const Entry &entry = this->m_entries.at(i);
+    // 第一次生成，确认状态变化时只重新生成第一行
+    bool first = !message.color.isValid();
+    if (first)
+    {
+        // 私聊消息的fromName用i和o来代表接收或者发出
+        QString fromName = senderName(entry.sender);
+        bool isSelf = fromName == "o" || fromName == selfName;
+        if (fromName == "i")
+            fromName = peerName;
+        else if (fromName == "o")
+            fromName = selfName;
+        message.sender = fromName;
+        message.color = isSelf ? QColor("#008040") : QColor("#0000ff");
+        message.content.setTextFormat(Qt::PlainText);
+        message.content.setText(this->content(i));
+    }
+    // 跨天时只重新生成第一行，内容的排版不变
+    message.header = message.sender + " " + timeText(entry.time);
+    if (entry.pending)
+        message.header += "  发送中...";
+    message.elidedHeader.clear();
+    message.day = generation;
+    // 内容在排版后还有一份布局，粗略按字符数的几倍估算
+    if (first)
+        this->m_renderedBytes += qint64(message.header.size() + 4 * entry.length) * qint64(sizeof(QChar));
+    return message;
+}
+
+quint32 IMChatRecord::internSender(const QString &name)
+{
+    IMSenderPool &pool = IMSenderPool::instance();
+    auto it = pool.indexes.constFind(name);
+    if (it != pool.indexes.constEnd())
+    {
+        ++pool.refs[int(it.value())];
+        return it.value();
+    }
+    quint32 index;
+    if (!pool.unused.isEmpty())
+    {
+        index = pool.unused.takeLast();
+        pool.names[int(index)] = name;
+        pool.refs[int(index)] = 1;
+    }
+    else
+    {
+        index = quint32(pool.names.size());
+        pool.names.append(name);
+        pool.refs.append(1);
+    }
+    pool.indexes.insert(name, index);
+    return index;
+}
+
+void IMChatRecord::releaseSender(quint32 index)
+{
+    IMSenderPool &pool = IMSenderPool::instance();
+    if (--pool.refs[int(index)] != 0)
+        return;
+    pool.indexes.remove(pool.names.at(int(index)));
+    pool.names[int(index)] = QString();
+    pool.unused.append(index);
+}
+
+IMChatRecord::~IMChatRecord()
+{
+    this->clear();
+}
+
+QString IMChatRecord::senderName(quint32 index)
+{
+    return IMSenderPool::instance().names.at(int(index));
+}
+
+IMMessage IMChatRecord::at(int i) const
+{
+    const Entry &entry = this->m_entries.at(i);
+    IMMessage msg(senderName(entry.sender), this->content(i),
+                  QDateTime::fromMSecsSinceEpoch(entry.time), entry.id);
+    msg.seq = entry.seq;
+    msg.pending = entry.pending != 0;
+    return msg;
+}
+
+int IMChatRecord::markDelivered(quint64 seq, quint64 hlc)
+{
+    // 等待确认的都是最近发出的消息，从后往前找
+    for (int i = this->m_entries.size() - 1; i >= 0; --i)
+    {
+        Entry &entry = this->m_entries[i];
+        if (entry.seq != seq)
+            continue;
+        entry.pending = 0;
+        // 确认之前显示的是本机的时间，换成服务端分配的，与数据库和其他设备上看到的一致
+        if (hlc != 0)
+            entry.time = IMHybridClock::physical(hlc);
+        if (i < this->m_rendered.size())
+            this->m_rendered[i].day = 0;
+        return i;
+    }
+    return -1;
+}
+
+QString IMChatRecord::content(int i) const
+{
+    const Entry &entry = this->m_entries.at(i);
+    return QString::fromUtf8(this->m_contents.constData() + entry.offset, int(entry.length));
+}
+
+IMChatRecord::Entry IMChatRecord::makeEntry(const IMMessage &msg)
+{
+    QByteArray content = msg.content.toUtf8();
+    Entry entry;
+    entry.id = msg.id;
+    entry.time = msg.time.toMSecsSinceEpoch();
+    entry.seq = msg.seq;
+    entry.pending = msg.pending ? 1 : 0;
+    entry.sender = internSender(msg.fromName);
+    entry.offset = quint32(this->m_contents.size());
+    entry.length = quint32(content.size());
+    this->m_contents.append(content);
+    return entry;
+}
+
+void IMChatRecord::append(const IMMessage &msg)
+{
+    this->m_entries.append(this->makeEntry(msg));
+}
+
+void IMChatRecord::prepend(const QVector<IMMessage> &page)
+{
+    if (page.isEmpty())
+        return;
+    // 内容照样追加到末尾，只有Entry的顺序在前面
+    QVector<Entry> entries;
+    entries.reserve(page.size() + this->m_entries.size());
+    for (const IMMessage &msg : page)
+        entries.append(this->makeEntry(msg));
+    entries += this->m_entries;
+    this->m_entries.swap(entries);
+    // 已经生成的显示形式跟着往后移
+    if (!this->m_rendered.isEmpty())
+        this->m_rendered.insert(0, page.size(), IMRenderedMessage());
+}
+
+void IMChatRecord::clear()
+{
+    for (const Entry &entry : this->m_entries)
+        releaseSender(entry.sender);
+    this->m_entries = QVector<Entry>();
+    this->m_contents = QByteArray();
+    this->m_rendered = QVector<IMRenderedMessage>();
+    this->m_renderedBytes = 0;
+}
+
+qint64 IMChatRecord::bytes() const
+{
+    return qint64(sizeof(IMChatRecord))
+            + qint64(this->m_entries.capacity()) * qint64(sizeof(Entry))
+            + qint64(this->m_contents.capacity())
+            + qint64(this->m_rendered.capacity()) * qint64(sizeof(IMRenderedMessage))
+            + this->m_renderedBytes;
+}
+
+IMChatCache::IMChatCache(qint64 budget)
+    : m_budget(budget),
+      m_clock(0),
+      m_hasPinned(false)
+{
+}
+
+IMChatCache::~IMChatCache()
+{
+    this->clear();
+}
+
+IMChatRecord &IMChatCache::record(const QString &key)
+{
+    auto it = this->m_records.find(key);
+    if (it == this->m_records.end())
+        it = this->m_records.insert(key, Entry{new IMChatRecord, 0});
+    it->lastUsed = ++this->m_clock;
+    this->m_mostRecent = key;
+    return *it->record;
+}
+
+IMChatRecord *IMChatCache::find(const QString &key) const
+{
+    auto it = this->m_records.constFind(key);
+    return it == this->m_records.constEnd() ? nullptr : it->record;
+}
+
+void IMChatCache::pin(const QString &key)
+{
+    this->m_pinned = key;
+    this->m_hasPinned = true;
+}
+
+void IMChatCache::unpin()
+{
+    this->m_pinned.clear();
+    this->m_hasPinned = false;
+}
+
+void IMChatCache::trim()
+{
+    qint64 total = this->bytes();
+    while (total > this->m_budget && this->m_records.size() > 1)
+    {
+        // 会话数量不多，直接找使用时间最早的那个
+        auto oldest = this->m_records.end();
+        for (auto it = this->m_records.begin(); it != this->m_records.end(); ++it)
+        {
+            if (it.key() == this->m_mostRecent || (this->m_hasPinned && it.key() == this->m_pinned))
+                continue;
+            if (oldest == this->m_records.end() || it->lastUsed < oldest->lastUsed)
+                oldest = it;
+        }
+        if (oldest == this->m_records.end())
+            break;
+        qDebug() << "IMChatCache: evict" << oldest.key() << oldest->record->bytes() << "bytes";
+        total -= oldest->record->bytes();
+        delete oldest->record;
+        this->m_records.erase(oldest);
+    }
+}
+
+void IMChatCache::clear()
+{
+    for (const Entry &entry : this->m_records)
+        delete entry.record;
+    this->m_records.clear();
+    this->m_mostRecent.clear();
+    this->unpin();
+}
+
+qint64 IMChatCache::bytes() const
+{
+    qint64 total = 0;
+    for (const Entry &entry : this->m_records)
+        total += entry.record->bytes();
+    return total;
+}
@@ -0,0 +1,310 @@
+#ifndef IMCHATCACHE_H
+#define IMCHATCACHE_H
+
+#include <QString>
+#include <QByteArray>
+#include <QVector>
+#include <QHash>
+#include <QColor>
+#include <QStaticText>
+#include "immessage.h"
+
+/**
+ * @brief 一条消息显示用的形式，第一次显示时生成并保存在聊天记录中，重新显示时不再格式化
+ */
+struct IMRenderedMessage
+{
+    /**
+     * @brief day 生成第一行时的日期代数，跨天后时间的格式会变，需要重新生成
+     */
+    quint32 day = 0;
+
+    /**
+     * @brief sender 显示的发送者，私聊的i和o已经换成了昵称
+     */
+    QString sender;
+
+    /**
+     * @brief header 第一行：发送者 时间
+     */
+    QString header;
+
+    /**
+     * @brief color 第一行的颜色，自己发的用绿色，别人发的用蓝色
+     */
+    QColor color;
+
+    /**
+     * @brief content 内容，由委托按宽度排好版
+     */
+    QStaticText content;
+
+    /**
+     * @brief width 排版时的宽度，0表示还没有排版
+     */
+    int width = 0;
+
+    /**
+     * @brief elidedHeader 按宽度省略过的第一行，第一行重新生成时清空
+     */
+    QString elidedHeader;
+
+    /**
+     * @brief height 按width排版后的行高
+     */
+    int height = 0;
+};
+
+/***********************************
+ *
+ * Class IMChatRecord
+ * 一个会话已经加载到内存中的聊天记录，按时间从早到晚排列
+ *
+ * 消息用紧凑的方式保存，不保存IMMessage：
+ * 发送者昵称放在全局的字符串池中，每条消息只记一个下标，池中的昵称按引用计数，没有消息引用时回收；
+ * 内容按UTF-8追加到一块连续的内存中，每条消息只记偏移和长度；
+ * 时间保存为毫秒时间戳
+ * 每条消息的固定开销是一个Entry，视图只为可见的行解码内容
+ *
+ * 往前加载的消息也是追加到内容区的末尾，只有Entry插入到前面
+ *
+ * 显示过的消息同时保存显示用的形式（IMRenderedMessage）：第一行的文字与颜色、排好版的内容和行高，
+ * 重新打开会话时直接使用；时间按今天、一年内、更早分段显示，只有日期变化时才重新生成第一行
+ *
+ **********************************/
+
+class IMChatRecord
+{
+public:
+    IMChatRecord() {}
+    ~IMChatRecord();
+    Q_DISABLE_COPY(IMChatRecord)
+
+    /**
+     * @brief size 消息条数
+     */
+    int size() const { return m_entries.size(); }
+
+    /**
+     * @brief isEmpty 是否没有消息
+     */
+    bool isEmpty() const { return m_entries.isEmpty(); }
+
+    /**
+     * @brief at 还原出第i条消息
+     */
+    IMMessage at(int i) const;
+
+    /**
+     * @brief sender 第i条消息的发送者，私聊时是i或o
+     */
+    QString sender(int i) const { return senderName(m_entries.at(i).sender); }
+
+    /**
+     * @brief content 第i条消息的内容
+     */
+    QString content(int i) const;
+
+    /**
+     * @brief time 第i条消息的时间（毫秒时间戳）
+     */
+    qint64 time(int i) const { return m_entries.at(i).time; }
+
+    /**
+     * @brief id 第i条消息在数据库中的编号
+     */
+    qint64 id(int i) const { return m_entries.at(i).id; }
+
+    /**
+     * @brief isPending 第i条消息是否还在等待服务端确认
+     */
+    bool isPending(int i) const { return m_entries.at(i).pending != 0; }
+
+    /**
+     * @brief markDelivered 把序号为seq的消息标记为已送达，时间换成服务端分配的时间，第一行会重新生成
+     * 消息留在原来的位置，重新加载时才按服务端的时间排序
+     * @param seq 客户端的序号
+     * @param hlc 服务端分配的时间，0表示服务端没有带回时间，保留本机的时间
+     * @return 消息所在的下标，没有找到时返回-1
+     */
+    int markDelivered(quint64 seq, quint64 hlc);
+
+    /**
+     * @brief rendered 第i条消息显示用的形式，第一次取时生成，跨天后重新生成第一行
+     * 只在界面线程中使用，返回的引用在聊天记录变化之前有效，由委托填写排版结果
+     * @param peerName 私聊的对方昵称，代替i
+     * @param selfName 自己的昵称，代替o
+     */
+    IMRenderedMessage &rendered(int i, const QString &peerName, const QString &selfName) const;
+
+    /**
+     * @brief setToday 设置今天的日期，日期变化时所有消息的第一行都要重新生成
+     * @return 日期是否变化了
+     */
+    static bool setToday(const QDate &today);
+
+    /**
+     * @brief append 在末尾追加一条消息
+     */
+    void append(const IMMessage &msg);
+
+    /**
+     * @brief prepend 在前面插入更早的一页消息
+     * @param page 按时间从早到晚排列
+     */
+    void prepend(const QVector<IMMessage> &page);
+
+    /**
+     * @brief clear 清空所有消息
+     */
+    void clear();
+
+    /**
+     * @brief bytes 占用的内存字节数
+     */
+    qint64 bytes() const;
+
+    /**
+     * @brief loaded 是否已经加载了最新的一页，没有加载时新消息只写数据库
+     */
+    bool loaded = false;
+
+    /**
+     * @brief hasMore 数据库中是否还有更早的消息
+     */
+    bool hasMore = true;
+
+private:
+    struct Entry {
+        // 数据库中的消息编号
+        qint64 id;
+        // 毫秒时间戳
+        qint64 time;
+        // 自己发出的消息的序号
+        quint64 seq;
+        // 发送者在字符串池中的下标
+        quint32 sender;
+        // 内容在m_contents中的偏移与长度
+        quint32 offset;
+        quint32 length;
+        // 是否还在等待服务端确认
+        quint32 pending;
+    };
+
+    /**
+     * @brief makeEntry 把消息内容写入内容区，返回对应的Entry
+     */
+    Entry makeEntry(const IMMessage &msg);
+
+    /**
+     * @brief internSender 发送者昵称放入字符串池并增加引用，返回下标
+     */
+    static quint32 internSender(const QString &name);
+
+    /**
+     * @brief releaseSender 减少引用，没有消息引用时从字符串池中回收
+     */
+    static void releaseSender(quint32 index);
+
+    /**
+     * @brief senderName 字符串池中下标对应的昵称
+     */
+    static QString senderName(quint32 index);
+
+    /**
+     * @brief timeText 消息时间的显示文字
+     * 同一天只显示时间，一年以内显示月份日期，再早的显示年份
+     */
+    static QString timeText(qint64 time);
+
+private:
+    // 每条消息的固定部分
+    QVector<Entry> m_entries;
+    // 所有消息的UTF-8内容
+    QByteArray m_contents;
+    // 显示用的形式，与m_entries一一对应，第一次显示时才分配
+    mutable QVector<IMRenderedMessage> m_rendered;
+    // 已经生成的显示形式大概占用的字节数
+    mutable qint64 m_renderedBytes = 0;
+};
+
+/***********************************
+ *
+ * Class IMChatCache
+ * 按内存预算缓存会话的聊天记录，超出预算时淘汰最久没有使用的会话
+ *
+ * record  取出一个会话并标记为最近使用，没有时新建一个空的，由调用方从数据库加载
+ * find    只查找，不改变使用顺序，新消息追加到已经缓存的会话时使用
+ * pin     固定正在显示的会话，视图引用着它，换成另一个会话之前不会被淘汰
+ * trim    超出预算时淘汰，固定的会话和最近使用的会话（刚加载、马上要显示的）不会被淘汰
+ *
+ * 被淘汰的会话下次打开时重新从数据库加载最新的一页
+ * 群聊使用空字符串作为key，昵称不会为空
+ *
+ **********************************/
+
+class IMChatCache
+{
+public:
+    explicit IMChatCache(qint64 budget);
+    ~IMChatCache();
+    Q_DISABLE_COPY(IMChatCache)
+
+    /**
+     * @brief record 取出会话并标记为最近使用
+     * @param key 对方昵称，群聊为空字符串
+     */
+    IMChatRecord &record(const QString &key);
+
+    /**
+     * @brief find 查找已经缓存的会话，不改变使用顺序
+     * @return 没有缓存时返回nullptr
+     */
+    IMChatRecord *find(const QString &key) const;
+
+    /**
+     * @brief pin 固定正在显示的会话，之前固定的会话恢复按使用时间淘汰
+     * @param key 对方昵称，群聊为空字符串
+     */
+    void pin(const QString &key);
+
+    /**
+     * @brief unpin 不再固定任何会话，没有显示会话时调用
+     */
+    void unpin();
+
+    /**
+     * @brief trim 超出预算时淘汰最久没有使用的会话
+     */
+    void trim();
+
+    /**
+     * @brief clear 清空所有会话
+     */
+    void clear();
+
+    /**
+     * @brief bytes 所有会话占用的内存字节数
+     */
+    qint64 bytes() const;
+
+private:
+    struct Entry {
+        IMChatRecord *record;
+        quint64 lastUsed;
+    };
+
+    // 内存预算
+    qint64 m_budget;
+    // 使用计数，越大越近
+    quint64 m_clock;
+    // 最近使用的会话
+    QString m_mostRecent;
+    // 固定的会话，群聊的key是空字符串，用m_hasPinned区分有没有固定
+    QString m_pinned;
+    bool m_hasPinned;
+    // 缓存的会话，Entry中保存指针，哈希表扩容时会话的地址不变
+    QHash<QString, Entry> m_records;
+};
+
+#endif // IMCHATCACHE_H
@@ -0,0 +1,123 @@
+#include <QPainter>
+#include <QAbstractItemView>
+#include <QScrollBar>
+#include <QtMath>
+#include "imchatdelegate.h"
+#include "imchatmodel.h"
+
+IMChatDelegate::IMChatDelegate(QObject *parent)
+    : QStyledItemDelegate(parent),
+      m_relayoutPending(false)
+{
+}
+
+int IMChatDelegate::viewWidth(const QStyleOptionViewItem &option)
+{
+    // 宽度取视图可见区域的宽度
+    const QAbstractItemView *view = qobject_cast<const QAbstractItemView *>(option.widget);
+    return view != nullptr ? view->viewport()->width() : option.rect.width();
+}
+
+void IMChatDelegate::layout(IMRenderedMessage &message, const QFont &font, int width)
+{
+    QFontMetrics metrics(font);
+    // 第一行跨天后会重新生成，这时只需要重新省略第一行
+    if (message.width != width || message.elidedHeader.isEmpty())
+        message.elidedHeader = metrics.elidedText(message.header, Qt::ElideRight, qMax(1, width - 2 * Margin));
+    if (message.width == width)
+        return;
+
+    message.content.setTextWidth(qMax(1, width - 2 * Margin - Indent));
+    message.content.prepare(QTransform(), font);
+    message.height = 2 * Margin + metrics.height() + qCeil(message.content.size().height());
+    message.width = width;
+}
+
+int IMChatDelegate::estimateHeight(const IMRenderedMessage &message, const QFontMetrics &metrics, int width)
+{
+    // 每段按平均字宽折成若干行，空段也占一行
+    int charsPerLine = qMax(1, (width - 2 * Margin - Indent) / qMax(1, metrics.averageCharWidth()));
+    int lines = 0;
+    for (const QStringRef &paragraph : message.content.text().splitRef(QLatin1Char('\n')))
+        lines += qMax(1, (paragraph.size() + charsPerLine - 1) / charsPerLine);
+    return 2 * Margin + metrics.height() + lines * metrics.lineSpacing();
+}
+
+void IMChatDelegate::relayout()
+{
+    this->m_relayoutPending = false;
+    QAbstractItemView *view = qobject_cast<QAbstractItemView *>(this->parent());
+    if (view == nullptr)
+    {
+        emit sizeHintChanged(QModelIndex());
+        return;
+    }
+
+    QScrollBar *bar = view->verticalScrollBar();
+    bool atBottom = bar->value() == bar->maximum();
+    QModelIndex top = view->indexAt(QPoint(0, 0));
+    int offset = top.isValid() ? view->visualRect(top).top() : 0;
+    // 视图收到sizeHintChanged后立即重新布局
+    emit sizeHintChanged(QModelIndex());
+    if (atBottom)
+        view->scrollToBottom();
+    else if (top.isValid())
+    {
+        view->scrollTo(top, QAbstractItemView::PositionAtTop);
+        bar->setValue(bar->value() - offset);
+    }
+}
+
+void IMChatDelegate::paint(QPainter *painter, const QStyleOptionViewItem &option, const QModelIndex &index) const
+{
+    const IMChatModel *model = qobject_cast<const IMChatModel *>(index.model());
+    if (model == nullptr)
+    {
+        QStyledItemDelegate::paint(painter, option, index);
+        return;
+    }
+    IMRenderedMessage &message = model->rendered(index.row());
+    int width = viewWidth(option);
+    // 还没按这个宽度排过版时，视图布局用的是估计的行高，排版后不一样就重新布局一次
+    int estimated = message.width != width ? estimateHeight(message, QFontMetrics(option.font), width) : message.height;
+    layout(message, option.font, width);
+    if (message.height != estimated && !this->m_relayoutPending)
+    {
+        this->m_relayoutPending = true;
+        QMetaObject::invokeMethod(const_cast<IMChatDelegate *>(this), "relayout", Qt::QueuedConnection);
+    }
+
+    painter->save();
+
+    // 选中的行（跳转到的搜索结果）画上背景
+    if (option.state & QStyle::State_Selected)
+        painter->fillRect(option.rect, option.palette.color(QPalette::Highlight).lighter(170));
+
+    QRect rect = option.rect.adjusted(Margin, Margin, -Margin, -Margin);
+    QFontMetrics metrics(option.font);
+
+    // 第一行：发送者 时间，自己发的用绿色，别人发的用蓝色
+    painter->setFont(option.font);
+    painter->setPen(message.color);
+    painter->drawText(QRect(rect.left(), rect.top(), rect.width(), metrics.height()),
+                      Qt::AlignLeft | Qt::AlignVCenter, message.elidedHeader);
+
+    // 内容，已经排好版了
+    painter->setPen(option.palette.color(QPalette::Text));
+    painter->drawStaticText(rect.left() + Indent, rect.top() + metrics.height(), message.content);
+
+    painter->restore();
+}
+
+QSize IMChatDelegate::sizeHint(const QStyleOptionViewItem &option, const QModelIndex &index) const
+{
+    const IMChatModel *model = qobject_cast<const IMChatModel *>(index.model());
+    if (model == nullptr)
+        return QStyledItemDelegate::sizeHint(option, index);
+    int width = viewWidth(option);
+    IMRenderedMessage &message = model->rendered(index.row());
+    // 已经按这个宽度排过版的用真实的行高，否则只估计，排版留到paint
+    if (message.width != width)
+        return QSize(width, estimateHeight(message, QFontMetrics(option.font), width));
+    return QSize(width, message.height);
+}
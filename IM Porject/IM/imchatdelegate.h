@@ -0,0 +1,69 @@
+#ifndef IMCHATDELEGATE_H
+#define IMCHATDELEGATE_H
+
+#include <QStyledItemDelegate>
+#include "imchatcache.h"
+
+/***********************************
+ *
+ * Class IMChatDelegate
+ * 聊天记录的绘制委托
+ *
+ * 每条消息画成两部分：第一行是发送者和时间，下面是自动换行的内容
+ * 视图只对可见的行调用paint，第一行的文字、颜色和排好版的内容都从IMChatModel::rendered中取，
+ * 只在第一次显示或者宽度变化时排版一次，绘制时不做任何字符串格式化
+ *
+ * 视图布局时对每一行都调用sizeHint，一次加载成千上万条记录（跳转到搜索结果）时不能逐行排版，
+ * 所以还没按当前宽度排版的行只按平均字宽估计行高，真正的排版留到paint，只有可见的行才会排版，
+ * 排版后的行高与估计的不同时，下一轮事件循环让视图重新布局一次，并保持最上面一行的位置不动
+ *
+ **********************************/
+
+class IMChatDelegate : public QStyledItemDelegate
+{
+    Q_OBJECT
+
+public:
+    explicit IMChatDelegate(QObject *parent = nullptr);
+
+    void paint(QPainter *painter, const QStyleOptionViewItem &option, const QModelIndex &index) const override;
+    QSize sizeHint(const QStyleOptionViewItem &option, const QModelIndex &index) const override;
+
+private slots:
+    /**
+     * @brief relayout 让视图按排好版的行高重新布局，在底部时保持在底部，否则保持最上面一行的位置
+     */
+    void relayout();
+
+private:
+    /**
+     * @brief layout 按宽度排版，宽度没有变化时什么也不做
+     * @param message 行显示用的形式
+     * @param font 字体
+     * @param width 视图可见区域的宽度
+     */
+    static void layout(IMRenderedMessage &message, const QFont &font, int width);
+
+    /**
+     * @brief estimateHeight 不排版，按平均字宽估计的行高
+     * @param message 行显示用的形式
+     * @param metrics 字体的度量
+     * @param width 视图可见区域的宽度
+     */
+    static int estimateHeight(const IMRenderedMessage &message, const QFontMetrics &metrics, int width);
+
+    /**
+     * @brief viewWidth 视图可见区域的宽度，paint和sizeHint用同一个宽度才不会反复排版
+     */
+    static int viewWidth(const QStyleOptionViewItem &option);
+
+    // 四周的留白
+    static const int Margin = 4;
+    // 内容相对于第一行的缩进
+    static const int Indent = 8;
+
+    // 已经安排了重新布局，一轮事件循环内只布局一次
+    mutable bool m_relayoutPending;
+};
+
+#endif // IMCHATDELEGATE_H
@@ -0,0 +1,130 @@
+#include "imchatmodel.h"
+
+IMChatModel::IMChatModel(QObject *parent)
+    : QAbstractListModel(parent),
+      m_record(nullptr),
+      m_count(0),
+      m_offset(0),
+      m_dayTimer(new QTimer(this))
+{
+    this->m_dayTimer->setSingleShot(true);
+    connect(this->m_dayTimer, &QTimer::timeout, this, &IMChatModel::dayChanged);
+    this->scheduleDayChange();
+}
+
+void IMChatModel::scheduleDayChange()
+{
+    IMChatRecord::setToday(QDate::currentDate());
+    // 多等一秒，定时器稍早一点触发时也已经是第二天了
+    QDateTime now = QDateTime::currentDateTime();
+    qint64 msecs = now.msecsTo(QDateTime(now.date().addDays(1), QTime(0, 0)));
+    this->m_dayTimer->start(int(qBound<qint64>(1000, msecs + 1000, 24 * 3600 * 1000)));
+}
+
+void IMChatModel::dayChanged()
+{
+    this->scheduleDayChange();
+    this->messagesChanged();
+}
+
+void IMChatModel::setRecord(const IMChatRecord *record, QString peerName, QString selfName)
+{
+    this->beginResetModel();
+    this->m_record = record;
+    this->m_count = record == nullptr ? 0 : record->size();
+    this->m_offset = 0;
+    this->m_peerName = peerName;
+    this->m_selfName = selfName;
+    this->endResetModel();
+}
+
+void IMChatModel::messagesAppended()
+{
+    if (this->m_record == nullptr || this->m_record->size() <= this->m_count)
+        return;
+    int count = this->m_record->size() - this->m_count;
+    this->beginInsertRows(QModelIndex(), this->m_count, this->m_count + count - 1);
+    this->m_count += count;
+    this->endInsertRows();
+}
+
+void IMChatModel::messagesPrepended(int count)
+{
+    if (this->m_record == nullptr || count <= 0)
+        return;
+    // 通知之前视图看到的旧行要跳过前面新加的count条
+    this->m_offset = count;
+    this->beginInsertRows(QModelIndex(), 0, count - 1);
+    this->m_offset = 0;
+    this->m_count += count;
+    this->endInsertRows();
+}
+
+void IMChatModel::messagesChanged()
+{
+    // 只有可见的行会重新绘制，行高不变
+    if (this->m_count > 0)
+        emit dataChanged(this->index(0), this->index(this->m_count - 1));
+}
+
+int IMChatModel::rowOfMessage(const IMMessage &message) const
+{
+    qint64 time = message.time.toMSecsSinceEpoch();
+    // 从后往前找，跳转的目标一般在刚加载的那一段的开头附近，但是最近的消息更常用
+    for (int row = this->m_count - 1; row >= 0; --row)
+    {
+        int i = row + this->m_offset;
+        qint64 id = this->m_record->id(i);
+        if (message.id != 0 && id == message.id)
+            return row;
+        // 编号为0的不能按编号比较，否则会匹配到所有还没写入数据库的消息；时间相同时才取出内容比较
+        if ((message.id == 0 || id == 0) && this->m_record->time(i) == time
+                && this->m_record->content(i) == message.content)
+            return row;
+    }
+    return -1;
+}
+
+IMRenderedMessage &IMChatModel::rendered(int row) const
+{
+    return this->m_record->rendered(row + this->m_offset, this->m_peerName, this->m_selfName);
+}
+
+int IMChatModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : this->m_count;
+}
+
+QVariant IMChatModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= this->m_count)
+        return QVariant();
+
+    int i = index.row() + this->m_offset;
+    switch (role) {
+    case Qt::DisplayRole:
+    case ContentRole:
+        return this->m_record->content(i);
+    case SenderRole:
+    {
+        // 私聊消息的fromName用i和o来代表接收或者发出
+        QString fromName = this->m_record->sender(i);
+        if (fromName == "i")
+            return this->m_peerName;
+        if (fromName == "o")
+            return this->m_selfName;
+        return fromName;
+    }
+    case IsSelfRole:
+    {
+        QString fromName = this->m_record->sender(i);
+        return fromName == "o" || fromName == this->m_selfName;
+    }
+    case TimeRole:
+        return QDateTime::fromMSecsSinceEpoch(this->m_record->time(i));
+    case IdRole:
+        return this->m_record->id(i);
+    default:
+        return QVariant();
+    }
+}
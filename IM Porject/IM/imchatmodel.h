@@ -0,0 +1,114 @@
+#ifndef IMCHATMODEL_H
+#define IMCHATMODEL_H
+
+#include <QAbstractListModel>
+#include <QVector>
+#include <QTimer>
+#include "imchatcache.h"
+
+/***********************************
+ *
+ * Class IMChatModel
+ * 一个会话的聊天记录模型
+ *
+ * 不复制消息，直接引用IMClient中这个会话的聊天记录，
+ * 切换会话只是换一个引用再重置模型，与消息条数无关
+ * IMClient往聊天记录里追加或者往前加载消息后，调用messagesAppended、messagesPrepended通知视图
+ * 聊天记录是紧凑保存的，每个角色只取出需要的那一部分，不还原整条消息
+ *
+ * 委托通过rendered取出每一行显示用的形式，它保存在聊天记录中，第一次显示时生成，
+ * 重新打开会话不再格式化时间、替换发送者、重新排版；只在日期变化时由定时器让第一行重新生成
+ *
+ **********************************/
+
+class IMChatModel : public QAbstractListModel
+{
+    Q_OBJECT
+
+public:
+    /**
+     * @brief 自定义的数据角色
+     */
+    enum Roles {
+        // 显示的发送者昵称
+        SenderRole = Qt::UserRole + 1,
+        // 是否是自己发的
+        IsSelfRole,
+        // 时间
+        TimeRole,
+        // 内容
+        ContentRole,
+        // 数据库中的消息编号
+        IdRole
+    };
+
+    explicit IMChatModel(QObject *parent = nullptr);
+
+    /**
+     * @brief setRecord 切换到另一个会话
+     * @param record 会话的聊天记录，由IMClient持有，nullptr表示清空
+     * @param peerName 私聊的对方昵称，群聊时为空
+     * @param selfName 自己的昵称
+     */
+    void setRecord(const IMChatRecord *record, QString peerName, QString selfName);
+
+    /**
+     * @brief messagesAppended 聊天记录末尾追加了消息，追加了几条都只调用一次
+     */
+    void messagesAppended();
+
+    /**
+     * @brief messagesPrepended 聊天记录前面加载了更早的消息
+     * @param count 加载的条数
+     */
+    void messagesPrepended(int count);
+
+    /**
+     * @brief messagesChanged 已有消息的状态变化了（例如被服务端确认），重新绘制
+     */
+    void messagesChanged();
+
+    /**
+     * @brief rowOfMessage 查找某条消息所在的行
+     * 按数据库编号查找；任意一边的编号为0（还没有写入数据库）时改为比较时间和内容
+     * @param message 要找的消息
+     * @return 没有找到时返回-1
+     */
+    int rowOfMessage(const IMMessage &message) const;
+
+    /**
+     * @brief rendered 行显示用的形式，由委托填写排版结果
+     */
+    IMRenderedMessage &rendered(int row) const;
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+
+private slots:
+    /**
+     * @brief dayChanged 过了零点，所有行的时间格式都要重新生成
+     */
+    void dayChanged();
+
+private:
+    /**
+     * @brief scheduleDayChange 安排在下一个零点触发dayChanged
+     */
+    void scheduleDayChange();
+
+private:
+    // 当前会话的聊天记录
+    const IMChatRecord *m_record;
+    // 视图已知的行数，聊天记录先变化，之后才通知视图
+    int m_count;
+    // 往前加载时，通知视图之前旧的行在聊天记录中的偏移
+    int m_offset;
+    // 私聊的对方昵称
+    QString m_peerName;
+    // 自己的昵称
+    QString m_selfName;
+    // 零点定时器
+    QTimer *m_dayTimer;
+};
+
+#endif // IMCHATMODEL_H
@@ -1,223 +1,871 @@
-#include <QDateTime>
-#include "imclient.h"
-#include "protocol.h"
-#include "imdal.h"
-
-IMClient::IMClient(QObject *parent)
-    : QObject(parent),
-      m_socket(new QTcpSocket)
-{
-    connect(m_socket, &QTcpSocket::connected, this, &IMClient::connected);
-    connect(m_socket, &QTcpSocket::readyRead, this, &IMClient::readyread);
-    connect(m_socket, &QTcpSocket::disconnected, this, &IMClient::disconnected);
-    connect(m_socket, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error),
-            [this](QAbstractSocket::SocketError socketError){this->error(socketError);});
-}
-
-IMClient *IMClient::instance()
-{
-    static IMClient imClient;
-    return &imClient;
-}
-
-IMClient::~IMClient()
-{
-    qDebug() << "~IMClient";
-    if (m_socket != nullptr)
-    {
-        m_socket->close();
-        delete m_socket;
-    }
-}
-
-// 连接服务器
-void IMClient::connectServer(QString hostName)
-{
-    m_socket->connectToHost(hostName, 9876, QTcpSocket::ReadWrite);
-}
-
-// 登录
-void IMClient::login(QString name)
-{
-    this->m_name = name;
-    this->sendData(QString("%1 %2").arg(ClientFunctionCode::Login).arg(name));
-}
-
-// 发送私聊消息
-void IMClient::sendPrivateMessage(QString toName, QString content)
-{
-    // 发送消息到服务器
-    this->sendData(QString("%1 %2 %3").arg(ClientFunctionCode::SendPrivateMessage).arg(toName).arg(content));
-    // 构造消息对象，用o表示是发出消息
-    IMMessage msg("o", content, QDateTime::currentDateTime());
-    // 将消息添加到聊天记录中
-    this->m_chatRecord[toName].append(msg);
-    // 将消息插入到数据库中
-    IMDAL::instance()->addPrivateMessage(toName, msg);
-}
-
-// 发送群聊消息
-void IMClient::sendGroupMessage(QString content)
-{
-    // 发送消息到服务器
-    this->sendData(QString("%1 %2").arg(ClientFunctionCode::SendGroupMessage).arg(content));
-    // 构造消息对象
-    IMMessage msg(this->m_name, content, QDateTime::currentDateTime());
-    // 将消息添加到聊天记录中
-    this->m_gruopChatRecord.append(msg);
-    // 将消息插入到数据库中
-    IMDAL::instance()->addGroupMessage(msg);
-}
-
-const QVector<IMMessage> *IMClient::getChatRecord(QString name)
-{
-    if (!this->m_chatRecord.contains(name))
-        this->m_chatRecord[name] = IMDAL::instance()->getPrivateMessage(name);
-
-    return &this->m_chatRecord[name];
-}
-
-// 连接成功时触发
-void IMClient::connected()
-{
-    qDebug() << "connected";
-    emit serverConnected();
-}
-
-// 当接收到数据时触发
-void IMClient::readyread()
-{
-    // 获取接收到数据的对象
-    QTcpSocket* sender = static_cast<QTcpSocket*>(QObject::sender());
-    // 获取数据
-    QByteArray data = sender->readAll();
-    QTextStream in(data, QIODevice::ReadOnly);
-    qDebug() << "readyread:" << data;
-
-    // 进行协议分析与任务调度
-    int functionID = 0;
-    in >> functionID;
-    switch (functionID) {
-    case ServerFunctionCode::PrivateMessage:
-    {
-        // 如果是私聊消息，获取发送者昵称，然后发出获取到私聊消息的信号
-        QString fromName;
-        in >> fromName;
-        in.seek(in.pos() + 1);
-        // 构造一个消息对象，发送者用'i'表示是接受到的消息
-        IMMessage msg("i", in.readAll(), QDateTime::currentDateTime());
-        // 将它添加到聊天记录中
-        this->m_chatRecord[fromName].append(msg);
-        // 并且插入数据库
-        IMDAL::instance()->addPrivateMessage(fromName, msg);
-        // 然后将发送者改回原来的名称
-        msg.fromName = fromName;
-        // 通过信号将其传递出去
-        emit receivedPrivateMessage(msg);
-    }break;
-    case ServerFunctionCode::GroupMessage:
-    {
-        // 如果是群聊消息，获取发送者昵称，然后发出获取到群聊消息的信号
-        QString fromName;
-        in >> fromName;
-        in.seek(in.pos() + 1);
-        // 构造一个消息对象
-        IMMessage msg(fromName, in.readAll(), QDateTime::currentDateTime());
-        // 添加到聊天记录中
-        this->m_gruopChatRecord.append(msg);
-        // 添加到数据库中
-        IMDAL::instance()->addGroupMessage(msg);
-        // 发出信号
-        emit receivedGroupMessage(msg);
-    }break;
-    case ServerFunctionCode::UserOnline:
-    {
-        // 如果是用户上线，获取发送者昵称，然后发出用户上线信号
-        QString fromName;
-        in >> fromName;
-        if (m_offline.contains(fromName))
-            m_offline.removeOne(fromName);
-        m_online.append(fromName);
-        emit userOnline(fromName);
-    }break;
-    case ServerFunctionCode::UserOffline:
-    {
-        // 如果是用户下线，获取发送者昵称，然后发出用户下线信号
-        QString fromName;
-        in >> fromName;
-        if (m_online.contains(fromName))
-            m_online.removeOne(fromName);
-        m_offline.append(fromName);
-        emit userOffline(fromName);
-    }break;
-    case ServerFunctionCode::LoginResult:
-    {
-        // 如果是登录有结果了，先获取登录结果
-        int result = 0;
-        in >> result;
-        if (result == 0)
-        {
-            // 如果登录成功了，获取当前在线人数
-            int n = 0;
-            in >> n;
-            QVector<QString> names;
-            QString name;
-            for (int i = 0; i < n; i++)
-            {
-                in >> name;
-                names.push_back(name);
-            }
-            this->m_online = names;
-
-            // 初始化数据库
-            IMDAL::instance()->initDatabase(this->m_name);
-            // 获取数据库中有聊天记录的用户名列表
-            QVector<QString> userList = IMDAL::instance()->getUserList();
-            // 将没上线的用户名添加到离线列表中
-            for (int i = 0; i < userList.length(); i++)
-            {
-                // 如果这个名字在在线列表中不存在同时又不是自己
-                if (!this->m_online.contains(userList[i]) && userList[i] != this->m_name)
-                {
-                    // 就添加到离线列表中
-                    this->m_offline.append(userList[i]);
-                }
-            }
-            // 初始化群聊消息
-            this->m_gruopChatRecord = IMDAL::instance()->getGroupMessage();
-            // 最后发送登录成功消息
-            emit loginResult(true);
-        }
-        else
-        {
-            // 否则就是登录失败了，发送登录失败的消息
-            emit loginResult(false);
-        }
-    }break;
-    default:
-        return;
-    }
-}
-
-// 当连接断开时触发
-void IMClient::disconnected()
-{
-    qDebug() << "disconnected";
-    // 发送服务器关闭信号
-    emit serverClose();
-}
-
-// 当连接发生错误时触发
-void IMClient::error(QAbstractSocket::SocketError socketError)
-{
-    qDebug() << socketError;
-    // 发出连接错误信号
-    emit connectError(this->m_socket->errorString());
-}
-
-// 向服务器发送数据方法
-void IMClient::sendData(QString data)
-{
-    if (this->isOpen())
-        this->m_socket->write(data.toUtf8());
-}
+#include <QDateTime>
+#include <QFileInfo>
+#include <QUuid>
+#include <QTimer>
+#include <QCoreApplication>
+#include <QSet>
+#include <QSettings>
+#include <QLoggingCategory>
+#include "imclient.h"
+#include "imdal.h"
+#include "imstartuptrace.h"
+
+// 每条命令的日志，默认关闭，用 QT_LOGGING_RULES="im.command.debug=true" 打开
+Q_LOGGING_CATEGORY(lcCommand, "im.command", QtWarningMsg)
+
+// 解析 host:port，不写端口时使用默认端口，IPv6地址写成[::1]:9876
+static void parseEndpoint(const QString &endpoint, QString &host, quint16 &port)
+{
+    int colon = endpoint.lastIndexOf(':');
+    int bracket = endpoint.lastIndexOf(']');
+    bool isNumber = false;
+    quint16 value = colon < 0 || colon < bracket ? 0 : endpoint.mid(colon + 1).toUShort(&isNumber);
+    host = isNumber ? endpoint.left(colon) : endpoint;
+    if (host.startsWith('[') && host.endsWith(']'))
+        host = host.mid(1, host.size() - 2);
+    port = isNumber ? value : IMClient::DefaultPort;
+}
+
+IMClient::IMClient(QObject *parent)
+    : QObject(parent),
+      m_networkThread(new QThread(this)),
+      m_network(new IMNetwork),
+      m_port(DefaultPort),
+      m_presenceVersion(0),
+      m_loggedIn(false),
+      m_sessionReady(false),
+      m_reconnectTimer(new QTimer(this)),
+      m_reconnectAttempt(0),
+      m_dbLoader(nullptr),
+      m_lastSeq(0),
+      m_outboundTimer(new QTimer(this)),
+      m_traceEnabled(false),
+      m_clockSynced(false),
+      m_clockOffset(0),
+      m_clockRtt(0),
+      m_chatCache(ChatCacheBudget)
+{
+    qRegisterMetaType<QVector<IMCommand>>("QVector<IMCommand>");
+    // 聊天连接放到网络线程中，界面线程只处理解析好的命令
+    this->m_network->moveToThread(this->m_networkThread);
+    connect(m_network, &IMNetwork::connected, this, &IMClient::connected);
+    connect(m_network, &IMNetwork::commandsReceived, this, &IMClient::commandsReceived);
+    connect(m_network, &IMNetwork::disconnected, this, &IMClient::disconnected);
+    connect(m_network, &IMNetwork::connectError, this, &IMClient::networkError);
+    // 线程结束前在网络线程中关闭连接，停线程时不用再向它排队调用
+    connect(m_networkThread, &QThread::finished, m_network, &IMNetwork::close, Qt::DirectConnection);
+    this->m_networkThread->start();
+    // 单例在QCoreApplication析构之后才析构，网络线程要在事件循环退出时就停下
+    if (QCoreApplication::instance() != nullptr)
+        connect(QCoreApplication::instance(), &QCoreApplication::aboutToQuit, this, &IMClient::shutdown);
+
+    this->m_reconnectTimer->setSingleShot(true);
+    connect(this->m_reconnectTimer, &QTimer::timeout, this, &IMClient::reconnect);
+
+    // 一轮事件循环中发出的命令攒在一起，一次交给网络线程
+    this->m_outboundTimer->setSingleShot(true);
+    this->m_outboundTimer->setInterval(0);
+    connect(this->m_outboundTimer, &QTimer::timeout, this, &IMClient::flushOutbound);
+
+    // 延迟跟踪只用于调试，默认关闭；服务端不认识带时间戳块的帧时会断开连接
+    QSettings settings(QCoreApplication::applicationDirPath() + "/IM.ini", QSettings::IniFormat);
+    this->m_traceEnabled = settings.value("debug/latencyTrace", false).toBool();
+    // 本地连接时文件传输通道连接的Tcp地址，服务端默认监听所有网卡的默认端口
+    this->m_transferEndpoint = settings.value("transfer/endpoint", QString("127.0.0.1:%1").arg(DefaultPort)).toString().trimmed();
+}
+
+IMClient *IMClient::instance()
+{
+    static IMClient imClient;
+    return &imClient;
+}
+
+IMClient::~IMClient()
+{
+    qDebug() << "~IMClient";
+    // 正常退出时已经在aboutToQuit中停过了，这里什么都不用做
+    this->shutdown();
+    delete this->m_network;
+}
+
+// 停止文件传输与网络线程
+void IMClient::shutdown()
+{
+    this->m_reconnectTimer->stop();
+    qDeleteAll(m_transfers);
+    this->m_transfers.clear();
+    // 数据库还在后台打开时等它结束
+    if (this->m_dbLoader != nullptr)
+        this->m_dbLoader->wait();
+    // 线程结束前会在网络线程中关闭连接，结束后再删除
+    this->m_network->disconnect(this);
+    this->m_networkThread->quit();
+    this->m_networkThread->wait();
+}
+
+// 连接服务器
+void IMClient::connectServer(QString address)
+{
+    this->m_address = address;
+    // 解析地址，没有写协议时当作Tcp地址
+    int pos = address.indexOf("://");
+    QString scheme = pos < 0 ? QString("tcp") : address.left(pos).toLower();
+    QString target = pos < 0 ? address : address.mid(pos + 3);
+
+    if (scheme == "local" || scheme == "shm")
+    {
+        // 文件传输通道仍然走Tcp，连接IM.ini中配置的地址
+        parseEndpoint(this->m_transferEndpoint, this->m_hostName, this->m_port);
+        // 连接要排队到网络线程中才开始，先标记为正在连接，紧接着调用的login不会因为isOpen为false被丢掉，
+        // 登录命令排在连接之后交给网络线程，连上之前先放在套接字的缓冲中
+        this->m_network->markConnecting();
+        QMetaObject::invokeMethod(this->m_network, "connectToServer", Qt::QueuedConnection,
+                                  Q_ARG(bool, true), Q_ARG(bool, scheme == "shm"), Q_ARG(QString, target), Q_ARG(quint16, 0));
+    }
+    else if (scheme == "tcp")
+    {
+        parseEndpoint(target, this->m_hostName, this->m_port);
+        // 和本地连接一样先标记为正在连接
+        this->m_network->markConnecting();
+        QMetaObject::invokeMethod(this->m_network, "connectToServer", Qt::QueuedConnection,
+                                  Q_ARG(bool, false), Q_ARG(bool, false), Q_ARG(QString, this->m_hostName), Q_ARG(quint16, this->m_port));
+    }
+    else
+    {
+        emit connectError("不支持的地址：" + address);
+    }
+}
+
+bool IMClient::isOpen()
+{
+    return this->m_network->isOpen();
+}
+
+// 登录
+void IMClient::login(QString name)
+{
+    this->m_name = name;
+    this->sendLogin();
+}
+
+void IMClient::sendLogin()
+{
+    if (!this->isOpen())
+        return;
+    int start = this->m_outbound.size();
+    if (this->m_presenceEpoch.isEmpty())
+        IMCodec<IMSchema::Login>::appendFrame(this->m_outbound, this->m_name);
+    else
+        IMCodec<IMSchema::Relogin>::appendFrame(this->m_outbound, this->m_name, this->m_presenceEpoch, this->m_presenceVersion);
+    // 发出时间用本机时钟，服务端在登录结果中原样带回
+    if (this->m_traceEnabled)
+    {
+        IMFrameTrace trace;
+        trace.stamps[TraceClientSend] = traceClock();
+        attachFrameTrace(this->m_outbound, start, trace);
+    }
+    this->outboundAppended();
+}
+
+// 发送私聊消息
+void IMClient::sendPrivateMessage(QString toName, QString content)
+{
+    // 放入发件箱并发送到服务器，服务端确认之前显示为发送中
+    quint64 seq = this->sendChat(toName, content);
+    // 构造消息对象，用o表示是发出消息，时间取本机的HLC时间，排在已经收到的消息之后
+    quint64 hlc = this->m_clock.now();
+    IMMessage msg("o", content, QDateTime::fromMSecsSinceEpoch(IMHybridClock::physical(hlc)));
+    msg.hlc = hlc;
+    msg.seq = seq;
+    msg.pending = true;
+    // 将消息添加到聊天记录中
+    this->appendChatRecord(toName, msg);
+    // 将消息插入到数据库中
+    IMDAL::instance()->addPrivateMessage(toName, msg);
+}
+
+// 发送群聊消息
+void IMClient::sendGroupMessage(QString content)
+{
+    // 放入发件箱并发送到服务器
+    quint64 seq = this->sendChat(QString(), content);
+    // 构造消息对象
+    quint64 hlc = this->m_clock.now();
+    IMMessage msg(this->m_name, content, QDateTime::fromMSecsSinceEpoch(IMHybridClock::physical(hlc)));
+    msg.hlc = hlc;
+    msg.seq = seq;
+    msg.pending = true;
+    // 将消息添加到聊天记录中
+    this->appendChatRecord(QString(), msg);
+    // 将消息插入到数据库中
+    IMDAL::instance()->addGroupMessage(msg);
+}
+
+// 请求发送文件
+bool IMClient::sendFile(QString toName, QString filePath)
+{
+    QFileInfo info(filePath);
+    if (!info.isFile() || !info.isReadable() || !this->isOpen())
+        return false;
+
+    // 传输编号随机生成，对方和服务端都用它来识别这次传输
+    quint64 id = qFromBigEndian<quint64>(reinterpret_cast<const uchar *>(QUuid::createUuid().toRfc4122().constData()));
+    IMTransfer *transfer = new IMTransfer(IMTransfer::Send, id, toName, info.fileName(), info.size(), this);
+    transfer->setFilePath(filePath);
+    connect(transfer, &IMTransfer::progress, this, &IMClient::transferProgress);
+    connect(transfer, &IMTransfer::interrupted, this, &IMClient::transferInterrupted);
+    this->m_transfers.insert(id, transfer);
+
+    this->sendCommand<IMSchema::SendFileRequest>(toName, id, info.size(), info.fileName());
+    return true;
+}
+
+// 接受文件
+void IMClient::acceptFile(quint64 id, QString savePath)
+{
+    IMTransfer *transfer = this->m_transfers.value(id);
+    if (transfer == nullptr || transfer->direction() != IMTransfer::Receive)
+        return;
+
+    transfer->setFilePath(savePath);
+    this->m_transferRetries.remove(id);
+    this->resumeTransfer(id);
+}
+
+// 拒绝或取消文件
+void IMClient::rejectFile(quint64 id)
+{
+    IMTransfer *transfer = this->m_transfers.value(id);
+    if (transfer == nullptr)
+        return;
+    this->sendCommand<IMSchema::CancelFile>(transfer->peerName(), id);
+    this->removeTransfer(id, false, "已取消");
+}
+
+// 接收方从已经收到的位置继续传输
+void IMClient::resumeTransfer(quint64 id)
+{
+    IMTransfer *transfer = this->m_transfers.value(id);
+    if (transfer == nullptr)
+        return;
+
+    qint64 offset = transfer->localOffset();
+    if (!transfer->start(this->m_hostName, this->m_port, this->m_name, offset))
+    {
+        this->rejectFile(id);
+        return;
+    }
+    // 告诉发送方从哪里开始发
+    this->sendCommand<IMSchema::AcceptFile>(transfer->peerName(), id, offset);
+}
+
+void IMClient::removeTransfer(quint64 id, bool isSuccess, QString info)
+{
+    IMTransfer *transfer = this->m_transfers.take(id);
+    this->m_transferRetries.remove(id);
+    if (transfer == nullptr)
+        return;
+    transfer->stop();
+    transfer->deleteLater();
+    emit transferFinished(id, isSuccess, info);
+}
+
+// 文件传输完成时触发
+void IMClient::transferCompleted(quint64 id)
+{
+    IMTransfer *transfer = this->m_transfers.value(id);
+    if (transfer == nullptr || transfer->direction() != IMTransfer::Receive)
+        return;
+    // 接收方收完后通知服务端结束这次传输，发送方收到后也就知道传输成功了
+    this->sendCommand<IMSchema::CancelFile>(transfer->peerName(), id);
+    this->removeTransfer(id, true, transfer->filePath());
+}
+
+// 文件传输通道中断时触发
+void IMClient::transferInterrupted(quint64 id)
+{
+    IMTransfer *transfer = this->m_transfers.value(id);
+    // 发送方等待接收方重新发起
+    if (transfer == nullptr || transfer->direction() != IMTransfer::Receive)
+        return;
+
+    // 接收方隔一段时间后从已经收到的位置继续，重试太多次就放弃
+    int retries = ++this->m_transferRetries[id];
+    if (retries > 5)
+    {
+        this->rejectFile(id);
+        return;
+    }
+    QTimer::singleShot(3000, this, [this, id]() {
+        if (this->isOpen())
+            this->resumeTransfer(id);
+        else
+            this->transferInterrupted(id);
+    });
+}
+
+const IMChatRecord *IMClient::getChatRecord(QString name)
+{
+    IMChatRecord &record = this->m_chatCache.record(name);
+    // 视图引用着这个会话，换成别的会话之前不能淘汰
+    this->m_chatCache.pin(name);
+    if (!record.loaded)
+        this->loadChatRecord(record, &name);
+
+    return &record;
+}
+
+const IMChatRecord *IMClient::getGroupChatRecord()
+{
+    IMChatRecord &record = this->m_chatCache.record(QString());
+    this->m_chatCache.pin(QString());
+    if (!record.loaded)
+        this->loadChatRecord(record, nullptr);
+
+    return &record;
+}
+
+int IMClient::loadOlderChatRecord(QString name)
+{
+    return this->loadChatRecord(this->m_chatCache.record(name), &name);
+}
+
+int IMClient::loadOlderGroupChatRecord()
+{
+    return this->loadChatRecord(this->m_chatCache.record(QString()), nullptr);
+}
+
+int IMClient::loadChatRecord(IMChatRecord &record, const QString *name, const IMMessage *until)
+{
+    // 数据库还没打开时不标记为已加载，打开后重新打开会话时再加载
+    if (!IMDAL::instance()->isOpen() || (record.loaded && !record.hasMore))
+        return 0;
+
+    // 已经加载过的从最早的一条往前取，还没加载过的从最新的一条开始取
+    IMMessage first = record.loaded && !record.isEmpty() ? record.at(0) : IMMessage();
+    const IMMessage *before = record.loaded && !record.isEmpty() ? &first : nullptr;
+    // 要加载到的消息已经在内存里了
+    if (until != nullptr && before != nullptr
+            && (before->time < until->time || (before->time == until->time && before->id <= until->id)))
+        return 0;
+    // 加载到某条消息时不限条数，SQLite的LIMIT -1表示不限制
+    int limit = until == nullptr ? HistoryPageSize : -1;
+    QVector<IMMessage> page = name == nullptr
+            ? IMDAL::instance()->getGroupMessage(limit, before, until)
+            : IMDAL::instance()->getPrivateMessage(*name, limit, before, until);
+
+    if (!record.loaded)
+    {
+        record.clear();
+        record.loaded = true;
+    }
+    record.prepend(page);
+    // 取到的不够一页，说明已经到头了；加载到某条消息时不知道更早的还有没有，当作还有
+    record.hasMore = until != nullptr || page.size() == HistoryPageSize;
+    // 加载的会话是最近使用的，不会被淘汰
+    this->m_chatCache.trim();
+    return page.size();
+}
+
+void IMClient::loadChatRecordTo(QString name, const IMMessage &target)
+{
+    this->loadChatRecord(this->m_chatCache.record(name), &name, &target);
+}
+
+void IMClient::loadGroupChatRecordTo(const IMMessage &target)
+{
+    this->loadChatRecord(this->m_chatCache.record(QString()), nullptr, &target);
+}
+
+QVector<IMSearchResult> IMClient::searchMessage(QString text, QString peer, QDateTime from, QDateTime to)
+{
+    if (!IMDAL::instance()->isOpen())
+        return QVector<IMSearchResult>();
+    return IMDAL::instance()->searchMessage(text, peer, from, to);
+}
+
+void IMClient::appendChatRecord(const QString &key, const IMMessage &msg)
+{
+    IMChatRecord *record = this->m_chatCache.find(key);
+    if (record == nullptr || !record->loaded)
+        return;
+    record->append(msg);
+    this->m_chatCache.trim();
+}
+
+// 连接成功时触发
+void IMClient::connected()
+{
+    if (!this->m_loggedIn)
+    {
+        IMStartupTrace::mark("connect");
+        emit serverConnected();
+        return;
+    }
+    // 重连成功，带上已知的在线状态版本重新登录
+    qDebug() << "reconnected, login again as" << this->m_name;
+    this->sendLogin();
+}
+
+void IMClient::networkError(QString errorInfo)
+{
+    if (!this->m_loggedIn)
+    {
+        emit connectError(errorInfo);
+        return;
+    }
+    qDebug() << "network error:" << errorInfo;
+    this->m_sessionReady = false;
+    // 还没发出去的命令属于断开的连接，聊天消息还在发件箱里
+    this->m_outbound.clear();
+    this->scheduleReconnect();
+}
+
+void IMClient::scheduleReconnect()
+{
+    if (this->m_reconnectTimer->isActive())
+        return;
+    if (this->m_reconnectAttempt == 0)
+        emit connectionLost();
+    // 指数退避，取上限之前的一半到全部之间的随机值，服务端重启后所有客户端不会同时涌上来
+    int delay = qMin(ReconnectMaxDelay, ReconnectBaseDelay << qMin(this->m_reconnectAttempt, 16));
+    quint32 random = qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(QUuid::createUuid().toRfc4122().constData()));
+    delay = delay / 2 + int(random % quint32(delay / 2 + 1));
+    ++this->m_reconnectAttempt;
+    qDebug() << "reconnect in" << delay << "ms, attempt" << this->m_reconnectAttempt;
+    this->m_reconnectTimer->start(delay);
+}
+
+void IMClient::reconnect()
+{
+    this->connectServer(this->m_address);
+}
+
+// 网络线程解出一批命令时触发
+void IMClient::commandsReceived(QVector<IMCommand> commands)
+{
+    for (const IMCommand &command : commands)
+        this->processCommand(command);
+}
+
+// 进行协议分析与任务调度
+void IMClient::processCommand(const IMCommand &command)
+{
+    qCDebug(lcCommand) << "processCommand:" << command.payload;
+
+    // 进行协议分析与任务调度，参数按命令的声明解码，参数不对的命令丢弃
+    const QByteArray &payload = command.payload;
+    switch (command.code) {
+    case ServerFunctionCode::PrivateMessage:
+    {
+        // 如果是私聊消息，获取发送者昵称，然后发出获取到私聊消息的信号
+        QString fromName, content;
+        quint64 msgId = 0, hlc = 0;
+        if (!IMCodec<IMSchema::PrivateMessage>::decode(payload, fromName, msgId, hlc, content))
+            break;
+        this->reportLatency(fromName, false, command.trace);
+        // 构造一个消息对象，发送者用'i'表示是接受到的消息，带上服务端分配的编号与时间
+        IMMessage msg = this->stampedMessage("i", content, msgId, hlc, command.receivedAt);
+        // 将它添加到聊天记录中
+        this->appendChatRecord(fromName, msg);
+        // 并且插入数据库
+        IMDAL::instance()->addPrivateMessage(fromName, msg);
+        // 然后将发送者改回原来的名称
+        msg.fromName = fromName;
+        // 通过信号将其传递出去
+        emit receivedPrivateMessage(msg);
+    }break;
+    case ServerFunctionCode::GroupMessage:
+    {
+        // 如果是群聊消息，获取发送者昵称，然后发出获取到群聊消息的信号
+        QString fromName, content;
+        quint64 msgId = 0, hlc = 0;
+        if (!IMCodec<IMSchema::GroupMessage>::decode(payload, fromName, msgId, hlc, content))
+            break;
+        this->reportLatency(fromName, true, command.trace);
+        // 构造一个消息对象
+        IMMessage msg = this->stampedMessage(fromName, content, msgId, hlc, command.receivedAt);
+        // 添加到聊天记录中
+        this->appendChatRecord(QString(), msg);
+        // 添加到数据库中
+        IMDAL::instance()->addGroupMessage(msg);
+        // 发出信号
+        emit receivedGroupMessage(msg);
+    }break;
+    case ServerFunctionCode::FileRequest:
+    {
+        // 如果是文件请求，记录下来，然后发出收到文件请求的信号，由用户决定是否接收
+        QString fromName, fileName;
+        quint64 id = 0;
+        qint64 size = 0;
+        if (!IMCodec<IMSchema::FileRequest>::decode(payload, fromName, id, size, fileName))
+            break;
+        // 文件名只保留最后一段，防止写到别的目录
+        fileName = QFileInfo(fileName).fileName();
+        if (this->m_transfers.contains(id))
+            return;
+        IMTransfer *transfer = new IMTransfer(IMTransfer::Receive, id, fromName, fileName, size, this);
+        connect(transfer, &IMTransfer::progress, this, &IMClient::transferProgress);
+        connect(transfer, &IMTransfer::finished, this, &IMClient::transferCompleted);
+        connect(transfer, &IMTransfer::interrupted, this, &IMClient::transferInterrupted);
+        this->m_transfers.insert(id, transfer);
+        emit fileOffered(fromName, id, size, fileName);
+    }break;
+    case ServerFunctionCode::FileAccepted:
+    {
+        // 如果是对方接受了文件，从对方给出的位置开始发送
+        QString peerName;
+        quint64 id = 0;
+        qint64 offset = 0;
+        if (!IMCodec<IMSchema::FileAccepted>::decode(payload, peerName, id, offset))
+            break;
+        IMTransfer *transfer = this->m_transfers.value(id);
+        if (transfer == nullptr || transfer->direction() != IMTransfer::Send)
+            return;
+        if (offset < 0 || offset > transfer->size()
+                || !transfer->start(this->m_hostName, this->m_port, this->m_name, offset))
+            this->rejectFile(id);
+    }break;
+    case ServerFunctionCode::FileCancelled:
+    {
+        // 如果是对方拒绝或取消了文件，结束这次传输
+        // 发送方已经把数据全部发出时，这是接收方收完后的结束通知
+        QString peerName;
+        quint64 id = 0;
+        if (!IMCodec<IMSchema::FileCancelled>::decode(payload, peerName, id))
+            break;
+        IMTransfer *transfer = this->m_transfers.value(id);
+        if (transfer == nullptr)
+            return;
+        bool isSuccess = transfer->direction() == IMTransfer::Send && transfer->done() >= transfer->size();
+        this->removeTransfer(id, isSuccess, isSuccess ? transfer->filePath() : peerName + " 取消了传输");
+    }break;
+    case ServerFunctionCode::UserOnline:
+    case ServerFunctionCode::UserOffline:
+    {
+        // 如果是用户上下线，获取昵称，状态确实变化了才发出上下线信号，同时记下版本
+        // 上线与下线的布局相同
+        QString name;
+        quint64 version = 0;
+        if (!IMCodec<IMSchema::UserOnline>::decode(payload, name, version)
+                && !IMCodec<IMSchema::UserOffline>::decode(payload, name, version))
+            break;
+        this->setPresence(name, command.code == ServerFunctionCode::UserOnline);
+        this->m_presenceVersion = qMax(this->m_presenceVersion, version);
+    }break;
+    case ServerFunctionCode::MessageAck:
+    {
+        // 如果是消息确认，把这条消息从发件箱中移除并标记为已送达
+        quint64 seq = 0, msgId = 0, hlc = 0;
+        if (!IMCodec<IMSchema::MessageAck>::decode(payload, seq, msgId, hlc))
+            break;
+        this->messageAcked(seq, msgId, hlc);
+    }break;
+    case ServerFunctionCode::MessageFailed:
+    {
+        // 如果是消息没有转发出去（对方不在线），消息留在发件箱中保持待确认，对方上线时再发
+        quint64 seq = 0;
+        int reason = 0;
+        if (!IMCodec<IMSchema::MessageFailed>::decode(payload, seq, reason))
+            break;
+        qDebug() << "message" << seq << "not delivered, reason" << reason;
+    }break;
+    case ServerFunctionCode::LoginResult:
+    {
+        // 如果是登录有结果了，先获取登录结果，几种布局的第一个参数都是结果，解不出来按失败处理
+        int result = 1;
+        IMCodec<IMSchema::LoginFailed>::decode(payload, result);
+        // 打开了延迟跟踪时登录结果带着时间戳，用来估计时钟偏差
+        if (command.trace.present)
+            this->syncClock(command.trace);
+        if (result != 0 && result != 2)
+        {
+            if (!this->m_loggedIn)
+            {
+                // 否则就是登录失败了，发送登录失败的消息
+                emit loginResult(false);
+                return;
+            }
+            // 重连时服务端可能还没发现旧的连接已经断开，昵称仍被占用，断开后稍后再试
+            qDebug() << "login again failed, retry later";
+            QMetaObject::invokeMethod(this->m_network, "close", Qt::QueuedConnection);
+            this->scheduleReconnect();
+            return;
+        }
+
+        if (result == 2)
+        {
+            // 增量同步：纪元 版本 人数 (是否在线 昵称)...
+            QString epoch;
+            quint64 version = 0;
+            QStringList changes;
+            if (!IMCodec<IMSchema::LoginResynced>::decode(payload, result, epoch, version, changes))
+                break;
+            this->m_presenceEpoch = epoch;
+            this->m_presenceVersion = version;
+            for (int i = 0; i + 1 < changes.size(); i += 2)
+                this->setPresence(changes.at(i + 1), changes.at(i).toInt() != 0);
+            qDebug() << "presence resync:" << changes.size() / 2 << "changes";
+        }
+        else
+        {
+            // 如果登录成功了，获取当前在线的人，后面是在线状态的纪元与版本
+            QStringList online;
+            QString epoch;
+            quint64 version = 0;
+            if (!IMCodec<IMSchema::LoginSucceeded>::decode(payload, result, online, epoch, version))
+                break;
+            QVector<QString> names = online.toVector();
+            this->m_presenceEpoch = epoch;
+            this->m_presenceVersion = version;
+
+            if (this->m_loggedIn)
+            {
+                // 重连时服务端已经重启或者落后太多，按完整列表同步
+                this->resyncPresence(names);
+            }
+            else
+            {
+                IMStartupTrace::mark("login");
+                // 在线的人先显示出来，有聊天记录的人等数据库打开后再合并进来
+                this->m_presence.reset(names, QVector<QString>(), this->m_name);
+                // 聊天记录都在第一次打开会话时才加载
+                this->m_chatCache.clear();
+                this->m_loggedIn = true;
+                this->m_sessionReady = true;
+                // 数据库在后台打开，不耽误显示主窗口
+                this->openDatabase();
+                // 最后发送登录成功消息
+                emit loginResult(true);
+                return;
+            }
+        }
+
+        // 重新登录成功，重新发送发件箱中还没有确认的消息
+        this->m_reconnectAttempt = 0;
+        this->m_sessionReady = true;
+        emit reconnected();
+        this->resendOutbox();
+    }break;
+    default:
+        return;
+    }
+}
+
+// 当连接断开时触发
+void IMClient::disconnected()
+{
+    qDebug() << "disconnected";
+    this->m_sessionReady = false;
+    this->m_outbound.clear();
+    // 还没登录时发送服务器关闭信号，登录之后自动重连
+    if (!this->m_loggedIn)
+    {
+        emit serverClose();
+        return;
+    }
+    this->scheduleReconnect();
+}
+
+void IMClient::openDatabase()
+{
+    if (this->m_dbLoader != nullptr)
+        return;
+    this->m_dbLoader = new IMDBLoader(this->m_name, this);
+    connect(this->m_dbLoader, &QThread::finished, this, &IMClient::databaseLoaded);
+    this->m_dbLoader->start();
+}
+
+void IMClient::databaseLoaded()
+{
+    IMDatabaseState state = this->m_dbLoader->state();
+    this->m_dbLoader->deleteLater();
+    this->m_dbLoader = nullptr;
+
+    qint64 begin = IMStartupTrace::now();
+    IMDAL::instance()->initDatabase(state);
+    IMStartupTrace::record("database attach", begin);
+    // 本机的HLC时钟不能比已经保存的消息早，系统时间往回调过也一样
+    this->m_clock.update(state.lastHlc);
+
+    // 有聊天记录但是不在线的人加入离线列表，他们本来就不在线，不发出下线信号
+    begin = IMStartupTrace::now();
+    QVector<QString> contacts;
+    contacts.reserve(state.userNames.size());
+    for (const QString &name : state.userNames)
+    {
+        if (name.isEmpty() || name == this->m_name || this->m_presence.contains(name))
+            continue;
+        this->m_presence.setOnline(name, false);
+        contacts.append(name);
+    }
+    IMStartupTrace::record("roster merge", begin);
+    qDebug() << "presence:" << this->m_presence.onlineCount() << "online,"
+             << this->m_presence.offlineList().size() << "offline";
+    emit databaseReady(contacts);
+
+    // 上次退出前没有确认的消息放回发件箱，已经登录了，立即重新发送
+    const QVector<IMOutboxMessage> outbox = IMDAL::instance()->getOutbox();
+    for (const IMOutboxMessage &msg : outbox)
+    {
+        if (this->m_outbox.contains(msg.seq))
+            continue;
+        this->m_lastSeq = qMax(this->m_lastSeq, msg.seq);
+        this->queueOutbox(msg.seq, msg.peer, msg.content);
+    }
+}
+
+void IMClient::setPresence(const QString &name, bool online)
+{
+    if (name.isEmpty() || name == this->m_name || !this->m_presence.setOnline(name, online))
+        return;
+    if (online)
+    {
+        // 对方不在线时没有发出去的私聊，现在重新发送
+        if (this->m_sessionReady)
+            for (const OutboxEntry &entry : this->m_outbox)
+                if (entry.key == name)
+                    this->sendChatFrame(entry.frame);
+        emit userOnline(name);
+    }
+    else
+        emit userOffline(name);
+}
+
+void IMClient::resyncPresence(const QVector<QString> &online)
+{
+    QSet<QString> current;
+    current.reserve(online.size());
+    for (const QString &name : online)
+        current.insert(name);
+    // 之前在线、现在不在列表中的人下线了；onlineList会随着修改重新生成，先复制一份
+    const QVector<QString> before = this->m_presence.onlineList();
+    for (const QString &name : before)
+        if (!current.contains(name))
+            this->setPresence(name, false);
+    for (const QString &name : online)
+        this->setPresence(name, true);
+    qDebug() << "presence resync: full list of" << online.size();
+}
+
+quint64 IMClient::sendChat(const QString &key, const QString &content)
+{
+    // 序号取微秒级的时间，程序重启后也不会和发件箱中之前的消息重复
+    quint64 seq = qMax(this->m_lastSeq + 1, quint64(QDateTime::currentMSecsSinceEpoch()) * 1000);
+    this->m_lastSeq = seq;
+    this->queueOutbox(seq, key, content);
+    return seq;
+}
+
+void IMClient::queueOutbox(quint64 seq, const QString &key, const QString &content)
+{
+    // 帧只编码一次，重发时原样发送
+    QByteArray frame = key.isEmpty()
+            ? IMCodec<IMSchema::SendTrackedGroupMessage>::encodeFrame(seq, content)
+            : IMCodec<IMSchema::SendTrackedPrivateMessage>::encodeFrame(seq, key, content);
+    this->m_outbox.insert(seq, OutboxEntry{key, frame});
+    // 断线重连期间只放入发件箱，重新登录后再发
+    if (this->m_sessionReady)
+        this->sendChatFrame(frame);
+}
+
+void IMClient::resendOutbox()
+{
+    if (!this->m_outbox.isEmpty())
+        qDebug() << "resend" << this->m_outbox.size() << "unacknowledged messages";
+    for (const OutboxEntry &entry : this->m_outbox)
+        this->sendChatFrame(entry.frame);
+}
+
+void IMClient::sendChatFrame(const QByteArray &frame)
+{
+    if (!this->m_traceEnabled || !this->m_clockSynced)
+    {
+        this->sendFrame(frame);
+        return;
+    }
+    // 发件箱里的帧不带时间戳块，每次发送时复制一份，带上换算到服务端时钟的发出时间
+    QByteArray traced = frame;
+    IMFrameTrace trace;
+    trace.stamps[TraceClientSend] = traceClock() + this->m_clockOffset;
+    attachFrameTrace(traced, 0, trace);
+    this->sendFrame(traced);
+}
+
+void IMClient::syncClock(const IMFrameTrace &trace)
+{
+    // t0、t3是本机时钟，t1、t2是服务端时钟，假设来回的路上花的时间相同
+    qint64 t0 = trace.stamps[TraceClientSend];
+    qint64 t1 = trace.stamps[TraceServerIngress];
+    qint64 t2 = trace.stamps[TraceSocketWrite];
+    qint64 t3 = trace.stamps[TraceReceiverDecode];
+    if (t0 == 0 || t1 == 0 || t2 == 0 || t3 == 0)
+        return;
+    this->m_clockOffset = ((t1 - t0) + (t2 - t3)) / 2;
+    this->m_clockRtt = qMax<qint64>(0, (t3 - t0) - (t2 - t1));
+    this->m_clockSynced = true;
+    qDebug() << "clock offset" << this->m_clockOffset << "us, rtt" << this->m_clockRtt << "us";
+}
+
+void IMClient::reportLatency(const QString &fromName, bool isGroup, IMFrameTrace trace)
+{
+    if (!trace.present || !this->m_clockSynced)
+        return;
+    // 解出的时间换算到服务端时钟，所有环节就在同一条时间线上了
+    trace.stamps[TraceReceiverDecode] += this->m_clockOffset;
+    emit messageTraced(fromName, isGroup, trace);
+}
+
+IMMessage IMClient::stampedMessage(const QString &fromName, const QString &content, quint64 msgId, quint64 hlc, qint64 receivedAt)
+{
+    // 消息按服务端的时间保存，所有设备上一样；时间为0时用本机收到的时间
+    this->m_clock.update(hlc);
+    IMMessage msg(fromName, content, QDateTime::fromMSecsSinceEpoch(
+                      hlc != 0 ? IMHybridClock::physical(hlc) : receivedAt));
+    msg.msgId = msgId;
+    msg.hlc = hlc != 0 ? hlc : this->m_clock.last();
+    return msg;
+}
+
+void IMClient::messageAcked(quint64 seq, quint64 msgId, quint64 hlc)
+{
+    this->m_clock.update(hlc);
+    // 重发后可能收到两次确认，第二次忽略
+    auto it = this->m_outbox.find(seq);
+    if (it == this->m_outbox.end())
+        return;
+    QString key = it->key;
+    this->m_outbox.erase(it);
+    IMDAL::instance()->markDelivered(seq, msgId, hlc);
+    IMChatRecord *record = this->m_chatCache.find(key);
+    if (record != nullptr)
+        record->markDelivered(seq, hlc);
+    emit messageDelivered(key, seq);
+}
+
+// 向服务器发送编码好的帧
+void IMClient::sendFrame(const QByteArray &frame)
+{
+    if (!this->isOpen())
+        return;
+    this->m_outbound += frame;
+    this->outboundAppended();
+}
+
+void IMClient::outboundAppended()
+{
+    // 攒下的帧在这一轮事件循环结束后一次交给网络线程
+    if (this->m_outbound.size() >= OutboundBatchBytes)
+        this->flushOutbound();
+    else if (!this->m_outboundTimer->isActive())
+        this->m_outboundTimer->start();
+}
+
+void IMClient::flushOutbound()
+{
+    this->m_outboundTimer->stop();
+    if (this->m_outbound.isEmpty())
+        return;
+    QMetaObject::invokeMethod(this->m_network, "sendFrames", Qt::QueuedConnection, Q_ARG(QByteArray, this->m_outbound));
+    this->m_outbound.clear();
+}
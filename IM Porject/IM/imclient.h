@@ -1,204 +1,689 @@
-#ifndef IMCLIENT_H
-#define IMCLIENT_H
-
-#include <QObject>
-#include <QtNetwork>
-#include <QString>
-#include <QVector>
-#include "immessage.h"
-
-/***********************************
- *
- * Class IMClient
- * IM客户端类
- *
- * 用于与服务端交互的封装类
- *
- * 公开方法有：
- * login                登录
- * sendPrivateMessage   发送私聊消息
- * sendGroupMessage     发送群聊消息
- *
- * 发出的信号有：
- * receivedPrivateMessage   接收到私聊消息信号
- * receivedGroupMessage     接收到群聊消息信号
- * userOnline               用户上线信号
- * userOffline              用户下线信号
- * serverClose              服务器关闭信号
- *
- **********************************/
-/**
- * @brief IM客户端类
- */
-class IMClient : public QObject
-{
-    Q_OBJECT
-// 公开的成员函数
-protected:
-    explicit IMClient(QObject *parent = nullptr);
-
-public:
-    /**
-     * @brief instance 单例对象
-     * @return 单例对象指针
-     */
-    static IMClient *instance();
-
-    ~IMClient();
-
-    /**
-     * @brief connectServer 尝试连接服务器
-     * @param hostName 连接名
-     */
-    void connectServer(QString hostName);
-
-    /**
-     * @brief login 登录
-     * @param name 用户名
-     */
-    void login(QString name);
-
-    /**
-     * @brief sendPrivateMessage 发送私聊消息
-     * @param toName 发送给谁
-     * @param content 消息内容
-     */
-    void sendPrivateMessage(QString toName, QString content);
-
-    /**
-     * @brief sendGroupMessage 发送群聊消息
-     * @param content 消息内容
-     */
-    void sendGroupMessage(QString content);
-
-    /**
-     * @brief isOpen 连接是否打开
-     * @return
-     */
-    bool isOpen()
-    {
-        return this->m_socket != nullptr
-                && this->m_socket->state() != QAbstractSocket::UnconnectedState;
-    }
-
-
-public:
-    const QVector<IMMessage> *getChatRecord(QString name);
-    const QVector<IMMessage> *getGroupChatRecord() { return &m_gruopChatRecord; }
-    const QVector<QString> *getOnlineList() { return &m_online; }
-    const QVector<QString> *getOfflineList() { return &m_offline; }
-    QString getName() { return m_name; }
-
-// 信号
-signals:
-    /**
-     * @brief loginResult 登录结果
-     * @param isSuccess 是否登录成功
-     */
-    void loginResult(bool isSuccess);
-
-    /**
-     * @brief receivedPrivateMessage 接收到私聊消息信号
-     * @param msg 消息内容
-     */
-    void receivedPrivateMessage(IMMessage msg);
-
-    /**
-     * @brief receivedGroupMessage 接收到群聊消息信号
-     * @param msg 消息内容
-     */
-    void receivedGroupMessage(IMMessage msg);
-
-    /**
-     * @brief userOnline 用户上线信号
-     * @param fromName 上线者昵称
-     */
-    void userOnline(QString fromName);
-
-    /**
-     * @brief userOffline 用户下线信号
-     * @param fromName 下线者昵称
-     */
-    void userOffline(QString fromName);
-
-    /**
-     * @brief serverConnected 服务器连接成功信号
-     */
-    void serverConnected();
-
-    /**
-     * @brief serverClose 服务器关闭信号
-     */
-    void serverClose();
-
-    /**
-     * @brief connectError 连接发生错误信号
-     * @param ErrorInfo 错误信息文本说明
-     */
-    void connectError(QString ErrorInfo);
-
-// 槽
-public slots:
-    /**
-     * @brief connected 连接成功时触发
-     */
-    void connected();
-
-    /**
-     * @brief readyread 当接收到数据时触发
-     */
-    void readyread();
-
-    /**
-     * @brief disconnected 当连接断开时触发
-     */
-    void disconnected();
-
-    /**
-     * @brief error 当连接发生错误时触发
-     * @param socketError 错误信息
-     */
-    void error(QAbstractSocket::SocketError socketError);
-
-// 私有成员函数
-private:
-    /**
-     * @brief sendData 发送数据到服务器
-     * @param data 数据
-     */
-    void sendData(QString data);
-
-// 私有的成员变量
-private:
-
-    /**
-     * @brief 当前登录的用户昵称
-     */
-    QString m_name;
-
-    /**
-     * @brief 客户端的Tcp Socket对象
-     */
-    QTcpSocket *m_socket;
-
-    /**
-     * @brief 在线人员昵称列表
-     */
-    QVector<QString> m_online;
-    /**
-     * @brief 离线人员昵称列表
-     */
-    QVector<QString> m_offline;
-
-    /**
-     * @brief 私聊的聊天记录
-     */
-    QMap<QString, QVector<IMMessage> > m_chatRecord;
-
-    /**
-     * @brief 群聊的聊天记录
-     */
-    QVector<IMMessage> m_gruopChatRecord;
-};
-
-#endif // IMCLIENT_H
+#ifndef IMCLIENT_H
+#define IMCLIENT_H
+
+#include <QObject>
+#include <QtNetwork>
+#include <QString>
+#include <QVector>
+#include <QHash>
+#include <QThread>
+#include <QMap>
+#include <QTimer>
+#include "immessage.h"
+#include "imtransfer.h"
+#include "imnetwork.h"
+#include "imchatcache.h"
+#include "impresencestore.h"
+#include "imdal.h"
+#include "imdbloader.h"
+#include "imcodec.h"
+#include "imhybridclock.h"
+
+/***********************************
+ *
+ * Class IMClient
+ * IM客户端类
+ *
+ * 用于与服务端交互的封装类
+ *
+ * 公开方法有：
+ * login                登录
+ * sendPrivateMessage   发送私聊消息
+ * sendGroupMessage     发送群聊消息
+ * sendFile             请求发送文件
+ * acceptFile           接受文件
+ * rejectFile           拒绝或取消文件
+ * getChatRecord        获取要显示的私聊记录，第一次获取时只加载最新的一页，显示期间不会被缓存淘汰
+ * releaseChatRecord    不再显示任何会话
+ * loadOlderChatRecord  往前多加载一页私聊记录
+ * searchMessage        全文搜索聊天记录
+ *
+ * 登录成功后立即显示主窗口，数据库在IMDBLoader线程中打开，打开后再把有聊天记录的人合并到好友列表，
+ * 打开之前收发的消息先暂存，打开之前打开的会话在数据库就绪后重新加载
+ *
+ * 聊天记录按页从数据库加载，登录时不加载任何历史记录，
+ * 打开会话时加载最新的一页，往上翻到顶时再加载更早的一页
+ * 加载过的会话放在按内存预算淘汰的缓存中，被淘汰的会话再次打开时重新加载
+ *
+ * 登录后连接断开时不再退出，而是按带随机抖动的指数退避自动重连并重新登录，
+ * 重新登录时只同步断线期间变化了的在线状态
+ *
+ * 发出的聊天消息带上序号，先写入本地数据库并标记为待确认，服务端确认后才标记为已送达
+ * 待确认的消息组成发件箱，断线期间只进发件箱，重新登录后按序号重新发送，程序重启后从数据库中恢复
+ * 发往服务端的所有命令先攒在发送缓冲区中，一轮事件循环只交给网络线程一次，一次写入
+ *
+ * 收到的消息带着服务端分配的消息编号与HLC时间，按服务端的时间保存和显示，本机的HLC时钟跟随服务端的时间，
+ * 自己发出的消息先用本机的HLC时间，确认时换成服务端分配的编号与时间
+ *
+ * 聊天连接的读写、拆帧与解析都在IMNetwork所在的网络线程中进行，
+ * 一次读取到的所有命令作为一批交回界面线程处理
+ *
+ * IM.ini 中 [debug] latencyTrace=true 时打开延迟跟踪：登录帧带上本机时钟，按登录结果估计与服务端的时钟偏差，
+ * 之后发出的聊天消息都带上发出时间，收到的消息带着各环节的时间，换算到服务端时钟后通过messageTraced交给调试浮层
+ *
+ * 发出的信号有：
+ * receivedPrivateMessage   接收到私聊消息信号
+ * receivedGroupMessage     接收到群聊消息信号
+ * userOnline               用户上线信号
+ * userOffline              用户下线信号
+ * serverClose              服务器关闭信号，只在登录之前发出
+ * connectionLost           登录后连接断开，开始自动重连
+ * reconnected              自动重连并重新登录成功
+ * databaseReady            数据库已经在后台打开，可以读取聊天记录
+ * messageDelivered         发出的消息被服务端确认
+ * messageTraced            收到一条带时间戳的消息，只在打开了延迟跟踪时发出
+ * fileOffered              收到文件请求信号
+ * transferProgress         文件传输进度信号
+ * transferFinished         文件传输结束信号
+ *
+ **********************************/
+/**
+ * @brief IM客户端类
+ */
+class IMClient : public QObject
+{
+    Q_OBJECT
+// 公开的成员函数
+protected:
+    explicit IMClient(QObject *parent = nullptr);
+
+public:
+    /**
+     * @brief instance 单例对象
+     * @return 单例对象指针
+     */
+    static IMClient *instance();
+
+    ~IMClient();
+
+    /**
+     * @brief connectServer 尝试连接服务器
+     * 地址格式：
+     * 127.0.0.1、127.0.0.1:9876、tcp://127.0.0.1:9876   Tcp连接，不写端口时为9876
+     * local://IMService                                本地套接字，与服务端在同一台机器上时使用
+     * shm://IMService                                  本地套接字 + 共享内存环形缓冲区，适合发送量大的本地客户端
+     * 本地连接时文件传输通道仍然走Tcp，连接 IM.ini 中 [transfer] endpoint 配置的地址，默认127.0.0.1:9876
+     * @param address 服务器地址
+     */
+    void connectServer(QString address);
+
+    /**
+     * @brief login 登录
+     * @param name 用户名
+     */
+    void login(QString name);
+
+    /**
+     * @brief sendPrivateMessage 发送私聊消息
+     * @param toName 发送给谁
+     * @param content 消息内容
+     */
+    void sendPrivateMessage(QString toName, QString content);
+
+    /**
+     * @brief sendGroupMessage 发送群聊消息
+     * @param content 消息内容
+     */
+    void sendGroupMessage(QString content);
+
+    /**
+     * @brief sendFile 请求给某人发送文件，对方接受后开始传输
+     * @param toName 发送给谁
+     * @param filePath 文件路径
+     * @return 文件无法读取时返回false
+     */
+    bool sendFile(QString toName, QString filePath);
+
+    /**
+     * @brief acceptFile 接受文件
+     * @param id 传输编号
+     * @param savePath 保存的路径
+     */
+    void acceptFile(quint64 id, QString savePath);
+
+    /**
+     * @brief rejectFile 拒绝或取消文件
+     * @param id 传输编号
+     */
+    void rejectFile(quint64 id);
+
+    /**
+     * @brief isOpen 连接是否打开
+     * @return
+     */
+    bool isOpen();
+
+
+    /**
+     * @brief loadOlderChatRecord 往前多加载一页私聊记录
+     * @param name 对方昵称
+     * @return 加载的消息条数，0表示没有更早的消息了
+     */
+    int loadOlderChatRecord(QString name);
+
+    /**
+     * @brief loadOlderGroupChatRecord 往前多加载一页群聊记录
+     * @return 加载的消息条数，0表示没有更早的消息了
+     */
+    int loadOlderGroupChatRecord();
+
+    /**
+     * @brief loadChatRecordTo 把私聊记录一直加载到某条消息，跳转到搜索结果时使用
+     * @param name 对方昵称
+     * @param target 要跳转到的消息
+     */
+    void loadChatRecordTo(QString name, const IMMessage &target);
+
+    /**
+     * @brief loadGroupChatRecordTo 把群聊记录一直加载到某条消息
+     * @param target 要跳转到的消息
+     */
+    void loadGroupChatRecordTo(const IMMessage &target);
+
+    /**
+     * @brief searchMessage 全文搜索聊天记录，见IMDAL::searchMessage
+     */
+    QVector<IMSearchResult> searchMessage(QString text, QString peer = QString(),
+                                          QDateTime from = QDateTime(), QDateTime to = QDateTime());
+
+    /**
+     * @brief DefaultPort 地址中不写端口时使用的端口
+     */
+    static const quint16 DefaultPort = 9876;
+
+    /**
+     * @brief HistoryPageSize 每次从数据库加载的消息条数
+     */
+    static const int HistoryPageSize = 50;
+
+    /**
+     * @brief ChatCacheBudget 内存中缓存的聊天记录最多占用的字节数
+     */
+    static const qint64 ChatCacheBudget = 16 * 1024 * 1024;
+
+    /**
+     * @brief ReconnectBaseDelay 第一次重连的等待时间（毫秒），之后每次翻倍
+     */
+    static const int ReconnectBaseDelay = 1000;
+
+    /**
+     * @brief ReconnectMaxDelay 重连等待时间的上限（毫秒）
+     */
+    static const int ReconnectMaxDelay = 60 * 1000;
+
+    /**
+     * @brief OutboundBatchBytes 发送缓冲区超过这个字节数时不等下一轮事件循环，立即交给网络线程
+     */
+    static const int OutboundBatchBytes = 64 * 1024;
+
+public:
+    const IMChatRecord *getChatRecord(QString name);
+    const IMChatRecord *getGroupChatRecord();
+    void releaseChatRecord() { m_chatCache.unpin(); }
+    const QVector<QString> *getOnlineList() { return &m_presence.onlineList(); }
+    const QVector<QString> *getOfflineList() { return &m_presence.offlineList(); }
+    QString getName() { return m_name; }
+
+    /**
+     * @brief isTraceEnabled 是否打开了延迟跟踪
+     */
+    bool isTraceEnabled() const { return m_traceEnabled; }
+
+    /**
+     * @brief clockOffset 估计的时钟偏差（微秒），服务端时钟减去本机时钟
+     */
+    qint64 clockOffset() const { return m_clockOffset; }
+
+    /**
+     * @brief clockRtt 估计时钟偏差时的往返时间（微秒），偏差的误差不超过它的一半，还没有估计时为-1
+     */
+    qint64 clockRtt() const { return m_clockSynced ? m_clockRtt : -1; }
+
+// 信号
+signals:
+    /**
+     * @brief loginResult 登录结果
+     * @param isSuccess 是否登录成功
+     */
+    void loginResult(bool isSuccess);
+
+    /**
+     * @brief receivedPrivateMessage 接收到私聊消息信号
+     * @param msg 消息内容
+     */
+    void receivedPrivateMessage(IMMessage msg);
+
+    /**
+     * @brief receivedGroupMessage 接收到群聊消息信号
+     * @param msg 消息内容
+     */
+    void receivedGroupMessage(IMMessage msg);
+
+    /**
+     * @brief userOnline 用户上线信号
+     * @param fromName 上线者昵称
+     */
+    void userOnline(QString fromName);
+
+    /**
+     * @brief userOffline 用户下线信号
+     * @param fromName 下线者昵称
+     */
+    void userOffline(QString fromName);
+
+    /**
+     * @brief serverConnected 服务器连接成功信号
+     */
+    void serverConnected();
+
+    /**
+     * @brief serverClose 服务器关闭信号，只在登录之前发出，登录之后断开会自动重连
+     */
+    void serverClose();
+
+    /**
+     * @brief connectionLost 登录后连接断开信号，之后会自动重连
+     */
+    void connectionLost();
+
+    /**
+     * @brief reconnected 自动重连并重新登录成功信号
+     */
+    void reconnected();
+
+    /**
+     * @brief databaseReady 登录后数据库在后台打开完成信号
+     * @param contacts 有聊天记录、之前不在好友列表中的人，都是离线的
+     */
+    void databaseReady(QVector<QString> contacts);
+
+    /**
+     * @brief messageDelivered 发出的消息被服务端确认信号
+     * @param key 对方昵称，群聊为空字符串
+     * @param seq 消息序号
+     */
+    void messageDelivered(QString key, quint64 seq);
+
+    /**
+     * @brief messageTraced 收到一条带时间戳的消息，只在打开了延迟跟踪并且估计出时钟偏差后发出
+     * @param fromName 发送者昵称
+     * @param isGroup 是否是群聊消息
+     * @param trace 各环节的时间，都已经换算到服务端时钟，发送者没有打开跟踪时发出时间为0
+     */
+    void messageTraced(QString fromName, bool isGroup, IMFrameTrace trace);
+
+    /**
+     * @brief connectError 连接发生错误信号
+     * @param ErrorInfo 错误信息文本说明
+     */
+    void connectError(QString ErrorInfo);
+
+    /**
+     * @brief fileOffered 收到文件请求信号
+     * @param fromName 发送者昵称
+     * @param id 传输编号
+     * @param size 文件大小
+     * @param fileName 文件名
+     */
+    void fileOffered(QString fromName, quint64 id, qint64 size, QString fileName);
+
+    /**
+     * @brief transferProgress 文件传输进度信号
+     * @param id 传输编号
+     * @param done 已经传输的字节数
+     * @param total 总字节数
+     */
+    void transferProgress(quint64 id, qint64 done, qint64 total);
+
+    /**
+     * @brief transferFinished 文件传输结束信号
+     * @param id 传输编号
+     * @param isSuccess 是否成功
+     * @param info 成功时是文件路径，失败时是原因
+     */
+    void transferFinished(quint64 id, bool isSuccess, QString info);
+
+// 槽
+public slots:
+    /**
+     * @brief connected 连接成功时触发
+     */
+    void connected();
+
+    /**
+     * @brief commandsReceived 网络线程解出一批命令时触发
+     * @param commands 按收到的顺序排列的命令
+     */
+    void commandsReceived(QVector<IMCommand> commands);
+
+    /**
+     * @brief disconnected 当连接断开时触发
+     */
+    void disconnected();
+
+// 私有槽
+private slots:
+    /**
+     * @brief networkError 连接发生错误时触发，登录之前交给界面，登录之后安排重连
+     * @param errorInfo 错误信息
+     */
+    void networkError(QString errorInfo);
+
+    /**
+     * @brief reconnect 重连定时器到时触发
+     */
+    void reconnect();
+
+    /**
+     * @brief databaseLoaded 后台线程打开数据库完成时触发
+     */
+    void databaseLoaded();
+
+    /**
+     * @brief flushOutbound 把发送缓冲区中攒下的帧一次交给网络线程
+     */
+    void flushOutbound();
+
+    /**
+     * @brief transferCompleted 文件传输完成时触发
+     * @param id 传输编号
+     */
+    void transferCompleted(quint64 id);
+
+    /**
+     * @brief transferInterrupted 文件传输通道中断时触发
+     * @param id 传输编号
+     */
+    void transferInterrupted(quint64 id);
+
+    /**
+     * @brief shutdown 程序退出时停止文件传输与网络线程，之后不能再使用网络
+     */
+    void shutdown();
+
+// 私有成员函数
+private:
+    /**
+     * @brief sendCommand 按命令的声明编码后直接追加到发送缓冲区，这一轮事件循环结束后一起发送
+     * @param args 命令的参数，个数和类型在编译时检查
+     */
+    template <typename Schema, typename... Args>
+    void sendCommand(const Args &... args)
+    {
+        if (!this->isOpen())
+            return;
+        IMCodec<Schema>::appendFrame(this->m_outbound, args...);
+        this->outboundAppended();
+    }
+
+    /**
+     * @brief sendLogin 发送登录命令，重连时带上已知的在线状态纪元与版本，打开了延迟跟踪时带上本机时钟
+     */
+    void sendLogin();
+
+    /**
+     * @brief sendChatFrame 发送发件箱中的一帧，打开了延迟跟踪时复制一份带上发出时间
+     * @param frame 帧数据
+     */
+    void sendChatFrame(const QByteArray &frame);
+
+    /**
+     * @brief syncClock 按登录结果中的时间戳估计时钟偏差
+     * @param trace 登录结果的时间戳，发出与解出是本机时钟，收到与写入是服务端时钟
+     */
+    void syncClock(const IMFrameTrace &trace);
+
+    /**
+     * @brief reportLatency 收到的消息带着时间戳时，换算到服务端时钟后发出messageTraced
+     * @param fromName 发送者昵称
+     * @param isGroup 是否是群聊消息
+     * @param trace 消息的时间戳
+     */
+    void reportLatency(const QString &fromName, bool isGroup, IMFrameTrace trace);
+
+    /**
+     * @brief sendFrame 发送已经编码好的帧，发件箱重发时使用
+     * @param frame 帧数据
+     */
+    void sendFrame(const QByteArray &frame);
+
+    /**
+     * @brief outboundAppended 发送缓冲区中追加了帧，攒够了立即发送，否则等这一轮事件循环结束
+     */
+    void outboundAppended();
+
+    /**
+     * @brief sendChat 发送聊天消息，放入发件箱，断线重连期间只放入发件箱
+     * @param key 对方昵称，群聊为空字符串
+     * @param content 消息内容
+     * @return 消息序号
+     */
+    quint64 sendChat(const QString &key, const QString &content);
+
+    /**
+     * @brief queueOutbox 把一条待确认的消息放入发件箱，连接可用时立即发送
+     * @param seq 消息序号
+     * @param key 对方昵称，群聊为空字符串
+     * @param content 消息内容
+     */
+    void queueOutbox(quint64 seq, const QString &key, const QString &content);
+
+    /**
+     * @brief resendOutbox 重新登录后按序号重新发送发件箱中所有待确认的消息
+     */
+    void resendOutbox();
+
+    /**
+     * @brief messageAcked 服务端确认了一条消息
+     * @param seq 消息序号
+     * @param msgId 服务端分配的消息编号
+     * @param hlc 服务端分配的HLC时间
+     */
+    void messageAcked(quint64 seq, quint64 msgId, quint64 hlc);
+
+    /**
+     * @brief scheduleReconnect 按带随机抖动的指数退避安排下一次重连
+     */
+    void scheduleReconnect();
+
+    /**
+     * @brief resyncPresence 重连后按完整的在线列表同步，只对变化了的人发出上下线信号
+     * @param online 当前在线的人
+     */
+    void resyncPresence(const QVector<QString> &online);
+
+    /**
+     * @brief setPresence 修改某人的在线状态，确实变化了才发出上下线信号
+     * 上线时把发件箱中发给他的消息重新发送，他不在线时服务端没有转发这些消息
+     */
+    void setPresence(const QString &name, bool online);
+
+    /**
+     * @brief openDatabase 登录成功后在后台线程中打开数据库
+     */
+    void openDatabase();
+
+    /**
+     * @brief processCommand 处理一条服务端发来的命令
+     * @param command 拆好帧的命令
+     */
+    void processCommand(const IMCommand &command);
+
+    /**
+     * @brief stampedMessage 由收到的私聊或群聊命令生成消息，带上服务端分配的编号与时间，并让本机的HLC时钟跟上
+     * @param fromName 消息的发送者，私聊时是i
+     * @param content 消息内容
+     * @param msgId 服务端分配的消息编号
+     * @param hlc 服务端分配的时间
+     * @param receivedAt 收到的时间，hlc为0时使用
+     */
+    IMMessage stampedMessage(const QString &fromName, const QString &content, quint64 msgId, quint64 hlc, qint64 receivedAt);
+
+    /**
+     * @brief loadChatRecord 加载一页聊天记录到会话中
+     * 还没有加载过时丢弃内存中的消息，加载最新的一页，否则加载已有消息之前的一页
+     * @param record 会话的聊天记录
+     * @param name 对方昵称，nullptr表示群聊
+     * @param until 不为nullptr时不按页，一次加载到这条消息为止
+     * @return 加载的消息条数
+     */
+    int loadChatRecord(IMChatRecord &record, const QString *name, const IMMessage *until = nullptr);
+
+    /**
+     * @brief appendChatRecord 新消息添加到会话中，会话没有缓存或者还没有加载时不用添加，打开时会从数据库读到
+     * @param key 对方昵称，群聊为空字符串
+     */
+    void appendChatRecord(const QString &key, const IMMessage &msg);
+
+    /**
+     * @brief resumeTransfer 接收方从已经收到的位置继续传输
+     * @param id 传输编号
+     */
+    void resumeTransfer(quint64 id);
+
+    /**
+     * @brief removeTransfer 结束一次传输并发出结束信号
+     * @param id 传输编号
+     * @param isSuccess 是否成功
+     * @param info 成功时是文件路径，失败时是原因
+     */
+    void removeTransfer(quint64 id, bool isSuccess, QString info);
+
+// 私有的成员变量
+private:
+
+    /**
+     * @brief 当前登录的用户昵称
+     */
+    QString m_name;
+
+    /**
+     * @brief 网络线程
+     */
+    QThread *m_networkThread;
+
+    /**
+     * @brief 聊天连接，运行在网络线程中
+     */
+    IMNetwork *m_network;
+
+    /**
+     * @brief 服务器地址，文件传输通道也连接这个地址
+     */
+    QString m_hostName;
+
+    /**
+     * @brief 服务器端口
+     */
+    quint16 m_port;
+
+    /**
+     * @brief 本地连接时文件传输通道连接的地址，host:port
+     */
+    QString m_transferEndpoint;
+
+    /**
+     * @brief 进行中的文件传输，key是传输编号
+     */
+    QHash<quint64, IMTransfer *> m_transfers;
+
+    /**
+     * @brief 接收方传输中断后已经重试的次数
+     */
+    QHash<quint64, int> m_transferRetries;
+
+    /**
+     * @brief 好友的在线状态
+     */
+    IMPresenceStore m_presence;
+
+    /**
+     * @brief 服务端在线状态的纪元与已知的版本，重连时用来增量同步
+     */
+    QString m_presenceEpoch;
+    quint64 m_presenceVersion;
+
+    /**
+     * @brief 服务器地址，重连时使用
+     */
+    QString m_address;
+
+    /**
+     * @brief 是否已经登录过，登录过之后断开就自动重连
+     */
+    bool m_loggedIn;
+
+    /**
+     * @brief 当前连接是否已经登录，可以直接发送聊天消息
+     */
+    bool m_sessionReady;
+
+    /**
+     * @brief 重连定时器
+     */
+    QTimer *m_reconnectTimer;
+
+    /**
+     * @brief 连续重连失败的次数
+     */
+    int m_reconnectAttempt;
+
+    /**
+     * @brief 发件箱：还没有被服务端确认的聊天消息，key是序号，按序号重新发送
+     */
+    struct OutboxEntry {
+        // 对方昵称，群聊为空字符串
+        QString key;
+        // 编码好的帧，重发时原样发送
+        QByteArray frame;
+    };
+    QMap<quint64, OutboxEntry> m_outbox;
+
+    /**
+     * @brief 上一条消息的序号
+     */
+    quint64 m_lastSeq;
+
+    /**
+     * @brief 本机的HLC时钟，跟随收到的服务端时间，数据库打开后从保存的最大时间继续
+     */
+    IMHybridClock m_clock;
+
+    /**
+     * @brief 发送缓冲区，攒下的帧首尾相接
+     */
+    QByteArray m_outbound;
+
+    /**
+     * @brief 发送缓冲区的定时器，0毫秒，这一轮事件循环结束后触发
+     */
+    QTimer *m_outboundTimer;
+
+    /**
+     * @brief 是否打开了延迟跟踪
+     */
+    bool m_traceEnabled;
+
+    /**
+     * @brief 是否已经估计出时钟偏差
+     */
+    bool m_clockSynced;
+
+    /**
+     * @brief 服务端时钟减去本机时钟（微秒），以及估计时的往返时间
+     */
+    qint64 m_clockOffset;
+    qint64 m_clockRtt;
+
+    /**
+     * @brief 正在后台打开数据库的线程，打开完成后为nullptr
+     */
+    IMDBLoader *m_dbLoader;
+
+    /**
+     * @brief 私聊和群聊的聊天记录缓存，群聊的key是空字符串
+     */
+    IMChatCache m_chatCache;
+};
+
+#endif // IMCLIENT_H
@@ -1,241 +1,1181 @@
-#include <QSqlDatabase>
-#include <QSqlError>
-#include <QSqlQuery>
-#include <QVector>
-#include <QString>
-#include <QDebug>
-#include "imdal.h"
-#include "immessage.h"
-
-
-
-IMDAL *IMDAL::instance()
-{
-    static IMDAL imDAL;
-    return &imDAL;
-}
-
-void IMDAL::initDatabase(QString name)
-{
-    //打印Qt支持的数据库驱动
-    qDebug()<<QSqlDatabase::drivers();
-
-    QSqlDatabase database;
-    // 检测默认连接是否已经存在
-    if (QSqlDatabase::contains(QSqlDatabase::defaultConnection))
-    {
-        // 存在就直接用
-        database = QSqlDatabase::database(QSqlDatabase::defaultConnection);
-    }
-    else
-    {
-        // 不存在就添加一个数据库驱动引擎SQLite
-        database = QSqlDatabase::addDatabase("QSQLITE");
-        // 然后打开指定用户的数据库文件
-        database.setDatabaseName(QString("./msgsave_%1.db").arg(name));
-        // database.setUserName("root");
-        // database.setPassword("123456");
-    }
-
-    //打开数据库
-    if(!database.open())
-    {
-        // 如果打开失败 退出程序
-        qDebug()<<database.lastError();
-        qFatal("failed to connect.");
-    }
-    else
-    {
-        qDebug() << "Open database success!";
-        QStringList tables = database.tables();  //获取数据库中的表
-        qDebug() << QString("表的个数： %1").arg(tables.count()); //打印表的个数
-        // 如果表的数量小于3，说明这是一个新用户登录
-        if (tables.count() < 3)
-        {
-/*
-  SQL语句：
-CREATE TABLE user (
-    id   INTEGER PRIMARY KEY AUTOINCREMENT,
-    name VARCHAR NOT NULL
-                 UNIQUE
-);
-
-INSERT INTO user (
-    name
-)
-VALUES (
-    'xxx'
-);
-
-CREATE TABLE message (
-    id       INTEGER  PRIMARY KEY AUTOINCREMENT,
-    fromID INTEGER  NOT NULL
-                      REFERENCES user ( id )  ON DELETE CASCADE
-                                              ON UPDATE CASCADE,
-    content  TEXT     NOT NULL,
-    time     DATETIME NOT NULL
-                      DEFAULT ( datetime( 'now', 'localtime' )  ),
-    io       CHAR     NOT NULL
-);
-io这个字段代表是发送还是接受：i收到消息 o发出消息 g群聊消息
-*/
-            database.transaction();
-            QSqlQuery query;
-            // 创建表并将用户昵称插入表中作为第一条数据存在，id为1
-            query.exec("CREATE TABLE user ("
-                          "id INTEGER PRIMARY KEY AUTOINCREMENT,"
-                          "name VARCHAR NOT NULL UNIQUE);");
-            query.exec(QString("INSERT INTO user(name) values('%1');").arg(name));
-            query.exec("CREATE TABLE message ("
-                       "id INTEGER PRIMARY KEY AUTOINCREMENT,"
-                       "fromID INTEGER NOT NULL REFERENCES user(id) ON DELETE CASCADE ON UPDATE CASCADE,"
-                       "content TEXT NOT NULL,"
-                       "time DATETIME NOT NULL DEFAULT(datetime('now','localtime')),"
-                       "io CHAR NOT NULL);");
-            if (!database.commit())
-                qDebug()<<database.lastError();
-        }
-    }
-}
-
-void IMDAL::addPrivateMessage(QString name, IMMessage msg)
-{
-    if (!QSqlDatabase::database().isOpen())
-        return;
-    // 获得用户ID
-    int userID = getUserID(name);
-    if (userID == 0)
-        return;
-    // 插入这条私聊消息
-    QSqlQuery query;
-    query.prepare("INSERT INTO message(fromID, content, time, io) "
-                  "VALUES(?, ?, ?, ?)");
-    query.addBindValue(userID);
-    query.addBindValue(msg.content);
-    query.addBindValue(msg.time);
-    query.addBindValue(msg.fromName);
-    if (!query.exec())
-        qDebug()<<query.lastError();
-}
-
-void IMDAL::addGroupMessage(IMMessage msg)
-{
-    if (!QSqlDatabase::database().isOpen())
-        return;
-
-    // 获取用户ID
-    int userID = getUserID(msg.fromName);
-    if (userID == 0)
-        return;
-    // 插入这条群聊消息
-    QSqlQuery query;
-    query.prepare("INSERT INTO message(fromID, content, time, io) "
-                  "VALUES(?, ?, ?, 'g')");
-    query.addBindValue(userID);
-    query.addBindValue(msg.content);
-    query.addBindValue(msg.time);
-    if (!query.exec())
-        qDebug()<<query.lastError();
-}
-
-QVector<IMMessage> IMDAL::getPrivateMessage(QString name)
-{
-    QVector<IMMessage> msgList;
-    int userID = 0;
-    if (!QSqlDatabase::database().isOpen())
-        return msgList;
-    QSqlQuery query;
-    query.prepare("SELECT id FROM user WHERE name = ?");
-    query.addBindValue(name);
-    if(!query.exec())
-    {
-        qDebug()<<query.lastError();
-        return msgList;
-    }
-    // 获取这个昵称的id
-    while(query.next())
-        userID = query.value(0).toInt();
-    // 如果没有这个人的记录，直接返回空
-    if (userID == 0)
-        return msgList;
-
-    // 否则查找这个用户的消息
-    query.prepare("SELECT io, content, time FROM message WHERE fromID = ? AND io != 'g'");
-    query.addBindValue(userID);
-    if(!query.exec())
-    {
-        qDebug()<<query.lastError();
-        return msgList;
-    }
-    // 将所有消息添加到列表中
-    while(query.next())
-        msgList.append(IMMessage(query.value(0).toString(), query.value(1).toString(), query.value(2).toDateTime()));
-
-    return msgList;
-}
-
-QVector<IMMessage> IMDAL::getGroupMessage()
-{
-    QVector<IMMessage> msgList;
-    if (!QSqlDatabase::database().isOpen())
-        return msgList;
-    QSqlQuery query;
-    if(!query.exec("SELECT name, content, time FROM message,user WHERE io == 'g' AND user.id = fromID"))
-    {
-        qDebug()<<query.lastError();
-        return msgList;
-    }
-    // 将所有消息添加到列表中
-    while(query.next())
-        msgList.append(IMMessage(query.value(0).toString(), query.value(1).toString(), query.value(2).toDateTime()));
-
-    return msgList;
-}
-
-QVector<QString> IMDAL::getUserList()
-{
-    qDebug() << "getUserList()";
-    QVector<QString> names;
-    if (!QSqlDatabase::database().isOpen())
-        return names;
-    QSqlQuery query;
-    if (!query.exec("SELECT name FROM user"))
-    {
-        qDebug()<<query.lastError();
-    }
-    else
-    {
-        while (query.next())
-            names.append(query.value(0).toString());
-    }
-    qDebug() << names;
-    return names;
-}
-
-int IMDAL::getUserID(QString name)
-{
-    QSqlQuery query;
-    int userID = 0;
-    query.prepare("SELECT id FROM user WHERE name = ?");
-    query.addBindValue(name);
-    if(!query.exec())
-    {
-        qDebug()<<query.lastError();
-        return 0;
-    }
-    // 获取这个昵称的id
-    while(query.next())
-        userID = query.value(0).toInt();
-    if (userID)
-        return userID;
-
-    // 如果没有这个人的记录，那么就创建这个人的ID
-    query.prepare("INSERT INTO user(name) VALUES(?)");
-    query.addBindValue(name);
-    if(!query.exec())
-    {
-        qDebug()<<query.lastError();
-        return 0;
-    }
-    return query.lastInsertId().toInt();
-}
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QVector>
+#include <QString>
+#include <QDebug>
+#include <QCoreApplication>
+#include <QThread>
+#include <QSettings>
+#include <QSet>
+#include <QMap>
+#include <algorithm>
+#include "imdal.h"
+#include "immessage.h"
+#include "imdbwriter.h"
+#include "imstartuptrace.h"
+#include "imarchive.h"
+#include "imhybridclock.h"
+
+// 全文索引跟着插入更新的触发器，导入大量消息时先删掉，导入完重建全文索引
+static const char *const FtsInsertTrigger =
+        "CREATE TRIGGER message_fts_insert AFTER INSERT ON message BEGIN "
+        "INSERT INTO message_fts(rowid, content) VALUES(new.id, new.content); END;";
+
+// 当前版本message表上的索引（名称与建索引的语句），导入大量消息时先删掉，导入完一次建好
+static const char *const MessageIndexes[][2] = {
+    { "message_peer", "CREATE INDEX IF NOT EXISTS message_peer ON message(fromID, time, id, io);" },
+    { "message_group", "CREATE INDEX IF NOT EXISTS message_group ON message(io, time, id, fromID);" },
+    { "message_time", "CREATE INDEX IF NOT EXISTS message_time ON message(time, id);" }
+};
+
+/**
+ * @brief likeSnippet 没有全文索引时自己截取匹配位置附近的内容，匹配的文字用[]括起来
+ */
+static QString likeSnippet(const QString &content, const QString &text)
+{
+    int pos = content.indexOf(text, 0, Qt::CaseInsensitive);
+    int begin = qMax(0, pos - 16);
+    if (pos < 0)
+        return content.left(32);
+    return (begin > 0 ? "..." : "") + content.mid(begin, pos - begin)
+            + "[" + content.mid(pos, text.length()) + "]"
+            + content.mid(pos + text.length(), 16)
+            + (pos + text.length() + 16 < content.length() ? "..." : "");
+}
+
+/**
+ * @brief rankResults 全文搜索的结果按相关度排序，只保留前limit条
+ * 整个搜索词是一个短语，IDF对每一条结果都一样，bm25的顺序只取决于词频和长度，这里只算这一部分
+ * 平均长度取这一批结果的，分数相同的保持原来从新到旧的顺序
+ */
+static void rankResults(QVector<IMSearchResult> &results, const QString &text, int limit)
+{
+    const double k1 = 1.2;
+    const double b = 0.75;
+    double averageLength = 0;
+    for (const IMSearchResult &result : results)
+        averageLength += result.message.content.length();
+    averageLength = qMax(1.0, averageLength / qMax(1, results.size()));
+
+    QVector<QPair<double, int>> scores;
+    scores.reserve(results.size());
+    for (int i = 0; i < results.size(); ++i)
+    {
+        const QString &content = results.at(i).message.content;
+        double frequency = qMax(1, content.count(text, Qt::CaseInsensitive));
+        double score = frequency * (k1 + 1) / (frequency + k1 * (1 - b + b * content.length() / averageLength));
+        scores.append(qMakePair(-score, i));
+    }
+    std::stable_sort(scores.begin(), scores.end(),
+                     [](const QPair<double, int> &a, const QPair<double, int> &b) { return a.first < b.first; });
+
+    if (limit < 0 || limit > scores.size())
+        limit = scores.size();
+    QVector<IMSearchResult> ranked;
+    ranked.reserve(limit);
+    for (int i = 0; i < scores.size() && i < limit; ++i)
+        ranked.append(results.at(scores.at(i).second));
+    results.swap(ranked);
+}
+
+/**
+ * @brief coldMessage 冷存储中的消息转换为IMMessage，私聊消息的fromName是i或o，群聊消息是发送者
+ */
+static IMMessage coldMessage(const IMSegmentMessage &msg, bool isGroup)
+{
+    IMMessage message(isGroup ? msg.user : msg.io, msg.content, QDateTime::fromMSecsSinceEpoch(msg.time), msg.id);
+    message.msgId = msg.msgId;
+    message.hlc = msg.hlc;
+    return message;
+}
+
+/**
+ * @brief keyLess (time, id) 的比较
+ */
+static inline bool keyLess(qint64 time1, qint64 id1, qint64 time2, qint64 id2)
+{
+    return time1 < time2 || (time1 == time2 && id1 < id2);
+}
+
+IMDAL *IMDAL::instance()
+{
+    static IMDAL imDAL;
+    return &imDAL;
+}
+
+IMDAL::IMDAL()
+    : m_ftsAvailable(false),
+      m_ftsTrigram(false),
+      m_writer(nullptr),
+      m_segments(nullptr),
+      m_unflushedBase(0)
+{
+}
+
+IMDAL::~IMDAL()
+{
+    this->closeDatabase();
+}
+
+void IMDAL::closeDatabase()
+{
+    if (this->m_writer == nullptr)
+        return;
+    // 剩下的消息提交完后写线程才会退出
+    this->m_writer->stop();
+    delete this->m_writer;
+    this->m_writer = nullptr;
+    this->m_unflushed = QVector<IMDBRecord>();
+    this->m_unflushedBase = 0;
+    delete this->m_segments;
+    this->m_segments = nullptr;
+}
+
+IMDatabaseState IMDAL::prepareDatabase(QString name)
+{
+    IMDatabaseState state;
+    state.databaseName = QString("./msgsave_%1.db").arg(name);
+    // 使用单独的连接，只在当前线程中使用
+    QString connectionName = QString("IMDAL_prepare_%1").arg(quintptr(QThread::currentThreadId()));
+    {
+        qint64 begin = IMStartupTrace::now();
+        QSqlDatabase database = QSqlDatabase::addDatabase("QSQLITE", connectionName);
+        database.setDatabaseName(state.databaseName);
+        database.setConnectOptions("QSQLITE_BUSY_TIMEOUT=5000");
+        if (!database.open())
+        {
+            qDebug() << database.lastError();
+        }
+        else
+        {
+            // 连接参数，WAL等
+            configureConnection(database);
+            // 移出消息后空出来的页要能还给文件系统，auto_vacuum只能在VACUUM时改变，旧数据库转换一次
+            QSqlQuery vacuum(database);
+            if (vacuum.exec("PRAGMA auto_vacuum") && vacuum.next() && vacuum.value(0).toInt() != 2)
+            {
+                vacuum.finish();
+                if (!vacuum.exec("PRAGMA auto_vacuum = INCREMENTAL") || !vacuum.exec("VACUUM"))
+                    qDebug() << "auto_vacuum:" << vacuum.lastError();
+            }
+            vacuum.finish();
+            IMStartupTrace::record("database open", begin);
+
+            // 把数据库结构升级到当前版本，新用户就是从0开始升级
+            begin = IMStartupTrace::now();
+            state.ok = this->migrate(database, name);
+            if (!state.ok)
+                qDebug() << "migrate database failed";
+
+            // 检查全文索引是否建好，以及使用的分词器
+            QSqlQuery fts(database);
+            state.ftsAvailable = fts.exec("SELECT sql FROM sqlite_master WHERE name = 'message_fts'") && fts.next();
+            state.ftsTrigram = state.ftsAvailable && fts.value(0).toString().contains("trigram");
+            fts.finish();
+            qDebug() << "full text search" << state.ftsAvailable << "trigram" << state.ftsTrigram;
+            // 上次导入到一半退出时，删掉的索引与触发器还没有建回来
+            if (state.ok && !restoreIndexes(database, state.ftsAvailable))
+                qDebug() << "restore indexes failed";
+            IMStartupTrace::record("database migrate", begin);
+
+            // 一次性读出用户表，既是ID缓存，也是有聊天记录的人
+            begin = IMStartupTrace::now();
+            QSqlQuery query(database);
+            query.setForwardOnly(true);
+            if (query.exec("SELECT id, name FROM user ORDER BY id"))
+            {
+                while (query.next())
+                {
+                    QString userName = query.value(1).toString();
+                    state.userIDs.insert(userName, query.value(0).toInt());
+                    state.userNames.append(userName);
+                }
+            }
+            else
+            {
+                qDebug() << query.lastError();
+            }
+            query.finish();
+            IMStartupTrace::record("user list", begin);
+            qDebug() << state.userNames.size() << "users";
+
+            // 客户端的HLC时钟从数据库中最大的时间继续，time来自HLC的物理部分，只看最新的几条，走message_time索引
+            if (query.exec("SELECT MAX(hlc) FROM (SELECT hlc FROM message ORDER BY time DESC, id DESC LIMIT 64)") && query.next())
+                state.lastHlc = quint64(query.value(0).toLongLong());
+            query.finish();
+        }
+        database.close();
+    }
+    QSqlDatabase::removeDatabase(connectionName);
+    return state;
+}
+
+void IMDAL::initDatabase(const IMDatabaseState &state)
+{
+    QSqlDatabase database;
+    // 检测默认连接是否已经存在
+    if (QSqlDatabase::contains(QSqlDatabase::defaultConnection))
+    {
+        // 存在就直接用
+        database = QSqlDatabase::database(QSqlDatabase::defaultConnection);
+    }
+    else
+    {
+        // 不存在就添加一个数据库驱动引擎SQLite
+        database = QSqlDatabase::addDatabase("QSQLITE");
+        // 然后打开指定用户的数据库文件
+        database.setDatabaseName(state.databaseName);
+        // 写线程提交时读可能被锁住，等一会儿而不是直接失败
+        database.setConnectOptions("QSQLITE_BUSY_TIMEOUT=5000");
+        // database.setUserName("root");
+        // database.setPassword("123456");
+    }
+
+    //打开数据库，结构已经在后台升级好了
+    if(!state.ok || !database.open())
+    {
+        // 如果打开失败 退出程序
+        qDebug()<<database.lastError();
+        qFatal("failed to connect.");
+    }
+    else
+    {
+        qDebug() << "Open database success!";
+        // 连接参数，WAL等
+        configureConnection(database);
+        this->m_ftsAvailable = state.ftsAvailable;
+        this->m_ftsTrigram = state.ftsTrigram;
+        this->m_userIDs = state.userIDs;
+
+        // 启动写线程，表建好之后才能开始写
+        this->closeDatabase();
+        // 冷存储放在数据库旁边的目录里
+        QString segmentDirectory = state.databaseName;
+        if (segmentDirectory.endsWith(".db"))
+            segmentDirectory.chop(3);
+        segmentDirectory += ".segments";
+        this->m_segments = new IMSegmentStore(segmentDirectory);
+        QSettings settings(QCoreApplication::applicationDirPath() + "/IM.ini", QSettings::IniFormat);
+        int hotDays = settings.value("history/hotDays", DefaultHotDays).toInt();
+        this->m_writer = new IMDBWriter(database.databaseName());
+        this->m_writer->setRetention(this->m_segments, hotDays);
+        this->m_writer->start();
+        // 打开之前收发的消息按原来的顺序写入
+        if (!this->m_pending.isEmpty())
+            qDebug() << "write" << this->m_pending.size() << "messages received before the database was open";
+        for (const IMDBRecord &record : this->m_pending)
+            this->enqueue(record);
+        this->m_pending = QVector<IMDBRecord>();
+        // 程序退出前把没写完的消息提交掉
+        static bool hooked = false;
+        if (!hooked)
+        {
+            hooked = true;
+            QObject::connect(qApp, &QCoreApplication::aboutToQuit, [](){ IMDAL::instance()->closeDatabase(); });
+        }
+    }
+}
+
+void IMDAL::configureConnection(QSqlDatabase &database)
+{
+    QSqlQuery query(database);
+    // WAL模式下写线程提交时界面线程仍然可以读，提交也只需要顺序写日志
+    // 日志模式会保存在数据库文件里，其他参数每个连接都要设置
+    const char *pragmas[] = {
+        "PRAGMA journal_mode = WAL",
+        // WAL模式下NORMAL只在检查点时fsync，断电最多丢失最后几个事务，不会损坏数据库
+        "PRAGMA synchronous = NORMAL",
+        // 页缓存8MB
+        "PRAGMA cache_size = -8192",
+        // 用mmap读前256MB，读历史记录时少一次复制
+        "PRAGMA mmap_size = 268435456",
+        "PRAGMA temp_store = MEMORY"
+    };
+    for (const char *pragma : pragmas)
+        if (!query.exec(pragma))
+            qDebug() << pragma << query.lastError();
+}
+
+/*
+  每一个版本的SQL语句：
+  版本1：
+CREATE TABLE user (
+    id   INTEGER PRIMARY KEY AUTOINCREMENT,
+    name VARCHAR NOT NULL
+                 UNIQUE
+);
+
+INSERT INTO user (
+    name
+)
+VALUES (
+    'xxx'
+);
+
+CREATE TABLE message (
+    id       INTEGER  PRIMARY KEY AUTOINCREMENT,
+    fromID INTEGER  NOT NULL
+                      REFERENCES user ( id )  ON DELETE CASCADE
+                                              ON UPDATE CASCADE,
+    content  TEXT     NOT NULL,
+    time     DATETIME NOT NULL
+                      DEFAULT ( datetime( 'now', 'localtime' )  ),
+    io       CHAR     NOT NULL
+);
+io这个字段代表是发送还是接受：i收到消息 o发出消息 g群聊消息
+
+  版本2：
+CREATE INDEX message_peer ON message ( fromID, io, time, id );
+CREATE INDEX message_group ON message ( io, time, id, fromID );
+  私聊记录按 fromID + io 查找，群聊记录按 io = 'g' 查找，两个索引都带上时间和id，按索引的顺序倒着读，不用排序也不用扫描整张表
+  索引不包含content等列，取出的每一行还要按rowid回表读一次，一页只有几十行，代价和页数成正比，与总条数无关
+
+  版本3：
+DROP INDEX message_peer;
+CREATE INDEX message_peer ON message ( fromID, time, id, io );
+  历史记录改为按 (time, id) 分页倒序读取，私聊的io条件是 != 'g'，放在time前面用不上索引的顺序，挪到最后只做过滤
+
+  版本4：
+CREATE VIRTUAL TABLE message_fts USING fts5 ( content, content = 'message', content_rowid = 'id', tokenize = 'trigram' );
+  外部内容的FTS5全文索引，只保存索引不重复保存内容，由message表上的触发器同步，写线程插入消息时在同一个事务中更新
+  中文没有空格分词，优先用trigram，SQLite版本太低不支持时退回默认的unicode61，都不支持时跳过，搜索退回LIKE
+
+  版本5：
+ALTER TABLE message ADD COLUMN seq INTEGER NOT NULL DEFAULT 0;
+ALTER TABLE message ADD COLUMN pending INTEGER NOT NULL DEFAULT 0;
+CREATE INDEX message_pending ON message ( seq ) WHERE pending = 1;
+  发出的消息带上序号，服务端确认之前pending为1，这些消息就是待发送的发件箱
+  部分索引只包含待确认的消息，一般只有几条，确认时按序号更新和重启后读发件箱都不用扫描整张表
+
+  版本6：
+CREATE INDEX message_time ON message ( time, id );
+  写线程按时间从最早的消息开始移到冷存储，按 (time, id) 顺序读取和删除一段，不用扫描整张表
+
+  版本7：
+ALTER TABLE message ADD COLUMN msgid INTEGER;
+ALTER TABLE message ADD COLUMN hlc INTEGER NOT NULL DEFAULT 0;
+UPDATE message SET hlc = 毫秒时间戳(time) << 16;
+CREATE UNIQUE INDEX message_msgid ON message ( msgid ) WHERE msgid IS NOT NULL;
+  服务端分配的消息编号与HLC时间，编号上的唯一索引让同一条消息只能插入一次，插入用INSERT OR IGNORE
+  还没有确认的消息和之前的消息没有编号（NULL），不在部分索引中；之前的消息按本地时间补上HLC时间
+  导入时不删除这个索引，导入的记录也按编号去重
+*/
+bool IMDAL::migrateTo(QSqlDatabase &database, int version, QString name)
+{
+    QSqlQuery query(database);
+    switch (version) {
+    case 1:
+        // 创建表并将用户昵称插入表中作为第一条数据存在，id为1
+        if (!query.exec("CREATE TABLE user ("
+                        "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+                        "name VARCHAR NOT NULL UNIQUE);"))
+            break;
+        query.prepare("INSERT INTO user(name) VALUES(?)");
+        query.addBindValue(name);
+        if (!query.exec())
+            break;
+        return query.exec("CREATE TABLE message ("
+                          "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+                          "fromID INTEGER NOT NULL REFERENCES user(id) ON DELETE CASCADE ON UPDATE CASCADE,"
+                          "content TEXT NOT NULL,"
+                          "time DATETIME NOT NULL DEFAULT(datetime('now','localtime')),"
+                          "io CHAR NOT NULL);");
+    case 2:
+        if (!query.exec("CREATE INDEX IF NOT EXISTS message_peer ON message(fromID, io, time, id);"))
+            break;
+        return query.exec("CREATE INDEX IF NOT EXISTS message_group ON message(io, time, id, fromID);");
+    case 3:
+        if (!query.exec("DROP INDEX IF EXISTS message_peer;"))
+            break;
+        return query.exec("CREATE INDEX message_peer ON message(fromID, time, id, io);");
+    case 4:
+        if (!query.exec("CREATE VIRTUAL TABLE message_fts USING fts5(content, content='message', content_rowid='id', tokenize='trigram');")
+                && !query.exec("CREATE VIRTUAL TABLE message_fts USING fts5(content, content='message', content_rowid='id');"))
+        {
+            qDebug() << "FTS5 not available:" << query.lastError();
+            return true;
+        }
+        if (!query.exec(FtsInsertTrigger)
+                || !query.exec("CREATE TRIGGER message_fts_delete AFTER DELETE ON message BEGIN "
+                               "INSERT INTO message_fts(message_fts, rowid, content) VALUES('delete', old.id, old.content); END;")
+                || !query.exec("CREATE TRIGGER message_fts_update AFTER UPDATE OF content ON message BEGIN "
+                               "INSERT INTO message_fts(message_fts, rowid, content) VALUES('delete', old.id, old.content); "
+                               "INSERT INTO message_fts(rowid, content) VALUES(new.id, new.content); END;"))
+            break;
+        // 给已有的消息建索引
+        return query.exec("INSERT INTO message_fts(message_fts) VALUES('rebuild');");
+    case 5:
+        if (!query.exec("ALTER TABLE message ADD COLUMN seq INTEGER NOT NULL DEFAULT 0;")
+                || !query.exec("ALTER TABLE message ADD COLUMN pending INTEGER NOT NULL DEFAULT 0;"))
+            break;
+        return query.exec("CREATE INDEX message_pending ON message(seq) WHERE pending = 1;");
+    case 6:
+        return query.exec("CREATE INDEX message_time ON message(time, id);");
+    case 7:
+        if (!query.exec("ALTER TABLE message ADD COLUMN msgid INTEGER;")
+                || !query.exec("ALTER TABLE message ADD COLUMN hlc INTEGER NOT NULL DEFAULT 0;")
+                // time是本地时间，换成UTC的毫秒时间戳再放到HLC的物理部分
+                || !query.exec("UPDATE message SET hlc = CAST(ROUND((julianday(time, 'utc') - 2440587.5) * 86400000) AS INTEGER) * 65536 "
+                               "WHERE julianday(time, 'utc') IS NOT NULL;"))
+            break;
+        return query.exec("CREATE UNIQUE INDEX message_msgid ON message(msgid) WHERE msgid IS NOT NULL;");
+    default:
+        qDebug() << "unknown schema version" << version;
+        return false;
+    }
+    qDebug() << query.lastError();
+    return false;
+}
+
+bool IMDAL::dropIndexes(QSqlDatabase &database, bool ftsAvailable)
+{
+    QSqlQuery query(database);
+    for (const auto &index : MessageIndexes)
+    {
+        if (!query.exec(QString("DROP INDEX IF EXISTS %1;").arg(index[0])))
+        {
+            qDebug()<<query.lastError();
+            return false;
+        }
+    }
+    if (ftsAvailable && !query.exec("DROP TRIGGER IF EXISTS message_fts_insert;"))
+    {
+        qDebug()<<query.lastError();
+        return false;
+    }
+    return true;
+}
+
+bool IMDAL::restoreIndexes(QSqlDatabase &database, bool ftsAvailable)
+{
+    QSqlQuery query(database);
+    // 都是IF NOT EXISTS，索引在的时候只查一下表结构
+    for (const auto &index : MessageIndexes)
+    {
+        if (!query.exec(index[1]))
+        {
+            qDebug()<<query.lastError();
+            return false;
+        }
+    }
+    if (!ftsAvailable)
+        return true;
+    if (!query.exec("SELECT 1 FROM sqlite_master WHERE type = 'trigger' AND name = 'message_fts_insert'"))
+    {
+        qDebug()<<query.lastError();
+        return false;
+    }
+    bool hasTrigger = query.next();
+    query.finish();
+    if (hasTrigger)
+        return true;
+
+    qDebug() << "rebuild full text index";
+    database.transaction();
+    if (!query.exec("INSERT INTO message_fts(message_fts) VALUES('rebuild');")
+            || !query.exec(FtsInsertTrigger)
+            || !database.commit())
+    {
+        qDebug()<<query.lastError()<<database.lastError();
+        database.rollback();
+        return false;
+    }
+    return true;
+}
+
+bool IMDAL::migrate(QSqlDatabase &database, QString name)
+{
+    QSqlQuery query(database);
+    QStringList tables = database.tables();  //获取数据库中的表
+    int version = 0;
+    bool hasVersion = false;
+    if (tables.contains("schema_version"))
+    {
+        if (query.exec("SELECT version FROM schema_version") && query.next())
+        {
+            version = query.value(0).toInt();
+            hasVersion = true;
+        }
+        query.finish();
+    }
+    // 没有版本号时：有user和message表的是加版本表之前创建的数据库，也就是版本1，否则是新数据库
+    if (!hasVersion && tables.contains("user") && tables.contains("message"))
+        version = 1;
+    qDebug() << "schema version" << version << "->" << SchemaVersion;
+
+    // 一步一步升级，每一步和版本号的修改在同一个事务中，中途失败下次从失败的那一步重新开始
+    // 版本表也在第一步的事务中建好并写入起始版本，不会留下没有版本号的版本表或者有版本号却没有升级的数据库
+    while (version < SchemaVersion)
+    {
+        database.transaction();
+        if ((!hasVersion
+                && (!query.exec("CREATE TABLE IF NOT EXISTS schema_version (version INTEGER NOT NULL);")
+                    || !query.exec("DELETE FROM schema_version;")
+                    || !query.exec(QString("INSERT INTO schema_version(version) VALUES(%1);").arg(version))))
+                || !this->migrateTo(database, version + 1, name)
+                || !query.exec(QString("UPDATE schema_version SET version = %1;").arg(version + 1))
+                || !database.commit())
+        {
+            qDebug() << query.lastError() << database.lastError();
+            database.rollback();
+            return false;
+        }
+        hasVersion = true;
+        ++version;
+    }
+    return true;
+}
+
+void IMDAL::addPrivateMessage(QString name, IMMessage msg)
+{
+    // 私聊消息的fromID是对方，io是收发方向
+    IMDBRecord record;
+    record.userName = name;
+    record.content = msg.content;
+    record.time = msg.time;
+    record.io = msg.fromName;
+    record.seq = msg.seq;
+    record.pending = msg.pending;
+    record.msgId = msg.msgId;
+    record.hlc = msg.hlc;
+    this->enqueue(record);
+}
+
+void IMDAL::addGroupMessage(IMMessage msg)
+{
+    // 群聊消息的fromID是发送者
+    IMDBRecord record;
+    record.userName = msg.fromName;
+    record.content = msg.content;
+    record.time = msg.time;
+    record.io = "g";
+    record.seq = msg.seq;
+    record.pending = msg.pending;
+    record.msgId = msg.msgId;
+    record.hlc = msg.hlc;
+    this->enqueue(record);
+}
+
+void IMDAL::markDelivered(quint64 seq, quint64 msgId, quint64 hlc)
+{
+    IMDBRecord record;
+    record.seq = seq;
+    record.msgId = msgId;
+    record.hlc = hlc;
+    record.delivered = true;
+    this->enqueue(record);
+}
+
+QVector<IMOutboxMessage> IMDAL::getOutbox()
+{
+    QVector<IMOutboxMessage> outbox;
+    if (!this->isOpen())
+        return outbox;
+    // 不等写线程（它可能正在等着重试失败的提交）：先丢掉已经提交的副本再查数据库，
+    // 这期间刚提交的在两边都有，按序号去掉重复的
+    this->pruneUnflushed();
+    QMap<quint64, IMOutboxMessage> messages;
+    QSqlQuery query;
+    query.setForwardOnly(true);
+    if (!query.exec("SELECT seq, io, name, content FROM message, user "
+                    "WHERE pending = 1 AND user.id = fromID ORDER BY seq"))
+        qDebug()<<query.lastError();
+    while (query.isActive() && query.next())
+    {
+        IMOutboxMessage msg;
+        msg.seq = quint64(query.value(0).toLongLong());
+        msg.isGroup = query.value(1).toString() == "g";
+        msg.peer = msg.isGroup ? QString() : query.value(2).toString();
+        msg.content = query.value(3).toString();
+        messages.insert(msg.seq, msg);
+    }
+    query.finish();
+    // 还没提交的待确认消息与确认
+    for (const IMDBRecord &record : this->m_unflushed)
+    {
+        if (record.delivered)
+        {
+            messages.remove(record.seq);
+        }
+        else if (record.pending)
+        {
+            IMOutboxMessage msg;
+            msg.seq = record.seq;
+            msg.isGroup = record.io == "g";
+            msg.peer = msg.isGroup ? QString() : record.userName;
+            msg.content = record.content;
+            messages.insert(msg.seq, msg);
+        }
+    }
+    outbox.reserve(messages.size());
+    for (const IMOutboxMessage &msg : messages)
+        outbox.append(msg);
+    qDebug() << outbox.size() << "messages in outbox";
+    return outbox;
+}
+
+void IMDAL::enqueue(const IMDBRecord &record)
+{
+    // 数据库在后台打开期间先暂存，打开后按顺序写入
+    if (this->m_writer == nullptr)
+    {
+        this->m_pending.append(record);
+        return;
+    }
+    this->m_writer->enqueue(record);
+    // 保留一份给读历史记录用，顺便丢掉已经提交的
+    this->m_unflushed.append(record);
+    this->pruneUnflushed();
+}
+
+void IMDAL::pruneUnflushed()
+{
+    if (this->m_writer == nullptr || this->m_unflushed.isEmpty())
+        return;
+    quint64 done = qMin(this->m_writer->committed() - this->m_unflushedBase, quint64(this->m_unflushed.size()));
+    if (done == 0)
+        return;
+    this->m_unflushed.remove(0, int(done));
+    this->m_unflushedBase += done;
+}
+
+QVector<IMSearchResult> IMDAL::searchUnflushed(const QString &text, const QString &peer, const QDateTime &from, const QDateTime &to)
+{
+    QVector<IMSearchResult> results;
+    this->pruneUnflushed();
+    // 从新到旧，和LIKE查找一样不区分大小写
+    for (int i = this->m_unflushed.size() - 1; i >= 0; --i)
+    {
+        const IMDBRecord &record = this->m_unflushed.at(i);
+        if (record.delivered
+                || (!peer.isEmpty() && record.userName != peer)
+                || (from.isValid() && record.time < from)
+                || (to.isValid() && record.time > to)
+                || !record.content.contains(text, Qt::CaseInsensitive))
+            continue;
+        IMSearchResult result;
+        result.isGroup = record.io == "g";
+        result.peer = record.userName;
+        result.message = IMMessage(result.isGroup ? result.peer : record.io, record.content, record.time);
+        result.snippet = likeSnippet(record.content, text);
+        results.append(result);
+    }
+    return results;
+}
+
+/**
+ * @brief applyDelivered 把一条还没提交的确认应用到待确认的消息上，和写线程中的标记已送达相同
+ * @return 是否有消息被修改
+ */
+static bool applyDelivered(QVector<IMMessage> &messages, const IMDBRecord &record)
+{
+    bool applied = false;
+    for (IMMessage &msg : messages)
+    {
+        if (!msg.pending || msg.seq != record.seq)
+            continue;
+        applied = true;
+        msg.pending = false;
+        msg.msgId = record.msgId;
+        if (record.hlc != 0)
+        {
+            msg.hlc = record.hlc;
+            msg.time = QDateTime::fromMSecsSinceEpoch(IMHybridClock::physical(record.hlc));
+        }
+    }
+    return applied;
+}
+
+void IMDAL::mergeUnflushed(QVector<IMMessage> &msgList, const QString &name, bool isGroup, int limit,
+                           const IMMessage *before, const IMMessage *after)
+{
+    this->pruneUnflushed();
+    if (this->m_unflushed.isEmpty())
+        return;
+
+    // 按入队的顺序：确认一定在它确认的消息之后
+    QVector<IMMessage> unflushed;
+    bool delivered = false;
+    for (const IMDBRecord &record : this->m_unflushed)
+    {
+        if (record.delivered)
+        {
+            delivered = applyDelivered(msgList, record) || delivered;
+            applyDelivered(unflushed, record);
+            continue;
+        }
+        if ((record.io == "g") != isGroup || (!isGroup && record.userName != name))
+            continue;
+        IMMessage msg(isGroup ? record.userName : record.io, record.content, record.time);
+        msg.seq = record.seq;
+        msg.pending = record.pending;
+        msg.msgId = record.msgId;
+        msg.hlc = record.hlc;
+        unflushed.append(msg);
+    }
+    // 确认后时间改成了HLC时间，数据库读出的一页重新排好
+    if (delivered)
+        std::stable_sort(msgList.begin(), msgList.end(), [](const IMMessage &a, const IMMessage &b) {
+            return a.time > b.time || (a.time == b.time && a.id > b.id);
+        });
+
+    // 分页的位置，还没提交的id都是0
+    QVector<IMMessage> page;
+    for (int i = unflushed.size() - 1; i >= 0; --i)
+    {
+        const IMMessage &msg = unflushed.at(i);
+        qint64 time = msg.time.toMSecsSinceEpoch();
+        if (before != nullptr && !keyLess(time, 0, before->time.toMSecsSinceEpoch(), before->id))
+            continue;
+        if (after != nullptr && keyLess(time, 0, after->time.toMSecsSinceEpoch(), after->id))
+            continue;
+        page.append(msg);
+    }
+    if (page.isEmpty())
+        return;
+    // 从晚到早，时间相同的后入队的在前，比数据库中同一时间的都晚
+    std::stable_sort(page.begin(), page.end(), [](const IMMessage &a, const IMMessage &b) { return a.time > b.time; });
+
+    // 两边都从晚到早，一趟合并；同一条消息（消息编号相同）只保留第一份
+    QVector<IMMessage> merged;
+    merged.reserve(msgList.size() + page.size());
+    QSet<quint64> msgIds;
+    int i = 0;
+    int j = 0;
+    while ((i < msgList.size() || j < page.size()) && (limit < 0 || merged.size() < limit))
+    {
+        bool takeStored = j >= page.size() || (i < msgList.size() && msgList.at(i).time > page.at(j).time);
+        const IMMessage &msg = takeStored ? msgList.at(i++) : page.at(j++);
+        if (msg.msgId != 0 && msgIds.contains(msg.msgId))
+            continue;
+        if (msg.msgId != 0)
+            msgIds.insert(msg.msgId);
+        merged.append(msg);
+    }
+    msgList.swap(merged);
+}
+
+QVector<IMMessage> IMDAL::getPrivateMessage(QString name, int limit, const IMMessage *before, const IMMessage *after)
+{
+    QVector<IMMessage> msgList;
+    int userID = 0;
+    if (!QSqlDatabase::database().isOpen())
+        return msgList;
+    // 获取这个昵称的id，数据库中还没有这个人时只有还没提交的消息
+    userID = this->getUserID(name);
+    if (userID != 0)
+    {
+        // 从before往前倒序查找这个用户的一页消息
+        // time <= ? 让索引直接定位到分页的位置，同一时间的消息再按id区分
+        QSqlQuery query;
+        query.prepare(QString("SELECT id, io, content, time, seq, pending, msgid, hlc FROM message "
+                              "WHERE fromID = ? AND io != 'g' %1 %2 "
+                              "ORDER BY time DESC, id DESC LIMIT ?")
+                      .arg(before == nullptr ? "" : "AND time <= ? AND (time < ? OR id < ?)")
+                      .arg(after == nullptr ? "" : "AND time >= ? AND (time > ? OR id >= ?)"));
+        query.addBindValue(userID);
+        if (before != nullptr)
+        {
+            query.addBindValue(before->time);
+            query.addBindValue(before->time);
+            query.addBindValue(before->id);
+        }
+        if (after != nullptr)
+        {
+            query.addBindValue(after->time);
+            query.addBindValue(after->time);
+            query.addBindValue(after->id);
+        }
+        query.addBindValue(limit);
+        if(!query.exec())
+        {
+            qDebug()<<query.lastError();
+            return msgList;
+        }
+        // 将所有消息添加到列表中
+        while(query.next())
+        {
+            IMMessage msg(query.value(1).toString(), query.value(2).toString(), query.value(3).toDateTime(), query.value(0).toLongLong());
+            msg.seq = quint64(query.value(4).toLongLong());
+            msg.pending = query.value(5).toInt() != 0;
+            msg.msgId = quint64(query.value(6).toLongLong());
+            msg.hlc = quint64(query.value(7).toLongLong());
+            msgList.append(msg);
+        }
+    }
+    // 还没提交的消息
+    this->mergeUnflushed(msgList, name, false, limit, before, after);
+    // 数据库中不够一页时接着读冷存储，冷存储中的消息都来自数据库，没有这个人时也不会有
+    if (userID != 0)
+        this->mergeCold(msgList, name, false, limit, before, after);
+    // 查出来是倒序的，翻转成从早到晚
+    std::reverse(msgList.begin(), msgList.end());
+
+    return msgList;
+}
+
+QVector<IMMessage> IMDAL::getGroupMessage(int limit, const IMMessage *before, const IMMessage *after)
+{
+    QVector<IMMessage> msgList;
+    if (!QSqlDatabase::database().isOpen())
+        return msgList;
+    QSqlQuery query;
+    query.prepare(QString("SELECT message.id, name, content, time, seq, pending, msgid, hlc FROM message, user "
+                          "WHERE io = 'g' AND user.id = fromID %1 %2 "
+                          "ORDER BY time DESC, message.id DESC LIMIT ?")
+                  .arg(before == nullptr ? "" : "AND time <= ? AND (time < ? OR message.id < ?)")
+                  .arg(after == nullptr ? "" : "AND time >= ? AND (time > ? OR message.id >= ?)"));
+    if (before != nullptr)
+    {
+        query.addBindValue(before->time);
+        query.addBindValue(before->time);
+        query.addBindValue(before->id);
+    }
+    if (after != nullptr)
+    {
+        query.addBindValue(after->time);
+        query.addBindValue(after->time);
+        query.addBindValue(after->id);
+    }
+    query.addBindValue(limit);
+    if(!query.exec())
+    {
+        qDebug()<<query.lastError();
+        return msgList;
+    }
+    // 将所有消息添加到列表中
+    while(query.next())
+    {
+        IMMessage msg(query.value(1).toString(), query.value(2).toString(), query.value(3).toDateTime(), query.value(0).toLongLong());
+        msg.seq = quint64(query.value(4).toLongLong());
+        msg.pending = query.value(5).toInt() != 0;
+        msg.msgId = quint64(query.value(6).toLongLong());
+        msg.hlc = quint64(query.value(7).toLongLong());
+        msgList.append(msg);
+    }
+    this->mergeUnflushed(msgList, QString(), true, limit, before, after);
+    this->mergeCold(msgList, QString(), true, limit, before, after);
+    std::reverse(msgList.begin(), msgList.end());
+
+    return msgList;
+}
+
+void IMDAL::mergeCold(QVector<IMMessage> &msgList, const QString &name, bool isGroup, int limit,
+                      const IMMessage *before, const IMMessage *after)
+{
+    if (this->m_segments == nullptr)
+        return;
+    // 一页已经满了，并且冷存储中的消息都比这一页早，不用读冷存储
+    if (limit >= 0 && msgList.size() >= limit
+            && (msgList.isEmpty() || this->m_segments->lastTime() < msgList.last().time.toMSecsSinceEpoch()))
+        return;
+    // 冷存储从同样的位置读一页
+    const QVector<IMSegmentMessage> cold = this->m_segments->read(name, isGroup, limit,
+                                                                  before == nullptr ? -1 : before->time.toMSecsSinceEpoch(), before == nullptr ? 0 : before->id,
+                                                                  after == nullptr ? -1 : after->time.toMSecsSinceEpoch(), after == nullptr ? 0 : after->id);
+    if (cold.isEmpty())
+        return;
+
+    // 两边都已经按 (time, id) 从晚到早排好了，一趟线性合并，不再排序
+    // 移出时写完段文件才删除，中途退出的话两边会有同一行（时间和编号都相同），只保留数据库中的
+    // 同一条消息的几份（消息编号相同）时间也相同，合并后挨在一起，只保留第一份
+    QVector<IMMessage> merged;
+    merged.reserve(limit >= 0 ? qMin(limit, msgList.size() + cold.size()) : msgList.size() + cold.size());
+    int i = 0;
+    int j = 0;
+    while ((i < msgList.size() || j < cold.size()) && (limit < 0 || merged.size() < limit))
+    {
+        bool takeHot = j >= cold.size();
+        if (i < msgList.size() && j < cold.size())
+        {
+            const IMMessage &hot = msgList.at(i);
+            const IMSegmentMessage &msg = cold.at(j);
+            qint64 hotTime = hot.time.toMSecsSinceEpoch();
+            if (hotTime == msg.time && hot.id == msg.id)
+            {
+                ++j;
+                continue;
+            }
+            takeHot = keyLess(msg.time, msg.id, hotTime, hot.id);
+        }
+        IMMessage msg = takeHot ? msgList.at(i++) : coldMessage(cold.at(j++), isGroup);
+        if (msg.msgId != 0 && !merged.isEmpty() && merged.last().msgId == msg.msgId)
+            continue;
+        merged.append(msg);
+    }
+    msgList.swap(merged);
+}
+
+QVector<IMSearchResult> IMDAL::searchMessage(QString text, QString peer, QDateTime from, QDateTime to, int limit)
+{
+    QVector<IMSearchResult> results;
+    text = text.trimmed();
+    if (text.isEmpty() || !QSqlDatabase::database().isOpen())
+        return results;
+    // 还没提交的消息不等写线程，在副本中查找
+    QVector<IMSearchResult> unflushed = this->searchUnflushed(text, peer, from, to);
+
+    int peerID = 0;
+    if (!peer.isEmpty())
+    {
+        peerID = this->getUserID(peer);
+        if (peerID == 0)
+            return unflushed.mid(0, limit);
+    }
+
+    // 过滤条件
+    QString filter;
+    if (peerID != 0)
+        filter += " AND fromID = ?";
+    if (from.isValid())
+        filter += " AND time >= ?";
+    if (to.isValid())
+        filter += " AND time <= ?";
+
+    // trigram索引搜不了少于3个字的内容，这种情况和没有全文索引时一样用LIKE按时间倒序查找
+    bool useFts = this->m_ftsAvailable && !(this->m_ftsTrigram && text.length() < 3);
+    QSqlQuery query;
+    if (useFts)
+    {
+        // 按rank排序要给所有匹配打分，bm25先扫一遍整个短语的倒排表算IDF，常见词在几百万条记录中要几百毫秒
+        // 这里按rowid倒序只取最近的SearchRankWindow条匹配，FTS5按倒排表的顺序读到够了就停，再在下面自己排序
+        query.prepare(QString("SELECT message.id, io, name, time, message.content, "
+                              "snippet(message_fts, 0, '[', ']', '...', 16) "
+                              "FROM message_fts JOIN message ON message.id = message_fts.rowid "
+                              "JOIN user ON user.id = fromID "
+                              "WHERE message_fts MATCH ?%1 ORDER BY message_fts.rowid DESC LIMIT ?").arg(filter));
+        // 整个作为一个短语搜索，双引号要转义
+        query.addBindValue(QString("\"%1\"").arg(QString(text).replace("\"", "\"\"")));
+    }
+    else
+    {
+        query.prepare(QString("SELECT message.id, io, name, time, content, '' "
+                              "FROM message JOIN user ON user.id = fromID "
+                              "WHERE content LIKE ? ESCAPE '\\'%1 ORDER BY time DESC LIMIT ?").arg(filter));
+        QString pattern = text;
+        pattern.replace("\\", "\\\\").replace("%", "\\%").replace("_", "\\_");
+        query.addBindValue("%" + pattern + "%");
+    }
+    if (peerID != 0)
+        query.addBindValue(peerID);
+    if (from.isValid())
+        query.addBindValue(from);
+    if (to.isValid())
+        query.addBindValue(to);
+    query.addBindValue(useFts ? qMax(limit, SearchRankWindow) : limit);
+    if (!query.exec())
+    {
+        qDebug()<<query.lastError();
+        return results;
+    }
+
+    while (query.next())
+    {
+        IMSearchResult result;
+        QString io = query.value(1).toString();
+        QString content = query.value(4).toString();
+        result.isGroup = io == "g";
+        result.peer = query.value(2).toString();
+        result.message = IMMessage(result.isGroup ? result.peer : io, content, query.value(3).toDateTime(), query.value(0).toLongLong());
+        result.snippet = query.value(5).toString();
+        // LIKE查找时自己截取匹配位置附近的内容
+        if (result.snippet.isEmpty())
+            result.snippet = likeSnippet(content, text);
+        results.append(result);
+    }
+    // 还没提交的比数据库中的都新，放在前面，按相关度排序时同分的排在前面
+    results = unflushed + results;
+    if (useFts)
+        rankResults(results, text, limit);
+    else if (results.size() > limit)
+        results.resize(limit);
+
+    // 不够时接着在冷存储中按时间倒序查找，冷存储没有全文索引，只解压时间和对象对得上的块
+    if (results.size() < limit && this->m_segments != nullptr)
+    {
+        QSet<qint64> ids;
+        for (const IMSearchResult &result : results)
+            ids.insert(result.message.id);
+        QVector<IMSegmentMessage> cold = this->m_segments->search(text, peer,
+                                                                  from.isValid() ? from.toMSecsSinceEpoch() : -1,
+                                                                  to.isValid() ? to.toMSecsSinceEpoch() : -1,
+                                                                  limit - results.size());
+        for (const IMSegmentMessage &msg : cold)
+        {
+            if (ids.contains(msg.id))
+                continue;
+            IMSearchResult result;
+            result.isGroup = msg.io == "g";
+            result.peer = msg.user;
+            result.message = coldMessage(msg, result.isGroup);
+            result.snippet = likeSnippet(msg.content, text);
+            results.append(result);
+        }
+    }
+    return results;
+}
+
+qint64 IMDAL::exportHistory(QString path)
+{
+    if (!this->isOpen())
+        return -1;
+    // 导出的要是完整的记录，写线程提交失败时不导出
+    if (!this->m_writer->flush())
+    {
+        qDebug() << "export: messages are not written yet";
+        return -1;
+    }
+    IMArchiveWriter writer;
+    if (!writer.open(path))
+    {
+        qDebug() << "export:" << writer.errorString();
+        return -1;
+    }
+
+    // 只往前读，SQLite一行一行地取，不会把整张表读进内存
+    QSqlQuery query;
+    query.setForwardOnly(true);
+    bool ok = query.exec("SELECT message.id, time, io, name, content, msgid, hlc FROM message JOIN user ON user.id = fromID "
+                         "ORDER BY time, message.id");
+    if (!ok)
+        qDebug()<<query.lastError();
+    bool hasRow = ok && query.next();
+    qint64 rowTime = hasRow ? query.value(1).toDateTime().toMSecsSinceEpoch() : 0;
+
+    // 同一条消息的几份时间相同，写出时挨在一起，按消息编号只写第一份
+    qint64 count = 0;
+    quint64 lastMsgId = 0;
+    auto write = [&](const IMArchiveRecord &record) {
+        if (record.msgId != 0 && record.msgId == lastMsgId)
+            return true;
+        lastMsgId = record.msgId;
+        ++count;
+        return writer.write(record);
+    };
+    // 写出数据库中当前的一行，并读下一行
+    auto writeRow = [&]() {
+        IMArchiveRecord record;
+        record.time = rowTime;
+        record.io = query.value(2).toString();
+        record.user = query.value(3).toString();
+        record.content = query.value(4).toString();
+        record.msgId = quint64(query.value(5).toLongLong());
+        record.hlc = quint64(query.value(6).toLongLong());
+        ok = write(record);
+        hasRow = ok && query.next();
+        rowTime = hasRow ? query.value(1).toDateTime().toMSecsSinceEpoch() : 0;
+    };
+
+    // 冷存储与数据库各自按 (time, id) 排好了序，一趟线性合并：冷存储每读出一条，先写出数据库中比它早的
+    // 一般冷存储中的都比数据库中的早，导入的旧记录留在数据库中时才会交错
+    ok = ok && (this->m_segments == nullptr || this->m_segments->scan([&](const IMSegmentMessage &msg) {
+        while (ok && hasRow && keyLess(rowTime, query.value(0).toLongLong(), msg.time, msg.id))
+            writeRow();
+        // 移出冷存储时中途退出的消息两边都有（时间和编号都相同），只写冷存储中的那份
+        if (ok && hasRow && rowTime == msg.time && query.value(0).toLongLong() == msg.id)
+        {
+            hasRow = query.next();
+            rowTime = hasRow ? query.value(1).toDateTime().toMSecsSinceEpoch() : 0;
+        }
+        IMArchiveRecord record;
+        record.time = msg.time;
+        record.io = msg.io;
+        record.user = msg.user;
+        record.content = msg.content;
+        record.msgId = msg.msgId;
+        record.hlc = msg.hlc;
+        return ok && write(record);
+    }));
+    while (ok && hasRow)
+        writeRow();
+    query.finish();
+    if (!writer.close() || !ok)
+    {
+        qDebug() << "export failed:" << writer.errorString();
+        return -1;
+    }
+    qDebug() << "exported" << count << "messages to" << path;
+    return count;
+}
+
+bool IMDAL::importHistory(QString path, const std::function<void(qint64)> &finished)
+{
+    if (!this->isOpen())
+        return false;
+    // 导入在写线程中做，结果排队回到界面线程，只接收这一次的结果
+    QMetaObject::Connection *connection = new QMetaObject::Connection;
+    *connection = QObject::connect(this->m_writer, &IMDBWriter::importFinished, qApp, [connection, finished](qint64 inserted) {
+        QObject::disconnect(*connection);
+        delete connection;
+        finished(inserted);
+    });
+    if (!this->m_writer->startImport(path, this->m_ftsAvailable))
+    {
+        QObject::disconnect(*connection);
+        delete connection;
+        return false;
+    }
+    qDebug() << "import" << path;
+    return true;
+}
+
+QVector<QString> IMDAL::getUserList()
+{
+    qDebug() << "getUserList()";
+    QVector<QString> names;
+    if (!QSqlDatabase::database().isOpen())
+        return names;
+    QSqlQuery query;
+    // 只往前读，不缓存已经读过的行
+    query.setForwardOnly(true);
+    if (!query.exec("SELECT name FROM user"))
+    {
+        qDebug()<<query.lastError();
+    }
+    else
+    {
+        while (query.next())
+            names.append(query.value(0).toString());
+    }
+    // 还没提交的消息中的新用户，写线程还没有插入
+    this->pruneUnflushed();
+    QSet<QString> known;
+    for (const IMDBRecord &record : this->m_unflushed)
+    {
+        if (record.delivered || record.userName.isEmpty() || this->m_userIDs.contains(record.userName))
+            continue;
+        if (known.isEmpty())
+            for (const QString &name : names)
+                known.insert(name);
+        if (!known.contains(record.userName))
+        {
+            known.insert(record.userName);
+            names.append(record.userName);
+        }
+    }
+    qDebug() << names.size() << "users";
+    return names;
+}
+
+int IMDAL::getUserID(QString name)
+{
+    int userID = this->m_userIDs.value(name);
+    if (userID)
+        return userID;
+
+    // 新用户由写线程插入，缓存里没有时查一次数据库
+    QSqlQuery query;
+    query.prepare("SELECT id FROM user WHERE name = ?");
+    query.addBindValue(name);
+    if(!query.exec())
+    {
+        qDebug()<<query.lastError();
+        return 0;
+    }
+    while(query.next())
+        userID = query.value(0).toInt();
+    if (userID)
+        this->m_userIDs.insert(name, userID);
+    return userID;
+}
@@ -1,59 +1,382 @@
-#ifndef IMDAL_H
-#define IMDAL_H
-
-#include <QVector>
-#include <QString>
-#include "immessage.h"
-
-// IM数据层
-class IMDAL
-{
-public:
-    /**
-     * @brief instance 单例对象
-     * @return 单例对象指针
-     */
-    static IMDAL *instance();
-
-    /**
-     * @brief initDatabase 初始化数据库
-     * @param name 用户名
-     */
-    void initDatabase(QString name);
-
-    /**
-     * @brief addPrivateMessage 添加一条私聊消息
-     * @param name 用户名
-     * @param msg 消息内容
-     */
-    void addPrivateMessage(QString name, IMMessage msg);
-
-    /**
-     * @brief addGroupMessage 添加一条群聊消息
-     * @param msg 消息内容
-     */
-    void addGroupMessage(IMMessage msg);
-
-    /**
-     * @brief getPrivateMessage 获取私聊消息
-     * @param name 对方昵称
-     * @return 消息内容
-     */
-    QVector<IMMessage> getPrivateMessage(QString name);
-
-    /**
-     * @brief getGroupMessage 获取群聊消息
-     * @return 消息内容
-     */
-    QVector<IMMessage> getGroupMessage();
-
-    /**
-     * @brief getUserList 获取用户列表
-     * @return 用户列表
-     */
-    QVector<QString> getUserList();
-private:
-    int getUserID(QString name);
-};
-
-#endif // IMDAL_H
+#ifndef IMDAL_H
+#define IMDAL_H
+
+#include <QVector>
+#include <QString>
+#include <QHash>
+#include <QSqlDatabase>
+#include <functional>
+#include "immessage.h"
+#include "imdbwriter.h"
+#include "imsegmentstore.h"
+
+/**
+ * @brief 一条搜索结果
+ */
+struct IMSearchResult
+{
+    /**
+     * @brief message 匹配的消息，私聊消息的fromName是i或o，群聊消息是发送者
+     */
+    IMMessage message;
+
+    /**
+     * @brief peer 私聊的对方昵称，群聊时是发送者昵称
+     */
+    QString peer;
+
+    /**
+     * @brief isGroup 是否是群聊消息
+     */
+    bool isGroup;
+
+    /**
+     * @brief snippet 匹配位置附近的一段内容，匹配的文字用[]括起来
+     */
+    QString snippet;
+};
+
+/**
+ * @brief 发件箱中一条还没有被服务端确认的消息
+ */
+struct IMOutboxMessage
+{
+    /**
+     * @brief seq 序号
+     */
+    quint64 seq = 0;
+
+    /**
+     * @brief isGroup 是否是群聊消息
+     */
+    bool isGroup = false;
+
+    /**
+     * @brief peer 私聊的对方昵称，群聊时为空
+     */
+    QString peer;
+
+    /**
+     * @brief content 内容
+     */
+    QString content;
+};
+
+/**
+ * @brief 后台线程打开并升级好的数据库，由prepareDatabase生成，交给initDatabase使用
+ */
+struct IMDatabaseState
+{
+    /**
+     * @brief databaseName 数据库文件
+     */
+    QString databaseName;
+
+    /**
+     * @brief ok 打开与升级是否成功
+     */
+    bool ok = false;
+
+    /**
+     * @brief ftsAvailable 全文索引是否可用
+     */
+    bool ftsAvailable = false;
+
+    /**
+     * @brief ftsTrigram 全文索引是否使用trigram分词
+     */
+    bool ftsTrigram = false;
+
+    /**
+     * @brief userIDs 用户昵称到ID
+     */
+    QHash<QString, int> userIDs;
+
+    /**
+     * @brief userNames 有聊天记录的所有用户，按ID排列
+     */
+    QVector<QString> userNames;
+
+    /**
+     * @brief lastHlc 数据库中最大的HLC时间，客户端的时钟从这里继续，重启后不会倒退
+     */
+    quint64 lastHlc = 0;
+};
+
+// IM数据层
+// 登录时数据库在后台线程中打开、升级并读出用户表，界面线程只需要打开一个已经准备好的连接
+// 写消息交给后台的数据库写线程批量提交，读历史记录前先等待写线程提交完
+// 超过保留期（IM.ini 中 [history] hotDays，默认180天，0表示不移出）的消息由写线程在空闲时移到冷存储，
+// 分页和搜索在数据库中不够时接着读冷存储，调用方看不出区别
+// 服务端分配的消息编号上有唯一索引，同一条消息（重连后重复收到、导入其他设备的记录）只保存一份
+class IMDAL
+{
+public:
+    /**
+     * @brief instance 单例对象
+     * @return 单例对象指针
+     */
+    static IMDAL *instance();
+
+    /**
+     * @brief prepareDatabase 打开数据库、升级结构、读出用户表，耗时的部分都在这里
+     * 使用自己的连接，用完就关闭，可以在任意线程调用，与界面线程的读写互不影响
+     * @param name 用户名
+     * @return 准备好的数据库
+     */
+    IMDatabaseState prepareDatabase(QString name);
+
+    /**
+     * @brief initDatabase 在界面线程打开准备好的数据库，启动写线程
+     * 之前入队的消息交给写线程写入
+     * @param state prepareDatabase的结果
+     */
+    void initDatabase(const IMDatabaseState &state);
+
+    /**
+     * @brief isOpen 数据库是否已经打开，打开之前读不到历史记录
+     */
+    bool isOpen() const { return this->m_writer != nullptr; }
+
+    /**
+     * @brief configureConnection 设置连接参数：WAL、页缓存、mmap等，每个数据库连接打开后都要调用
+     * @param database 数据库连接
+     */
+    static void configureConnection(QSqlDatabase &database);
+
+    /**
+     * @brief closeDatabase 提交还没写入的消息并停止写线程，程序退出时调用
+     */
+    void closeDatabase();
+
+    /**
+     * @brief addPrivateMessage 添加一条私聊消息，只入队不等待写入
+     * @param name 用户名
+     * @param msg 消息内容
+     */
+    void addPrivateMessage(QString name, IMMessage msg);
+
+    /**
+     * @brief addGroupMessage 添加一条群聊消息，只入队不等待写入
+     * @param msg 消息内容
+     */
+    void addGroupMessage(IMMessage msg);
+
+    /**
+     * @brief markDelivered 把序号为seq的消息标记为已送达，填上服务端分配的编号与时间，只入队不等待写入
+     * @param seq 消息序号
+     * @param msgId 消息编号
+     * @param hlc HLC时间
+     */
+    void markDelivered(quint64 seq, quint64 msgId, quint64 hlc);
+
+    /**
+     * @brief getOutbox 获取所有还没有被服务端确认的消息，重启后重新发送
+     * 不等写线程，还没提交的待确认消息与确认从入队时保留的副本中读
+     * @return 按序号排列
+     */
+    QVector<IMOutboxMessage> getOutbox();
+
+    /**
+     * @brief getPrivateMessage 分页获取私聊消息
+     * 按 (time, id) 倒序取before之前的最多limit条，不会扫描更早的记录
+     * 不等写线程，还没提交的消息从入队时保留的副本中读，它们还没有id，和刚收发的消息一样为0
+     * @param name 对方昵称
+     * @param limit 最多取多少条
+     * @param before 从这条消息之前开始取，nullptr表示从最新的一条开始
+     * @param after 只取这条消息以及之后的消息，nullptr表示不限制，跳转到搜索结果时使用
+     * @return 消息内容，按时间从早到晚排列
+     */
+    QVector<IMMessage> getPrivateMessage(QString name, int limit, const IMMessage *before = nullptr, const IMMessage *after = nullptr);
+
+    /**
+     * @brief getGroupMessage 分页获取群聊消息
+     * @param limit 最多取多少条
+     * @param before 从这条消息之前开始取，nullptr表示从最新的一条开始
+     * @param after 只取这条消息以及之后的消息，nullptr表示不限制
+     * @return 消息内容，按时间从早到晚排列
+     */
+    QVector<IMMessage> getGroupMessage(int limit, const IMMessage *before = nullptr, const IMMessage *after = nullptr);
+
+    /**
+     * @brief searchMessage 全文搜索聊天记录，按相关度排序
+     * 匹配很多时只在最近的SearchRankWindow条匹配中排序，常见词在几百万条记录中也不用给每一条打分
+     * 还没提交的消息在副本中逐条查找，一起排序
+     * @param text 要搜索的文字
+     * @param peer 只搜索这个用户的消息（与他的私聊以及他发的群聊），为空表示不限制
+     * @param from 开始时间，无效表示不限制
+     * @param to 结束时间，无效表示不限制
+     * @param limit 最多返回多少条
+     * @return 搜索结果
+     */
+    QVector<IMSearchResult> searchMessage(QString text, QString peer = QString(),
+                                          QDateTime from = QDateTime(), QDateTime to = QDateTime(), int limit = 50);
+
+    /**
+     * @brief exportHistory 把所有聊天记录（包括冷存储）按时间顺序导出到文件，格式见IMArchiveWriter
+     * 边读边写，内存占用与记录的多少无关
+     * @param path 导出文件
+     * @return 导出的消息条数，失败时返回-1
+     */
+    qint64 exportHistory(QString path);
+
+    /**
+     * @brief importHistory 从导出文件导入聊天记录，追加到现有的记录中，不阻塞调用方
+     * 导入交给写线程，和新收发的消息轮流提交，见IMDBWriter::startImport
+     * 带消息编号的消息按编号去重，已经在数据库中的跳过（已经移到冷存储的消息不检查）；旧版本导出的消息没有编号，不去重
+     * 每IMDBWriter::ImportBatchSize条提交一次；导入的比已有的多时先删掉索引和全文索引触发器，导入完再一次建好，消息编号的唯一索引保留
+     * 中途失败时已经提交的批次会保留；中途退出时删掉的索引由下次登录时的prepareDatabase建回来
+     * 导入期间写线程不做维护，不往冷存储移消息
+     * @param path 导出文件
+     * @param finished 导入结束时在界面线程中调用，参数是导入的消息条数，不包括跳过的重复消息，失败时为-1
+     * @return 数据库没有打开或者已经有导入在进行时返回false，这时不会调用finished
+     */
+    bool importHistory(QString path, const std::function<void(qint64)> &finished);
+
+    /**
+     * @brief getUserList 获取用户列表
+     * @return 用户列表
+     */
+    QVector<QString> getUserList();
+
+    /**
+     * @brief dropIndexes 导入大量消息之前删掉message表上的索引与全文索引的插入触发器，消息编号的唯一索引保留
+     * @param database 数据库连接
+     * @param ftsAvailable 是否有全文索引
+     * @return 是否成功
+     */
+    static bool dropIndexes(QSqlDatabase &database, bool ftsAvailable);
+
+    /**
+     * @brief restoreIndexes 建回导入时删掉的索引与全文索引的插入触发器，都在的时候什么也不做
+     * 触发器不在时全文索引缺了这期间插入的消息，重建全文索引后再建触发器，在同一个事务中
+     * @param database 数据库连接
+     * @param ftsAvailable 是否有全文索引
+     * @return 是否成功
+     */
+    static bool restoreIndexes(QSqlDatabase &database, bool ftsAvailable);
+private:
+    IMDAL();
+    ~IMDAL();
+
+    /**
+     * @brief SchemaVersion 当前的数据库结构版本，每加一步迁移加1
+     */
+    static const int SchemaVersion = 7;
+
+    /**
+     * @brief SearchRankWindow 全文搜索时最多在最近的多少条匹配中按相关度排序
+     */
+    static const int SearchRankWindow = 256;
+
+    /**
+     * @brief DefaultHotDays 默认的保留天数，更早的消息移到冷存储
+     */
+    static const int DefaultHotDays = 180;
+
+    /**
+     * @brief migrate 把数据库结构从保存的版本一步一步升级到SchemaVersion
+     * @param database 数据库连接
+     * @param name 用户名，新数据库中作为第一个用户
+     * @return 是否成功
+     */
+    bool migrate(QSqlDatabase &database, QString name);
+
+    /**
+     * @brief migrateTo 执行升级到某个版本的那一步
+     * @param database 数据库连接
+     * @param version 目标版本
+     * @param name 用户名
+     * @return 是否成功
+     */
+    bool migrateTo(QSqlDatabase &database, int version, QString name);
+
+
+    /**
+     * @brief mergeCold 从冷存储中读出与数据库同样位置的一页，和数据库读出的一页合并
+     * 数据库中不够一页，或者冷存储中有比这一页最早的一条还晚的消息（导入的旧记录留在数据库中）时才读冷存储，
+     * 不限条数（跳转到某条消息）时总是读；两边按 (time, id) 归并，不假设冷存储中的消息都比数据库中的早
+     * @param msgList 数据库读出的一页，从晚到早，合并后仍然从晚到早，最多limit条
+     * @param name 私聊的对方昵称，群聊时忽略
+     * @param isGroup 是否是群聊
+     * @param limit 最多多少条，小于0表示不限制
+     * @param before 分页的位置，同getPrivateMessage
+     * @param after 分页的位置，同getPrivateMessage
+     */
+    void mergeCold(QVector<IMMessage> &msgList, const QString &name, bool isGroup, int limit,
+                   const IMMessage *before, const IMMessage *after);
+
+    /**
+     * @brief mergeUnflushed 把还没提交的消息和数据库读出的一页合并，还没提交的确认也应用到这一页上
+     * @param msgList 数据库读出的一页，从晚到早，合并后仍然从晚到早，最多limit条
+     * @param name 私聊的对方昵称，群聊时忽略
+     * @param isGroup 是否是群聊
+     * @param limit 最多多少条，小于0表示不限制
+     * @param before 分页的位置，同getPrivateMessage
+     * @param after 分页的位置，同getPrivateMessage
+     */
+    void mergeUnflushed(QVector<IMMessage> &msgList, const QString &name, bool isGroup, int limit,
+                        const IMMessage *before, const IMMessage *after);
+
+    /**
+     * @brief searchUnflushed 在还没提交的消息中查找，条件同searchMessage
+     * @return 从新到旧
+     */
+    QVector<IMSearchResult> searchUnflushed(const QString &text, const QString &peer, const QDateTime &from, const QDateTime &to);
+
+    /**
+     * @brief pruneUnflushed 丢掉写线程已经提交的副本
+     */
+    void pruneUnflushed();
+
+    /**
+     * @brief getUserID 从缓存中获取用户ID，缓存里没有时查一次数据库
+     * @param name 用户昵称
+     * @return 用户ID，没有这个用户时为0
+     */
+    int getUserID(QString name);
+
+    /**
+     * @brief enqueue 把消息交给写线程，数据库还没打开时先暂存
+     */
+    void enqueue(const IMDBRecord &record);
+
+    /**
+     * @brief m_userIDs 用户昵称到ID的缓存，initDatabase时加载
+     */
+    QHash<QString, int> m_userIDs;
+
+    /**
+     * @brief m_ftsAvailable 全文索引是否可用，SQLite没有编译FTS5时不可用
+     */
+    bool m_ftsAvailable;
+
+    /**
+     * @brief m_ftsTrigram 全文索引是否使用trigram分词，trigram不能搜索少于3个字的内容
+     */
+    bool m_ftsTrigram;
+
+    /**
+     * @brief m_writer 数据库写线程，initDatabase之前为nullptr
+     */
+    IMDBWriter *m_writer;
+
+    /**
+     * @brief m_segments 冷存储，initDatabase之前为nullptr
+     */
+    IMSegmentStore *m_segments;
+
+    /**
+     * @brief m_pending 数据库打开之前收发的消息，打开后交给写线程
+     */
+    QVector<IMDBRecord> m_pending;
+
+    /**
+     * @brief m_unflushed 交给写线程、还没提交的消息的副本，按入队的顺序，读历史记录时和数据库中的合并
+     * 写线程按入队的顺序提交，它的committed减去m_unflushedBase就是前面已经提交、可以丢掉的条数
+     */
+    QVector<IMDBRecord> m_unflushed;
+    quint64 m_unflushedBase;
+};
+
+#endif // IMDAL_H
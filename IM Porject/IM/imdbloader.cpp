@@ -0,0 +1,12 @@
+#include "imdbloader.h"
+
+IMDBLoader::IMDBLoader(QString name, QObject *parent)
+    : QThread(parent),
+      m_name(name)
+{
+}
+
+void IMDBLoader::run()
+{
+    this->m_state = IMDAL::instance()->prepareDatabase(this->m_name);
+}
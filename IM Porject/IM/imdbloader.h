@@ -0,0 +1,44 @@
+#ifndef IMDBLOADER_H
+#define IMDBLOADER_H
+
+#include <QThread>
+#include "imdal.h"
+
+/***********************************
+ *
+ * Class IMDBLoader
+ * 登录后在后台打开数据库的线程
+ *
+ * 在自己的线程中调用IMDAL::prepareDatabase，打开、升级数据库并读出用户表，
+ * 这期间主窗口已经显示出来了，在线的人可以先聊天
+ * 线程结束（finished信号）后在界面线程中取出state交给IMDAL::initDatabase
+ *
+ **********************************/
+
+class IMDBLoader : public QThread
+{
+    Q_OBJECT
+
+public:
+    /**
+     * @brief IMDBLoader 构造函数，调用start后开始打开
+     * @param name 用户名
+     */
+    explicit IMDBLoader(QString name, QObject *parent = nullptr);
+
+    /**
+     * @brief state 准备好的数据库，线程结束后才能读取
+     */
+    const IMDatabaseState &state() const { return this->m_state; }
+
+protected:
+    void run() override;
+
+private:
+    // 用户名
+    QString m_name;
+    // 准备好的数据库
+    IMDatabaseState m_state;
+};
+
+#endif // IMDBLOADER_H
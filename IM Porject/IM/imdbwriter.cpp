@@ -0,0 +1,592 @@
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QElapsedTimer>
+#include <QVector>
+#include <QDebug>
+#include "imdbwriter.h"
+#include "imdal.h"
+#include "imsegmentstore.h"
+#include "imhybridclock.h"
+#include "imarchive.h"
+
+IMDBWriter::IMDBWriter(QString databaseName, QObject *parent)
+    : QThread(parent),
+      m_databaseName(databaseName),
+      m_connectionName(QString("IMDBWriter_%1").arg(quintptr(this))),
+      m_wakeupPending(0),
+      m_stopping(0),
+      m_flushWaiters(0),
+      m_enqueued(0),
+      m_committed(0),
+      m_failing(0),
+      m_importing(0),
+      m_importFts(false),
+      m_segments(nullptr),
+      m_hotDays(0),
+      m_insertMessage(nullptr),
+      m_selectUser(nullptr),
+      m_insertUser(nullptr),
+      m_markDelivered(nullptr),
+      m_dropDuplicate(nullptr),
+      m_importReader(nullptr),
+      m_importDeferIndexes(false),
+      m_importCount(0),
+      m_importInserted(0)
+{
+}
+
+IMDBWriter::~IMDBWriter()
+{
+    this->stop();
+}
+
+void IMDBWriter::enqueue(const IMDBRecord &record)
+{
+    this->m_queue.enqueue(record);
+    this->m_enqueued.fetchAndAddOrdered(1);
+    this->wakeup();
+}
+
+void IMDBWriter::wakeup()
+{
+    // 每条消息都释放一次的话，写线程忙时计数会随着积压的消息一直涨
+    if (this->m_wakeupPending.testAndSetOrdered(0, 1))
+        this->m_wakeup.release();
+}
+
+quint64 IMDBWriter::committed()
+{
+    QMutexLocker locker(&this->m_flushMutex);
+    return this->m_committed;
+}
+
+bool IMDBWriter::flush()
+{
+    if (!this->isRunning())
+        return this->committed() >= this->m_enqueued.load();
+    quint64 target = this->m_enqueued.load();
+    this->m_flushWaiters.fetchAndAddOrdered(1);
+    this->wakeup();
+    bool done = false;
+    {
+        // 提交失败、正在等着重试时不再等下去，否则数据库一直忙时调用方会一直卡住
+        QMutexLocker locker(&this->m_flushMutex);
+        while (this->m_committed < target && this->isRunning() && this->m_failing.load() == 0)
+            this->m_flushed.wait(&this->m_flushMutex, 100);
+        done = this->m_committed >= target;
+    }
+    this->m_flushWaiters.fetchAndAddOrdered(-1);
+    return done;
+}
+
+void IMDBWriter::stop()
+{
+    if (!this->isRunning())
+        return;
+    this->m_stopping.store(1);
+    this->wakeup();
+    this->wait();
+}
+
+void IMDBWriter::setRetention(IMSegmentStore *segments, int hotDays)
+{
+    this->m_segments = segments;
+    this->m_hotDays = hotDays;
+}
+
+bool IMDBWriter::startImport(QString path, bool ftsAvailable)
+{
+    if (!this->isRunning() || !this->m_importing.testAndSetOrdered(0, 1))
+        return false;
+    {
+        QMutexLocker locker(&this->m_importMutex);
+        this->m_importPath = path;
+        this->m_importFts = ftsAvailable;
+    }
+    this->wakeup();
+    return true;
+}
+
+void IMDBWriter::run()
+{
+    {
+        QSqlDatabase database = QSqlDatabase::addDatabase("QSQLITE", this->m_connectionName);
+        database.setDatabaseName(this->m_databaseName);
+        // 界面线程读历史记录时可能正好在提交，等一会儿而不是直接失败
+        database.setConnectOptions("QSQLITE_BUSY_TIMEOUT=5000");
+        this->openDatabase(database);
+
+        QVector<IMDBRecord> batch;
+        QElapsedTimer timer;
+        // 提交失败后的重试：这一批留着，等retryDelay毫秒再提交，0表示没有失败
+        QElapsedTimer retryTimer;
+        int retryDelay = 0;
+        int stopRetries = 0;
+        // 空闲多久后做下一步维护，写过消息后重新从IdleDelay开始
+        int idleWait = IdleDelay;
+        for (;;)
+        {
+            IMDBRecord record;
+            while (batch.size() < MaxBatchSize && this->m_queue.dequeue(record))
+                batch.append(record);
+            if (!batch.isEmpty() && !timer.isValid())
+                timer.start();
+
+            bool stopping = this->m_stopping.load() != 0;
+            bool due = retryDelay > 0
+                    ? retryTimer.elapsed() >= retryDelay
+                    : batch.size() >= MaxBatchSize || timer.elapsed() >= MaxBatchDelay
+                      || stopping || this->m_flushWaiters.load() > 0;
+            if (!batch.isEmpty() && due)
+            {
+                if (this->commit(database, batch))
+                {
+                    {
+                        QMutexLocker locker(&this->m_flushMutex);
+                        this->m_committed += quint64(batch.size());
+                    }
+                    this->m_failing.store(0);
+                    this->m_flushed.wakeAll();
+                    batch.clear();
+                    timer.invalidate();
+                    retryDelay = 0;
+                    stopRetries = 0;
+                    idleWait = IdleDelay;
+                    continue;
+                }
+                // 数据库忙、磁盘满等，这一批一条也没有写入，留着重试，间隔逐次加倍
+                retryDelay = retryDelay == 0 ? RetryBaseDelay : qMin(retryDelay * 2, int(RetryMaxDelay));
+                retryTimer.start();
+                this->m_failing.store(1);
+                // 等着flush的线程不再等下去
+                this->m_flushed.wakeAll();
+                if (stopping && ++stopRetries >= MaxStopRetries)
+                {
+                    qDebug() << "IMDBWriter: give up," << this->m_enqueued.load() - this->m_committed
+                             << "messages are not written";
+                    break;
+                }
+                qDebug() << "IMDBWriter: commit failed, retry in" << retryDelay << "ms";
+                continue;
+            }
+            // 导入一步一步做，两步之间先提交新来的消息；退出时没导完的算失败
+            if (this->m_importing.load() != 0)
+            {
+                if (!stopping)
+                {
+                    this->importStep(database);
+                    continue;
+                }
+                this->finishImport(database, false);
+            }
+            if (batch.isEmpty() && stopping)
+                break;
+
+            // 没有消息时等到空闲够久再维护，有消息没攒够时最多等到这一批到期，提交失败时等到重试
+            if (batch.isEmpty())
+            {
+                if (this->m_wakeup.tryAcquire(1, idleWait))
+                    this->m_wakeupPending.fetchAndStoreOrdered(0);
+                else
+                    idleWait = this->maintain(database) ? ArchiveDelay : MaintainInterval;
+            }
+            else
+            {
+                qint64 remaining = retryDelay > 0 ? retryDelay - retryTimer.elapsed() : MaxBatchDelay - timer.elapsed();
+                if (this->m_wakeup.tryAcquire(1, int(qMax<qint64>(1, remaining))))
+                    this->m_wakeupPending.fetchAndStoreOrdered(0);
+            }
+        }
+        this->closeDatabase(database);
+    }
+    QSqlDatabase::removeDatabase(this->m_connectionName);
+    this->m_flushed.wakeAll();
+}
+
+bool IMDBWriter::openDatabase(QSqlDatabase &database)
+{
+    this->closeDatabase(database);
+    if (!database.open())
+    {
+        qDebug() << "IMDBWriter:" << database.lastError();
+        return false;
+    }
+    IMDAL::configureConnection(database);
+
+    // 语句只准备一次
+    this->m_insertMessage = new QSqlQuery(database);
+    this->m_insertMessage->prepare("INSERT OR IGNORE INTO message(fromID, content, time, io, seq, pending, msgid, hlc) "
+                                   "VALUES(?, ?, ?, ?, ?, ?, NULLIF(?, 0), ?)");
+    this->m_selectUser = new QSqlQuery(database);
+    this->m_selectUser->prepare("SELECT id FROM user WHERE name = ?");
+    this->m_insertUser = new QSqlQuery(database);
+    this->m_insertUser->prepare("INSERT INTO user(name) VALUES(?)");
+    this->m_markDelivered = new QSqlQuery(database);
+    this->m_markDelivered->prepare("UPDATE message SET pending = 0, msgid = NULLIF(?, 0), hlc = IFNULL(NULLIF(?, 0), hlc), "
+                                   "time = IFNULL(?, time) WHERE seq = ? AND pending = 1");
+    // 同一条消息已经以服务端的编号存在时，本地待确认的这条是重复的
+    this->m_dropDuplicate = new QSqlQuery(database);
+    this->m_dropDuplicate->prepare("DELETE FROM message WHERE seq = ? AND pending = 1 "
+                                   "AND EXISTS (SELECT 1 FROM message WHERE msgid = ?)");
+    this->loadUserIDs(database);
+    return true;
+}
+
+void IMDBWriter::closeDatabase(QSqlDatabase &database)
+{
+    delete this->m_insertMessage;
+    delete this->m_selectUser;
+    delete this->m_insertUser;
+    delete this->m_markDelivered;
+    delete this->m_dropDuplicate;
+    this->m_insertMessage = this->m_selectUser = this->m_insertUser = this->m_markDelivered = this->m_dropDuplicate = nullptr;
+    if (database.isOpen())
+        database.close();
+}
+
+bool IMDBWriter::commit(QSqlDatabase &database, const QVector<IMDBRecord> &batch)
+{
+    // 没有打开的数据库（比如启动时文件被锁住）每次重试时再打开一次
+    if (!database.isOpen() && !this->openDatabase(database))
+        return false;
+    if (!database.transaction())
+    {
+        qDebug()<<database.lastError();
+        return false;
+    }
+    QSqlQuery &query = *this->m_insertMessage;
+    // 任何一条失败都回滚整批，调用方留着这一批重试，不会只写进去一部分
+    bool ok = true;
+    for (const IMDBRecord &record : batch)
+    {
+        // 服务端确认了之前的消息
+        if (record.delivered)
+        {
+            if (record.msgId != 0)
+            {
+                QSqlQuery &drop = *this->m_dropDuplicate;
+                drop.bindValue(0, qint64(record.seq));
+                drop.bindValue(1, qint64(record.msgId));
+                if (!drop.exec())
+                {
+                    qDebug()<<drop.lastError();
+                    ok = false;
+                    break;
+                }
+                if (drop.numRowsAffected() > 0)
+                    qDebug() << "drop duplicate of message" << record.msgId << "seq" << record.seq;
+            }
+            // 时间取HLC的物理部分，没有HLC时保留本地时间
+            QSqlQuery &mark = *this->m_markDelivered;
+            mark.bindValue(0, qint64(record.msgId));
+            mark.bindValue(1, qint64(record.hlc));
+            mark.bindValue(2, record.hlc != 0 ? QVariant(QDateTime::fromMSecsSinceEpoch(IMHybridClock::physical(record.hlc)))
+                                              : QVariant(QVariant::DateTime));
+            mark.bindValue(3, qint64(record.seq));
+            if (!mark.exec())
+            {
+                qDebug()<<mark.lastError();
+                ok = false;
+                break;
+            }
+            continue;
+        }
+        // 获得用户ID，查不到也建不了时整批重试，不能把这条消息丢掉
+        int id = this->userID(record.userName);
+        if (id == 0)
+        {
+            ok = false;
+            break;
+        }
+        query.bindValue(0, id);
+        query.bindValue(1, record.content);
+        query.bindValue(2, record.time);
+        query.bindValue(3, record.io);
+        query.bindValue(4, qint64(record.seq));
+        query.bindValue(5, record.pending ? 1 : 0);
+        query.bindValue(6, qint64(record.msgId));
+        query.bindValue(7, qint64(record.hlc));
+        if (!query.exec())
+        {
+            qDebug()<<query.lastError();
+            ok = false;
+            break;
+        }
+    }
+    query.finish();
+    this->m_markDelivered->finish();
+    this->m_dropDuplicate->finish();
+    if (ok && database.commit())
+        return true;
+    qDebug()<<database.lastError();
+    database.rollback();
+    // 这一批新建的用户也被回滚了，缓存要重新加载
+    this->loadUserIDs(database);
+    return false;
+}
+
+bool IMDBWriter::maintain(QSqlDatabase &database)
+{
+    if (!database.isOpen())
+        return false;
+    if (this->archive(database))
+        return true;
+
+    // 没有要移出的消息时，把删除后空出来的页还给文件系统，一次只回收一部分
+    QSqlQuery query(database);
+    if (!query.exec("PRAGMA freelist_count") || !query.next())
+        return false;
+    int freePages = query.value(0).toInt();
+    query.finish();
+    if (freePages == 0)
+        return false;
+    if (!query.exec(QString("PRAGMA incremental_vacuum(%1)").arg(VacuumPages)))
+    {
+        qDebug()<<query.lastError();
+        return false;
+    }
+    while (query.next())
+        ;
+    query.finish();
+    return freePages > VacuumPages;
+}
+
+bool IMDBWriter::archive(QSqlDatabase &database)
+{
+    if (this->m_segments == nullptr || this->m_hotDays <= 0)
+        return false;
+    QDateTime cutoff = QDateTime::currentDateTime().addDays(-this->m_hotDays);
+
+    // 最早的一条已经确认的消息决定这一段在哪个月，还没确认的留在数据库里等着重发
+    QSqlQuery query(database);
+    query.setForwardOnly(true);
+    if (!query.exec("SELECT time FROM message WHERE pending = 0 ORDER BY time, id LIMIT 1") || !query.next())
+        return false;
+    QDateTime oldest = query.value(0).toDateTime();
+    query.finish();
+    if (!oldest.isValid() || oldest >= cutoff)
+        return false;
+    QDate month(oldest.date().year(), oldest.date().month(), 1);
+    QDateTime end = qMin(cutoff, QDateTime(month.addMonths(1), QTime(0, 0)));
+
+    query.prepare("SELECT message.id, time, name, io, content, msgid, hlc FROM message JOIN user ON user.id = fromID "
+                  "WHERE time < ? AND pending = 0 ORDER BY time, message.id LIMIT ?");
+    query.addBindValue(end);
+    query.addBindValue(MaxArchiveRows);
+    if (!query.exec())
+    {
+        qDebug()<<query.lastError();
+        return false;
+    }
+    QVector<IMSegmentMessage> messages;
+    // 最后一条的原始时间，删除时按原样比较
+    QVariant lastTime;
+    while (query.next())
+    {
+        IMSegmentMessage msg;
+        msg.id = query.value(0).toLongLong();
+        msg.time = query.value(1).toDateTime().toMSecsSinceEpoch();
+        msg.user = query.value(2).toString();
+        msg.io = query.value(3).toString();
+        msg.content = query.value(4).toString();
+        msg.msgId = quint64(query.value(5).toLongLong());
+        msg.hlc = quint64(query.value(6).toLongLong());
+        messages.append(msg);
+        lastTime = query.value(1);
+    }
+    query.finish();
+    if (messages.isEmpty())
+        return false;
+
+    // 先写段文件，写成功了再删除，中途退出最多在两边各有一份，读的时候会去掉重复的
+    if (!this->m_segments->writeSegment(messages))
+        return false;
+    database.transaction();
+    QSqlQuery remove(database);
+    remove.prepare("DELETE FROM message WHERE pending = 0 AND (time < ? OR (time = ? AND id <= ?))");
+    remove.addBindValue(lastTime);
+    remove.addBindValue(lastTime);
+    remove.addBindValue(messages.last().id);
+    if (!remove.exec() || !database.commit())
+    {
+        qDebug()<<remove.lastError()<<database.lastError();
+        database.rollback();
+        return false;
+    }
+    qDebug() << "IMDBWriter: archived" << messages.size() << "messages before" << end;
+    return true;
+}
+
+void IMDBWriter::importStep(QSqlDatabase &database)
+{
+    if (this->m_importReader == nullptr && !this->beginImport(database))
+    {
+        this->finishImport(database, false);
+        return;
+    }
+    if (!database.transaction())
+    {
+        qDebug()<<database.lastError();
+        this->finishImport(database, false);
+        return;
+    }
+    // 和消息用同一条插入语句，导入的消息不是自己发出的，没有序号，都已经送达
+    QSqlQuery &insert = *this->m_insertMessage;
+    bool ok = true;
+    bool more = true;
+    IMArchiveRecord record;
+    for (int i = 0; i < ImportBatchSize; ++i)
+    {
+        if (!this->m_importReader->next(record))
+        {
+            more = false;
+            break;
+        }
+        int id = this->userID(record.user);
+        if (id == 0)
+        {
+            ok = false;
+            break;
+        }
+        insert.bindValue(0, id);
+        insert.bindValue(1, record.content);
+        insert.bindValue(2, QDateTime::fromMSecsSinceEpoch(record.time));
+        insert.bindValue(3, record.io);
+        insert.bindValue(4, 0);
+        insert.bindValue(5, 0);
+        insert.bindValue(6, qint64(record.msgId));
+        // 旧版本导出的消息没有HLC时间，和升级数据库时一样按时间补上
+        insert.bindValue(7, qint64(record.hlc != 0 ? record.hlc : IMHybridClock::pack(record.time, 0)));
+        if (!insert.exec())
+        {
+            qDebug()<<insert.lastError();
+            ok = false;
+            break;
+        }
+        // 已经有这个消息编号的被忽略了
+        if (insert.numRowsAffected() > 0)
+            ++this->m_importInserted;
+        ++this->m_importCount;
+    }
+    insert.finish();
+    if (!ok || !database.commit())
+    {
+        qDebug()<<database.lastError();
+        database.rollback();
+        // 这一步新建的用户也被回滚了
+        this->loadUserIDs(database);
+        this->finishImport(database, false);
+        return;
+    }
+    if (!more)
+        this->finishImport(database, true);
+}
+
+bool IMDBWriter::beginImport(QSqlDatabase &database)
+{
+    QString path;
+    {
+        QMutexLocker locker(&this->m_importMutex);
+        path = this->m_importPath;
+    }
+    if (!database.isOpen() && !this->openDatabase(database))
+        return false;
+    IMArchiveReader *reader = new IMArchiveReader;
+    if (!reader->open(path))
+    {
+        qDebug() << "import:" << reader->errorString();
+        delete reader;
+        return false;
+    }
+    this->m_importReader = reader;
+    this->m_importCount = 0;
+    this->m_importInserted = 0;
+
+    // 导入的比已有的多时，每插入一条都维护索引比最后一次性建索引慢得多
+    qint64 total = reader->count();
+    qint64 existing = 0;
+    QSqlQuery query(database);
+    if (query.exec("SELECT MAX(id) FROM message") && query.next())
+        existing = query.value(0).toLongLong();
+    query.finish();
+    this->m_importDeferIndexes = total > existing;
+    qDebug() << "import" << total << "messages into" << existing << "deferIndexes" << this->m_importDeferIndexes;
+    if (this->m_importDeferIndexes && !IMDAL::dropIndexes(database, this->m_importFts))
+        qDebug() << "drop indexes failed";
+    return true;
+}
+
+void IMDBWriter::finishImport(QSqlDatabase &database, bool ok)
+{
+    if (this->m_importReader != nullptr)
+    {
+        if (ok && !this->m_importReader->atEnd())
+        {
+            qDebug() << "import:" << this->m_importReader->errorString();
+            ok = false;
+        }
+        // 不管成功与否，删掉的索引都要建回来
+        if (this->m_importDeferIndexes && !IMDAL::restoreIndexes(database, this->m_importFts))
+            qDebug() << "restore indexes failed";
+        qDebug() << "imported" << this->m_importInserted << "messages, skipped"
+                 << this->m_importCount - this->m_importInserted << "duplicates";
+        delete this->m_importReader;
+        this->m_importReader = nullptr;
+    }
+    else
+    {
+        ok = false;
+    }
+    this->m_importDeferIndexes = false;
+    qint64 inserted = ok ? this->m_importInserted : -1;
+    this->m_importing.store(0);
+    emit importFinished(inserted);
+}
+
+void IMDBWriter::loadUserIDs(QSqlDatabase &database)
+{
+    this->m_userIDs.clear();
+    QSqlQuery query(database);
+    if (!query.exec("SELECT id, name FROM user"))
+    {
+        qDebug()<<query.lastError();
+        return;
+    }
+    while (query.next())
+        this->m_userIDs.insert(query.value(1).toString(), query.value(0).toInt());
+}
+
+int IMDBWriter::userID(QString name)
+{
+    int userID = this->m_userIDs.value(name);
+    if (userID)
+        return userID;
+
+    // 缓存里没有，可能是别的连接刚插入的，先查一次
+    QSqlQuery &select = *this->m_selectUser;
+    select.bindValue(0, name);
+    if(!select.exec())
+    {
+        qDebug()<<select.lastError();
+        return 0;
+    }
+    // 获取这个昵称的id
+    while(select.next())
+        userID = select.value(0).toInt();
+    select.finish();
+
+    if (!userID)
+    {
+        // 如果没有这个人的记录，那么就创建这个人的ID
+        QSqlQuery &insert = *this->m_insertUser;
+        insert.bindValue(0, name);
+        if(!insert.exec())
+        {
+            qDebug()<<insert.lastError();
+            return 0;
+        }
+        userID = insert.lastInsertId().toInt();
+    }
+    this->m_userIDs.insert(name, userID);
+    return userID;
+}
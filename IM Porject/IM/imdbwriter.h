@@ -0,0 +1,320 @@
+#ifndef IMDBWRITER_H
+#define IMDBWRITER_H
+
+#include <QThread>
+#include <QSemaphore>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QAtomicInt>
+#include <QDateTime>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QHash>
+#include "imlockfreequeue.h"
+
+class IMSegmentStore;
+class IMArchiveReader;
+
+/**
+ * @brief 一条等待写入数据库的消息
+ */
+struct IMDBRecord
+{
+    /**
+     * @brief userName fromID对应的用户昵称，私聊是对方，群聊是发送者
+     */
+    QString userName;
+
+    /**
+     * @brief content 内容
+     */
+    QString content;
+
+    /**
+     * @brief time 时间
+     */
+    QDateTime time;
+
+    /**
+     * @brief io i收到消息 o发出消息 g群聊消息
+     */
+    QString io;
+
+    /**
+     * @brief seq 自己发出的消息的序号
+     */
+    quint64 seq = 0;
+
+    /**
+     * @brief pending 是否还在等待服务端确认
+     */
+    bool pending = false;
+
+    /**
+     * @brief msgId 服务端分配的消息编号，0表示没有
+     */
+    quint64 msgId = 0;
+
+    /**
+     * @brief hlc HLC时间
+     */
+    quint64 hlc = 0;
+
+    /**
+     * @brief delivered 为true时这不是一条新消息，而是把序号为seq的消息标记为已送达，同时填上msgId与hlc，
+     * time改为hlc的物理部分，和其他客户端收到的这条消息时间一致
+     * 数据库中已经有这个msgId的消息（比如确认丢了，重发后先收到了服务端转回的同一条）时，删掉本地这条待确认的，
+     * 否则唯一索引冲突，这条消息会一直留在发件箱中，每次启动都重发
+     * 和插入消息走同一个队列，标记一定在插入之后执行
+     */
+    bool delivered = false;
+};
+
+/***********************************
+ *
+ * Class IMDBWriter
+ * 数据库写线程
+ *
+ * 消息通过无锁队列交给写线程，调用方从不等待SQLite
+ * 写线程使用自己的数据库连接，把消息攒成一批放在一个事务中提交：
+ * 一批满MaxBatchSize条或者第一条消息已经等了MaxBatchDelay毫秒就提交，
+ * 这样一批消息只需要一次fsync
+ *
+ * 用户昵称到ID的对应关系在写线程启动时一次性读入内存，之后只有新用户才会访问user表
+ * 插入消息、查询用户、插入用户、标记已送达四条语句只准备一次，之后每条消息只需要绑定参数再执行
+ * 消息编号上有唯一索引，插入用INSERT OR IGNORE，同一条消息写两次只保留第一次
+ *
+ * 读历史记录时不等写线程：committed是已经提交的条数，调用方按入队的顺序保留还没提交的消息，和数据库中的合并
+ * 导出、导入等需要数据库完整的操作之前调用flush，等已经入队的消息都提交
+ * stop会把队列中剩下的消息全部提交后再退出
+ *
+ * 一批提交失败（数据库忙超时、磁盘满、读写出错，或者用户ID建不了）时整批回滚，一条也不丢：
+ * 这一批留在写线程中，隔RetryBaseDelay毫秒再提交，每次失败间隔加倍，最长RetryMaxDelay毫秒，
+ * 成功之前committed不增加，调用方保留的副本也就一直在；数据库没有打开时每次重试先重新打开
+ * 失败期间flush不再等待，返回false；退出时连续失败MaxStopRetries次才放弃，剩下的消息没有写入
+ *
+ * 导入聊天记录也在写线程中做，和消息共用一个连接与用户ID缓存，两边不会互相等锁，也不会重复插入同一个用户：
+ * 每一步在一个事务中导入ImportBatchSize条，两步之间先提交新来的消息，导入期间不做维护，导入完发出importFinished
+ *
+ * 队列空闲IdleDelay毫秒后做一次维护：把超过保留期的消息按 (time, id) 顺序一段一段移到冷存储，
+ * 每段不跨月、最多MaxArchiveRows条，先写段文件，再在一个事务中删除；没有要移的就增量回收空闲页
+ * 每次只做一小步，还有剩余时隔ArchiveDelay毫秒再做下一步，期间来了新消息先写消息
+ *
+ **********************************/
+
+class IMDBWriter : public QThread
+{
+    Q_OBJECT
+
+public:
+    /**
+     * @brief IMDBWriter 构造函数，调用start后开始工作
+     * @param databaseName 数据库文件
+     */
+    explicit IMDBWriter(QString databaseName, QObject *parent = nullptr);
+
+    ~IMDBWriter();
+
+    /**
+     * @brief enqueue 把一条消息交给写线程，可以在任意线程调用，不会阻塞
+     * @param record 消息
+     */
+    void enqueue(const IMDBRecord &record);
+
+    /**
+     * @brief flush 等待已经入队的消息全部提交
+     * @return 是否都已经提交，写线程提交失败、正在等着重试时不等待，返回false
+     */
+    bool flush();
+
+    /**
+     * @brief committed 已经提交的条数，按入队的顺序，前这么多条已经在数据库中
+     */
+    quint64 committed();
+
+    /**
+     * @brief stop 提交剩下的消息并等待写线程退出
+     */
+    void stop();
+
+    /**
+     * @brief setRetention 设置冷存储与保留天数，在start之前调用
+     * @param segments 冷存储，nullptr表示不移出
+     * @param hotDays 保留的天数，小于等于0表示不移出
+     */
+    void setRetention(IMSegmentStore *segments, int hotDays);
+
+    /**
+     * @brief startImport 让写线程导入一个导出文件，可以在任意线程调用，不会阻塞
+     * 带消息编号的消息按编号去重；导入的比已有的多时先删掉索引和全文索引触发器，导入完再一次建好
+     * 中途失败时已经提交的步骤会保留；中途退出时删掉的索引由下次登录时的prepareDatabase建回来
+     * @param path 导出文件
+     * @param ftsAvailable 是否有全文索引
+     * @return 已经有导入在进行时返回false
+     */
+    bool startImport(QString path, bool ftsAvailable);
+
+    /**
+     * @brief ImportBatchSize 导入时每个事务的消息条数
+     */
+    static const int ImportBatchSize = 20000;
+
+signals:
+    /**
+     * @brief importFinished 导入结束，在写线程中发出
+     * @param inserted 导入的消息条数，不包括跳过的重复消息，失败时为-1
+     */
+    void importFinished(qint64 inserted);
+
+protected:
+    void run() override;
+
+private:
+    /**
+     * @brief commit 在一个事务中写入一批消息
+     * @param database 写线程的数据库连接
+     * @param batch 消息
+     * @return 是否提交成功，失败时整批都已经回滚
+     */
+    bool commit(QSqlDatabase &database, const QVector<IMDBRecord> &batch);
+
+    /**
+     * @brief openDatabase 打开写线程的数据库连接，准备语句，读入用户ID
+     * @param database 写线程的数据库连接
+     * @return 是否成功
+     */
+    bool openDatabase(QSqlDatabase &database);
+
+    /**
+     * @brief closeDatabase 删除准备好的语句并关闭连接
+     * @param database 写线程的数据库连接
+     */
+    void closeDatabase(QSqlDatabase &database);
+
+    /**
+     * @brief maintain 空闲时的一步维护：移出一段过期消息，或者回收一些空闲页
+     * @param database 写线程的数据库连接
+     * @return 是否还有没做完的维护
+     */
+    bool maintain(QSqlDatabase &database);
+
+    /**
+     * @brief archive 把最早的一段过期消息移到冷存储
+     * @param database 写线程的数据库连接
+     * @return 是否移出了消息
+     */
+    bool archive(QSqlDatabase &database);
+
+    /**
+     * @brief importStep 导入的一步：第一次时打开文件，之后在一个事务中导入ImportBatchSize条，导完时结束导入
+     * @param database 写线程的数据库连接
+     */
+    void importStep(QSqlDatabase &database);
+
+    /**
+     * @brief beginImport 打开导出文件，需要时删掉索引
+     * @param database 写线程的数据库连接
+     * @return 是否成功
+     */
+    bool beginImport(QSqlDatabase &database);
+
+    /**
+     * @brief finishImport 建回删掉的索引，关闭文件，发出importFinished
+     * @param database 写线程的数据库连接
+     * @param ok 是否导入成功
+     */
+    void finishImport(QSqlDatabase &database, bool ok);
+
+    /**
+     * @brief loadUserIDs 把user表全部读入缓存
+     * @param database 写线程的数据库连接
+     */
+    void loadUserIDs(QSqlDatabase &database);
+
+    /**
+     * @brief userID 获取用户ID，先查缓存，没有就创建
+     * @param name 用户昵称
+     * @return 用户ID，失败时为0
+     */
+    int userID(QString name);
+
+    /**
+     * @brief wakeup 唤醒写线程，写线程还没有醒来处理之前只释放一次，信号量的计数不超过1
+     */
+    void wakeup();
+
+private:
+    // 一批最多的消息数
+    static const int MaxBatchSize = 512;
+    // 第一条消息最多等待的毫秒数
+    static const int MaxBatchDelay = 50;
+    // 队列空闲多少毫秒后开始维护
+    static const int IdleDelay = 5000;
+    // 维护还没做完时两步之间的间隔
+    static const int ArchiveDelay = 200;
+    // 没有维护可做时隔多久再检查一次
+    static const int MaintainInterval = 600000;
+    // 一段最多移出的消息数
+    static const int MaxArchiveRows = 10000;
+    // 提交失败后第一次重试前等待的毫秒数，之后每次加倍
+    static const int RetryBaseDelay = 100;
+    // 重试间隔的上限
+    static const int RetryMaxDelay = 5000;
+    // 退出时连续失败多少次后放弃
+    static const int MaxStopRetries = 5;
+    // 一次增量回收的页数
+    static const int VacuumPages = 256;
+
+    // 数据库文件
+    QString m_databaseName;
+    // 写线程的数据库连接名
+    QString m_connectionName;
+    // 等待写入的消息
+    IMLockFreeQueue<IMDBRecord> m_queue;
+    // 有新消息或者需要退出时唤醒写线程
+    QSemaphore m_wakeup;
+    // 已经释放了m_wakeup、写线程还没有取走时为1，这期间不再释放
+    QAtomicInt m_wakeupPending;
+    // 是否需要退出
+    QAtomicInt m_stopping;
+    // 等待flush的线程数，大于0时写线程不再攒批
+    QAtomicInt m_flushWaiters;
+    // 已经入队的消息数
+    QAtomicInteger<quint64> m_enqueued;
+    // 已经提交的消息数，由m_flushMutex保护
+    quint64 m_committed;
+    // 最近一次提交失败、还没有重试成功时为1
+    QAtomicInt m_failing;
+    QMutex m_flushMutex;
+    QWaitCondition m_flushed;
+
+    // 有导入在进行（包括已经请求、写线程还没开始的）时为1
+    QAtomicInt m_importing;
+    // 请求导入的文件与是否有全文索引，由m_importMutex保护
+    QMutex m_importMutex;
+    QString m_importPath;
+    bool m_importFts;
+
+    // 冷存储与保留天数，start之后不再修改
+    IMSegmentStore *m_segments;
+    int m_hotDays;
+
+    // 以下只在写线程中使用
+    // 用户昵称到ID的缓存
+    QHash<QString, int> m_userIDs;
+    // 准备好的语句，在run中创建，退出前删除
+    QSqlQuery *m_insertMessage;
+    QSqlQuery *m_selectUser;
+    QSqlQuery *m_insertUser;
+    QSqlQuery *m_markDelivered;
+    QSqlQuery *m_dropDuplicate;
+    // 进行中的导入，没有开始时为nullptr
+    IMArchiveReader *m_importReader;
+    // 导入时是否删掉了索引
+    bool m_importDeferIndexes;
+    // 已经读出的与实际插入的条数
+    qint64 m_importCount;
+    qint64 m_importInserted;
+};
+
+#endif // IMDBWRITER_H
@@ -0,0 +1,70 @@
+#include <QEvent>
+#include <QFontDatabase>
+#include "imlatencyoverlay.h"
+
+// 两个环节之间的时间，有一个没有经过时显示为-
+static QString hopText(const IMFrameTrace &trace, TraceHop from, TraceHop to)
+{
+    if (trace.stamps[from] == 0 || trace.stamps[to] == 0)
+        return "-";
+    return QString::number(double(trace.stamps[to] - trace.stamps[from]) / 1000.0, 'f', 1);
+}
+
+IMLatencyOverlay::IMLatencyOverlay(QWidget *parent)
+    : QLabel(parent)
+{
+    this->setAttribute(Qt::WA_TransparentForMouseEvents);
+    this->setFont(QFontDatabase::systemFont(QFontDatabase::FixedFont));
+    this->setStyleSheet("QLabel { background-color: rgba(0, 0, 0, 160); color: white; padding: 4px; }");
+    this->setTextFormat(Qt::PlainText);
+    // 聊天框改变大小时跟着调整位置
+    parent->installEventFilter(this);
+    this->setClock(0, -1);
+}
+
+void IMLatencyOverlay::setClock(qint64 offset, qint64 rtt)
+{
+    if (rtt < 0)
+        this->m_clockLine = "时钟偏差: 未同步";
+    else
+        this->m_clockLine = QString("时钟偏差: %1ms ±%2ms")
+                .arg(double(offset) / 1000.0, 0, 'f', 1).arg(double(rtt) / 2000.0, 0, 'f', 1);
+    this->refresh();
+}
+
+void IMLatencyOverlay::addSample(QString fromName, bool isGroup, IMFrameTrace trace)
+{
+    QString line = QString("%1 %2 %3 %4 %5 %6")
+            .arg((isGroup ? "[群]" : "") + fromName, -10)
+            .arg(hopText(trace, TraceClientSend, TraceServerIngress), 6)
+            .arg(hopText(trace, TraceServerIngress, TraceFanoutEnqueue), 6)
+            .arg(hopText(trace, TraceFanoutEnqueue, TraceSocketWrite), 6)
+            .arg(hopText(trace, TraceSocketWrite, TraceReceiverDecode), 6)
+            .arg(hopText(trace, TraceClientSend, TraceReceiverDecode), 6);
+    this->m_samples.prepend(line);
+    while (this->m_samples.size() > MaxSamples)
+        this->m_samples.removeLast();
+    this->refresh();
+}
+
+bool IMLatencyOverlay::eventFilter(QObject *watched, QEvent *event)
+{
+    if (watched == this->parentWidget() && event->type() == QEvent::Resize)
+        this->refresh();
+    return QLabel::eventFilter(watched, event);
+}
+
+void IMLatencyOverlay::refresh()
+{
+    QStringList lines;
+    lines << this->m_clockLine
+          << QString("%1 %2 %3 %4 %5 %6 (ms)").arg("", -10).arg("上行", 4).arg("处理", 4)
+             .arg("排队", 4).arg("下行", 4).arg("合计", 4);
+    lines << this->m_samples;
+    this->setText(lines.join("\n"));
+    this->adjustSize();
+    // 放在右上角，留出滚动条的位置
+    QWidget *parent = this->parentWidget();
+    this->move(qMax(0, parent->width() - this->width() - 20), 4);
+    this->raise();
+}
@@ -0,0 +1,71 @@
+#ifndef IMLATENCYOVERLAY_H
+#define IMLATENCYOVERLAY_H
+
+#include <QLabel>
+#include <QStringList>
+#include "protocol.h"
+
+/***********************************
+ *
+ * Class IMLatencyOverlay
+ * 延迟跟踪的调试浮层
+ *
+ * 半透明地盖在聊天框的右上角，不接收鼠标事件，不随聊天框滚动
+ * 第一行是估计的时钟偏差，下面是最近收到的几条消息在各环节花的时间：
+ * 上行(客户端发出到服务端收到) 处理(服务端收到到放入发送队列) 排队(放入发送队列到写入Socket)
+ * 下行(写入Socket到本机解出) 合计(发出到解出)
+ * 发送者没有打开延迟跟踪时没有上行与合计，显示为-
+ *
+ * 只在打开了延迟跟踪时创建
+ *
+ **********************************/
+
+class IMLatencyOverlay : public QLabel
+{
+    Q_OBJECT
+
+public:
+    /**
+     * @brief IMLatencyOverlay 构造函数
+     * @param parent 盖在上面的控件，跟着它的大小调整位置
+     */
+    explicit IMLatencyOverlay(QWidget *parent);
+
+    /**
+     * @brief setClock 设置估计的时钟偏差
+     * @param offset 服务端时钟减去本机时钟（微秒）
+     * @param rtt 估计时的往返时间（微秒），小于0表示还没有估计
+     */
+    void setClock(qint64 offset, qint64 rtt);
+
+    /**
+     * @brief MaxSamples 最多显示的消息条数
+     */
+    static const int MaxSamples = 8;
+
+public slots:
+    /**
+     * @brief addSample 显示一条消息的各环节延迟
+     * @param fromName 发送者昵称
+     * @param isGroup 是否是群聊消息
+     * @param trace 各环节的时间，都在服务端时钟上
+     */
+    void addSample(QString fromName, bool isGroup, IMFrameTrace trace);
+
+protected:
+    bool eventFilter(QObject *watched, QEvent *event) override;
+
+private:
+    /**
+     * @brief refresh 重新生成显示的文本并放到右上角
+     */
+    void refresh();
+
+private:
+    // 时钟偏差那一行
+    QString m_clockLine;
+    // 最近的消息，新的在前
+    QStringList m_samples;
+};
+
+#endif // IMLATENCYOVERLAY_H
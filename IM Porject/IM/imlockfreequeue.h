@@ -0,0 +1,84 @@
+#ifndef IMLOCKFREEQUEUE_H
+#define IMLOCKFREEQUEUE_H
+
+#include <QAtomicPointer>
+
+/***********************************
+ *
+ * Class IMLockFreeQueue
+ * 无锁的多生产者单消费者队列
+ *
+ * 入队只有一次原子交换，任意线程都可以入队，不会阻塞
+ * 出队只能在一个线程中进行，队列空时立即返回false
+ *
+ * 队列里始终有一个哨兵节点，m_tail指向哨兵，真正的元素从哨兵的next开始
+ *
+ **********************************/
+
+template <typename T>
+class IMLockFreeQueue
+{
+public:
+    IMLockFreeQueue()
+    {
+        Node *stub = new Node;
+        m_head.store(stub);
+        m_tail = stub;
+    }
+
+    ~IMLockFreeQueue()
+    {
+        T value;
+        while (dequeue(value)) {}
+        delete m_tail;
+    }
+
+    /**
+     * @brief enqueue 入队，可以在任意线程调用
+     * @param value 元素
+     */
+    void enqueue(const T &value)
+    {
+        Node *node = new Node;
+        node->value = value;
+        // 先把自己换成新的队头，再把前一个节点接到自己身上
+        Node *prev = m_head.fetchAndStoreOrdered(node);
+        prev->next.storeRelease(node);
+    }
+
+    /**
+     * @brief dequeue 出队，只能在消费者线程调用
+     * @param value 取出的元素
+     * @return 队列为空时返回false
+     */
+    bool dequeue(T &value)
+    {
+        Node *tail = m_tail;
+        Node *next = tail->next.loadAcquire();
+        if (next == nullptr)
+            return false;
+        // next成为新的哨兵，它的元素移交给调用者
+        value = next->value;
+        next->value = T();
+        m_tail = next;
+        delete tail;
+        return true;
+    }
+
+private:
+    Q_DISABLE_COPY(IMLockFreeQueue)
+
+    struct Node
+    {
+        Node() : next(nullptr) {}
+        QAtomicPointer<Node> next;
+        T value;
+    };
+
+    // 生产者一端，最后入队的节点
+    QAtomicPointer<Node> m_head;
+    // 消费者一端，哨兵节点
+    Node *m_tail;
+};
+
+#endif // IMLOCKFREEQUEUE_H
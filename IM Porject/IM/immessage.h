@@ -1,33 +1,60 @@
-#ifndef IMMESSAGE_H
-#define IMMESSAGE_H
-
-#include <QString>
-#include <QDateTime>
-
-struct IMMessage
-{
-    IMMessage(){}
-
-    IMMessage(QString fromName, QString content, QDateTime time)
-        : fromName(fromName),
-          content(content),
-          time(time) {}
-
-
-    /**
-     * @brief fromName 发送者
-     */
-    QString fromName;
-
-    /**
-     * @brief content 内容
-     */
-    QString content;
-
-    /**
-     * @brief time 时间
-     */
-    QDateTime time;
-};
-
-#endif // IMMESSAGE_H
+#ifndef IMMESSAGE_H
+#define IMMESSAGE_H
+
+#include <QString>
+#include <QDateTime>
+
+struct IMMessage
+{
+    IMMessage(){}
+
+    IMMessage(QString fromName, QString content, QDateTime time, qint64 id = 0)
+        : fromName(fromName),
+          content(content),
+          time(time),
+          id(id) {}
+
+
+    /**
+     * @brief fromName 发送者
+     */
+    QString fromName;
+
+    /**
+     * @brief content 内容
+     */
+    QString content;
+
+    /**
+     * @brief time 时间，有HLC时间的消息取它的物理部分，所有设备上都相同
+     */
+    QDateTime time;
+
+    /**
+     * @brief id 数据库中的消息编号，还没有写入数据库的消息为0
+     * 与time一起作为分页读取历史记录的位置
+     */
+    qint64 id = 0;
+
+    /**
+     * @brief seq 自己发出的消息的序号，服务端确认时带回，其他消息为0
+     */
+    quint64 seq = 0;
+
+    /**
+     * @brief pending 是否还在等待服务端确认
+     */
+    bool pending = false;
+
+    /**
+     * @brief msgId 服务端分配的消息编号，还没有确认的消息和升级之前的消息为0
+     */
+    quint64 msgId = 0;
+
+    /**
+     * @brief hlc 服务端分配的HLC时间，自己发出还没有确认的消息是本机的HLC时间
+     */
+    quint64 hlc = 0;
+};
+
+#endif // IMMESSAGE_H
@@ -0,0 +1,226 @@
+#include <QDateTime>
+#include <QCoreApplication>
+#include "imnetwork.h"
+#include "imcodec.h"
+
+// 环形缓冲区满时重试写入的最短与最长间隔（毫秒）
+static const int MinRingRetryInterval = 1;
+static const int MaxRingRetryInterval = 16;
+
+IMNetwork::IMNetwork(QObject *parent)
+    : QObject(parent),
+      m_socket(new QTcpSocket(this)),
+      m_localSocket(new QLocalSocket(this)),
+      m_device(m_socket),
+      m_useSharedMemory(false),
+      m_ring(nullptr),
+      m_ringTimer(new QTimer(this)),
+      m_open(0)
+{
+    connect(m_socket, &QTcpSocket::connected, this, &IMNetwork::onConnected);
+    connect(m_socket, &QTcpSocket::readyRead, this, &IMNetwork::readyRead);
+    connect(m_socket, &QTcpSocket::disconnected, this, &IMNetwork::disconnected);
+    connect(m_socket, &QTcpSocket::stateChanged, [this](QAbstractSocket::SocketState state){
+        if (this->m_device == this->m_socket)
+            this->m_open.storeRelease(state != QAbstractSocket::UnconnectedState);
+    });
+    connect(m_socket, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error),
+            [this](QAbstractSocket::SocketError socketError){
+        qDebug() << socketError;
+        emit connectError(this->m_socket->errorString());
+    });
+
+    connect(m_localSocket, &QLocalSocket::connected, this, &IMNetwork::onConnected);
+    connect(m_localSocket, &QLocalSocket::readyRead, this, &IMNetwork::readyRead);
+    connect(m_localSocket, &QLocalSocket::disconnected, this, &IMNetwork::disconnected);
+    connect(m_localSocket, &QLocalSocket::stateChanged, [this](QLocalSocket::LocalSocketState state){
+        if (this->m_device == this->m_localSocket)
+            this->m_open.storeRelease(state != QLocalSocket::UnconnectedState);
+    });
+    connect(m_localSocket, QOverload<QLocalSocket::LocalSocketError>::of(&QLocalSocket::error),
+            [this](QLocalSocket::LocalSocketError socketError){
+        qDebug() << socketError;
+        emit connectError(this->m_localSocket->errorString());
+    });
+    // 断开后环形缓冲区也不能再用了
+    connect(this, &IMNetwork::disconnected, this, &IMNetwork::closeRing);
+
+    // 环形缓冲区满时定时重试，服务端一直没读走数据时间隔逐次加倍
+    m_ringTimer->setInterval(MinRingRetryInterval);
+    connect(m_ringTimer, &QTimer::timeout, this, &IMNetwork::flushRing);
+}
+
+void IMNetwork::connectToServer(bool isLocal, bool useSharedMemory, QString target, quint16 port)
+{
+    this->close();
+    this->m_readBuffer.clear();
+    this->m_useSharedMemory = isLocal && useSharedMemory;
+    // 先标记为打开，连接结果出来之前发出的命令和原来一样交给套接字缓冲
+    this->m_open.storeRelease(1);
+    if (isLocal)
+    {
+        this->m_device = this->m_localSocket;
+        this->m_localSocket->connectToServer(target, QIODevice::ReadWrite);
+    }
+    else
+    {
+        this->m_device = this->m_socket;
+        this->m_socket->connectToHost(target, port, QTcpSocket::ReadWrite);
+    }
+}
+
+void IMNetwork::close()
+{
+    this->closeRing();
+    this->m_socket->abort();
+    this->m_localSocket->abort();
+    this->m_open.storeRelease(0);
+}
+
+void IMNetwork::onConnected()
+{
+    qDebug() << "connected";
+    this->m_readBuffer.clear();
+    if (this->m_device == this->m_localSocket && this->m_useSharedMemory)
+        this->openRing();
+    emit connected();
+}
+
+void IMNetwork::openRing()
+{
+    this->closeRing();
+    // key在本机唯一即可
+    QString key = QString("IM_%1_%2").arg(QCoreApplication::applicationPid()).arg(QDateTime::currentMSecsSinceEpoch());
+    IMSharedRing *ring = new IMSharedRing;
+    if (!ring->create(key, 4 * 1024 * 1024))
+    {
+        // 创建失败时继续使用本地套接字
+        qDebug() << "openRing: create shared memory failed" << key;
+        delete ring;
+        return;
+    }
+    // 这一帧必须走本地套接字，之后的帧都写入环形缓冲区
+    this->m_localSocket->write(IMCodec<IMSchema::AttachSharedMemory>::encodeFrame(key));
+    this->m_ring = ring;
+    qDebug() << "openRing:" << key;
+}
+
+void IMNetwork::closeRing()
+{
+    this->m_ringTimer->stop();
+    this->m_ringPending.clear();
+    delete this->m_ring;
+    this->m_ring = nullptr;
+}
+
+// 把排队的帧写入环形缓冲区
+void IMNetwork::flushRing()
+{
+    int written = 0;
+    while (this->m_ring != nullptr && !this->m_ringPending.isEmpty())
+    {
+        const QByteArray &frame = this->m_ringPending.head();
+        // 比整个环形缓冲区还大的帧（或者一批帧），等前面的数据都被读走后改走本地套接字，顺序不会乱
+        if (quint32(frame.size()) > this->m_ring->capacity())
+        {
+            if (!this->m_ring->isDrained())
+                break;
+            this->m_localSocket->write(frame);
+        }
+        else if (!this->m_ring->write(frame))
+        {
+            break;
+        }
+        this->m_ringPending.dequeue();
+        ++written;
+    }
+    if (this->m_ring == nullptr || this->m_ringPending.isEmpty())
+    {
+        this->m_ringTimer->stop();
+        return;
+    }
+    // 写进去一些时从最短间隔开始，一点都没写进去时间隔加倍，服务端卡住时不会空转
+    int interval = MinRingRetryInterval;
+    if (written == 0 && this->m_ringTimer->isActive())
+        interval = qMin(this->m_ringTimer->interval() * 2, MaxRingRetryInterval);
+    this->m_ringTimer->start(interval);
+}
+
+void IMNetwork::send(QByteArray payload)
+{
+    this->sendFrames(encodeFrame(payload));
+}
+
+void IMNetwork::sendFrames(QByteArray frames)
+{
+    if (!this->isOpen() || frames.isEmpty())
+        return;
+
+    if (this->m_ring != nullptr)
+    {
+        // 前面还有排队的数据时排在后面，保证顺序；一批帧整段写入，放不下时整段排队
+        if (this->m_ringPending.isEmpty() && quint32(frames.size()) <= this->m_ring->capacity() && this->m_ring->write(frames))
+            return;
+        this->m_ringPending.enqueue(frames);
+        this->flushRing();
+        return;
+    }
+    this->m_device->write(frames);
+}
+
+// 当接收到数据时触发
+void IMNetwork::readyRead()
+{
+    // 获取数据，追加到接收缓冲区中
+    this->m_readBuffer.append(this->m_device->readAll());
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    qint64 clock = traceClock();
+
+    // 一次可能收到多条命令，也可能只收到半条，取出所有完整的帧作为一批
+    QVector<IMCommand> commands;
+    int offset = 0;
+    int ret = 0;
+    QByteArray payload;
+    IMFrameTrace trace;
+    while ((ret = takeFrame(this->m_readBuffer, offset, payload, &trace)) > 0)
+    {
+        commands.append(parseCommand(payload, now));
+        // 只有打开了延迟跟踪时服务端才会发来带时间戳块的帧
+        if (trace.present)
+        {
+            trace.stamps[TraceReceiverDecode] = clock;
+            commands.last().trace = trace;
+        }
+    }
+
+    if (ret < 0)
+    {
+        qDebug() << "readyRead: invalid frame";
+        this->abort();
+    }
+    else
+    {
+        this->m_readBuffer.remove(0, offset);
+    }
+    // 非法数据之前的命令仍然是完整的，照常交出去
+    if (!commands.isEmpty())
+        emit commandsReceived(commands);
+}
+
+void IMNetwork::abort()
+{
+    this->m_readBuffer.clear();
+    if (this->m_device == this->m_localSocket)
+        this->m_localSocket->disconnectFromServer();
+    else
+        this->m_socket->disconnectFromHost();
+}
+
+IMCommand IMNetwork::parseCommand(const QByteArray &payload, qint64 receivedAt)
+{
+    IMCommand command;
+    command.receivedAt = receivedAt;
+    command.code = peekFunctionCode(payload);
+    command.payload = payload;
+    return command;
+}
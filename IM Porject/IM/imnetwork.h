@@ -0,0 +1,182 @@
+#ifndef IMNETWORK_H
+#define IMNETWORK_H
+
+#include <QObject>
+#include <QtNetwork>
+#include <QLocalSocket>
+#include <QQueue>
+#include <QVector>
+#include <QAtomicInt>
+#include "imsharedring.h"
+#include "protocol.h"
+
+/**
+ * @brief 一条拆好帧的服务端命令，参数由IMClient按命令的声明用IMCodec解码
+ */
+struct IMCommand
+{
+    /**
+     * @brief code 服务端功能码
+     */
+    int code = 0;
+
+    /**
+     * @brief payload 命令文本（不含帧头），包括功能码
+     */
+    QByteArray payload;
+
+    /**
+     * @brief receivedAt 收到这一帧的时间（毫秒时间戳）
+     */
+    qint64 receivedAt = 0;
+
+    /**
+     * @brief trace 帧中的时间戳，带着时间戳块时填上本机解出的时间（本机时钟）
+     */
+    IMFrameTrace trace;
+};
+
+Q_DECLARE_METATYPE(IMCommand)
+
+/***********************************
+ *
+ * Class IMNetwork
+ * 客户端的聊天连接，运行在单独的网络线程中
+ *
+ * 负责Tcp或本地套接字、共享内存环形缓冲区与拆帧，
+ * 收到的数据先追加到接收缓冲区，取出其中所有完整的帧，不够一帧的留到下次
+ * 一次读取解出的所有命令作为一批，通过一个跨线程信号交给IMClient，
+ * 界面线程不做网络读写，只按命令的声明直接在负载上解码，和服务端一样
+ *
+ * 其他线程只能通过排队调用槽函数来使用这个类，isOpen与markConnecting除外
+ *
+ **********************************/
+
+class IMNetwork : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit IMNetwork(QObject *parent = nullptr);
+
+    /**
+     * @brief isOpen 连接是否打开（包括正在连接），任何线程都可以调用
+     */
+    bool isOpen() const { return this->m_open.loadAcquire() != 0; }
+
+    /**
+     * @brief markConnecting 排队调用connectToServer之前标记为正在连接，任何线程都可以调用
+     */
+    void markConnecting() { this->m_open.storeRelease(1); }
+
+    /**
+     * @brief parseCommand 读出一条服务端命令的功能码，负载原样保留
+     * @param payload 命令文本（UTF-8）
+     * @param receivedAt 收到的时间
+     */
+    static IMCommand parseCommand(const QByteArray &payload, qint64 receivedAt);
+
+public slots:
+    /**
+     * @brief connectToServer 连接服务器
+     * @param isLocal 是否使用本地套接字
+     * @param useSharedMemory 本地连接上是否启用共享内存
+     * @param target Tcp连接时是主机名，本地连接时是服务名
+     * @param port Tcp端口
+     */
+    void connectToServer(bool isLocal, bool useSharedMemory, QString target, quint16 port);
+
+    /**
+     * @brief send 封装成帧后发送
+     * @param payload 命令文本（UTF-8）
+     */
+    void send(QByteArray payload);
+
+    /**
+     * @brief sendFrames 发送已经封装好的一批帧，一次写入
+     * @param frames 首尾相接的若干帧
+     */
+    void sendFrames(QByteArray frames);
+
+    /**
+     * @brief close 关闭连接与环形缓冲区
+     */
+    void close();
+
+signals:
+    /**
+     * @brief connected 连接成功信号
+     */
+    void connected();
+
+    /**
+     * @brief disconnected 连接断开信号
+     */
+    void disconnected();
+
+    /**
+     * @brief connectError 连接发生错误信号
+     * @param errorInfo 错误信息
+     */
+    void connectError(QString errorInfo);
+
+    /**
+     * @brief commandsReceived 一次读取解出的所有命令
+     * @param commands 按收到的顺序排列
+     */
+    void commandsReceived(QVector<IMCommand> commands);
+
+private slots:
+    /**
+     * @brief onConnected 连接成功时触发
+     */
+    void onConnected();
+
+    /**
+     * @brief readyRead 当接收到数据时触发
+     */
+    void readyRead();
+
+    /**
+     * @brief flushRing 把排队的帧写入共享内存环形缓冲区
+     */
+    void flushRing();
+
+private:
+    /**
+     * @brief openRing 创建共享内存环形缓冲区并通知服务端
+     */
+    void openRing();
+
+    /**
+     * @brief closeRing 关闭共享内存环形缓冲区
+     */
+    void closeRing();
+
+    /**
+     * @brief abort 收到非法数据时断开连接
+     */
+    void abort();
+
+private:
+    // Tcp连接
+    QTcpSocket *m_socket;
+    // 本地套接字
+    QLocalSocket *m_localSocket;
+    // 当前使用的连接，m_socket或者m_localSocket
+    QIODevice *m_device;
+    // 是否在本地连接上启用共享内存
+    bool m_useSharedMemory;
+    // 共享内存环形缓冲区，没有启用时为nullptr
+    IMSharedRing *m_ring;
+    // 环形缓冲区满时排队等待写入的帧，一批帧作为一段
+    QQueue<QByteArray> m_ringPending;
+    // 环形缓冲区满时定时重试写入，间隔在MinRingRetryInterval与MaxRingRetryInterval之间
+    QTimer *m_ringTimer;
+    // 接收缓冲区，保存还不够一帧的数据
+    QByteArray m_readBuffer;
+    // 连接状态，界面线程也会读取
+    QAtomicInt m_open;
+};
+
+#endif // IMNETWORK_H
@@ -0,0 +1,92 @@
+#include "impresencestore.h"
+
+IMPresenceStore::IMPresenceStore()
+    : m_onlineCount(0),
+      m_listsDirty(false)
+{
+}
+
+void IMPresenceStore::reset(const QVector<QString> &online, const QVector<QString> &known, const QString &selfName)
+{
+    this->m_contacts.clear();
+    this->m_index.clear();
+    this->m_onlineCount = 0;
+    this->m_contacts.reserve(online.size() + known.size());
+    this->m_index.reserve(online.size() + known.size());
+
+    for (const QString &name : online)
+        this->add(name, true);
+    // 已经在线的人和自己不再加入
+    for (const QString &name : known)
+        if (name != selfName && !this->m_index.contains(name))
+            this->add(name, false);
+    this->m_listsDirty = true;
+}
+
+void IMPresenceStore::add(const QString &name, bool online)
+{
+    auto it = this->m_index.constFind(name);
+    if (it != this->m_index.constEnd())
+    {
+        this->setOnline(name, online);
+        return;
+    }
+    this->m_index.insert(name, this->m_contacts.size());
+    this->m_contacts.append(Contact{name, online});
+    if (online)
+        ++this->m_onlineCount;
+}
+
+bool IMPresenceStore::setOnline(const QString &name, bool online)
+{
+    auto it = this->m_index.constFind(name);
+    if (it == this->m_index.constEnd())
+    {
+        this->add(name, online);
+        this->m_listsDirty = true;
+        return true;
+    }
+    Contact &contact = this->m_contacts[it.value()];
+    if (contact.online == online)
+        return false;
+    contact.online = online;
+    this->m_onlineCount += online ? 1 : -1;
+    this->m_listsDirty = true;
+    return true;
+}
+
+bool IMPresenceStore::isOnline(const QString &name) const
+{
+    int i = this->m_index.value(name, -1);
+    return i >= 0 && this->m_contacts.at(i).online;
+}
+
+const QVector<QString> &IMPresenceStore::onlineList() const
+{
+    if (this->m_listsDirty)
+        this->rebuildLists();
+    return this->m_onlineList;
+}
+
+const QVector<QString> &IMPresenceStore::offlineList() const
+{
+    if (this->m_listsDirty)
+        this->rebuildLists();
+    return this->m_offlineList;
+}
+
+void IMPresenceStore::rebuildLists() const
+{
+    this->m_onlineList.clear();
+    this->m_offlineList.clear();
+    this->m_onlineList.reserve(this->m_onlineCount);
+    this->m_offlineList.reserve(this->m_contacts.size() - this->m_onlineCount);
+    for (const Contact &contact : this->m_contacts)
+    {
+        if (contact.online)
+            this->m_onlineList.append(contact.name);
+        else
+            this->m_offlineList.append(contact.name);
+    }
+    this->m_listsDirty = false;
+}
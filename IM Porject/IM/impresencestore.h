@@ -0,0 +1,95 @@
+#ifndef IMPRESENCESTORE_H
+#define IMPRESENCESTORE_H
+
+#include <QString>
+#include <QVector>
+#include <QHash>
+
+/***********************************
+ *
+ * Class IMPresenceStore
+ * 好友的在线状态
+ *
+ * 每个人只保存一次，昵称到位置用哈希表查找，上下线只修改一个标志，与人数无关
+ * 人员按第一次出现的顺序排列，上下线不改变位置，所以显示顺序是稳定的
+ *
+ * onlineList、offlineList是给界面显示用的有序视图，
+ * 在线状态变化后只标记为过期，下一次读取时才重新生成，
+ * 一批上下线之后不管改了多少次都只生成一次
+ *
+ **********************************/
+
+class IMPresenceStore
+{
+public:
+    IMPresenceStore();
+
+    /**
+     * @brief reset 登录后重新设置所有人的在线状态
+     * @param online 当前在线的人
+     * @param known 有聊天记录的人，不在线的算作离线
+     * @param selfName 自己的昵称，不算作离线
+     */
+    void reset(const QVector<QString> &online, const QVector<QString> &known, const QString &selfName);
+
+    /**
+     * @brief setOnline 修改某人的在线状态，没见过的人追加到末尾
+     * @return 状态确实发生变化时返回true
+     */
+    bool setOnline(const QString &name, bool online);
+
+    /**
+     * @brief isOnline 是否在线
+     */
+    bool isOnline(const QString &name) const;
+
+    /**
+     * @brief contains 是否认识这个人
+     */
+    bool contains(const QString &name) const { return m_index.contains(name); }
+
+    /**
+     * @brief onlineCount 在线人数
+     */
+    int onlineCount() const { return m_onlineCount; }
+
+    /**
+     * @brief onlineList 按出现顺序排列的在线人员
+     */
+    const QVector<QString> &onlineList() const;
+
+    /**
+     * @brief offlineList 按出现顺序排列的离线人员
+     */
+    const QVector<QString> &offlineList() const;
+
+private:
+    /**
+     * @brief add 追加一个人，已经有了就只修改在线状态
+     */
+    void add(const QString &name, bool online);
+
+    /**
+     * @brief rebuildLists 重新生成有序视图
+     */
+    void rebuildLists() const;
+
+private:
+    struct Contact {
+        QString name;
+        bool online;
+    };
+
+    // 所有人，按第一次出现的顺序
+    QVector<Contact> m_contacts;
+    // 昵称到m_contacts中的下标
+    QHash<QString, int> m_index;
+    // 在线人数
+    int m_onlineCount;
+    // 有序视图与是否过期
+    mutable QVector<QString> m_onlineList;
+    mutable QVector<QString> m_offlineList;
+    mutable bool m_listsDirty;
+};
+
+#endif // IMPRESENCESTORE_H
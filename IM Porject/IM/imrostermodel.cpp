@@ -0,0 +1,166 @@
+#include "imrostermodel.h"
+
+IMRosterModel::IMRosterModel(QObject *parent)
+    : QAbstractListModel(parent),
+      m_timer(new QTimer(this)),
+      m_groupIcon(":icons/images/group.png"),
+      m_onlineIcon(":icons/images/userOnline.png"),
+      m_offlineIcon(":icons/images/userOffline.png")
+{
+    this->m_contacts.append(Contact{QString(), true, true});
+    this->m_sortKeys.push_back(this->m_collator.sortKey(QString()));
+    // 一帧之内的上下线合并成一次修改
+    this->m_timer->setSingleShot(true);
+    this->m_timer->setInterval(16);
+    connect(this->m_timer, &QTimer::timeout, this, &IMRosterModel::applyPresence);
+}
+
+void IMRosterModel::setContacts(const QVector<QString> &online, const QVector<QString> &offline)
+{
+    this->beginResetModel();
+    this->m_contacts.resize(1);
+    this->m_sortKeys.erase(this->m_sortKeys.begin() + 1, this->m_sortKeys.end());
+    this->m_rows.clear();
+    this->m_pending.clear();
+    this->m_contacts.reserve(1 + online.size() + offline.size());
+    this->m_sortKeys.reserve(1 + online.size() + offline.size());
+    this->m_rows.reserve(online.size() + offline.size());
+    for (const QString &name : online)
+    {
+        if (this->m_rows.contains(name))
+            continue;
+        this->m_rows.insert(name, this->m_contacts.size());
+        this->m_contacts.append(Contact{name, true, false});
+        this->m_sortKeys.push_back(this->m_collator.sortKey(name));
+    }
+    for (const QString &name : offline)
+    {
+        if (this->m_rows.contains(name))
+            continue;
+        this->m_rows.insert(name, this->m_contacts.size());
+        this->m_contacts.append(Contact{name, false, false});
+        this->m_sortKeys.push_back(this->m_collator.sortKey(name));
+    }
+    this->endResetModel();
+}
+
+void IMRosterModel::setPresence(QString name, bool online)
+{
+    this->m_pending.insert(name, online);
+    if (!this->m_timer->isActive())
+        this->m_timer->start();
+}
+
+QModelIndex IMRosterModel::indexOf(QString name) const
+{
+    int row = this->m_rows.value(name, -1);
+    return row < 0 ? QModelIndex() : this->index(row);
+}
+
+bool IMRosterModel::lessThan(int left, int right) const
+{
+    const Contact &leftContact = this->m_contacts.at(left);
+    const Contact &rightContact = this->m_contacts.at(right);
+    if (leftContact.isGroup != rightContact.isGroup)
+        return leftContact.isGroup;
+    if (leftContact.online != rightContact.online)
+        return leftContact.online;
+    return this->m_sortKeys[size_t(left)].compare(this->m_sortKeys[size_t(right)]) < 0;
+}
+
+void IMRosterModel::applyPresence()
+{
+    if (this->m_pending.isEmpty())
+        return;
+
+    // 已有的人只改这一行，新出现的人攒起来一次插入
+    // 在线状态都没有变、也没有新的人时顺序不变，不通知重新排序
+    bool changed = false;
+    QVector<Contact> added;
+    const QVector<int> roles{OnlineRole, Qt::DecorationRole};
+    for (auto it = this->m_pending.constBegin(); it != this->m_pending.constEnd(); ++it)
+    {
+        int row = this->m_rows.value(it.key(), -1);
+        if (row < 0)
+        {
+            added.append(Contact{it.key(), it.value(), false});
+            continue;
+        }
+        if (this->m_contacts.at(row).online == it.value())
+            continue;
+        this->m_contacts[row].online = it.value();
+        changed = true;
+        QModelIndex index = this->index(row);
+        emit dataChanged(index, index, roles);
+    }
+    this->m_pending.clear();
+
+    if (!added.isEmpty())
+    {
+        int first = this->m_contacts.size();
+        this->beginInsertRows(QModelIndex(), first, first + added.size() - 1);
+        for (const Contact &contact : added)
+        {
+            this->m_rows.insert(contact.name, this->m_contacts.size());
+            this->m_contacts.append(contact);
+            this->m_sortKeys.push_back(this->m_collator.sortKey(contact.name));
+        }
+        this->endInsertRows();
+        changed = true;
+    }
+
+    if (changed)
+        emit presenceApplied();
+}
+
+int IMRosterModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : this->m_contacts.size();
+}
+
+QVariant IMRosterModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= this->m_contacts.size())
+        return QVariant();
+    const Contact &contact = this->m_contacts.at(index.row());
+    switch (role) {
+    case Qt::DisplayRole:
+        return contact.isGroup ? QString("群聊") : contact.name;
+    case Qt::DecorationRole:
+        if (contact.isGroup)
+            return this->m_groupIcon;
+        return contact.online ? this->m_onlineIcon : this->m_offlineIcon;
+    case NameRole:
+        return contact.name;
+    case OnlineRole:
+        return contact.online;
+    case IsGroupRole:
+        return contact.isGroup;
+    default:
+        return QVariant();
+    }
+}
+
+IMRosterProxy::IMRosterProxy(QObject *parent)
+    : QSortFilterProxyModel(parent)
+{
+    // 上下线很频繁，不让每一行的修改都触发重新排序
+    this->setDynamicSortFilter(false);
+    this->setFilterRole(IMRosterModel::NameRole);
+    this->setFilterCaseSensitivity(Qt::CaseInsensitive);
+}
+
+bool IMRosterProxy::lessThan(const QModelIndex &left, const QModelIndex &right) const
+{
+    // 排序键在模型中已经算好，按行号直接比较，每次比较不再构造QVariant
+    const IMRosterModel *model = static_cast<const IMRosterModel *>(this->sourceModel());
+    return model->lessThan(left.row(), right.row());
+}
+
+bool IMRosterProxy::filterAcceptsRow(int sourceRow, const QModelIndex &sourceParent) const
+{
+    QModelIndex index = this->sourceModel()->index(sourceRow, 0, sourceParent);
+    if (index.data(IMRosterModel::IsGroupRole).toBool())
+        return true;
+    return QSortFilterProxyModel::filterAcceptsRow(sourceRow, sourceParent);
+}
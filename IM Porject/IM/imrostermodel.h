@@ -0,0 +1,143 @@
+#ifndef IMROSTERMODEL_H
+#define IMROSTERMODEL_H
+
+#include <QAbstractListModel>
+#include <QSortFilterProxyModel>
+#include <QVector>
+#include <QHash>
+#include <QIcon>
+#include <QTimer>
+#include <QCollator>
+#include <vector>
+
+/***********************************
+ *
+ * Class IMRosterModel
+ * 好友列表模型，第一行固定是群聊
+ *
+ * 上下线只修改对应的一行：已有的人改在线状态，没见过的人追加到末尾，
+ * 行号一旦分配就不再变化，昵称到行号用哈希表查找，与好友数量无关
+ * 排序和过滤交给IMRosterProxy，这里的行顺序就是第一次出现的顺序
+ *
+ * 一帧之内收到的上下线先记下来，定时器到了再一次性应用，
+ * 有人的在线状态变了或者新增了人时发出presenceApplied，视图只重新排序和绘制一次
+ * 昵称的排序键在加入时用QCollator算好，排序时直接比较，不再经过data()与localeAwareCompare
+ *
+ **********************************/
+
+class IMRosterModel : public QAbstractListModel
+{
+    Q_OBJECT
+
+public:
+    /**
+     * @brief 自定义的数据角色
+     */
+    enum Roles {
+        // 昵称，群聊为空
+        NameRole = Qt::UserRole + 1,
+        // 是否在线
+        OnlineRole,
+        // 是否是群聊
+        IsGroupRole
+    };
+
+    explicit IMRosterModel(QObject *parent = nullptr);
+
+    /**
+     * @brief setContacts 重新设置整个列表，只在登录后调用一次
+     * @param online 在线的人
+     * @param offline 离线的人
+     */
+    void setContacts(const QVector<QString> &online, const QVector<QString> &offline);
+
+    /**
+     * @brief setPresence 记下某人的上下线，下一帧统一应用
+     * @param name 昵称
+     * @param online 是否在线
+     */
+    void setPresence(QString name, bool online);
+
+    /**
+     * @brief indexOf 某人所在的行
+     * @return 不在列表中时返回无效的索引
+     */
+    QModelIndex indexOf(QString name) const;
+
+    /**
+     * @brief groupIndex 群聊所在的行
+     */
+    QModelIndex groupIndex() const { return this->index(0); }
+
+    /**
+     * @brief lessThan 两行的先后：群聊在最前，然后在线的在前，同一组内按昵称的排序键
+     * @param left 左边的行号
+     * @param right 右边的行号
+     */
+    bool lessThan(int left, int right) const;
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+
+signals:
+    /**
+     * @brief presenceApplied 一批上下线应用完毕，并且有人的在线状态变了或者新增了人，排序需要更新
+     */
+    void presenceApplied();
+
+private slots:
+    /**
+     * @brief applyPresence 应用这一帧内记下的所有上下线
+     */
+    void applyPresence();
+
+private:
+    struct Contact {
+        QString name;
+        bool online;
+        bool isGroup;
+    };
+
+    // 所有行，第0行是群聊
+    QVector<Contact> m_contacts;
+    // 每一行昵称的排序键，与m_contacts一一对应，QCollatorSortKey没有默认构造函数，不能放进QVector
+    std::vector<QCollatorSortKey> m_sortKeys;
+    // 计算排序键，使用当前的语言环境
+    QCollator m_collator;
+    // 昵称到行号
+    QHash<QString, int> m_rows;
+    // 还没有应用的上下线，同一个人只保留最后一次
+    QHash<QString, bool> m_pending;
+    // 合并上下线的定时器
+    QTimer *m_timer;
+    // 图标只加载一次
+    QIcon m_groupIcon;
+    QIcon m_onlineIcon;
+    QIcon m_offlineIcon;
+};
+
+/***********************************
+ *
+ * Class IMRosterProxy
+ * 好友列表的排序与过滤
+ *
+ * 群聊永远在最前面，然后在线的在前、离线的在后，同一组内按昵称排序
+ * 过滤只匹配昵称，群聊总是显示
+ * 不开启动态排序，由使用者在一批修改之后调用一次sort
+ * 源模型必须是IMRosterModel，比较直接使用它算好的排序键
+ *
+ **********************************/
+
+class IMRosterProxy : public QSortFilterProxyModel
+{
+    Q_OBJECT
+
+public:
+    explicit IMRosterProxy(QObject *parent = nullptr);
+
+protected:
+    bool lessThan(const QModelIndex &left, const QModelIndex &right) const override;
+    bool filterAcceptsRow(int sourceRow, const QModelIndex &sourceParent) const override;
+};
+
+#endif // IMROSTERMODEL_H
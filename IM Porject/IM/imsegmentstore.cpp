@@ -0,0 +1,416 @@
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QDataStream>
+#include <QDateTime>
+#include <QSet>
+#include <QMutexLocker>
+#include <QDebug>
+#include <algorithm>
+#include "imsegmentstore.h"
+
+// 段文件的魔数与版本
+static const quint32 SegmentMagic = 0x494D5347;
+static const quint32 SegmentVersion = 2;
+// 块缓存的大小
+static const int BlockCacheSize = 8;
+
+// (time, id) 的比较
+static inline bool keyLess(qint64 time1, qint64 id1, qint64 time2, qint64 id2)
+{
+    return time1 < time2 || (time1 == time2 && id1 < id2);
+}
+
+IMSegmentStore::IMSegmentStore(QString directory)
+    : m_directory(directory)
+{
+    QDir dir(directory);
+    if (!dir.exists() && !QDir().mkpath(directory))
+        qDebug() << "IMSegmentStore: cannot create" << directory;
+
+    // 只读入每个文件末尾的索引，上次写到一半的临时文件直接删掉
+    for (const QFileInfo &info : dir.entryInfoList(QStringList() << "*.seg.tmp", QDir::Files))
+        QFile::remove(info.filePath());
+    for (const QFileInfo &info : dir.entryInfoList(QStringList() << "*.seg", QDir::Files))
+    {
+        Segment segment;
+        if (loadSegment(info.filePath(), segment))
+            this->addSegment(segment);
+        else
+            qDebug() << "IMSegmentStore: bad segment" << info.filePath();
+    }
+    qDebug() << "IMSegmentStore:" << this->m_segments.size() << "segments in" << directory;
+}
+
+bool IMSegmentStore::loadSegment(const QString &path, Segment &segment)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+    QDataStream in(&file);
+    in.setVersion(QDataStream::Qt_5_0);
+    quint32 magic = 0, version = 0;
+    quint64 indexOffset = 0;
+    in >> magic >> version >> indexOffset;
+    if (magic != SegmentMagic || version < 1 || version > SegmentVersion || indexOffset >= quint64(file.size()) || !file.seek(qint64(indexOffset)))
+        return false;
+
+    quint32 count = 0;
+    in >> count;
+    segment.path = path;
+    segment.version = version;
+    segment.blocks.clear();
+    segment.blocks.reserve(int(qMin<quint32>(count, 65536)));
+    for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; ++i)
+    {
+        Block block;
+        in >> block.firstTime >> block.firstId >> block.lastTime >> block.lastId
+           >> block.count >> block.offset >> block.size >> block.hasGroup >> block.peers;
+        segment.blocks.append(block);
+    }
+    if (in.status() != QDataStream::Ok || segment.blocks.isEmpty())
+        return false;
+    segment.firstTime = segment.blocks.first().firstTime;
+    segment.lastTime = segment.blocks.last().lastTime;
+    return true;
+}
+
+void IMSegmentStore::addSegment(const Segment &segment)
+{
+    // 上次移出后没来得及删除的消息会重新写成同名的段，替换掉旧的
+    for (int i = 0; i < this->m_segments.size(); ++i)
+    {
+        if (this->m_segments.at(i).path == segment.path)
+        {
+            this->m_segments.remove(i);
+            break;
+        }
+    }
+    auto it = std::upper_bound(this->m_segments.begin(), this->m_segments.end(), segment,
+                               [](const Segment &a, const Segment &b) { return a.firstTime < b.firstTime; });
+    this->m_segments.insert(it, segment);
+}
+
+bool IMSegmentStore::writeSegment(const QVector<IMSegmentMessage> &messages)
+{
+    if (messages.isEmpty())
+        return true;
+
+    // 按月份和第一条消息的编号命名，同一个月可以有多个段
+    const IMSegmentMessage &first = messages.first();
+    QString name = QString("%1_%2.seg").arg(QDateTime::fromMSecsSinceEpoch(first.time).toString("yyyyMM")).arg(first.id);
+    QString path = QDir(this->m_directory).filePath(name);
+    QFile file(path + ".tmp");
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        qDebug() << "IMSegmentStore:" << file.errorString();
+        return false;
+    }
+    QDataStream out(&file);
+    out.setVersion(QDataStream::Qt_5_0);
+    // 索引的偏移最后再回来填
+    out << SegmentMagic << SegmentVersion << quint64(0);
+
+    Segment segment;
+    segment.path = path;
+    segment.version = SegmentVersion;
+    for (int begin = 0; begin < messages.size(); begin += BlockSize)
+    {
+        int end = qMin(messages.size(), begin + BlockSize);
+        QByteArray raw;
+        QDataStream block(&raw, QIODevice::WriteOnly);
+        block.setVersion(QDataStream::Qt_5_0);
+        block << quint32(end - begin);
+        Block index;
+        index.hasGroup = false;
+        QSet<QString> peers;
+        for (int i = begin; i < end; ++i)
+        {
+            const IMSegmentMessage &msg = messages.at(i);
+            block << msg.id << msg.time << msg.user << msg.io << msg.content << msg.msgId << msg.hlc;
+            if (msg.io == "g")
+                index.hasGroup = true;
+            else
+                peers.insert(msg.user);
+        }
+        QByteArray compressed = qCompress(raw);
+        index.firstTime = messages.at(begin).time;
+        index.firstId = messages.at(begin).id;
+        index.lastTime = messages.at(end - 1).time;
+        index.lastId = messages.at(end - 1).id;
+        index.count = quint32(end - begin);
+        index.offset = quint64(file.pos());
+        index.size = quint32(compressed.size());
+        index.peers = peers.values();
+        out.writeRawData(compressed.constData(), compressed.size());
+        segment.blocks.append(index);
+    }
+
+    quint64 indexOffset = quint64(file.pos());
+    out << quint32(segment.blocks.size());
+    for (const Block &block : segment.blocks)
+        out << block.firstTime << block.firstId << block.lastTime << block.lastId
+            << block.count << block.offset << block.size << block.hasGroup << block.peers;
+    file.seek(8);
+    out << indexOffset;
+    bool ok = out.status() == QDataStream::Ok && file.flush();
+    file.close();
+    // 写完再改名，读的一方只会看到完整的段文件
+    if (!ok || (QFile::exists(path) && !QFile::remove(path)) || !QFile::rename(path + ".tmp", path))
+    {
+        qDebug() << "IMSegmentStore: write failed" << path;
+        QFile::remove(path + ".tmp");
+        return false;
+    }
+
+    segment.firstTime = segment.blocks.first().firstTime;
+    segment.lastTime = segment.blocks.last().lastTime;
+    QMutexLocker locker(&this->m_mutex);
+    this->m_blockCache.clear();
+    this->addSegment(segment);
+    return true;
+}
+
+QVector<IMSegmentMessage> IMSegmentStore::readBlock(const Segment &segment, const Block &block)
+{
+    QVector<IMSegmentMessage> messages;
+    QFile file(segment.path);
+    if (!file.open(QIODevice::ReadOnly) || !file.seek(qint64(block.offset)))
+        return messages;
+    QByteArray raw = qUncompress(file.read(block.size));
+    QDataStream in(raw);
+    in.setVersion(QDataStream::Qt_5_0);
+    quint32 count = 0;
+    in >> count;
+    messages.reserve(int(qMin<quint32>(count, quint32(BlockSize))));
+    for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; ++i)
+    {
+        IMSegmentMessage msg;
+        in >> msg.id >> msg.time >> msg.user >> msg.io >> msg.content;
+        if (segment.version >= 2)
+            in >> msg.msgId >> msg.hlc;
+        messages.append(msg);
+    }
+    return messages;
+}
+
+QVector<IMSegmentMessage> IMSegmentStore::decodeBlock(const Segment &segment, int block) const
+{
+    QString key = QString("%1#%2").arg(segment.path).arg(block);
+    for (int i = 0; i < this->m_blockCache.size(); ++i)
+    {
+        if (this->m_blockCache.at(i).key != key)
+            continue;
+        // 命中的挪到最后，缓存满时淘汰最前面的
+        CachedBlock hit = this->m_blockCache.takeAt(i);
+        this->m_blockCache.append(hit);
+        return hit.messages;
+    }
+
+    QVector<IMSegmentMessage> messages = readBlock(segment, segment.blocks.at(block));
+    if (this->m_blockCache.size() >= BlockCacheSize)
+        this->m_blockCache.removeFirst();
+    this->m_blockCache.append(CachedBlock{key, messages});
+    return messages;
+}
+
+QVector<IMSegmentMessage> IMSegmentStore::read(const QString &user, bool isGroup, int limit,
+                                               qint64 beforeTime, qint64 beforeId, qint64 afterTime, qint64 afterId) const
+{
+    QVector<IMSegmentMessage> results;
+    QMutexLocker locker(&this->m_mutex);
+
+    // 块按时间范围和私聊对象过滤
+    auto blockMatches = [&](const Block &block) {
+        if (beforeTime >= 0 && !keyLess(block.firstTime, block.firstId, beforeTime, beforeId))
+            return false;
+        return isGroup ? block.hasGroup : block.peers.contains(user);
+    };
+    // 找到段中下一个（更早的）相关的块，没有了时为-1；比after还早的块之前的块也都更早
+    auto nextBlock = [&](Cursor &cursor) {
+        const Segment &segment = this->m_segments.at(cursor.segment);
+        while (--cursor.block >= 0)
+        {
+            const Block &block = segment.blocks.at(cursor.block);
+            if (afterTime >= 0 && keyLess(block.lastTime, block.lastId, afterTime, afterId))
+            {
+                cursor.block = -1;
+                break;
+            }
+            if (blockMatches(block))
+                break;
+        }
+    };
+
+    // 每个段一个从晚到早的游标
+    QVector<Cursor> cursors;
+    for (int s = 0; s < this->m_segments.size(); ++s)
+    {
+        const Segment &segment = this->m_segments.at(s);
+        if (beforeTime >= 0 && segment.firstTime > beforeTime)
+            continue;
+        if (afterTime >= 0 && segment.lastTime < afterTime)
+            continue;
+        Cursor cursor;
+        cursor.segment = s;
+        cursor.block = segment.blocks.size();
+        nextBlock(cursor);
+        if (cursor.block >= 0)
+            cursors.append(cursor);
+    }
+
+    // 段之间可能重叠，按 (time, id) 多路归并：游标的头是已经解出的下一条消息，没有时是下一块最后一条的 (time, id)，
+    // 它是这一块的上界；头最大的是一块时先解压它，是一条消息时它比其他所有游标剩下的都晚，输出
+    for (;;)
+    {
+        int best = -1;
+        bool bestIsBlock = false;
+        qint64 bestTime = 0, bestId = 0;
+        for (int c = 0; c < cursors.size(); ++c)
+        {
+            const Cursor &cursor = cursors.at(c);
+            bool isBlock = cursor.next >= cursor.messages.size();
+            if (isBlock && cursor.block < 0)
+                continue;
+            const Block &block = this->m_segments.at(cursor.segment).blocks.at(qMax(0, cursor.block));
+            qint64 time = isBlock ? block.lastTime : cursor.messages.at(cursor.next).time;
+            qint64 id = isBlock ? block.lastId : cursor.messages.at(cursor.next).id;
+            // 相同时先解压块，块中可能有相同 (time, id) 的消息
+            if (best < 0 || keyLess(bestTime, bestId, time, id)
+                    || (isBlock && !bestIsBlock && time == bestTime && id == bestId))
+            {
+                best = c;
+                bestIsBlock = isBlock;
+                bestTime = time;
+                bestId = id;
+            }
+        }
+        if (best < 0)
+            break;
+
+        Cursor &cursor = cursors[best];
+        if (bestIsBlock)
+        {
+            const QVector<IMSegmentMessage> messages = this->decodeBlock(this->m_segments.at(cursor.segment), cursor.block);
+            cursor.messages.clear();
+            cursor.next = 0;
+            for (int i = messages.size() - 1; i >= 0; --i)
+            {
+                const IMSegmentMessage &msg = messages.at(i);
+                if (isGroup ? msg.io != "g" : (msg.io == "g" || msg.user != user))
+                    continue;
+                if (beforeTime >= 0 && !keyLess(msg.time, msg.id, beforeTime, beforeId))
+                    continue;
+                if (afterTime >= 0 && keyLess(msg.time, msg.id, afterTime, afterId))
+                    continue;
+                cursor.messages.append(msg);
+            }
+            nextBlock(cursor);
+            continue;
+        }
+        results.append(cursor.messages.at(cursor.next++));
+        if (limit >= 0 && results.size() >= limit)
+            break;
+    }
+    return results;
+}
+
+QVector<IMSegmentMessage> IMSegmentStore::search(const QString &text, const QString &user, qint64 from, qint64 to, int limit) const
+{
+    QVector<IMSegmentMessage> results;
+    QMutexLocker locker(&this->m_mutex);
+    for (int s = this->m_segments.size() - 1; s >= 0 && results.size() < limit; --s)
+    {
+        const Segment &segment = this->m_segments.at(s);
+        if ((to >= 0 && segment.firstTime > to) || (from >= 0 && segment.lastTime < from))
+            continue;
+        for (int b = segment.blocks.size() - 1; b >= 0 && results.size() < limit; --b)
+        {
+            const Block &block = segment.blocks.at(b);
+            if ((to >= 0 && block.firstTime > to) || (from >= 0 && block.lastTime < from))
+                continue;
+            if (!user.isEmpty() && !block.hasGroup && !block.peers.contains(user))
+                continue;
+
+            const QVector<IMSegmentMessage> messages = this->decodeBlock(segment, b);
+            for (int i = messages.size() - 1; i >= 0 && results.size() < limit; --i)
+            {
+                const IMSegmentMessage &msg = messages.at(i);
+                if ((to >= 0 && msg.time > to) || (from >= 0 && msg.time < from))
+                    continue;
+                if (!user.isEmpty() && msg.user != user)
+                    continue;
+                if (msg.content.contains(text, Qt::CaseInsensitive))
+                    results.append(msg);
+            }
+        }
+    }
+    return results;
+}
+
+bool IMSegmentStore::scan(const std::function<bool(const IMSegmentMessage &)> &visit) const
+{
+    QMutexLocker locker(&this->m_mutex);
+    // 和read一样在段之间归并，只是从早到晚：块的下界是第一条的 (time, id)，每个段最多解出一块
+    QVector<Cursor> cursors;
+    for (int s = 0; s < this->m_segments.size(); ++s)
+    {
+        Cursor cursor;
+        cursor.segment = s;
+        cursor.block = 0;
+        cursors.append(cursor);
+    }
+    for (;;)
+    {
+        int best = -1;
+        bool bestIsBlock = false;
+        qint64 bestTime = 0, bestId = 0;
+        for (int c = 0; c < cursors.size(); ++c)
+        {
+            const Cursor &cursor = cursors.at(c);
+            const QVector<Block> &blocks = this->m_segments.at(cursor.segment).blocks;
+            bool isBlock = cursor.next >= cursor.messages.size();
+            if (isBlock && cursor.block >= blocks.size())
+                continue;
+            qint64 time = isBlock ? blocks.at(cursor.block).firstTime : cursor.messages.at(cursor.next).time;
+            qint64 id = isBlock ? blocks.at(cursor.block).firstId : cursor.messages.at(cursor.next).id;
+            if (best < 0 || keyLess(time, id, bestTime, bestId)
+                    || (isBlock && !bestIsBlock && time == bestTime && id == bestId))
+            {
+                best = c;
+                bestIsBlock = isBlock;
+                bestTime = time;
+                bestId = id;
+            }
+        }
+        if (best < 0)
+            return true;
+
+        Cursor &cursor = cursors[best];
+        if (bestIsBlock)
+        {
+            // 不经过块缓存，导出时每块只读一次
+            const Segment &segment = this->m_segments.at(cursor.segment);
+            cursor.messages = readBlock(segment, segment.blocks.at(cursor.block++));
+            cursor.next = 0;
+            continue;
+        }
+        if (!visit(cursor.messages.at(cursor.next++)))
+            return false;
+    }
+}
+
+int IMSegmentStore::segmentCount() const
+{
+    QMutexLocker locker(&this->m_mutex);
+    return this->m_segments.size();
+}
+
+qint64 IMSegmentStore::lastTime() const
+{
+    QMutexLocker locker(&this->m_mutex);
+    qint64 last = -1;
+    for (const Segment &segment : this->m_segments)
+        last = qMax(last, segment.lastTime);
+    return last;
+}
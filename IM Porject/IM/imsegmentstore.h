@@ -0,0 +1,206 @@
+#ifndef IMSEGMENTSTORE_H
+#define IMSEGMENTSTORE_H
+
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QByteArray>
+#include <QMutex>
+#include <functional>
+
+/**
+ * @brief 冷存储中的一条消息，字段与message表相同
+ */
+struct IMSegmentMessage
+{
+    /**
+     * @brief id 原来在数据库中的消息编号
+     */
+    qint64 id = 0;
+
+    /**
+     * @brief time 毫秒时间戳
+     */
+    qint64 time = 0;
+
+    /**
+     * @brief user fromID对应的用户昵称，私聊是对方，群聊是发送者
+     */
+    QString user;
+
+    /**
+     * @brief io i收到消息 o发出消息 g群聊消息
+     */
+    QString io;
+
+    /**
+     * @brief content 内容
+     */
+    QString content;
+
+    /**
+     * @brief msgId 服务端分配的消息编号，0表示没有
+     */
+    quint64 msgId = 0;
+
+    /**
+     * @brief hlc HLC时间
+     */
+    quint64 hlc = 0;
+};
+
+/***********************************
+ *
+ * Class IMSegmentStore
+ * 历史消息的冷存储
+ *
+ * 超过保留期的消息由数据库写线程按月从数据库中移出，写成压缩的只读段文件，
+ * 每个段文件只包含一个月中的一段消息，按 (time, id) 排列，写好之后不再修改
+ * 段之间的时间范围可能重叠：导入的旧记录可能在更晚的月份已经移出之后才移出，
+ * 所以read与scan不按段的顺序一段一段地读，而是每段一个游标，按 (time, id) 多路归并
+ *
+ * 段文件格式（QDataStream，大端序）：
+ * [魔数 'IMSG'][版本][索引的偏移]
+ * [块][块]...      每块最多BlockSize条消息，序列化后用qCompress压缩
+ *                  版本2的每条消息在内容后面多了消息编号与HLC时间，版本1的段文件仍然可以读
+ * [索引]          每块一项：第一条与最后一条的 (time, id)、条数、偏移、长度、是否有群聊、私聊对象列表
+ *
+ * 打开时只读入每个段文件末尾的稀疏索引，读取时按时间与私聊对象跳过不相关的块，
+ * 只解压需要的块，最近解压的几块留在缓存中，往上翻页时不用重复解压
+ *
+ * 写线程调用writeSegment，界面线程调用read与search，段列表与块缓存由互斥锁保护
+ *
+ **********************************/
+
+class IMSegmentStore
+{
+public:
+    /**
+     * @brief IMSegmentStore 打开目录中所有的段文件，目录不存在时创建
+     * @param directory 段文件所在的目录
+     */
+    explicit IMSegmentStore(QString directory);
+    Q_DISABLE_COPY(IMSegmentStore)
+
+    /**
+     * @brief writeSegment 把一段消息写成新的段文件，先写临时文件再改名，写到一半不会留下坏文件
+     * @param messages 同一个月中的消息，按 (time, id) 从早到晚排列
+     * @return 是否成功
+     */
+    bool writeSegment(const QVector<IMSegmentMessage> &messages);
+
+    /**
+     * @brief read 分页读取一个会话的消息，与IMDAL::getPrivateMessage的分页方式相同
+     * @param user 私聊的对方昵称，群聊时忽略
+     * @param isGroup 是否是群聊
+     * @param limit 最多取多少条，小于0表示不限制
+     * @param before 只取 (time, id) 在这之前的消息，beforeTime小于0表示不限制
+     * @param after 只取 (time, id) 在这之后（包括）的消息，afterTime小于0表示不限制
+     * @return 按时间从晚到早排列
+     */
+    QVector<IMSegmentMessage> read(const QString &user, bool isGroup, int limit,
+                                   qint64 beforeTime, qint64 beforeId, qint64 afterTime, qint64 afterId) const;
+
+    /**
+     * @brief search 在冷存储中查找包含text的消息
+     * @param text 要查找的文字，不区分大小写
+     * @param user 只查找这个用户的消息（与他的私聊以及他发的群聊），为空表示不限制
+     * @param from 开始时间，小于0表示不限制
+     * @param to 结束时间，小于0表示不限制
+     * @param limit 最多返回多少条
+     * @return 按时间从晚到早排列
+     */
+    QVector<IMSegmentMessage> search(const QString &text, const QString &user, qint64 from, qint64 to, int limit) const;
+
+    /**
+     * @brief scan 按 (time, id) 从早到晚遍历所有消息，导出时使用
+     * 每个段最多解压着一块，不经过块缓存，内存占用与消息总数无关
+     * @param visit 对每条消息调用，返回false时停止
+     * @return 是否遍历完
+     */
+    bool scan(const std::function<bool(const IMSegmentMessage &)> &visit) const;
+
+    /**
+     * @brief segmentCount 段文件的个数
+     */
+    int segmentCount() const;
+
+    /**
+     * @brief lastTime 冷存储中最晚的一条消息的时间，没有消息时为-1
+     * 数据库中比它还早的消息（导入的旧记录）要和冷存储合并着读
+     */
+    qint64 lastTime() const;
+
+    /**
+     * @brief BlockSize 每块最多的消息条数
+     */
+    static const int BlockSize = 256;
+
+private:
+    struct Block {
+        qint64 firstTime;
+        qint64 firstId;
+        qint64 lastTime;
+        qint64 lastId;
+        quint32 count;
+        quint64 offset;
+        quint32 size;
+        bool hasGroup;
+        QStringList peers;
+    };
+
+    struct Segment {
+        QString path;
+        quint32 version;
+        qint64 firstTime;
+        qint64 lastTime;
+        QVector<Block> blocks;
+    };
+
+    // 多路归并时一个段上的游标
+    struct Cursor {
+        int segment = 0;
+        // 下一个要解压的块，read中从晚到早，-1表示读完，scan中从早到晚
+        int block = 0;
+        // 已经解出、还没输出的消息
+        QVector<IMSegmentMessage> messages;
+        int next = 0;
+    };
+
+    /**
+     * @brief loadSegment 读入段文件的索引
+     * @return 文件损坏时返回false
+     */
+    static bool loadSegment(const QString &path, Segment &segment);
+
+    /**
+     * @brief addSegment 按时间顺序插入段列表，调用方持有锁
+     */
+    void addSegment(const Segment &segment);
+
+    /**
+     * @brief readBlock 从文件中读出一块并解压解码
+     */
+    static QVector<IMSegmentMessage> readBlock(const Segment &segment, const Block &block);
+
+    /**
+     * @brief decodeBlock 解压并解码一块，先查缓存，调用方持有锁
+     */
+    QVector<IMSegmentMessage> decodeBlock(const Segment &segment, int block) const;
+
+private:
+    // 段文件所在的目录
+    QString m_directory;
+    // 所有段，按第一条消息的时间从早到晚排列
+    QVector<Segment> m_segments;
+    // 最近解压的块，key是 路径#块号
+    struct CachedBlock {
+        QString key;
+        QVector<IMSegmentMessage> messages;
+    };
+    mutable QVector<CachedBlock> m_blockCache;
+    // 保护段列表与块缓存
+    mutable QMutex m_mutex;
+};
+
+#endif // IMSEGMENTSTORE_H
@@ -0,0 +1,63 @@
+#include <QDebug>
+#include <QMutexLocker>
+#include <algorithm>
+#include "imstartuptrace.h"
+
+IMStartupTrace &IMStartupTrace::instance()
+{
+    static IMStartupTrace trace;
+    return trace;
+}
+
+void IMStartupTrace::start()
+{
+    IMStartupTrace &trace = instance();
+    QMutexLocker locker(&trace.m_mutex);
+    trace.m_timer.start();
+    trace.m_lastMark = 0;
+    trace.m_phases.clear();
+    trace.m_finished = false;
+}
+
+qint64 IMStartupTrace::now()
+{
+    IMStartupTrace &trace = instance();
+    return trace.m_timer.isValid() ? trace.m_timer.elapsed() : 0;
+}
+
+void IMStartupTrace::mark(const char *phase)
+{
+    IMStartupTrace &trace = instance();
+    qint64 begin = trace.m_lastMark;
+    trace.m_lastMark = now();
+    record(phase, begin);
+}
+
+void IMStartupTrace::record(const char *phase, qint64 begin)
+{
+    IMStartupTrace &trace = instance();
+    qint64 end = now();
+    QMutexLocker locker(&trace.m_mutex);
+    if (trace.m_finished)
+        return;
+    trace.m_phases.append(Phase{QByteArray(phase), begin, end});
+    qDebug().nospace() << "startup: " << phase << " " << end - begin << "ms (at " << end << "ms)";
+}
+
+void IMStartupTrace::finish()
+{
+    IMStartupTrace &trace = instance();
+    qint64 total = now();
+    QMutexLocker locker(&trace.m_mutex);
+    if (trace.m_finished)
+        return;
+    trace.m_finished = true;
+
+    // 后台阶段和界面阶段是交错的，按开始时间排好再打印
+    std::stable_sort(trace.m_phases.begin(), trace.m_phases.end(),
+                     [](const Phase &a, const Phase &b) { return a.begin < b.begin; });
+    qDebug().nospace() << "startup finished in " << total << "ms";
+    for (const Phase &phase : trace.m_phases)
+        qDebug().nospace() << "  " << phase.begin << "-" << phase.end << "ms  "
+                           << phase.name.constData() << " " << phase.end - phase.begin << "ms";
+}
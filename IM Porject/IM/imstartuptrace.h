@@ -0,0 +1,75 @@
+#ifndef IMSTARTUPTRACE_H
+#define IMSTARTUPTRACE_H
+
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QVector>
+#include <QByteArray>
+
+/***********************************
+ *
+ * Class IMStartupTrace
+ * 启动过程的耗时记录
+ *
+ * 从main开始计时，每个阶段记下开始与结束的时间（毫秒），阶段结束时立即打印一行
+ * mark     界面线程上顺序执行的阶段，从上一次mark到现在
+ * record   自己记下开始时间的阶段，可以在任意线程调用，后台线程的阶段用它记录
+ * finish   启动完成，按开始时间打印所有阶段的汇总，之后的记录都忽略
+ *
+ * 等待用户输入用户名的时间也会算在登录阶段里，看汇总时要扣掉
+ *
+ **********************************/
+
+class IMStartupTrace
+{
+public:
+    /**
+     * @brief start 开始计时，main的第一行调用
+     */
+    static void start();
+
+    /**
+     * @brief now 从开始计时到现在的毫秒数
+     */
+    static qint64 now();
+
+    /**
+     * @brief mark 记录界面线程上一个顺序执行的阶段，从上一次mark到现在
+     * @param phase 阶段名称
+     */
+    static void mark(const char *phase);
+
+    /**
+     * @brief record 记录一个阶段，任意线程都可以调用
+     * @param phase 阶段名称
+     * @param begin 阶段开始的时间，now的返回值
+     */
+    static void record(const char *phase, qint64 begin);
+
+    /**
+     * @brief finish 启动完成，打印汇总
+     */
+    static void finish();
+
+private:
+    struct Phase {
+        QByteArray name;
+        qint64 begin;
+        qint64 end;
+    };
+
+    static IMStartupTrace &instance();
+
+    // 从main开始计时
+    QElapsedTimer m_timer;
+    // 上一次mark的时间
+    qint64 m_lastMark = 0;
+    // 已经结束的阶段
+    QVector<Phase> m_phases;
+    // 是否已经打印了汇总
+    bool m_finished = false;
+    // 后台线程也会记录
+    QMutex m_mutex;
+};
+
+#endif // IMSTARTUPTRACE_H
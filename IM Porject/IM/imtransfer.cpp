@@ -0,0 +1,174 @@
+#include <QFileInfo>
+#include "imtransfer.h"
+#include "imcodec.h"
+
+// 每次从文件读取的块大小
+static const qint64 ChunkSize = 64 * 1024;
+
+// 传输通道中待发送数据的高水位，超过时暂停读取文件
+static const qint64 StreamHighWatermark = 4 * ChunkSize;
+
+IMTransfer::IMTransfer(Direction direction, quint64 id, QString peerName, QString fileName, qint64 size, QObject *parent)
+    : QObject(parent),
+      m_direction(direction),
+      m_id(id),
+      m_peerName(peerName),
+      m_fileName(fileName),
+      m_size(size),
+      m_done(0),
+      m_stream(nullptr),
+      m_ready(false),
+      m_completed(false)
+{
+}
+
+IMTransfer::~IMTransfer()
+{
+    this->stop();
+}
+
+qint64 IMTransfer::localOffset() const
+{
+    if (m_direction == Send)
+        return 0;
+    // 已经收到的部分保存在 文件名.part 中
+    return qMin(QFileInfo(m_filePath + ".part").size(), m_size);
+}
+
+bool IMTransfer::start(QString hostName, quint16 port, QString userName, qint64 offset)
+{
+    this->stop();
+    m_userName = userName;
+
+    if (m_direction == Send)
+    {
+        m_file.setFileName(m_filePath);
+        if (!m_file.open(QIODevice::ReadOnly) || !m_file.seek(offset))
+            return false;
+    }
+    else
+    {
+        // 丢掉续传位置之后的数据，然后接着写
+        m_file.setFileName(m_filePath + ".part");
+        if (!m_file.open(QIODevice::ReadWrite) || !m_file.resize(offset) || !m_file.seek(offset))
+            return false;
+    }
+    m_done = offset;
+    m_ready = false;
+    m_completed = false;
+    m_readBuffer.clear();
+
+    // 接收方已经收完了（比如空文件），不用再连接传输通道
+    if (m_direction == Receive && m_done >= m_size)
+    {
+        QMetaObject::invokeMethod(this, "complete", Qt::QueuedConnection);
+        return true;
+    }
+
+    m_stream = new QTcpSocket(this);
+    connect(m_stream, &QTcpSocket::connected, this, &IMTransfer::connected);
+    connect(m_stream, &QTcpSocket::readyRead, this, &IMTransfer::readyRead);
+    connect(m_stream, &QTcpSocket::disconnected, this, &IMTransfer::disconnected);
+    connect(m_stream, &QTcpSocket::bytesWritten, this, &IMTransfer::sendChunks);
+    connect(m_stream, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error),
+            this, [this](QAbstractSocket::SocketError){ this->disconnected(); });
+    m_stream->connectToHost(hostName, port, QTcpSocket::ReadWrite);
+    return true;
+}
+
+void IMTransfer::stop()
+{
+    if (m_stream != nullptr)
+    {
+        QTcpSocket *stream = m_stream;
+        m_stream = nullptr;
+        stream->disconnect(this);
+        stream->abort();
+        stream->deleteLater();
+    }
+    if (m_file.isOpen())
+        m_file.close();
+}
+
+// 传输通道连接成功后，告诉服务端这条连接属于哪次传输、是谁连的
+void IMTransfer::connected()
+{
+    m_stream->write(IMCodec<IMSchema::AttachTransfer>::encodeFrame(m_id, m_direction, m_userName));
+}
+
+void IMTransfer::readyRead()
+{
+    if (m_direction == Send)
+    {
+        // 发送方只会收到一个就绪帧
+        m_readBuffer.append(m_stream->readAll());
+        int offset = 0;
+        QByteArray payload;
+        if (!m_ready && takeFrame(m_readBuffer, offset, payload) > 0
+                && peekFunctionCode(payload) == ServerFunctionCode::TransferReady)
+        {
+            m_ready = true;
+            m_readBuffer.clear();
+            this->sendChunks();
+        }
+        return;
+    }
+
+    // 接收方收到的都是文件数据
+    QByteArray data = m_stream->read(m_size - m_done);
+    if (data.isEmpty())
+        return;
+    m_file.write(data);
+    m_done += data.size();
+    emit progress(m_id, m_done, m_size);
+    if (m_done >= m_size)
+        this->complete();
+}
+
+void IMTransfer::sendChunks()
+{
+    if (m_direction != Send || !m_ready || m_stream == nullptr)
+        return;
+
+    // 按块读取文件，Socket中积压的数据超过高水位时暂停，等bytesWritten再继续
+    while (m_done < m_size && m_stream->bytesToWrite() < StreamHighWatermark)
+    {
+        QByteArray chunk = m_file.read(qMin(ChunkSize, m_size - m_done));
+        if (chunk.isEmpty())
+            break;
+        m_stream->write(chunk);
+        m_done += chunk.size();
+    }
+    emit progress(m_id, m_done, m_size);
+
+    // 全部交给Socket后断开，disconnectFromHost会等数据写完
+    if (m_done >= m_size && !m_completed)
+    {
+        m_completed = true;
+        m_file.close();
+        m_stream->disconnectFromHost();
+        emit finished(m_id);
+    }
+}
+
+void IMTransfer::disconnected()
+{
+    if (m_stream == nullptr)
+        return;
+    // 发送方把数据都交出去后主动断开，接收方收完后主动断开，其他情况都是中断
+    if (!m_completed)
+    {
+        this->stop();
+        emit interrupted(m_id);
+    }
+}
+
+void IMTransfer::complete()
+{
+    m_completed = true;
+    m_file.close();
+    QFile::remove(m_filePath);
+    m_file.rename(m_filePath);
+    this->stop();
+    emit finished(m_id);
+}
@@ -0,0 +1,171 @@
+#ifndef IMTRANSFER_H
+#define IMTRANSFER_H
+
+#include <QObject>
+#include <QtNetwork>
+#include <QFile>
+#include <QString>
+
+/***********************************
+ *
+ * Class IMTransfer
+ * 一次文件传输
+ *
+ * 文件数据不走聊天连接，每次传输单独连接一次服务器作为传输通道，
+ * 这样大文件不会增加聊天消息的延迟
+ *
+ * 发送方：收到服务端的传输通道就绪后，按固定大小的块读取文件写入Socket，
+ *        Socket中待发送的数据超过高水位时暂停，等数据写出去后再继续
+ * 接收方：数据先写入 文件名.part，收完后改名，
+ *        传输通道中断时保留已经收到的部分，下次从这个位置继续
+ *
+ * 发出的信号有：
+ * progress     传输进度
+ * finished     传输完成
+ * interrupted  传输通道中断
+ *
+ **********************************/
+
+class IMTransfer : public QObject
+{
+    Q_OBJECT
+
+public:
+    /**
+     * @brief 传输方向
+     */
+    enum Direction {
+        // 发送
+        Send = 0,
+        // 接收
+        Receive = 1
+    };
+
+    /**
+     * @brief IMTransfer 构造函数
+     * @param direction 传输方向
+     * @param id 传输编号
+     * @param peerName 对方昵称
+     * @param fileName 文件名
+     * @param size 文件大小
+     */
+    IMTransfer(Direction direction, quint64 id, QString peerName, QString fileName, qint64 size, QObject *parent = nullptr);
+
+    ~IMTransfer();
+
+    quint64 id() const { return m_id; }
+    Direction direction() const { return m_direction; }
+    QString peerName() const { return m_peerName; }
+    QString fileName() const { return m_fileName; }
+    qint64 size() const { return m_size; }
+    qint64 done() const { return m_done; }
+    bool isCompleted() const { return m_completed; }
+
+    /**
+     * @brief setFilePath 设置本地文件路径，发送方是要发送的文件，接收方是保存的位置
+     * @param filePath 文件路径
+     */
+    void setFilePath(QString filePath) { m_filePath = filePath; }
+
+    /**
+     * @brief filePath 本地文件路径
+     */
+    QString filePath() const { return m_filePath; }
+
+    /**
+     * @brief localOffset 接收方已经收到的字节数，用于断点续传
+     */
+    qint64 localOffset() const;
+
+    /**
+     * @brief start 打开传输通道并从指定位置开始传输
+     * @param hostName 服务器地址
+     * @param port 服务器端口
+     * @param userName 自己的昵称，服务端用它确认传输连接属于这次传输的发送者或接收者
+     * @param offset 开始的位置
+     * @return 文件打开失败返回false
+     */
+    bool start(QString hostName, quint16 port, QString userName, qint64 offset);
+
+    /**
+     * @brief stop 关闭传输通道和文件
+     */
+    void stop();
+
+signals:
+    /**
+     * @brief progress 传输进度
+     * @param id 传输编号
+     * @param done 已经传输的字节数
+     * @param total 总字节数
+     */
+    void progress(quint64 id, qint64 done, qint64 total);
+
+    /**
+     * @brief finished 传输完成
+     * @param id 传输编号
+     */
+    void finished(quint64 id);
+
+    /**
+     * @brief interrupted 传输通道中断
+     * @param id 传输编号
+     */
+    void interrupted(quint64 id);
+
+private slots:
+    void connected();
+    void readyRead();
+    void disconnected();
+
+    /**
+     * @brief sendChunks 发送方按块发送文件，直到达到高水位
+     */
+    void sendChunks();
+
+    /**
+     * @brief complete 接收方收完数据后关闭文件并改名
+     */
+    void complete();
+
+private:
+    Direction m_direction;
+    quint64 m_id;
+    QString m_peerName;
+    QString m_userName;
+    QString m_fileName;
+    QString m_filePath;
+    qint64 m_size;
+
+    /**
+     * @brief m_done 已经传输的字节数
+     */
+    qint64 m_done;
+
+    /**
+     * @brief m_stream 传输通道
+     */
+    QTcpSocket *m_stream;
+
+    /**
+     * @brief m_file 本地文件
+     */
+    QFile m_file;
+
+    /**
+     * @brief m_ready 发送方是否已经收到传输通道就绪
+     */
+    bool m_ready;
+
+    /**
+     * @brief m_completed 传输是否已经完成
+     */
+    bool m_completed;
+
+    /**
+     * @brief m_readBuffer 发送方等待就绪帧时的接收缓冲区
+     */
+    QByteArray m_readBuffer;
+};
+
+#endif // IMTRANSFER_H
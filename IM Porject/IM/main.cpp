@@ -1,14 +1,37 @@
-#include "formlogin.h"
-#include <QApplication>
-#include <QTextCodec>
-
-int main(int argc, char *argv[])
-{
-    QApplication a(argc, argv);
-    QTextCodec *codec = QTextCodec::codecForName("UTF-8");
-    QTextCodec::setCodecForLocale(codec);
-    // 启动登录窗口
-    FormLogin l;
-    l.show();
-    return a.exec();
-}
+#include "formlogin.h"
+#include <QApplication>
+#include <QTextCodec>
+#include "imstartuptrace.h"
+#include "imdal.h"
+
+int main(int argc, char *argv[])
+{
+    // 启动过程的耗时从这里开始算
+    IMStartupTrace::start();
+    QApplication a(argc, argv);
+    QTextCodec *codec = QTextCodec::codecForName("UTF-8");
+    QTextCodec::setCodecForLocale(codec);
+
+    // 命令行导出、导入聊天记录，不显示界面：
+    // IM --export-history 用户名 文件    IM --import-history 用户名 文件
+    QStringList args = a.arguments();
+    if (args.size() == 4 && (args.at(1) == "--export-history" || args.at(1) == "--import-history"))
+    {
+        IMDAL *dal = IMDAL::instance();
+        dal->initDatabase(dal->prepareDatabase(args.at(2)));
+        qint64 count = -1;
+        if (args.at(1) == "--export-history")
+            count = dal->exportHistory(args.at(3));
+        // 导入在写线程中做，等它结束
+        else if (dal->importHistory(args.at(3), [&](qint64 inserted){ count = inserted; a.quit(); }))
+            a.exec();
+        dal->closeDatabase();
+        return count < 0 ? 1 : 0;
+    }
+
+    // 启动登录窗口
+    FormLogin l;
+    l.show();
+    IMStartupTrace::mark("login window");
+    return a.exec();
+}
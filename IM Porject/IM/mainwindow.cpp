@@ -1,190 +1,463 @@
-#include "mainwindow.h"
-#include "ui_mainwindow.h"
-#include <QMessageBox>
-#include <QListWidget>
-#include <QListWidgetItem>
-#include <QDebug>
-#include <QDateTime>
-
-MainWindow::MainWindow(QWidget *parent) :
-    QMainWindow(parent),
-    ui(new Ui::MainWindow)
-{
-    ui->setupUi(this);
-    connect(IMClient::instance(), &IMClient::receivedPrivateMessage, this, &MainWindow::receivedPrivateMessage);
-    connect(IMClient::instance(), &IMClient::receivedGroupMessage, this, &MainWindow::receivedGroupMessage);
-    connect(IMClient::instance(), &IMClient::userOnline, this, &MainWindow::userOnline);
-    connect(IMClient::instance(), &IMClient::userOffline, this, &MainWindow::userOffline);
-    connect(IMClient::instance(), &IMClient::serverClose, this, &MainWindow::serverClose);
-    // 初始化好友列表
-    ui->listWidget->setEditTriggers(QAbstractItemView::NoEditTriggers);
-    updateUserList();
-
-    // 设置窗口标题
-    this->setWindowTitle("IM:" + IMClient::instance()->getName());
-}
-
-MainWindow::~MainWindow()
-{
-    delete ui;
-}
-
-// 当发送按钮被点击时
-void MainWindow::on_btnSend_clicked()
-{
-    // 获取输入框的内容
-    QString text = ui->plainTextEdit->toPlainText();
-    if (text.isEmpty())
-        return;
-    // 如果要发送的文本大于255，提示超出范围并返回
-    if (text.length() > 255)
-    {
-        QMessageBox::warning(this, "警告", "您输入的文本太长");
-        return;
-    }
-
-    // 如果当前没有选中任何人，提示并返回
-    if (ui->listWidget->currentItem() == nullptr)
-    {
-        QMessageBox::information(this, "提示", "请选择对话对象！");
-        return;
-    }
-    // 验证通过后清空输入框
-    ui->plainTextEdit->clear();
-
-    // 用自己的名字组装消息结构
-    IMMessage msg(IMClient::instance()->getName(), text, QDateTime::currentDateTime());
-    // 添加到对话框中
-    this->addMessage(msg);
-    // 如果当前选中的是群聊，发送群聊消息，否则发送私聊消息
-    if (ui->listWidget->currentItem() == this->pGruopItem)
-        IMClient::instance()->sendGroupMessage(text);
-    else
-        IMClient::instance()->sendPrivateMessage(ui->listWidget->currentItem()->text(), text);
-}
-
-// 接收到私聊消息时
-void MainWindow::receivedPrivateMessage(IMMessage msg)
-{
-    // 如果当前没有选中发消息这个人，直接返回（优化的话就是新消息提醒）
-    if (ui->listWidget->currentItem() == nullptr)
-        return;
-    if (ui->listWidget->currentItem() == this->pGruopItem)
-        return;
-    if (ui->listWidget->currentItem()->text() != msg.fromName)
-        return;
-
-    // 将消息添加到对话框中
-    this->addMessage(msg);
-}
-
-void MainWindow::receivedGroupMessage(IMMessage msg)
-{
-    if (ui->listWidget->currentItem() == this->pGruopItem)
-        this->addMessage(msg);
-}
-
-void MainWindow::userOnline(QString fromName)
-{
-    updateUserList();
-    QMessageBox::information(nullptr, "提示", fromName + " 已上线");
-}
-
-void MainWindow::userOffline(QString fromName)
-{
-    updateUserList();
-    QMessageBox::information(nullptr, "提示", fromName + " 已下线");
-}
-
-void MainWindow::serverClose()
-{
-    QMessageBox::warning(this, "警告", "服务器已经关闭，程序即将退出！");
-    QApplication::quit();
-}
-
-// 更新用户列表
-void MainWindow::updateUserList()
-{
-    ui->listWidget->setCurrentItem(nullptr);
-    int n = ui->listWidget->count();
-    // 清空表，重新加载
-    for (int i = 0; i < n; i++)
-        delete ui->listWidget->takeItem(0);
-
-    // 添加群聊项在表中
-    pGruopItem = new QListWidgetItem(QIcon(":icons/images/group.png"), "群聊");
-    ui->listWidget->addItem(pGruopItem);
-
-    // 添加在线人员在表中
-    const QVector<QString> *pUserList = IMClient::instance()->getOnlineList();
-    for (int i = 0; i < pUserList->length(); i++)
-        ui->listWidget->addItem(new QListWidgetItem(QIcon(":icons/images/userOnline.png"), pUserList->at(i)));
-
-    // 添加离线人员到表中
-    pUserList = IMClient::instance()->getOfflineList();
-    for (int i = 0; i < pUserList->length(); i++)
-        ui->listWidget->addItem(new QListWidgetItem(QIcon(":icons/images/userOffline.png"), pUserList->at(i)));
-}
-
-void MainWindow::setChatRecord(const QVector<IMMessage> *chatRecord, const QString *name)
-{
-    // 清空聊天框
-    ui->textBrowser->clear();
-    // 如果是空的直接返回
-    if (chatRecord == nullptr)
-        return;
-    // 如果name为空表示是群聊消息
-    if (name == nullptr)
-    {
-        // 群聊消息直接添加即可
-        for (int i = 0; i < chatRecord->length(); ++i)
-            this->addMessage(chatRecord->at(i));
-    }
-    else
-    {
-        // 私聊消息需要经过转换，因为私聊消息的fromName使用i和o来代表接收或者发出
-        for (int i = 0; i < chatRecord->length(); ++i)
-        {
-            IMMessage msg = chatRecord->at(i);
-            // 如果是i表示接收的消息，用传进来的名字代替，否则是接收的消息，用自己的名字来代替
-            msg.fromName = msg.fromName == "i" ? *name : IMClient::instance()->getName();
-            this->addMessage(msg);
-        }
-    }
-}
-
-void MainWindow::addMessage(const IMMessage &msg)
-{
-    QString timeStr;
-    // 选择时间的格式  如果是同一天，那么时间就按 12:00:00 这种格式显示
-    if (msg.time.date() > QDateTime::currentDateTime().date().addDays(-1))
-        timeStr = msg.time.toString("HH:mm:ss");
-    // 否则如果超过一天，但是小于一年，则显示月份日期  12/10 12:00:00
-    else if (msg.time.date() > QDateTime::currentDateTime().date().addYears(-1))
-        timeStr = msg.time.toString("MM/dd HH:mm:ss");
-    // 否则显示年份
-    else
-        timeStr = msg.time.toString("yyyy/MM.dd HH:mm:ss");
-
-    // 显示文本
-    ui->textBrowser->append(QString("<font color=\"%1\">%2 %3</font>").arg(msg.fromName == IMClient::instance()->getName() ? "#008040" : "#0000ff").arg(msg.fromName).arg(timeStr));
-    ui->textBrowser->insertPlainText(QString("\n  %1\n").arg(msg.content));
-    ui->textBrowser->moveCursor(QTextCursor::End);
-}
-
-void MainWindow::on_listWidget_itemClicked(QListWidgetItem *item)
-{
-    // 如果选中项为空，那就清空对话框
-    if (item == nullptr)
-        this->setChatRecord(nullptr);
-
-    // 如果选中了群聊选项，加载群聊的聊天记录
-    if (item == this->pGruopItem)
-        this->setChatRecord(IMClient::instance()->getGroupChatRecord());
-    else
-    {
-        // 否则就是选中了用户，读取这个用户的聊天记录
-        QString name = item->text();
-        this->setChatRecord(IMClient::instance()->getChatRecord(name), &name);
-    }
-}
+#include "mainwindow.h"
+#include "ui_mainwindow.h"
+#include <QMessageBox>
+#include <QListWidget>
+#include <QDebug>
+#include <QDateTime>
+#include <QFileDialog>
+#include <QFile>
+#include <QDir>
+#include <QScrollBar>
+#include <QDialog>
+#include <QVBoxLayout>
+#include <QElapsedTimer>
+#include <QTimer>
+#include "imchatdelegate.h"
+#include "imstartuptrace.h"
+
+MainWindow::MainWindow(QWidget *parent) :
+    QMainWindow(parent),
+    ui(new Ui::MainWindow),
+    m_rosterModel(new IMRosterModel(this)),
+    m_rosterProxy(new IMRosterProxy(this)),
+    m_chatModel(new IMChatModel(this)),
+    m_chatUpdateTimer(new QTimer(this)),
+    m_loadingHistory(false),
+    m_noticeTimer(new QTimer(this)),
+    m_noticeBox(nullptr),
+    m_latencyOverlay(nullptr)
+{
+    ui->setupUi(this);
+    // 聊天框用模型和委托显示，只绘制可见的行，行高有缓存
+    ui->chatView->setModel(this->m_chatModel);
+    ui->chatView->setItemDelegate(new IMChatDelegate(ui->chatView));
+    ui->chatView->setVerticalScrollMode(QAbstractItemView::ScrollPerPixel);
+    ui->chatView->setSelectionMode(QAbstractItemView::SingleSelection);
+    ui->chatView->setEditTriggers(QAbstractItemView::NoEditTriggers);
+    ui->chatView->setResizeMode(QListView::Adjust);
+    // 新消息最多每16毫秒插入一次
+    this->m_chatUpdateTimer->setSingleShot(true);
+    this->m_chatUpdateTimer->setInterval(16);
+    connect(this->m_chatUpdateTimer, &QTimer::timeout, this, &MainWindow::updateChat);
+    connect(IMClient::instance(), &IMClient::receivedPrivateMessage, this, &MainWindow::receivedPrivateMessage);
+    connect(IMClient::instance(), &IMClient::receivedGroupMessage, this, &MainWindow::receivedGroupMessage);
+    connect(IMClient::instance(), &IMClient::userOnline, this, &MainWindow::userOnline);
+    connect(IMClient::instance(), &IMClient::userOffline, this, &MainWindow::userOffline);
+    connect(IMClient::instance(), &IMClient::serverClose, this, &MainWindow::serverClose);
+    connect(IMClient::instance(), &IMClient::connectionLost, this, &MainWindow::connectionLost);
+    connect(IMClient::instance(), &IMClient::reconnected, this, &MainWindow::reconnected);
+    connect(IMClient::instance(), &IMClient::databaseReady, this, &MainWindow::databaseReady);
+    connect(IMClient::instance(), &IMClient::messageDelivered, this, &MainWindow::messageDelivered);
+    connect(IMClient::instance(), &IMClient::fileOffered, this, &MainWindow::fileOffered);
+    connect(IMClient::instance(), &IMClient::transferFinished, this, &MainWindow::transferFinished);
+    // 聊天框滚到顶时加载更早的聊天记录
+    connect(ui->chatView->verticalScrollBar(), &QScrollBar::valueChanged, this, &MainWindow::chatScrolled);
+    // 初始化好友列表，这时只有在线的人，离线好友等数据库打开后再补上，之后的上下线只修改对应的行，每帧最多重新排序一次
+    this->m_rosterModel->setContacts(*IMClient::instance()->getOnlineList(), *IMClient::instance()->getOfflineList());
+    this->m_rosterProxy->setSourceModel(this->m_rosterModel);
+    this->m_rosterProxy->sort(0);
+    ui->rosterView->setModel(this->m_rosterProxy);
+    ui->rosterView->setEditTriggers(QAbstractItemView::NoEditTriggers);
+    ui->rosterView->setUniformItemSizes(true);
+    connect(this->m_rosterModel, &IMRosterModel::presenceApplied, this, [this]() { this->m_rosterProxy->sort(0); });
+    connect(ui->rosterView->selectionModel(), &QItemSelectionModel::currentChanged, this, &MainWindow::contactChanged);
+    // 搜索框的内容同时用来过滤好友列表，回车才搜索聊天记录
+    connect(ui->leSearch, &QLineEdit::textChanged, this->m_rosterProxy, &QSortFilterProxyModel::setFilterFixedString);
+    // 上下线提醒最多每2秒弹出一次，期间的提醒合并显示
+    this->m_noticeTimer->setSingleShot(true);
+    this->m_noticeTimer->setInterval(2000);
+    connect(this->m_noticeTimer, &QTimer::timeout, this, &MainWindow::showPresenceNotice);
+    // 打开了延迟跟踪时在聊天框上显示每条消息各环节的延迟
+    if (IMClient::instance()->isTraceEnabled())
+    {
+        this->m_latencyOverlay = new IMLatencyOverlay(ui->chatView);
+        this->m_latencyOverlay->setClock(IMClient::instance()->clockOffset(), IMClient::instance()->clockRtt());
+        connect(IMClient::instance(), &IMClient::messageTraced, this->m_latencyOverlay, &IMLatencyOverlay::addSample);
+        this->m_latencyOverlay->show();
+    }
+
+    // 设置窗口标题
+    this->setWindowTitle("IM:" + IMClient::instance()->getName());
+}
+
+MainWindow::~MainWindow()
+{
+    delete ui;
+}
+
+// 当发送按钮被点击时
+void MainWindow::on_btnSend_clicked()
+{
+    // 获取输入框的内容
+    QString text = ui->plainTextEdit->toPlainText();
+    if (text.isEmpty())
+        return;
+    // 如果要发送的文本大于255，询问是否作为文件发送
+    if (text.length() > 255)
+    {
+        if (QMessageBox::question(this, "提示", "您输入的文本太长，是否作为文件发送？") != QMessageBox::Yes)
+            return;
+        // 写到临时目录中的文本文件，然后走文件传输
+        QFile file(QDir::temp().filePath(QString("IM_%1.txt").arg(QDateTime::currentDateTime().toString("yyyyMMdd_HHmmss"))));
+        if (!file.open(QIODevice::WriteOnly))
+        {
+            QMessageBox::warning(this, "警告", "临时文件创建失败！");
+            return;
+        }
+        file.write(text.toUtf8());
+        file.close();
+        this->sendFile(file.fileName());
+        ui->plainTextEdit->clear();
+        return;
+    }
+
+    // 如果当前没有选中任何人，提示并返回
+    if (!this->m_currentContact.isValid())
+    {
+        QMessageBox::information(this, "提示", "请选择对话对象！");
+        return;
+    }
+    // 验证通过后清空输入框
+    ui->plainTextEdit->clear();
+
+    // 如果当前选中的是群聊，发送群聊消息，否则发送私聊消息
+    if (this->m_currentContact.data(IMRosterModel::IsGroupRole).toBool())
+        IMClient::instance()->sendGroupMessage(text);
+    else
+        IMClient::instance()->sendPrivateMessage(this->m_currentContact.data(IMRosterModel::NameRole).toString(), text);
+    // 消息已经添加到聊天记录中，显示出来并滚到底部
+    this->m_chatModel->messagesAppended();
+    ui->chatView->scrollToBottom();
+}
+
+// 当发送文件按钮被点击时
+void MainWindow::on_btnSendFile_clicked()
+{
+    QString filePath = QFileDialog::getOpenFileName(this, "选择要发送的文件");
+    if (filePath.isEmpty())
+        return;
+    this->sendFile(filePath);
+}
+
+// 给当前选中的人发送文件
+void MainWindow::sendFile(QString filePath)
+{
+    // 如果当前没有选中任何人或者选中的是群聊，提示并返回
+    if (!this->m_currentContact.isValid() || this->m_currentContact.data(IMRosterModel::IsGroupRole).toBool())
+    {
+        QMessageBox::information(this, "提示", "请选择要发送文件的好友！");
+        return;
+    }
+    if (!IMClient::instance()->sendFile(this->m_currentContact.data(IMRosterModel::NameRole).toString(), filePath))
+        QMessageBox::warning(this, "警告", "文件无法读取或者未连接服务器！");
+}
+
+// 收到文件请求时
+void MainWindow::fileOffered(QString fromName, quint64 id, qint64 size, QString fileName)
+{
+    QString text = QString("%1 想发送文件 %2 (%3 KB) 给您，是否接收？").arg(fromName).arg(fileName).arg((size + 1023) / 1024);
+    if (QMessageBox::question(this, "文件", text) != QMessageBox::Yes)
+    {
+        IMClient::instance()->rejectFile(id);
+        return;
+    }
+    QString savePath = QFileDialog::getSaveFileName(this, "保存文件", fileName);
+    if (savePath.isEmpty())
+        IMClient::instance()->rejectFile(id);
+    else
+        IMClient::instance()->acceptFile(id, savePath);
+}
+
+// 文件传输结束时
+void MainWindow::transferFinished(quint64 id, bool isSuccess, QString info)
+{
+    Q_UNUSED(id);
+    if (isSuccess)
+        QMessageBox::information(this, "文件", "文件传输完成：" + info);
+    else
+        QMessageBox::warning(this, "文件", "文件传输失败：" + info);
+}
+
+// 接收到私聊消息时
+void MainWindow::receivedPrivateMessage(IMMessage msg)
+{
+    // 如果当前没有选中发消息这个人，直接返回（优化的话就是新消息提醒）
+    if (!this->m_currentContact.isValid())
+        return;
+    if (this->m_currentContact.data(IMRosterModel::IsGroupRole).toBool())
+        return;
+    if (this->m_currentContact.data(IMRosterModel::NameRole).toString() != msg.fromName)
+        return;
+
+    // 消息已经在聊天记录中了，通知对话框显示
+    this->scheduleChatUpdate();
+}
+
+void MainWindow::receivedGroupMessage(IMMessage msg)
+{
+    Q_UNUSED(msg);
+    if (this->m_currentContact.data(IMRosterModel::IsGroupRole).toBool())
+        this->scheduleChatUpdate();
+}
+
+void MainWindow::userOnline(QString fromName)
+{
+    this->m_rosterModel->setPresence(fromName, true);
+    this->notifyPresence(fromName, true);
+}
+
+void MainWindow::userOffline(QString fromName)
+{
+    this->m_rosterModel->setPresence(fromName, false);
+    this->notifyPresence(fromName, false);
+}
+
+void MainWindow::serverClose()
+{
+    QMessageBox::warning(this, "警告", "服务器已经关闭，程序即将退出！");
+    QApplication::quit();
+}
+
+void MainWindow::connectionLost()
+{
+    // 不打断用户，只在标题上提示，这期间发出的消息会排队
+    this->setWindowTitle("IM:" + IMClient::instance()->getName() + " (连接已断开，正在重连...)");
+}
+
+void MainWindow::reconnected()
+{
+    this->setWindowTitle("IM:" + IMClient::instance()->getName());
+    // 重新登录时重新估计了时钟偏差
+    if (this->m_latencyOverlay != nullptr)
+        this->m_latencyOverlay->setClock(IMClient::instance()->clockOffset(), IMClient::instance()->clockRtt());
+}
+
+void MainWindow::messageDelivered(QString key, quint64 seq)
+{
+    Q_UNUSED(seq);
+    if (!this->m_currentContact.isValid())
+        return;
+    bool isGroup = this->m_currentContact.data(IMRosterModel::IsGroupRole).toBool();
+    if (isGroup ? key.isEmpty() : key == this->m_currentContact.data(IMRosterModel::NameRole).toString())
+        this->m_chatModel->messagesChanged();
+}
+
+void MainWindow::databaseReady(QVector<QString> contacts)
+{
+    // 离线好友和上下线一样批量插入，下一帧一起排序
+    for (const QString &name : contacts)
+        this->m_rosterModel->setPresence(name, false);
+
+    // 数据库打开之前打开的会话是空的，现在加载它的聊天记录
+    if (this->m_currentContact.isValid())
+    {
+        qint64 begin = IMStartupTrace::now();
+        this->openContact(this->m_currentContact);
+        IMStartupTrace::record("history", begin);
+    }
+    IMStartupTrace::finish();
+}
+
+void MainWindow::notifyPresence(QString name, bool online)
+{
+    if (online)
+        this->m_onlineNotices.append(name);
+    else
+        this->m_offlineNotices.append(name);
+    // 距离上次提醒不到2秒就先攒着，定时器到了再一起显示
+    if (!this->m_noticeTimer->isActive())
+        this->showPresenceNotice();
+}
+
+// 把一组昵称写成一行提醒，人多时只列出前几个
+static QString presenceNoticeText(const QStringList &names, const QString &action)
+{
+    const int shown = 3;
+    QString text = names.mid(0, shown).join("、");
+    if (names.size() > shown)
+        text += QString(" 等%1人").arg(names.size());
+    return text + " " + action;
+}
+
+void MainWindow::showPresenceNotice()
+{
+    if (this->m_onlineNotices.isEmpty() && this->m_offlineNotices.isEmpty())
+        return;
+
+    QStringList lines;
+    if (!this->m_onlineNotices.isEmpty())
+        lines.append(presenceNoticeText(this->m_onlineNotices, "已上线"));
+    if (!this->m_offlineNotices.isEmpty())
+        lines.append(presenceNoticeText(this->m_offlineNotices, "已下线"));
+    this->m_onlineNotices.clear();
+    this->m_offlineNotices.clear();
+
+    // 非模态，不打断正在进行的操作，已经显示着的话只更新内容
+    if (this->m_noticeBox == nullptr)
+    {
+        this->m_noticeBox = new QMessageBox(QMessageBox::Information, "提示", QString(), QMessageBox::Ok, this);
+        this->m_noticeBox->setModal(false);
+    }
+    this->m_noticeBox->setText(lines.join("\n"));
+    this->m_noticeBox->show();
+    this->m_noticeTimer->start();
+}
+
+void MainWindow::setChatRecord(const IMChatRecord *chatRecord, const QString *name)
+{
+    // 切换会话时滚动条会经过顶部，这期间不触发加载
+    bool loading = this->m_loadingHistory;
+    this->m_loadingHistory = true;
+    // 模型直接引用聊天记录，只有可见的行才会被绘制
+    // 私聊消息的fromName使用i和o来代表接收或者发出，由模型换成对方和自己的名字
+    this->m_chatModel->setRecord(chatRecord, name == nullptr ? QString() : *name, IMClient::instance()->getName());
+    ui->chatView->scrollToBottom();
+    this->m_loadingHistory = loading;
+}
+
+void MainWindow::scheduleChatUpdate()
+{
+    // 一帧之内到达的消息合并成一次插入
+    if (!this->m_chatUpdateTimer->isActive())
+        this->m_chatUpdateTimer->start();
+}
+
+void MainWindow::updateChat()
+{
+    // 原来就在底部的话，插入新消息后继续停在底部，否则不打扰正在往上翻的用户
+    QScrollBar *bar = ui->chatView->verticalScrollBar();
+    bool atBottom = bar->value() == bar->maximum();
+    this->m_chatModel->messagesAppended();
+    if (atBottom)
+        ui->chatView->scrollToBottom();
+}
+
+void MainWindow::contactChanged(const QModelIndex &current)
+{
+    // 当前行被过滤掉时current无效，这时保持原来的会话
+    QModelIndex contact = this->m_rosterProxy->mapToSource(current);
+    if (!contact.isValid() || contact == this->m_currentContact)
+        return;
+    this->openContact(contact);
+}
+
+void MainWindow::openContact(const QModelIndex &contact)
+{
+    this->m_currentContact = contact;
+    // 如果选中项为空，那就清空对话框
+    if (!contact.isValid())
+    {
+        this->setChatRecord(nullptr);
+        IMClient::instance()->releaseChatRecord();
+        return;
+    }
+
+    // 如果选中了群聊选项，加载群聊的聊天记录
+    if (contact.data(IMRosterModel::IsGroupRole).toBool())
+        this->setChatRecord(IMClient::instance()->getGroupChatRecord());
+    else
+    {
+        // 否则就是选中了用户，读取这个用户的聊天记录
+        QString name = contact.data(IMRosterModel::NameRole).toString();
+        this->setChatRecord(IMClient::instance()->getChatRecord(name), &name);
+    }
+
+    // 第一页不够一屏时没有滚动条，也就没法往上翻，直接继续往前加载
+    ui->chatView->doItemsLayout();
+    while (ui->chatView->verticalScrollBar()->maximum() == 0 && this->loadOlderHistory() > 0)
+        ui->chatView->doItemsLayout();
+}
+
+void MainWindow::chatScrolled(int value)
+{
+    if (value == ui->chatView->verticalScrollBar()->minimum())
+        this->loadOlderHistory();
+}
+
+int MainWindow::loadOlderHistory()
+{
+    if (!this->m_currentContact.isValid() || this->m_loadingHistory)
+        return 0;
+    this->m_loadingHistory = true;
+
+    // 记下当前最上面的一行，插入后滚回这一行，看到的内容就不会跳
+    int topRow = qMax(0, ui->chatView->indexAt(QPoint(0, 0)).row());
+    int n = 0;
+    if (this->m_currentContact.data(IMRosterModel::IsGroupRole).toBool())
+        n = IMClient::instance()->loadOlderGroupChatRecord();
+    else
+        n = IMClient::instance()->loadOlderChatRecord(this->m_currentContact.data(IMRosterModel::NameRole).toString());
+    if (n > 0)
+    {
+        this->m_chatModel->messagesPrepended(n);
+        ui->chatView->scrollTo(this->m_chatModel->index(topRow + n), QAbstractItemView::PositionAtTop);
+    }
+
+    this->m_loadingHistory = false;
+    return n;
+}
+
+// 在搜索框中按下回车时
+void MainWindow::on_leSearch_returnPressed()
+{
+    QString text = ui->leSearch->text().trimmed();
+    if (text.isEmpty())
+        return;
+
+    QElapsedTimer timer;
+    timer.start();
+    QVector<IMSearchResult> results = IMClient::instance()->searchMessage(text);
+    qDebug() << "search" << text << results.size() << "results in" << timer.elapsed() << "ms";
+    if (results.isEmpty())
+    {
+        QMessageBox::information(this, "搜索", "没有找到包含 " + text + " 的聊天记录");
+        return;
+    }
+
+    // 用一个列表显示结果，双击或者回车跳转到那条消息
+    QDialog dialog(this);
+    dialog.setWindowTitle(QString("搜索 %1 (%2)").arg(text).arg(results.size()));
+    dialog.resize(420, 360);
+    QVBoxLayout *layout = new QVBoxLayout(&dialog);
+    QListWidget *list = new QListWidget(&dialog);
+    layout->addWidget(list);
+    for (const IMSearchResult &result : results)
+    {
+        QString title = result.isGroup ? QString("群聊 %1").arg(result.peer) : result.peer;
+        list->addItem(QString("%1  %2\n  %3").arg(title)
+                      .arg(result.message.time.toString("yyyy/MM/dd HH:mm:ss"))
+                      .arg(result.snippet));
+    }
+    connect(list, &QListWidget::itemActivated, &dialog, &QDialog::accept);
+    if (dialog.exec() != QDialog::Accepted || list->currentRow() < 0)
+        return;
+    this->jumpToMessage(results.at(list->currentRow()));
+}
+
+void MainWindow::jumpToMessage(const IMSearchResult &result)
+{
+    // 找到消息所在的会话
+    QModelIndex contact = result.isGroup ? this->m_rosterModel->groupIndex() : this->m_rosterModel->indexOf(result.peer);
+    if (!contact.isValid())
+        return;
+
+    // 先把聊天记录加载到这条消息，再显示会话
+    if (result.isGroup)
+        IMClient::instance()->loadGroupChatRecordTo(result.message);
+    else
+        IMClient::instance()->loadChatRecordTo(result.peer, result.message);
+    this->openContact(contact);
+    // 会话已经打开了，列表里选中这一行时不会再打开一次；被过滤掉的话列表里就不选中
+    ui->rosterView->setCurrentIndex(this->m_rosterProxy->mapFromSource(contact));
+
+    // 滚动到这条消息并选中
+    this->m_loadingHistory = true;
+    int row = this->m_chatModel->rowOfMessage(result.message);
+    if (row >= 0)
+    {
+        QModelIndex index = this->m_chatModel->index(row);
+        ui->chatView->setCurrentIndex(index);
+        ui->chatView->scrollTo(index, QAbstractItemView::PositionAtCenter);
+    }
+    this->m_loadingHistory = false;
+}
@@ -1,83 +1,228 @@
-#ifndef MAINWINDOW_H
-#define MAINWINDOW_H
-
-#include <QMainWindow>
-#include <QListWidgetItem>
-#include <QVector>
-#include "imclient.h"
-#include "immessage.h"
-
-namespace Ui {
-class MainWindow;
-}
-
-class MainWindow : public QMainWindow
-{
-    Q_OBJECT
-
-public:
-    explicit MainWindow(QWidget *parent = nullptr);
-    ~MainWindow();
-
-private slots:
-    void on_btnSend_clicked();
-
-    void on_listWidget_itemClicked(QListWidgetItem *item);
-
-public slots:
-    /**
-     * @brief receivedPrivateMessage 接收到私聊消息时触发
-     * @param msg 消息内容
-     */
-    void receivedPrivateMessage(IMMessage msg);
-
-    /**
-     * @brief receivedGroupMessage 接收到群聊消息时触发
-     * @param msg 消息内容
-     */
-    void receivedGroupMessage(IMMessage msg);
-
-    /**
-     * @brief userOnline 用户上线时触发
-     * @param fromName 上线者昵称
-     */
-    void userOnline(QString fromName);
-
-    /**
-     * @brief userOffline 用户下线时触发
-     * @param fromName 下线者昵称
-     */
-    void userOffline(QString fromName);
-
-    /**
-     * @brief serverClose 服务器关闭时触发
-     */
-    void serverClose();
-
-private:
-    /**
-     * @brief updateUserList 更新用户列表
-     */
-    void updateUserList();
-
-    /**
-     * @brief setChatRecord 设置当前聊天记录
-     * @param chatRecord 聊天记录内容
-     */
-    void setChatRecord(const QVector<IMMessage> *chatRecord, const QString *name = nullptr);
-
-    /**
-     * @brief addMessage 添加一条消息
-     * @param msg 消息内容
-     */
-    void addMessage(const IMMessage &msg);
-private:
-    Ui::MainWindow *ui;
-
-    /**
-     * @brief pGruopItem 群聊项指针
-     */
-    QListWidgetItem *pGruopItem;
-};
-
-#endif // MAINWINDOW_H
+#ifndef MAINWINDOW_H
+#define MAINWINDOW_H
+
+#include <QMainWindow>
+#include <QPersistentModelIndex>
+#include <QMessageBox>
+#include <QStringList>
+#include <QVector>
+#include <QTimer>
+#include "imclient.h"
+#include "immessage.h"
+#include "imchatmodel.h"
+#include "imrostermodel.h"
+#include "imlatencyoverlay.h"
+
+namespace Ui {
+class MainWindow;
+}
+
+class MainWindow : public QMainWindow
+{
+    Q_OBJECT
+
+public:
+    explicit MainWindow(QWidget *parent = nullptr);
+    ~MainWindow();
+
+private slots:
+    void on_btnSend_clicked();
+
+    void on_btnSendFile_clicked();
+
+    /**
+     * @brief contactChanged 好友列表的当前行变化时触发，打开对应的会话
+     * @param current 新的当前行（排序过滤后的索引）
+     */
+    void contactChanged(const QModelIndex &current);
+
+    void on_leSearch_returnPressed();
+
+    /**
+     * @brief chatScrolled 聊天框滚动时触发，滚到顶时加载更早的聊天记录
+     * @param value 滚动条的位置
+     */
+    void chatScrolled(int value);
+
+    /**
+     * @brief updateChat 把聊天记录中新追加的消息显示出来
+     */
+    void updateChat();
+
+    /**
+     * @brief showPresenceNotice 显示攒下的上下线提醒，最多每2秒一次
+     */
+    void showPresenceNotice();
+
+public slots:
+    /**
+     * @brief receivedPrivateMessage 接收到私聊消息时触发
+     * @param msg 消息内容
+     */
+    void receivedPrivateMessage(IMMessage msg);
+
+    /**
+     * @brief receivedGroupMessage 接收到群聊消息时触发
+     * @param msg 消息内容
+     */
+    void receivedGroupMessage(IMMessage msg);
+
+    /**
+     * @brief userOnline 用户上线时触发
+     * @param fromName 上线者昵称
+     */
+    void userOnline(QString fromName);
+
+    /**
+     * @brief userOffline 用户下线时触发
+     * @param fromName 下线者昵称
+     */
+    void userOffline(QString fromName);
+
+    /**
+     * @brief serverClose 服务器关闭时触发
+     */
+    void serverClose();
+
+    /**
+     * @brief connectionLost 连接断开、开始自动重连时触发
+     */
+    void connectionLost();
+
+    /**
+     * @brief reconnected 自动重连成功时触发
+     */
+    void reconnected();
+
+    /**
+     * @brief messageDelivered 发出的消息被服务端确认时触发，正在显示这个会话时去掉发送中的标记
+     * @param key 对方昵称，群聊为空字符串
+     * @param seq 消息序号
+     */
+    void messageDelivered(QString key, quint64 seq);
+
+    /**
+     * @brief databaseReady 数据库在后台打开后触发，补上离线好友，重新加载已经打开的会话
+     * @param contacts 新加入好友列表的离线用户
+     */
+    void databaseReady(QVector<QString> contacts);
+
+    /**
+     * @brief fileOffered 收到文件请求时触发
+     * @param fromName 发送者昵称
+     * @param id 传输编号
+     * @param size 文件大小
+     * @param fileName 文件名
+     */
+    void fileOffered(QString fromName, quint64 id, qint64 size, QString fileName);
+
+    /**
+     * @brief transferFinished 文件传输结束时触发
+     * @param id 传输编号
+     * @param isSuccess 是否成功
+     * @param info 成功时是文件路径，失败时是原因
+     */
+    void transferFinished(quint64 id, bool isSuccess, QString info);
+
+private:
+    /**
+     * @brief openContact 打开好友或者群聊的会话
+     * @param contact 好友列表模型中的行，无效时清空聊天框
+     */
+    void openContact(const QModelIndex &contact);
+
+    /**
+     * @brief notifyPresence 记下一条上下线提醒，频率受限
+     * @param name 昵称
+     * @param online 上线还是下线
+     */
+    void notifyPresence(QString name, bool online);
+
+    /**
+     * @brief setChatRecord 设置当前聊天记录
+     * @param chatRecord 聊天记录内容
+     */
+    void setChatRecord(const IMChatRecord *chatRecord, const QString *name = nullptr);
+
+    /**
+     * @brief loadOlderHistory 给当前会话往前加载一页聊天记录，并保持当前看到的位置不动
+     * @return 加载的消息条数
+     */
+    int loadOlderHistory();
+
+    /**
+     * @brief jumpToMessage 打开搜索结果所在的会话并滚动到这条消息
+     * @param result 搜索结果
+     */
+    void jumpToMessage(const IMSearchResult &result);
+
+    /**
+     * @brief scheduleChatUpdate 有新消息时调用，同一帧内的多条消息合并成一次更新
+     */
+    void scheduleChatUpdate();
+
+    /**
+     * @brief sendFile 给当前选中的人发送文件
+     * @param filePath 文件路径
+     */
+    void sendFile(QString filePath);
+private:
+    Ui::MainWindow *ui;
+
+    /**
+     * @brief m_rosterModel 好友列表模型
+     */
+    IMRosterModel *m_rosterModel;
+
+    /**
+     * @brief m_rosterProxy 好友列表的排序与过滤
+     */
+    IMRosterProxy *m_rosterProxy;
+
+    /**
+     * @brief m_currentContact 当前会话在好友列表模型中的行，被过滤掉时会话不变
+     */
+    QPersistentModelIndex m_currentContact;
+
+    /**
+     * @brief m_chatModel 当前会话的聊天记录模型
+     */
+    IMChatModel *m_chatModel;
+
+    /**
+     * @brief m_chatUpdateTimer 合并新消息更新的定时器
+     */
+    QTimer *m_chatUpdateTimer;
+
+    /**
+     * @brief m_loadingHistory 正在加载聊天记录，重新显示时滚动条的变化不再触发加载
+     */
+    bool m_loadingHistory;
+
+    /**
+     * @brief m_onlineNotices 还没有提醒的上线者
+     */
+    QStringList m_onlineNotices;
+
+    /**
+     * @brief m_offlineNotices 还没有提醒的下线者
+     */
+    QStringList m_offlineNotices;
+
+    /**
+     * @brief m_noticeTimer 限制提醒频率的定时器
+     */
+    QTimer *m_noticeTimer;
+
+    /**
+     * @brief m_noticeBox 非模态的提醒框，反复使用同一个
+     */
+    QMessageBox *m_noticeBox;
+
+    /**
+     * @brief m_latencyOverlay 延迟跟踪的调试浮层，没有打开延迟跟踪时为nullptr
+     */
+    IMLatencyOverlay *m_latencyOverlay;
+};
+
+#endif // MAINWINDOW_H
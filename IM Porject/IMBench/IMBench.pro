@@ -0,0 +1,52 @@
+#-------------------------------------------------
+#
+# 基准测试：不启动界面，直接测客户端数据层、协议编解码与服务端的性能
+#
+#-------------------------------------------------
+
+QT      -= gui
+QT      += network sql
+
+TARGET = IMBench
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+# 客户端的数据层不依赖界面，直接编译客户端的源文件
+SOURCES += \
+    main.cpp \
+    imbench.cpp \
+    ../IM/imdal.cpp \
+    ../IM/imdbwriter.cpp \
+    ../IM/imsegmentstore.cpp \
+    ../IM/imarchive.cpp \
+    ../IM/imstartuptrace.cpp \
+    ../IM/impresencestore.cpp
+
+HEADERS += \
+    imbench.h \
+    ../IM/imdal.h \
+    ../IM/imdbwriter.h \
+    ../IM/imlockfreequeue.h \
+    ../IM/immessage.h \
+    ../IM/imsegmentstore.h \
+    ../IM/imarchive.h \
+    ../IM/imstartuptrace.h \
+    ../IM/impresencestore.h
+
+INCLUDEPATH += $$PWD/../IM
+
+# 协议静态库
+win32:CONFIG(release, debug|release): LIBS += -L$$OUT_PWD/../IMProtocol/release/ -lIMProtocol
+else:win32:CONFIG(debug, debug|release): LIBS += -L$$OUT_PWD/../IMProtocol/debug/ -lIMProtocol
+else:unix: LIBS += -L$$OUT_PWD/../IMProtocol/ -lIMProtocol
+
+INCLUDEPATH += $$PWD/../IMProtocol
+DEPENDPATH += $$PWD/../IMProtocol
+
+win32-g++:CONFIG(release, debug|release): PRE_TARGETDEPS += $$OUT_PWD/../IMProtocol/release/libIMProtocol.a
+else:win32-g++:CONFIG(debug, debug|release): PRE_TARGETDEPS += $$OUT_PWD/../IMProtocol/debug/libIMProtocol.a
+else:win32:!win32-g++:CONFIG(release, debug|release): PRE_TARGETDEPS += $$OUT_PWD/../IMProtocol/release/IMProtocol.lib
+else:win32:!win32-g++:CONFIG(debug, debug|release): PRE_TARGETDEPS += $$OUT_PWD/../IMProtocol/debug/IMProtocol.lib
+else:unix: PRE_TARGETDEPS += $$OUT_PWD/../IMProtocol/libIMProtocol.a
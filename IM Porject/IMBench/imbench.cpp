@@ -0,0 +1,840 @@
+#include <QDir>
+#include <QElapsedTimer>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QDebug>
+#include <QTcpSocket>
+#include <QEventLoop>
+#include <QTimer>
+#include <QSet>
+#include <QCoreApplication>
+#include <algorithm>
+#include <functional>
+#include "imbench.h"
+#include "imhybridclock.h"
+#include "imsegmentstore.h"
+#include "imcodec.h"
+
+// 测试数据中带的搜索词：隔NeedleInterval条出现一次的，只出现一次的，以及两个字的（trigram搜不了，走LIKE）
+static const char *const NeedleText = "基准暗号";
+static const char *const UniqueText = "只出现一次的句子";
+static const char *const ShortText = "暗号";
+// 词表中的一个词，搜索时匹配很多
+static const char *const CommonText = "meeting";
+// 冷存储中只出现一次的句子，跳转到它所在的位置
+static const char *const ColdText = "冷存储中的句子";
+
+// 测试数据的词表，每条消息随机取几个词
+static const char *const Words[] = {
+    "你好", "今天", "晚上", "一起", "吃饭", "开会", "项目", "进度", "文件", "已经",
+    "发给你", "看一下", "没问题", "明天", "上午", "下午", "周末", "出去", "电影", "好的",
+    "hello", "meeting", "review", "build", "release", "server", "client", "thanks", "ok", "later"
+};
+
+// 线性同余随机数，固定种子，每次生成的数据都一样
+static quint32 nextRandom(quint32 &state)
+{
+    state = state * 1103515245u + 12345u;
+    return (state >> 16) & 0x7FFF;
+}
+
+static QString millis(qint64 nanos)
+{
+    return QString::number(double(nanos) / 1000000.0, 'f', 2) + "ms";
+}
+
+// 改用IMCodec之前客户端的解析方式：整条转成QString，按空白拆出count个参数，剩下的是文本，用来对比
+static QStringList splitFields(const QByteArray &payload, int count, QString &text)
+{
+    QString data = QString::fromUtf8(payload);
+    QStringList fields;
+    int pos = 0;
+    for (int i = 0; i <= count; ++i)
+    {
+        while (pos < data.size() && data.at(pos).isSpace())
+            ++pos;
+        int start = pos;
+        while (pos < data.size() && !data.at(pos).isSpace())
+            ++pos;
+        fields.append(data.mid(start, pos - start));
+    }
+    text = pos < data.size() ? data.mid(pos + 1) : QString();
+    return fields;
+}
+
+// 按 (time, id) 严格从早到晚，没有重复
+static bool ascending(const QVector<IMMessage> &messages)
+{
+    for (int i = 1; i < messages.size(); ++i)
+    {
+        const IMMessage &a = messages.at(i - 1);
+        const IMMessage &b = messages.at(i);
+        if (!(a.time < b.time || (a.time == b.time && a.id < b.id)))
+            return false;
+    }
+    return true;
+}
+
+// 入库用的第i条消息，收、发、群聊轮流，1000个发送者，服务端编号从base+1开始不重复
+static IMDBRecord ingestRecord(int i, int base, const QDateTime &time)
+{
+    const char *io[] = { "i", "o", "g" };
+    IMDBRecord record;
+    record.userName = QString("sender%1").arg(i % 1000);
+    record.content = QString::fromUtf8("今天晚上一起吃饭吗 hello meeting %1").arg(i);
+    record.time = time.addMSecs(i);
+    record.io = io[i % 3];
+    record.msgId = quint64(base) + quint64(i) + 1;
+    record.hlc = IMHybridClock::pack(record.time.toMSecsSinceEpoch(), 0);
+    return record;
+}
+
+// 改动前写线程存一条消息的写法：每条都新建查询、重新准备语句，并查一次用户ID，用来对比
+static bool insertBefore(QSqlDatabase &database, const IMDBRecord &record)
+{
+    QSqlQuery query(database);
+    int userID = 0;
+    query.prepare("SELECT id FROM user WHERE name = ?");
+    query.addBindValue(record.userName);
+    if (!query.exec())
+        return false;
+    while (query.next())
+        userID = query.value(0).toInt();
+    if (!userID)
+    {
+        query.prepare("INSERT INTO user(name) VALUES(?)");
+        query.addBindValue(record.userName);
+        if (!query.exec())
+            return false;
+        userID = query.lastInsertId().toInt();
+    }
+    query.prepare("INSERT OR IGNORE INTO message(fromID, content, time, io, seq, pending, msgid, hlc) "
+                  "VALUES(?, ?, ?, ?, ?, ?, NULLIF(?, 0), ?)");
+    query.addBindValue(userID);
+    query.addBindValue(record.content);
+    query.addBindValue(record.time);
+    query.addBindValue(record.io);
+    query.addBindValue(qint64(record.seq));
+    query.addBindValue(record.pending ? 1 : 0);
+    query.addBindValue(qint64(record.msgId));
+    query.addBindValue(qint64(record.hlc));
+    return query.exec();
+}
+
+// 用单独的连接数一下消息条数
+static int countMessages(const QString &databaseName)
+{
+    int count = -1;
+    {
+        QSqlDatabase database = QSqlDatabase::addDatabase("QSQLITE", "IMBench_count");
+        database.setDatabaseName(databaseName);
+        QSqlQuery query(database);
+        if (database.open() && query.exec("SELECT COUNT(*) FROM message") && query.next())
+            count = query.value(0).toInt();
+        query.finish();
+        database.close();
+    }
+    QSqlDatabase::removeDatabase("IMBench_count");
+    return count;
+}
+
+IMBench::IMBench(const IMBenchOptions &options)
+    : m_options(options),
+      m_out(stdout),
+      m_temporary(nullptr),
+      m_databaseOpen(false)
+{
+    if (options.directory.isEmpty())
+    {
+        this->m_temporary = new QTemporaryDir();
+        this->m_directory = this->m_temporary->path();
+    }
+    else
+    {
+        this->m_directory = options.directory;
+        QDir().mkpath(this->m_directory);
+    }
+    // IMDAL按用户名在当前目录下找数据库
+    QDir::setCurrent(this->m_directory);
+    qDebug() << "bench directory" << this->m_directory;
+}
+
+IMBench::~IMBench()
+{
+    IMDAL::instance()->closeDatabase();
+    delete this->m_temporary;
+}
+
+QStringList IMBench::cases()
+{
+    return QStringList() << "search" << "history" << "codec" << "ingest" << "presence" << "accept";
+}
+
+bool IMBench::run(const QString &name)
+{
+    if (name == "search")
+        return this->benchSearch();
+    if (name == "history")
+        return this->benchHistory();
+    if (name == "codec")
+        return this->benchCodec();
+    if (name == "ingest")
+        return this->benchIngest();
+    if (name == "presence")
+        return this->benchPresence();
+    if (name == "accept")
+        return this->benchAccept();
+    this->m_out << "unknown case " << name << "\n";
+    this->m_out.flush();
+    return false;
+}
+
+bool IMBench::check(bool ok, const QString &what)
+{
+    if (!ok)
+    {
+        this->m_out << "FAIL  " << what << "\n";
+        this->m_out.flush();
+    }
+    return ok;
+}
+
+void IMBench::report(const QString &name, QVector<qint64> &nanos, double targetMillis, int ops)
+{
+    if (nanos.isEmpty())
+        return;
+    std::sort(nanos.begin(), nanos.end());
+    qint64 p50 = nanos.at(nanos.size() / 2);
+    this->m_out << name.leftJustified(28) << " runs " << nanos.size()
+                << " p50 " << millis(p50) << " max " << millis(nanos.last());
+    if (targetMillis > 0)
+        this->m_out << " target " << targetMillis << "ms" << (double(p50) / 1000000.0 > targetMillis ? " OVER" : "");
+    if (ops > 1)
+        this->m_out << " per op " << QString::number(double(p50) / ops, 'f', 1) << "ns";
+    this->m_out << "\n";
+    this->m_out.flush();
+}
+
+bool IMBench::openDatabase()
+{
+    if (this->m_databaseOpen)
+        return true;
+    // 和登录时一样在这里建表和升级，之后写入测试数据
+    IMDatabaseState state = IMDAL::instance()->prepareDatabase("bench");
+    // 冷存储的目录和IMDAL::initDatabase中的一样
+    this->m_segmentDirectory = state.databaseName;
+    this->m_segmentDirectory.chop(3);
+    this->m_segmentDirectory += ".segments";
+    if (!this->check(state.ok, "prepare database") || !this->seedDatabase(state.databaseName))
+        return false;
+    // 用户表在写入测试数据后才完整，重新读一次
+    state = IMDAL::instance()->prepareDatabase("bench");
+    IMDAL::instance()->initDatabase(state);
+    this->m_databaseOpen = true;
+    return true;
+}
+
+bool IMBench::seedDatabase(const QString &databaseName)
+{
+    QElapsedTimer timer;
+    timer.start();
+    bool ok = true;
+    {
+        QSqlDatabase database = QSqlDatabase::addDatabase("QSQLITE", "IMBench_seed");
+        database.setDatabaseName(databaseName);
+        if (!database.open())
+        {
+            qDebug() << database.lastError();
+            ok = false;
+        }
+        else
+        {
+            IMDAL::configureConnection(database);
+            QSqlQuery query(database);
+            // 已经写过的数据库（指定了工作目录）不再写
+            if (query.exec("SELECT COUNT(*) FROM message") && query.next() && query.value(0).toInt() > 0)
+            {
+                qDebug() << "reuse" << query.value(0).toInt() << "messages";
+                this->m_options.rows = query.value(0).toInt();
+            }
+            else
+            {
+                query.finish();
+                database.transaction();
+                query.prepare("INSERT INTO user(name) VALUES(?)");
+                for (int i = 0; i < PeerCount; ++i)
+                {
+                    query.addBindValue(QString("peer%1").arg(i));
+                    ok = ok && query.exec();
+                }
+                // 用户1是自己，对象从2开始
+                // 最早的1/ColdFraction放进冷存储，其中每隔ImportedInterval条留在数据库里，就像导入的旧记录，
+                // 读历史记录时两边的消息交错；消息的id在两边统一编号，和移出时一样
+                query.prepare("INSERT INTO message(id, fromID, content, time, io, msgid, hlc) VALUES(?, ?, ?, ?, ?, ?, ?)");
+                QDateTime first = QDateTime::currentDateTime().addDays(-SeedDays);
+                qint64 step = qint64(SeedDays) * 86400000 / qMax(1, this->m_options.rows);
+                int coldRows = this->m_options.rows / ColdFraction;
+                auto isCold = [coldRows](int i) { return i < coldRows && i % ImportedInterval != 0; };
+                // 冷存储中的句子放在peer0的一条私聊里
+                int coldTextRow = coldRows / 2 - (coldRows / 2) % PeerCount;
+                while (coldTextRow < coldRows && !isCold(coldTextRow))
+                    coldTextRow += PeerCount;
+                IMSegmentStore segments(this->m_segmentDirectory);
+                QVector<IMSegmentMessage> segment;
+                quint32 random = 1;
+                for (int i = 0; ok && i < this->m_options.rows; ++i)
+                {
+                    QStringList words;
+                    int count = 3 + int(nextRandom(random) % 10);
+                    for (int j = 0; j < count; ++j)
+                        words.append(Words[nextRandom(random) % (sizeof(Words) / sizeof(Words[0]))]);
+                    if (i % NeedleInterval == 0)
+                        words.insert(int(nextRandom(random)) % words.size(), NeedleText);
+                    if (i == this->m_options.rows / 2)
+                        words.append(UniqueText);
+                    QDateTime time = first.addMSecs(qint64(i) * step);
+                    const char *io[] = { "i", "o", "g" };
+                    QString direction = io[nextRandom(random) % 3];
+                    if (i == coldTextRow)
+                    {
+                        words.append(ColdText);
+                        direction = "i";
+                    }
+                    if (isCold(i))
+                    {
+                        // 段文件不跨月
+                        if (!segment.isEmpty() && QDateTime::fromMSecsSinceEpoch(segment.last().time).date().month() != time.date().month())
+                        {
+                            ok = segments.writeSegment(segment);
+                            segment.clear();
+                        }
+                        IMSegmentMessage msg;
+                        msg.id = qint64(i) + 1;
+                        msg.time = time.toMSecsSinceEpoch();
+                        msg.user = QString("peer%1").arg(i % PeerCount);
+                        msg.io = direction;
+                        msg.content = words.join(" ");
+                        msg.msgId = quint64(i) + 1;
+                        msg.hlc = IMHybridClock::pack(msg.time, 0);
+                        segment.append(msg);
+                        continue;
+                    }
+                    query.addBindValue(qint64(i) + 1);
+                    query.addBindValue(2 + i % PeerCount);
+                    query.addBindValue(words.join(" "));
+                    query.addBindValue(time);
+                    query.addBindValue(direction);
+                    query.addBindValue(qint64(i) + 1);
+                    query.addBindValue(qint64(IMHybridClock::pack(time.toMSecsSinceEpoch(), 0)));
+                    if (!query.exec())
+                    {
+                        qDebug() << query.lastError();
+                        ok = false;
+                    }
+                    if ((i + 1) % SeedBatchSize == 0)
+                    {
+                        ok = ok && database.commit();
+                        database.transaction();
+                    }
+                }
+                query.finish();
+                ok = database.commit() && ok;
+                ok = segments.writeSegment(segment) && ok;
+                qDebug() << "seeded" << this->m_options.rows << "messages in" << timer.elapsed() << "ms,"
+                         << segments.segmentCount() << "cold segments";
+            }
+            // 测试数据的时间范围
+            if (query.exec("SELECT MIN(time), MAX(time) FROM message") && query.next())
+            {
+                this->m_firstTime = query.value(0).toDateTime();
+                this->m_lastTime = query.value(1).toDateTime();
+            }
+            query.finish();
+        }
+        database.close();
+    }
+    QSqlDatabase::removeDatabase("IMBench_seed");
+    return this->check(ok, "seed database");
+}
+
+bool IMBench::benchSearch()
+{
+    if (!this->openDatabase())
+        return false;
+    IMDAL *dal = IMDAL::instance();
+    const int limit = 50;
+    int needles = (this->m_options.rows + NeedleInterval - 1) / NeedleInterval;
+    QDateTime middle = this->m_firstTime.addMSecs(this->m_firstTime.msecsTo(this->m_lastTime) / 2);
+    bool ok = true;
+
+    // 每一项：名字、搜索词、对象、时间范围、是否应用50ms的目标
+    // 第0条一定带搜索词，它属于peer0，按对象过滤时总能搜到
+    // 常见词出现在大约三分之一的消息中；只搜最早一天时要从新到旧跳过几乎所有匹配，是最慢的情况
+    struct SearchCase
+    {
+        const char *name;
+        QString text;
+        QString peer;
+        QDateTime from;
+        QDateTime to;
+        bool fts;
+    };
+    const SearchCase searchCases[] = {
+        { "search phrase", NeedleText, QString(), QDateTime(), QDateTime(), true },
+        { "search unique", UniqueText, QString(), QDateTime(), QDateTime(), true },
+        { "search phrase by peer", NeedleText, "peer0", QDateTime(), QDateTime(), true },
+        { "search phrase by time", NeedleText, QString(), middle, QDateTime(), true },
+        { "search common word", CommonText, QString(), QDateTime(), QDateTime(), true },
+        { "search common word by peer", CommonText, "peer0", QDateTime(), QDateTime(), true },
+        { "search common, oldest day", CommonText, QString(), QDateTime(), this->m_firstTime.addDays(1), true },
+        { "search short (LIKE)", ShortText, QString(), QDateTime(), QDateTime(), false }
+    };
+    for (const SearchCase &searchCase : searchCases)
+    {
+        QVector<IMSearchResult> results;
+        QVector<qint64> nanos;
+        // 第一次把页读进缓存，不计时
+        dal->searchMessage(searchCase.text, searchCase.peer, searchCase.from, searchCase.to, limit);
+        for (int i = 0; i < this->m_options.runs; ++i)
+        {
+            QElapsedTimer timer;
+            timer.start();
+            results = dal->searchMessage(searchCase.text, searchCase.peer, searchCase.from, searchCase.to, limit);
+            nanos.append(timer.nsecsElapsed());
+        }
+        this->report(searchCase.name, nanos, searchCase.fts ? 50 : 0);
+
+        // 检查结果：都包含搜索词，并且满足过滤条件
+        QString name = searchCase.name;
+        ok = this->check(!results.isEmpty(), name + ": no results") && ok;
+        for (const IMSearchResult &result : results)
+        {
+            if (!this->check(result.message.content.contains(searchCase.text), name + ": wrong hit " + result.message.content)
+                    || (!searchCase.peer.isEmpty() && !this->check(result.peer == searchCase.peer, name + ": wrong peer " + result.peer))
+                    || (searchCase.from.isValid() && !this->check(result.message.time >= searchCase.from, name + ": too early"))
+                    || (searchCase.to.isValid() && !this->check(result.message.time <= searchCase.to, name + ": too late")))
+            {
+                ok = false;
+                break;
+            }
+        }
+    }
+    // 条数：只出现一次的只能搜到一条，隔一段出现的搜到limit条（不够时全部）
+    ok = this->check(dal->searchMessage(UniqueText).size() == 1, "search unique: count") && ok;
+    ok = this->check(dal->searchMessage(NeedleText, QString(), QDateTime(), QDateTime(), limit).size() == qMin(limit, needles),
+                     "search phrase: count") && ok;
+    return ok;
+}
+
+bool IMBench::benchHistory()
+{
+    if (!this->openDatabase())
+        return false;
+    IMDAL *dal = IMDAL::instance();
+    const int limit = 50;
+    const QString peer = "peer0";
+    bool ok = true;
+
+    // 应该读到的条数：数据库中的加上冷存储中的
+    int expected = 0;
+    {
+        QSqlQuery query;
+        query.prepare("SELECT COUNT(*) FROM message JOIN user ON user.id = fromID WHERE name = ? AND io != 'g'");
+        query.addBindValue(peer);
+        if (query.exec() && query.next())
+            expected = query.value(0).toInt();
+        IMSegmentStore segments(this->m_segmentDirectory);
+        segments.scan([&](const IMSegmentMessage &msg) {
+            if (msg.user == peer && msg.io != "g")
+                ++expected;
+            return true;
+        });
+    }
+
+    // 最新的一页
+    QVector<IMMessage> latest;
+    QVector<qint64> nanos;
+    for (int i = 0; i < this->m_options.runs; ++i)
+    {
+        QElapsedTimer timer;
+        timer.start();
+        latest = dal->getPrivateMessage(peer, limit);
+        nanos.append(timer.nsecsElapsed());
+    }
+    this->report("history latest page", nanos);
+    ok = this->check(latest.size() == qMin(limit, expected), "history latest page: count") && ok;
+    ok = this->check(ascending(latest), "history latest page: order") && ok;
+
+    // 一页一页往前翻到最早，翻到冷存储那一段时两边的消息交错
+    QVector<IMMessage> all = latest;
+    nanos.clear();
+    while (!all.isEmpty())
+    {
+        IMMessage before = all.first();
+        QElapsedTimer timer;
+        timer.start();
+        QVector<IMMessage> page = dal->getPrivateMessage(peer, limit, &before);
+        nanos.append(timer.nsecsElapsed());
+        if (page.isEmpty())
+            break;
+        all = page + all;
+    }
+    this->report("history page back", nanos);
+    ok = this->check(all.size() == expected,
+                     QString("history page back: %1 messages, expected %2").arg(all.size()).arg(expected)) && ok;
+    ok = this->check(ascending(all), "history page back: order") && ok;
+
+    // 跳转到冷存储中的搜索结果：不限条数地从这条读到最新
+    QVector<IMSearchResult> hits = dal->searchMessage(ColdText);
+    if (!this->check(hits.size() == 1 && hits.first().peer == peer, "history jump: cold search hit"))
+        return false;
+    IMMessage hit = hits.first().message;
+    QVector<IMMessage> tail;
+    nanos.clear();
+    for (int i = 0; i < this->m_options.runs; ++i)
+    {
+        QElapsedTimer timer;
+        timer.start();
+        tail = dal->getPrivateMessage(peer, -1, nullptr, &hit);
+        nanos.append(timer.nsecsElapsed());
+    }
+    this->report("history jump to cold hit", nanos);
+    int from = 0;
+    while (from < all.size() && all.at(from).id != hit.id)
+        ++from;
+    ok = this->check(!tail.isEmpty() && tail.first().id == hit.id, "history jump: first message is the hit") && ok;
+    ok = this->check(tail.size() == all.size() - from,
+                     QString("history jump: %1 messages, expected %2").arg(tail.size()).arg(all.size() - from)) && ok;
+    ok = this->check(ascending(tail), "history jump: order") && ok;
+    return ok;
+}
+
+bool IMBench::benchCodec()
+{
+    bool ok = true;
+    const QString name = "peer0";
+    const QString content = QString::fromUtf8("今天晚上一起吃饭吗 hello meeting review 发给你看一下");
+    const quint64 msgId = 1234567;
+    const quint64 hlc = IMHybridClock::pack(QDateTime::currentMSecsSinceEpoch(), 3);
+    QVector<qint64> nanos;
+
+    // 编码：同一个缓冲区反复使用，预留过容量的QByteArray缩到0时不释放内存
+    QByteArray frame;
+    frame.reserve(256);
+    for (int run = 0; run < this->m_options.runs; ++run)
+    {
+        QElapsedTimer timer;
+        timer.start();
+        for (int i = 0; i < CodecBatchSize; ++i)
+        {
+            frame.resize(0);
+            IMCodec<IMSchema::PrivateMessage>::appendFrame(frame, name, msgId + quint64(i), hlc, content);
+        }
+        nanos.append(timer.nsecsElapsed());
+    }
+    this->report("codec encode private message", nanos, 0, CodecBatchSize);
+
+    // 解码：直接在负载上解析
+    QByteArray payload = IMCodec<IMSchema::PrivateMessage>::encodeFrame(name, msgId, hlc, content).mid(FrameHeaderSize);
+    QString fromName, text;
+    quint64 id = 0, stamp = 0;
+    nanos.clear();
+    for (int run = 0; run < this->m_options.runs; ++run)
+    {
+        QElapsedTimer timer;
+        timer.start();
+        for (int i = 0; i < CodecBatchSize; ++i)
+            IMCodec<IMSchema::PrivateMessage>::decode(payload, fromName, id, stamp, text);
+        nanos.append(timer.nsecsElapsed());
+    }
+    this->report("codec decode private message", nanos, 0, CodecBatchSize);
+    ok = this->check(IMCodec<IMSchema::PrivateMessage>::decode(payload, fromName, id, stamp, text)
+                     && fromName == name && id == msgId && stamp == hlc && text == content, "codec decode: round trip") && ok;
+
+    // 对比：原来的QString拆分
+    nanos.clear();
+    QStringList fields;
+    for (int run = 0; run < this->m_options.runs; ++run)
+    {
+        QElapsedTimer timer;
+        timer.start();
+        for (int i = 0; i < CodecBatchSize; ++i)
+        {
+            fields = splitFields(payload, 3, text);
+            id = fields.value(2).toULongLong();
+            stamp = fields.value(3).toULongLong();
+        }
+        nanos.append(timer.nsecsElapsed());
+    }
+    this->report("codec QString split (before)", nanos, 0, CodecBatchSize);
+    ok = this->check(fields.value(1) == name && text == content, "codec split: round trip") && ok;
+
+    // 登录结果中的在线列表，1000人
+    QStringList online;
+    for (int i = 0; i < 1000; ++i)
+        online.append(QString("user%1").arg(i));
+    payload = IMCodec<IMSchema::LoginSucceeded>::encodeFrame(0, online, "epoch", 42).mid(FrameHeaderSize);
+    QStringList names;
+    QString epoch;
+    int result = -1;
+    quint64 version = 0;
+    nanos.clear();
+    const int listOps = qMax(1, CodecBatchSize / 100);
+    for (int run = 0; run < this->m_options.runs; ++run)
+    {
+        QElapsedTimer timer;
+        timer.start();
+        for (int i = 0; i < listOps; ++i)
+            IMCodec<IMSchema::LoginSucceeded>::decode(payload, result, names, epoch, version);
+        nanos.append(timer.nsecsElapsed());
+    }
+    this->report("codec decode 1000-name login", nanos, 0, listOps);
+    ok = this->check(IMCodec<IMSchema::LoginSucceeded>::decode(payload, result, names, epoch, version)
+                     && result == 0 && names == online && epoch == "epoch" && version == 42, "codec login list: round trip") && ok;
+
+    // 超出范围的整数要解码失败，不能回绕
+    quint64 seq = 0;
+    int reason = 0;
+    ok = this->check(IMCodec<IMSchema::MessageAck>::decode("9 18446744073709551615 1 1", seq, id, stamp)
+                     && seq == Q_UINT64_C(18446744073709551615), "codec: max quint64") && ok;
+    ok = this->check(!IMCodec<IMSchema::MessageAck>::decode("9 18446744073709551616 1 1", seq, id, stamp), "codec: quint64 overflow") && ok;
+    ok = this->check(!IMCodec<IMSchema::MessageAck>::decode("9 99999999999999999999999 1 1", seq, id, stamp), "codec: long number") && ok;
+    ok = this->check(!IMCodec<IMSchema::MessageFailed>::decode("11 1 2147483648", seq, reason), "codec: int overflow") && ok;
+    ok = this->check(IMCodec<IMSchema::MessageFailed>::decode("11 1 -2147483648", seq, reason) && reason == INT_MIN, "codec: min int") && ok;
+    return ok;
+}
+
+bool IMBench::benchIngest()
+{
+    // 用单独的数据库，不改变其他用例的测试数据
+    IMDatabaseState state = IMDAL::instance()->prepareDatabase("ingest");
+    if (!this->check(state.ok, "ingest: prepare database"))
+        return false;
+    const int total = this->m_options.runs * IngestBatchSize;
+    const QDateTime now = QDateTime::currentDateTime();
+    bool ok = true;
+
+    // 现在的写法：写线程上准备好的语句与用户ID缓存，计时包括入队和等到提交完
+    int base = countMessages(state.databaseName);
+    QVector<qint64> nanos;
+    {
+        IMDBWriter writer(state.databaseName);
+        writer.start();
+        for (int run = 0; run < this->m_options.runs; ++run)
+        {
+            QElapsedTimer timer;
+            timer.start();
+            for (int i = 0; i < IngestBatchSize; ++i)
+                writer.enqueue(ingestRecord(run * IngestBatchSize + i, base, now));
+            writer.flush();
+            nanos.append(timer.nsecsElapsed());
+        }
+        writer.stop();
+    }
+    this->report("ingest writer", nanos, 0, IngestBatchSize);
+    ok = this->check(countMessages(state.databaseName) == base + total, "ingest writer: count") && ok;
+
+    // 对比：改动前的写法，事务的大小和写线程相同
+    base = countMessages(state.databaseName);
+    nanos.clear();
+    {
+        QSqlDatabase database = QSqlDatabase::addDatabase("QSQLITE", "IMBench_ingest");
+        database.setDatabaseName(state.databaseName);
+        if (!database.open())
+        {
+            qDebug() << database.lastError();
+            ok = false;
+        }
+        else
+        {
+            IMDAL::configureConnection(database);
+            for (int run = 0; ok && run < this->m_options.runs; ++run)
+            {
+                QElapsedTimer timer;
+                timer.start();
+                database.transaction();
+                for (int i = 0; i < IngestBatchSize; ++i)
+                {
+                    if (i > 0 && i % IngestCommitSize == 0)
+                    {
+                        ok = database.commit() && ok;
+                        database.transaction();
+                    }
+                    ok = insertBefore(database, ingestRecord(run * IngestBatchSize + i, base, now)) && ok;
+                }
+                ok = database.commit() && ok;
+                nanos.append(timer.nsecsElapsed());
+            }
+            database.close();
+        }
+    }
+    QSqlDatabase::removeDatabase("IMBench_ingest");
+    this->report("ingest prepare each (before)", nanos, 0, IngestBatchSize);
+    ok = this->check(ok && countMessages(state.databaseName) == base + total, "ingest before: count") && ok;
+    return ok;
+}
+
+bool IMBench::benchPresence()
+{
+    // 有聊天记录的人是user0到user(PresenceKnown-1)，其中编号是偶数的前PresenceOnline个在线，自己是user1
+    QVector<QString> known;
+    QVector<QString> online;
+    known.reserve(PresenceKnown);
+    online.reserve(PresenceOnline);
+    for (int i = 0; i < PresenceKnown; ++i)
+        known.append(QString("user%1").arg(i));
+    for (int i = 0; i < PresenceOnline; ++i)
+        online.append(known.at(2 * i));
+    const QString self = known.at(1);
+    const int offline = PresenceKnown - PresenceOnline - 1;
+    bool ok = true;
+
+    // 登录：和IMClient一样先按在线列表重置，数据库打开后合并有聊天记录的人，最后界面读一次两个列表
+    IMPresenceStore store;
+    QVector<qint64> nanos;
+    for (int run = 0; run < this->m_options.runs; ++run)
+    {
+        store = IMPresenceStore();
+        QElapsedTimer timer;
+        timer.start();
+        store.reset(online, QVector<QString>(), self);
+        for (const QString &name : known)
+            if (name != self && !store.contains(name))
+                store.setOnline(name, false);
+        int shown = store.onlineList().size() + store.offlineList().size();
+        nanos.append(timer.nsecsElapsed());
+        ok = this->check(shown == PresenceKnown - 1, "presence login: list sizes") && ok;
+    }
+    this->report(QString("presence login %1/%2").arg(PresenceOnline).arg(PresenceKnown), nanos, 20);
+    ok = this->check(store.onlineCount() == PresenceOnline && store.offlineList().size() == offline,
+                     "presence login: counts") && ok;
+    ok = this->check(store.onlineList().first() == known.first() && store.offlineList().first() == known.at(3),
+                     "presence login: order") && ok;
+
+    // 上下线：每次一个人改变状态，界面读一次在线列表
+    const int events = qMax(1, CodecBatchSize / 10);
+    nanos.clear();
+    for (int run = 0; run < this->m_options.runs; ++run)
+    {
+        QElapsedTimer timer;
+        timer.start();
+        for (int i = 0; i < events; ++i)
+        {
+            const QString &name = known.at((i * 7 + 2) % PresenceKnown);
+            store.setOnline(name, !store.isOnline(name));
+        }
+        nanos.append(timer.nsecsElapsed());
+    }
+    this->report("presence online/offline", nanos, 0, events);
+    int counted = 0;
+    for (const QString &name : known)
+        counted += store.isOnline(name) ? 1 : 0;
+    ok = this->check(store.onlineCount() == counted && store.onlineList().size() == counted,
+                     "presence events: online count") && ok;
+    ok = this->check(store.offlineList().size() == PresenceKnown - 1 - counted, "presence events: offline count") && ok;
+
+    // 对比：原来在QVector中线性查找，登录时是平方级的，只跑一次
+    nanos.clear();
+    {
+        QElapsedTimer timer;
+        timer.start();
+        QVector<QString> onlineBefore = online;
+        QVector<QString> offlineBefore;
+        for (int i = 0; i < known.length(); i++)
+            if (!onlineBefore.contains(known[i]) && known[i] != self)
+                offlineBefore.append(known[i]);
+        nanos.append(timer.nsecsElapsed());
+        ok = this->check(offlineBefore.size() == offline, "presence QVector: offline count") && ok;
+    }
+    this->report("presence login QVector (before)", nanos);
+    return ok;
+}
+
+bool IMBench::benchAccept()
+{
+    if (this->m_options.server.isEmpty())
+    {
+        this->m_out << "accept skipped: no server (--server host:port)\n";
+        this->m_out.flush();
+        return true;
+    }
+    int colon = this->m_options.server.lastIndexOf(':');
+    QString host = this->m_options.server.left(colon);
+    quint16 port = colon > 0 ? this->m_options.server.mid(colon + 1).toUShort() : 0;
+    if (!this->check(!host.isEmpty() && port != 0, "accept: bad server " + this->m_options.server))
+        return false;
+
+    const int total = this->m_options.connections;
+    const int window = qMin(total, this->m_options.window);
+    const QByteArray query = IMCodec<IMSchema::QueryProgress>::encodeFrame();
+    QEventLoop loop;
+    QElapsedTimer clock;
+    QVector<qint64> nanos;
+    nanos.reserve(total);
+    int started = 0;
+    int finished = 0;
+    int failed = 0;
+    QSet<QTcpSocket *> sockets;
+
+    // 每个连接连上后发一条处理进度查询，收到回复或者出错后关掉，再发起下一个，保持window个同时在连接中
+    std::function<void()> open = [&]() {
+        QTcpSocket *socket = new QTcpSocket();
+        sockets.insert(socket);
+        qint64 begin = clock.nsecsElapsed();
+        ++started;
+        auto finish = [&, socket, begin](bool ok) {
+            // 断开所有信号，关闭时不会再进来第二次
+            socket->disconnect();
+            socket->abort();
+            socket->deleteLater();
+            sockets.remove(socket);
+            if (ok)
+                nanos.append(clock.nsecsElapsed() - begin);
+            else
+                ++failed;
+            if (++finished == total)
+                loop.quit();
+            else if (started < total)
+                open();
+        };
+        QObject::connect(socket, &QTcpSocket::connected, [socket, &query]() {
+            socket->write(query);
+        });
+        QObject::connect(socket, &QTcpSocket::readyRead, [socket, finish]() {
+            QByteArray buffer = socket->peek(socket->bytesAvailable());
+            int offset = 0;
+            QByteArray payload;
+            int ret = takeFrame(buffer, offset, payload);
+            if (ret != 0)
+                finish(ret > 0 && peekFunctionCode(payload) == ServerFunctionCode::Progress);
+        });
+        QObject::connect(socket, static_cast<void (QAbstractSocket::*)(QAbstractSocket::SocketError)>(&QAbstractSocket::error),
+                         [finish](QAbstractSocket::SocketError) { finish(false); });
+        socket->connectToHost(host, port);
+    };
+
+    QTimer::singleShot(AcceptTimeout * 1000, &loop, &QEventLoop::quit);
+    clock.start();
+    for (int i = 0; i < window; ++i)
+        open();
+    if (finished < total)
+        loop.exec();
+    qint64 elapsed = clock.nsecsElapsed();
+    // 超时后还没完成的连接直接关掉，它们的信号引用了这里的局部变量
+    for (QTcpSocket *socket : sockets)
+    {
+        socket->disconnect();
+        socket->abort();
+        delete socket;
+    }
+    QCoreApplication::sendPostedEvents(nullptr, QEvent::DeferredDelete);
+
+    this->report(QString("accept storm (window %1)").arg(window), nanos);
+    this->m_out << "accept " << nanos.size() << " of " << total << " connections in " << millis(elapsed)
+                << ", " << QString::number(double(nanos.size()) * 1e9 / qMax<qint64>(1, elapsed), 'f', 0) << " per second\n";
+    this->m_out.flush();
+    bool ok = this->check(finished == total, QString("accept: %1 connections unfinished after %2s").arg(total - finished).arg(AcceptTimeout));
+    ok = this->check(failed == 0, QString("accept: %1 connections failed").arg(failed)) && ok;
+    return ok;
+}
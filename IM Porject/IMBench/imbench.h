@@ -0,0 +1,193 @@
+#ifndef IMBENCH_H
+#define IMBENCH_H
+
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QTextStream>
+#include <QTemporaryDir>
+#include <QDateTime>
+#include "imdal.h"
+#include "impresencestore.h"
+
+/**
+ * @brief 基准测试的参数
+ */
+struct IMBenchOptions
+{
+    /**
+     * @brief directory 工作目录，数据库等文件都放在这里，为空时用一个临时目录，结束后删除
+     */
+    QString directory;
+
+    /**
+     * @brief rows 数据库中预先写入的消息条数
+     */
+    int rows = 200000;
+
+    /**
+     * @brief runs 每个查询重复的次数
+     */
+    int runs = 20;
+
+    /**
+     * @brief server accept用例连接的服务端，host:port，为空时跳过这个用例
+     */
+    QString server;
+
+    /**
+     * @brief connections accept用例一共建立的连接数
+     */
+    int connections = 100000;
+
+    /**
+     * @brief window accept用例同时处于连接中的最多连接数，受打开文件数限制
+     */
+    int window = 10000;
+};
+
+/***********************************
+ *
+ * Class IMBench
+ * 客户端数据层等模块的基准测试，每个用例既测时间也检查结果
+ *
+ * 用例按名字运行，结果打印到标准输出，每行一项：名字、次数、p50、最大值，
+ * 有目标的项在后面标出目标以及是否超过；结果不对时打印FAIL，程序返回1，超过目标只报告不算失败
+ *
+ * 需要数据库的用例共用一个数据库：第一次用到时在工作目录中按正常登录的流程建好（prepareDatabase升级到最新结构），
+ * 直接用SQL写入rows条消息（全文索引由触发器同步），再用initDatabase打开，之后和客户端一样通过IMDAL读
+ * 最早的1/ColdFraction条写成冷存储的段文件，其中每隔ImportedInterval条留在数据库中（像导入的旧记录），
+ * 冷热两边的消息在时间上交错，历史记录必须合并后才是对的
+ *
+ * 用例：
+ * search   全文搜索，包括按对象、按时间过滤以及少于3个字时的LIKE查找，目标50ms
+ * history  历史记录：最新一页、一页一页翻到最早、不限条数地跳转到冷存储中的搜索结果，检查条数、顺序与不重复
+ * codec    协议编码与解码，每次计时CodecBatchSize条，同时打印每条的纳秒数，并和原来的QString拆分对比，检查整数越界
+ * ingest   消息入库：通过写线程存入IngestBatchSize条并等它们提交，和改动前每条都重新准备语句、查用户ID的写法对比，
+ *          用单独的数据库，检查条数
+ * presence 在线状态：PresenceKnown个有聊天记录的人、PresenceOnline个在线时登录并合并出在线与离线列表，目标20ms，
+ *          再测一个个上下线，并和原来的QVector查找对比，检查人数与顺序
+ * accept   重连风暴：向已经启动的服务端同时发起window个连接，一共connections个，每个连接发一条处理进度查询，
+ *          收到回复说明服务端已经accept并在工作线程上处理了它，打印每秒完成的连接数与从发起连接到收到回复的延迟；
+ *          没有指定服务端时跳过，在本机测试时客户端和服务端的打开文件数都要大于window
+ *
+ **********************************/
+
+class IMBench
+{
+public:
+    explicit IMBench(const IMBenchOptions &options);
+
+    ~IMBench();
+
+    /**
+     * @brief cases 所有用例的名字
+     */
+    static QStringList cases();
+
+    /**
+     * @brief run 运行一个用例
+     * @param name 用例的名字
+     * @return 结果都正确时返回true
+     */
+    bool run(const QString &name);
+
+private:
+    /**
+     * @brief benchSearch 全文搜索
+     */
+    bool benchSearch();
+
+    /**
+     * @brief benchHistory 历史记录的分页读取与冷热合并
+     */
+    bool benchHistory();
+
+    /**
+     * @brief benchCodec 协议的编码与解码
+     */
+    bool benchCodec();
+
+    /**
+     * @brief benchIngest 消息入库的吞吐
+     */
+    bool benchIngest();
+
+    /**
+     * @brief benchPresence 登录时合并在线状态与之后的上下线
+     */
+    bool benchPresence();
+
+    /**
+     * @brief benchAccept 服务端在重连风暴中accept连接的吞吐
+     */
+    bool benchAccept();
+
+    /**
+     * @brief openDatabase 第一次调用时建好并写入测试数据，打开数据库
+     * @return 是否成功
+     */
+    bool openDatabase();
+
+    /**
+     * @brief seedDatabase 用单独的连接写入rows条消息
+     * @param databaseName 数据库文件
+     * @return 是否成功
+     */
+    bool seedDatabase(const QString &databaseName);
+
+    /**
+     * @brief report 打印一项的耗时分布
+     * @param name 名字
+     * @param nanos 每次的纳秒数，会被排序
+     * @param targetMillis 目标毫秒数，0表示没有目标
+     * @param ops 每次计时中重复的次数，大于1时再打印每次的纳秒数
+     */
+    void report(const QString &name, QVector<qint64> &nanos, double targetMillis = 0, int ops = 1);
+
+    /**
+     * @brief check 检查一项结果，不对时打印原因
+     * @return ok
+     */
+    bool check(bool ok, const QString &what);
+
+private:
+    // 测试数据中的对象数
+    static const int PeerCount = 100;
+    // 测试数据中每隔多少条有一条带搜索词
+    static const int NeedleInterval = 997;
+    // 测试数据的时间跨度（天），小于保留期，测试时写线程不会把消息移到冷存储
+    static const int SeedDays = 30;
+    // 写入测试数据时每个事务的条数
+    static const int SeedBatchSize = 10000;
+    // 最早的多少分之一放进冷存储
+    static const int ColdFraction = 10;
+    // 冷存储那一段中每隔多少条留在数据库里
+    static const int ImportedInterval = 50;
+    // 编码与解码每次计时的条数
+    static const int CodecBatchSize = 10000;
+    // 入库每次计时的条数
+    static const int IngestBatchSize = 10000;
+    // 对比的写法每个事务的条数，和写线程一批的条数相同
+    static const int IngestCommitSize = 512;
+    // 在线状态用例中有聊天记录的人数与在线人数
+    static const int PresenceKnown = 50000;
+    static const int PresenceOnline = 20000;
+    // accept用例等待所有连接完成的最长秒数
+    static const int AcceptTimeout = 300;
+
+    IMBenchOptions m_options;
+    QTextStream m_out;
+    // 工作目录，没有指定时是新建的临时目录，结束时删除
+    QString m_directory;
+    QTemporaryDir *m_temporary;
+    // 冷存储的目录
+    QString m_segmentDirectory;
+    // 数据库是否已经打开
+    bool m_databaseOpen;
+    // 测试数据的时间范围
+    QDateTime m_firstTime;
+    QDateTime m_lastTime;
+};
+
+#endif // IMBENCH_H
@@ -0,0 +1,50 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QTextCodec>
+#include <QDebug>
+#include "imbench.h"
+
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QTextCodec *codec = QTextCodec::codecForName("UTF-8");
+    QTextCodec::setCodecForLocale(codec);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("IM的基准测试，打印每一项的耗时分布，结果不对时返回1");
+    parser.addHelpOption();
+    parser.addPositionalArgument("cases", "要运行的用例，不指定时运行全部：" + IMBench::cases().join(", "), "[cases...]");
+    QCommandLineOption directoryOption(QStringList() << "d" << "directory", "工作目录，默认用临时目录，指定时可以重复使用写好的数据库", "path");
+    QCommandLineOption rowsOption(QStringList() << "n" << "rows", "数据库中预先写入的消息条数，默认200000", "count", "200000");
+    QCommandLineOption runsOption(QStringList() << "r" << "runs", "每一项重复的次数，默认20", "count", "20");
+    QCommandLineOption serverOption(QStringList() << "s" << "server", "accept用例连接的服务端，不指定时跳过accept", "host:port");
+    QCommandLineOption connectionsOption(QStringList() << "c" << "connections", "accept用例一共建立的连接数，默认100000", "count", "100000");
+    QCommandLineOption windowOption(QStringList() << "w" << "window", "accept用例同时发起的连接数，默认10000", "count", "10000");
+    parser.addOption(directoryOption);
+    parser.addOption(rowsOption);
+    parser.addOption(runsOption);
+    parser.addOption(serverOption);
+    parser.addOption(connectionsOption);
+    parser.addOption(windowOption);
+    parser.process(a);
+
+    IMBenchOptions options;
+    options.directory = parser.value(directoryOption);
+    options.rows = qMax(1, parser.value(rowsOption).toInt());
+    options.runs = qMax(1, parser.value(runsOption).toInt());
+    options.server = parser.value(serverOption);
+    options.connections = qMax(1, parser.value(connectionsOption).toInt());
+    options.window = qMax(1, parser.value(windowOption).toInt());
+    QStringList cases = parser.positionalArguments();
+    if (cases.isEmpty())
+        cases = IMBench::cases();
+
+    bool ok = true;
+    {
+        IMBench bench(options);
+        for (const QString &name : cases)
+            ok = bench.run(name) && ok;
+    }
+    return ok ? 0 : 1;
+}
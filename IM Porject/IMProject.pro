@@ -0,0 +1,19 @@
+#-------------------------------------------------
+#
+# 整个工程：先编译协议库，再编译客户端、服务端、重放工具与基准测试
+#
+#-------------------------------------------------
+
+TEMPLATE = subdirs
+
+SUBDIRS += \
+    IMProtocol \
+    IM \
+    IMService \
+    IMReplay \
+    IMBench
+
+IM.depends = IMProtocol
+IMService.depends = IMProtocol
+IMReplay.depends = IMProtocol
+IMBench.depends = IMProtocol
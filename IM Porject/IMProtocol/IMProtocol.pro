@@ -0,0 +1,26 @@
+#-------------------------------------------------
+#
+# IM客户端与服务端共用的协议静态库
+#
+#-------------------------------------------------
+
+QT       -= gui
+
+TARGET = IMProtocol
+TEMPLATE = lib
+CONFIG += staticlib c++11
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+SOURCES += \
+    imcodec.cpp \
+    imhybridclock.cpp \
+    imtracefile.cpp \
+    imsharedring.cpp
+
+HEADERS += \
+    protocol.h \
+    imcodec.h \
+    imhybridclock.h \
+    imtracefile.h \
+    imsharedring.h
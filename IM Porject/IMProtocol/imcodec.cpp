@@ -0,0 +1,132 @@
+#include "imcodec.h"
+#include <limits>
+
+namespace IMCodecDetail {
+
+// 命令中的参数用空白分隔
+static inline bool isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static inline void skipSpaces(const char *&p, const char *end)
+{
+    while (p < end && isSpace(*p))
+        ++p;
+}
+
+void appendUtf8(QByteArray &out, const QString &text)
+{
+    // 每个UTF-16单元最多编码为3个字节（代理对是2个单元编码为4个字节），先按最大长度扩展，写完再缩回去
+    // 缩小时不释放内存，反复使用同一个out时不会再分配
+    int start = out.size();
+    out.resize(start + text.size() * 3);
+    uchar *d = reinterpret_cast<uchar *>(out.data()) + start;
+    const QChar *s = text.constData();
+    const QChar *e = s + text.size();
+    while (s < e)
+    {
+        uint c = s->unicode();
+        ++s;
+        if (c < 0x80)
+        {
+            *d++ = uchar(c);
+        }
+        else if (c < 0x800)
+        {
+            *d++ = uchar(0xC0 | (c >> 6));
+            *d++ = uchar(0x80 | (c & 0x3F));
+        }
+        else if (QChar::isHighSurrogate(c) && s < e && s->isLowSurrogate())
+        {
+            uint u = QChar::surrogateToUcs4(ushort(c), s->unicode());
+            ++s;
+            *d++ = uchar(0xF0 | (u >> 18));
+            *d++ = uchar(0x80 | ((u >> 12) & 0x3F));
+            *d++ = uchar(0x80 | ((u >> 6) & 0x3F));
+            *d++ = uchar(0x80 | (u & 0x3F));
+        }
+        else
+        {
+            // 落单的代理项按替换字符编码，与QString::toUtf8相同
+            if (QChar::isSurrogate(c))
+                c = QChar::ReplacementCharacter;
+            *d++ = uchar(0xE0 | (c >> 12));
+            *d++ = uchar(0x80 | ((c >> 6) & 0x3F));
+            *d++ = uchar(0x80 | (c & 0x3F));
+        }
+    }
+    out.resize(int(d - reinterpret_cast<const uchar *>(out.constData())));
+}
+
+void appendUnsigned(QByteArray &out, quint64 value)
+{
+    char buffer[20];
+    int i = int(sizeof(buffer));
+    do {
+        buffer[--i] = char('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    out.append(buffer + i, int(sizeof(buffer)) - i);
+}
+
+void appendSigned(QByteArray &out, qint64 value)
+{
+    if (value < 0)
+    {
+        out.append('-');
+        appendUnsigned(out, quint64(0) - quint64(value));
+    }
+    else
+    {
+        appendUnsigned(out, quint64(value));
+    }
+}
+
+bool readWord(const char *&p, const char *end, const char *&begin, int &size)
+{
+    skipSpaces(p, end);
+    begin = p;
+    while (p < end && !isSpace(*p))
+        ++p;
+    size = int(p - begin);
+    return size > 0;
+}
+
+bool readUnsigned(const char *&p, const char *end, quint64 &value)
+{
+    skipSpaces(p, end);
+    const char *begin = p;
+    quint64 v = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+    {
+        // 超过64位的数是坏数据，不能回绕成一个小的数
+        quint64 digit = quint64(*p - '0');
+        if (v > (std::numeric_limits<quint64>::max() - digit) / 10)
+            return false;
+        v = v * 10 + digit;
+        ++p;
+    }
+    if (p == begin)
+        return false;
+    value = v;
+    return true;
+}
+
+bool readSigned(const char *&p, const char *end, qint64 &value)
+{
+    skipSpaces(p, end);
+    bool negative = p < end && *p == '-';
+    if (negative)
+        ++p;
+    quint64 v = 0;
+    if (!readUnsigned(p, end, v))
+        return false;
+    // 负数最小到-2^63
+    if (v > quint64(std::numeric_limits<qint64>::max()) + (negative ? 1 : 0))
+        return false;
+    value = negative ? qint64(quint64(0) - v) : qint64(v);
+    return true;
+}
+
+}
@@ -0,0 +1,357 @@
+#ifndef IMCODEC_H
+#define IMCODEC_H
+
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+#include <QtEndian>
+#include <climits>
+#include "protocol.h"
+
+/**
+ * @brief 编码与解码用到的基本操作，在imcodec.cpp中实现
+ * 解码时p指向当前位置，读完后移动到读过的内容之后，end是负载的结尾
+ */
+namespace IMCodecDetail {
+
+/**
+ * @brief appendUtf8 把文本按UTF-8追加到out的末尾，不产生临时的QByteArray
+ */
+void appendUtf8(QByteArray &out, const QString &text);
+
+/**
+ * @brief appendUnsigned 追加一个十进制的无符号数
+ */
+void appendUnsigned(QByteArray &out, quint64 value);
+
+/**
+ * @brief appendSigned 追加一个十进制的有符号数
+ */
+void appendSigned(QByteArray &out, qint64 value);
+
+/**
+ * @brief readWord 跳过空白后读取一个不含空白的参数
+ * @param begin 参数的开头
+ * @param size 参数的字节数
+ * @return 没有参数时返回false
+ */
+bool readWord(const char *&p, const char *end, const char *&begin, int &size);
+
+/**
+ * @brief readUnsigned 跳过空白后读取一个十进制的无符号数
+ * @return 没有数字或者超过quint64的范围时返回false
+ */
+bool readUnsigned(const char *&p, const char *end, quint64 &value);
+
+/**
+ * @brief readSigned 跳过空白后读取一个十进制的有符号数
+ * @return 没有数字或者超过qint64的范围时返回false
+ */
+bool readSigned(const char *&p, const char *end, qint64 &value);
+
+}
+
+/**
+ * @brief IMText 参数类型：剩下的全部文本（消息内容、文件名），只能作为最后一个参数
+ * 与前一个参数之间只隔一个分隔符，之后的内容原样保留，可以包含空白
+ */
+struct IMText {};
+
+/**
+ * @brief IMWordList 参数类型：先是组数，后面是组数×Stride个不含空白的参数，例如 在线人数 昵称...
+ */
+template <int Stride>
+struct IMWordList {};
+
+/**
+ * @brief 每种参数类型的C++类型与编码、解码方法
+ * QString是一个不含空白的参数（昵称、纪元等），整数按十进制编码
+ */
+template <typename Field>
+struct IMField;
+
+template <>
+struct IMField<QString>
+{
+    typedef QString Type;
+    static void append(QByteArray &out, const QString &value) { IMCodecDetail::appendUtf8(out, value); }
+    static bool read(const char *&p, const char *end, QString &value)
+    {
+        const char *begin = nullptr;
+        int size = 0;
+        if (!IMCodecDetail::readWord(p, end, begin, size))
+            return false;
+        value = QString::fromUtf8(begin, size);
+        return true;
+    }
+};
+
+template <>
+struct IMField<quint64>
+{
+    typedef quint64 Type;
+    static void append(QByteArray &out, quint64 value) { IMCodecDetail::appendUnsigned(out, value); }
+    static bool read(const char *&p, const char *end, quint64 &value) { return IMCodecDetail::readUnsigned(p, end, value); }
+};
+
+template <>
+struct IMField<qint64>
+{
+    typedef qint64 Type;
+    static void append(QByteArray &out, qint64 value) { IMCodecDetail::appendSigned(out, value); }
+    static bool read(const char *&p, const char *end, qint64 &value) { return IMCodecDetail::readSigned(p, end, value); }
+};
+
+template <>
+struct IMField<int>
+{
+    typedef int Type;
+    static void append(QByteArray &out, int value) { IMCodecDetail::appendSigned(out, value); }
+    static bool read(const char *&p, const char *end, int &value)
+    {
+        qint64 v = 0;
+        if (!IMCodecDetail::readSigned(p, end, v) || v < INT_MIN || v > INT_MAX)
+            return false;
+        value = int(v);
+        return true;
+    }
+};
+
+template <>
+struct IMField<IMText>
+{
+    typedef QString Type;
+    static void append(QByteArray &out, const QString &value) { IMCodecDetail::appendUtf8(out, value); }
+    static bool read(const char *&p, const char *end, QString &value)
+    {
+        // 跳过紧跟在前一个参数后面的那个分隔符
+        if (p < end)
+            ++p;
+        value = QString::fromUtf8(p, int(end - p));
+        p = end;
+        return true;
+    }
+};
+
+template <int Stride>
+struct IMField<IMWordList<Stride> >
+{
+    typedef QStringList Type;
+    static void append(QByteArray &out, const QStringList &value)
+    {
+        IMCodecDetail::appendUnsigned(out, quint64(value.size() / Stride));
+        for (const QString &word : value)
+        {
+            out.append(' ');
+            IMCodecDetail::appendUtf8(out, word);
+        }
+    }
+    static bool read(const char *&p, const char *end, QStringList &value)
+    {
+        quint64 count = 0;
+        if (!IMCodecDetail::readUnsigned(p, end, count))
+            return false;
+        value.clear();
+        // 组数来自对方，每个参数至少占一个字节，组数比剩下的字节还多一定是坏数据，
+        // 先排除掉再乘Stride，乘法就不会回绕成一个小的数
+        if (count > quint64(end - p))
+            return false;
+        value.reserve(int(qMin<quint64>(count * Stride, 1024)));
+        for (quint64 i = 0; i < count * Stride; ++i)
+        {
+            QString word;
+            if (!IMField<QString>::read(p, end, word))
+                return false;
+            value.append(word);
+        }
+        return true;
+    }
+};
+
+/**
+ * @brief 一条命令的声明：功能码、优先级、按顺序排列的参数类型
+ */
+template <int Code, MessagePriority Priority, typename... Fields>
+struct IMCommandSchema
+{
+    enum {
+        code = Code,
+        priority = Priority,
+        fieldCount = int(sizeof...(Fields))
+    };
+};
+
+/***********************************
+ *
+ * Class IMCodec
+ * 按命令的声明生成的编码与解码函数
+ *
+ * 参数的个数和类型在编译时检查，传错了编译不过
+ * appendFrame  直接在out的末尾写入帧头与命令文本，整数在栈上格式化，文本直接编码为UTF-8，
+ *              out反复使用时不再分配内存
+ * decode       直接在负载上解析，整数不产生临时对象，只有文本参数需要生成QString
+ *              功能码不对或者参数不够时返回false，已经读到的参数仍然会填好，可选的尾部参数保持原值
+ *
+ **********************************/
+
+template <typename Schema>
+struct IMCodec;
+
+template <int Code, MessagePriority Priority, typename... Fields>
+struct IMCodec<IMCommandSchema<Code, Priority, Fields...> >
+{
+    /**
+     * @brief appendPayload 在out的末尾追加命令文本（不含帧头）
+     */
+    static void appendPayload(QByteArray &out, const typename IMField<Fields>::Type &... values)
+    {
+        IMCodecDetail::appendUnsigned(out, quint64(Code));
+        int expand[] = { 0, (out.append(' '), IMField<Fields>::append(out, values), 0)... };
+        Q_UNUSED(expand);
+    }
+
+    /**
+     * @brief appendFrame 在out的末尾追加一个完整的帧
+     */
+    static void appendFrame(QByteArray &out, const typename IMField<Fields>::Type &... values)
+    {
+        int start = out.size();
+        out.resize(start + FrameHeaderSize);
+        appendPayload(out, values...);
+        qToBigEndian<quint32>(quint32(out.size() - start - FrameHeaderSize), reinterpret_cast<uchar *>(out.data() + start));
+    }
+
+    /**
+     * @brief encodeFrame 编码为一个单独的帧
+     */
+    static QByteArray encodeFrame(const typename IMField<Fields>::Type &... values)
+    {
+        QByteArray frame;
+        frame.reserve(64);
+        appendFrame(frame, values...);
+        return frame;
+    }
+
+    /**
+     * @brief decode 从命令文本（不含帧头）中解出各个参数
+     * @return 功能码相同并且所有参数都读到了时返回true
+     */
+    static bool decode(const QByteArray &payload, typename IMField<Fields>::Type &... values)
+    {
+        const char *p = payload.constData();
+        const char *end = p + payload.size();
+        quint64 code = 0;
+        if (!IMCodecDetail::readUnsigned(p, end, code) || code != quint64(Code))
+            return false;
+        bool ok = true;
+        int expand[] = { 0, (ok = ok && IMField<Fields>::read(p, end, values), 0)... };
+        Q_UNUSED(expand);
+        return ok;
+    }
+};
+
+/**
+ * @brief 所有命令的声明，参数的含义见protocol.h
+ * 同一个功能码有几种布局时分别声明，由接收方按第一个参数区分
+ */
+namespace IMSchema {
+
+// 客户端命令
+typedef IMCommandSchema<ClientFunctionCode::Login, ControlPriority, QString> Login;
+typedef IMCommandSchema<ClientFunctionCode::Login, ControlPriority, QString, QString, quint64> Relogin;
+typedef IMCommandSchema<ClientFunctionCode::SendPrivateMessage, InteractivePriority, QString, IMText> SendPrivateMessage;
+typedef IMCommandSchema<ClientFunctionCode::SendGroupMessage, BulkPriority, IMText> SendGroupMessage;
+typedef IMCommandSchema<ClientFunctionCode::SendFileRequest, InteractivePriority, QString, quint64, qint64, IMText> SendFileRequest;
+typedef IMCommandSchema<ClientFunctionCode::AcceptFile, InteractivePriority, QString, quint64, qint64> AcceptFile;
+typedef IMCommandSchema<ClientFunctionCode::CancelFile, InteractivePriority, QString, quint64> CancelFile;
+typedef IMCommandSchema<ClientFunctionCode::AttachTransfer, ControlPriority, quint64, int, QString> AttachTransfer;
+typedef IMCommandSchema<ClientFunctionCode::AttachSharedMemory, ControlPriority, QString> AttachSharedMemory;
+typedef IMCommandSchema<ClientFunctionCode::SendTrackedPrivateMessage, InteractivePriority, quint64, QString, IMText> SendTrackedPrivateMessage;
+typedef IMCommandSchema<ClientFunctionCode::SendTrackedGroupMessage, BulkPriority, quint64, IMText> SendTrackedGroupMessage;
+typedef IMCommandSchema<ClientFunctionCode::QueryProgress, ControlPriority> QueryProgress;
+
+// 服务端命令
+// 聊天消息：发送者 消息编号 时间(HLC) 内容
+typedef IMCommandSchema<ServerFunctionCode::PrivateMessage, InteractivePriority, QString, quint64, quint64, IMText> PrivateMessage;
+typedef IMCommandSchema<ServerFunctionCode::GroupMessage, BulkPriority, QString, quint64, quint64, IMText> GroupMessage;
+typedef IMCommandSchema<ServerFunctionCode::UserOnline, ControlPriority, QString, quint64> UserOnline;
+typedef IMCommandSchema<ServerFunctionCode::UserOffline, ControlPriority, QString, quint64> UserOffline;
+typedef IMCommandSchema<ServerFunctionCode::FileRequest, InteractivePriority, QString, quint64, qint64, IMText> FileRequest;
+typedef IMCommandSchema<ServerFunctionCode::FileAccepted, InteractivePriority, QString, quint64, qint64> FileAccepted;
+typedef IMCommandSchema<ServerFunctionCode::FileCancelled, InteractivePriority, QString, quint64> FileCancelled;
+typedef IMCommandSchema<ServerFunctionCode::TransferReady, ControlPriority> TransferReady;
+// 消息确认：序号 消息编号 时间(HLC)
+typedef IMCommandSchema<ServerFunctionCode::MessageAck, InteractivePriority, quint64, quint64, quint64> MessageAck;
+// 消息发送失败：序号 原因
+typedef IMCommandSchema<ServerFunctionCode::MessageFailed, InteractivePriority, quint64, int> MessageFailed;
+// 处理进度：收到的帧数 待处理的命令数 是否在并行分发
+typedef IMCommandSchema<ServerFunctionCode::Progress, ControlPriority, quint64, int, int> Progress;
+// 登录成功：0 在线人数 昵称... 纪元 版本
+typedef IMCommandSchema<ServerFunctionCode::LoginResult, ControlPriority, int, IMWordList<1>, QString, quint64> LoginSucceeded;
+// 增量同步成功：2 纪元 版本 人数 (是否在线 昵称)...
+typedef IMCommandSchema<ServerFunctionCode::LoginResult, ControlPriority, int, QString, quint64, IMWordList<2> > LoginResynced;
+// 登录失败：1
+typedef IMCommandSchema<ServerFunctionCode::LoginResult, ControlPriority, int> LoginFailed;
+
+}
+
+/**
+ * @brief 一组命令声明，按功能码在编译生成的比较链中查找优先级
+ * 同一个功能码有几种布局时用排在前面的那个
+ */
+template <typename... Schemas>
+struct IMSchemaList;
+
+template <>
+struct IMSchemaList<>
+{
+    static MessagePriority priority(int) { return ControlPriority; }
+};
+
+template <typename Schema, typename... Rest>
+struct IMSchemaList<Schema, Rest...>
+{
+    static MessagePriority priority(int code)
+    {
+        return code == Schema::code ? MessagePriority(Schema::priority) : IMSchemaList<Rest...>::priority(code);
+    }
+};
+
+/**
+ * @brief 客户端发出的所有命令
+ */
+typedef IMSchemaList<IMSchema::Relogin, IMSchema::SendPrivateMessage, IMSchema::SendGroupMessage,
+                     IMSchema::SendFileRequest, IMSchema::AcceptFile, IMSchema::CancelFile,
+                     IMSchema::AttachTransfer, IMSchema::AttachSharedMemory,
+                     IMSchema::SendTrackedPrivateMessage, IMSchema::SendTrackedGroupMessage,
+                     IMSchema::QueryProgress> IMClientSchemas;
+
+/**
+ * @brief 服务端发出的所有命令，登录结果的几种布局优先级相同，只列出LoginSucceeded
+ */
+typedef IMSchemaList<IMSchema::PrivateMessage, IMSchema::GroupMessage, IMSchema::UserOnline, IMSchema::UserOffline,
+                     IMSchema::FileRequest, IMSchema::FileAccepted, IMSchema::FileCancelled,
+                     IMSchema::TransferReady, IMSchema::MessageAck, IMSchema::LoginSucceeded,
+                     IMSchema::MessageFailed, IMSchema::Progress> IMServerSchemas;
+
+/**
+ * @brief clientCommandPriority 客户端命令的优先级
+ * @param functionCode 客户端功能码
+ * @return 优先级
+ */
+inline MessagePriority clientCommandPriority(int functionCode)
+{
+    return IMClientSchemas::priority(functionCode);
+}
+
+/**
+ * @brief serverCommandPriority 服务端命令的优先级
+ * @param functionCode 服务端功能码
+ * @return 优先级
+ */
+inline MessagePriority serverCommandPriority(int functionCode)
+{
+    return IMServerSchemas::priority(functionCode);
+}
+
+#endif // IMCODEC_H
@@ -0,0 +1,30 @@
+#include <QDateTime>
+#include <QDebug>
+#include "imhybridclock.h"
+
+IMHybridClock::IMHybridClock()
+    : m_last(0)
+{
+}
+
+quint64 IMHybridClock::now()
+{
+    quint64 wall = pack(QDateTime::currentMSecsSinceEpoch(), 0);
+    // 系统时间没有前进（同一毫秒或者往回调了）时在上一个时间戳上加一
+    this->m_last = wall > this->m_last ? wall : this->m_last + 1;
+    return this->m_last;
+}
+
+quint64 IMHybridClock::update(quint64 remote)
+{
+    qint64 wallTime = QDateTime::currentMSecsSinceEpoch();
+    if (physical(remote) > wallTime + MaxDrift)
+    {
+        qDebug() << "IMHybridClock: ignore remote time" << physical(remote) << "local" << wallTime;
+        remote = 0;
+    }
+    quint64 wall = pack(wallTime, 0);
+    quint64 seen = qMax(this->m_last, remote);
+    this->m_last = wall > seen ? wall : seen + 1;
+    return this->m_last;
+}
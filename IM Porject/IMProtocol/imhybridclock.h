@@ -0,0 +1,80 @@
+#ifndef IMHYBRIDCLOCK_H
+#define IMHYBRIDCLOCK_H
+
+#include <QtGlobal>
+
+/***********************************
+ *
+ * Class IMHybridClock
+ * 混合逻辑时钟（HLC）
+ *
+ * 时间戳是一个64位无符号数：高48位是毫秒时间戳，低16位是逻辑计数
+ * [物理时间 ms(48位)][逻辑计数(16位)]
+ * 直接按整数比较就是时间顺序，物理部分和系统时间相差不大，可以直接当作时间显示
+ *
+ * now     本地事件（服务端收到一条消息、客户端发出一条消息），系统时间前进了就用系统时间，
+ *         否则在上一个时间戳上加一，系统时间往回调时也不会倒退
+ * update  收到别人的时间戳，之后的时间戳都比它大，因果在前的消息排在前面
+ *         对方的物理时间比本机快MaxDrift以上时认为是错误的时间，不跟随
+ *
+ * 逻辑计数在同一毫秒内用完时进位到物理部分，相当于借用下一毫秒
+ * 不是线程安全的，服务端只在服务端线程中使用，客户端只在界面线程中使用
+ *
+ **********************************/
+
+class IMHybridClock
+{
+public:
+    /**
+     * @brief LogicalBits 逻辑计数的位数
+     */
+    static const int LogicalBits = 16;
+
+    /**
+     * @brief MaxDrift 对方的时钟最多比本机快多少毫秒
+     */
+    static const qint64 MaxDrift = 60 * 1000;
+
+    IMHybridClock();
+
+    /**
+     * @brief now 生成一个本地事件的时间戳，比之前生成和收到的都大
+     */
+    quint64 now();
+
+    /**
+     * @brief update 收到别人的时间戳
+     * @param remote 对方的时间戳，0表示没有
+     * @return 收到这个事件的时间戳，比remote和之前的都大
+     */
+    quint64 update(quint64 remote);
+
+    /**
+     * @brief last 最后一个时间戳，还没有时为0
+     */
+    quint64 last() const { return m_last; }
+
+    /**
+     * @brief pack 由毫秒时间戳与逻辑计数组成时间戳
+     */
+    static quint64 pack(qint64 physical, quint32 logical)
+    {
+        return (quint64(qMax<qint64>(0, physical)) << LogicalBits) | (logical & ((1u << LogicalBits) - 1));
+    }
+
+    /**
+     * @brief physical 时间戳的物理部分（毫秒时间戳）
+     */
+    static qint64 physical(quint64 stamp) { return qint64(stamp >> LogicalBits); }
+
+    /**
+     * @brief logical 时间戳的逻辑计数
+     */
+    static quint32 logical(quint64 stamp) { return quint32(stamp & ((1u << LogicalBits) - 1)); }
+
+private:
+    // 最后一个时间戳
+    quint64 m_last;
+};
+
+#endif // IMHYBRIDCLOCK_H
@@ -0,0 +1,97 @@
+#include <cstring>
+#include "imsharedring.h"
+
+IMSharedRing::IMSharedRing()
+    : m_header(nullptr),
+      m_data(nullptr)
+{
+}
+
+IMSharedRing::~IMSharedRing()
+{
+    if (m_memory.isAttached())
+        m_memory.detach();
+}
+
+bool IMSharedRing::create(QString key, quint32 capacity)
+{
+    m_memory.setKey(key);
+    if (!m_memory.create(int(sizeof(Header) + capacity)))
+        return false;
+
+    // 还没有交给消费者，不需要加锁
+    memset(m_memory.data(), 0, sizeof(Header));
+    m_header = static_cast<Header *>(m_memory.data());
+    m_data = static_cast<char *>(m_memory.data()) + sizeof(Header);
+    m_header->capacity = capacity;
+    m_header->head.store(0);
+    m_header->tail.store(0);
+    m_header->magic = Magic;
+    return true;
+}
+
+bool IMSharedRing::attach(QString key)
+{
+    m_memory.setKey(key);
+    if (!m_memory.attach())
+        return false;
+
+    Header *header = static_cast<Header *>(m_memory.data());
+    // 检查头部，防止附加到别的共享内存上
+    if (m_memory.size() < int(sizeof(Header)) || header->magic != Magic
+            || header->capacity == 0 || m_memory.size() < int(sizeof(Header) + header->capacity))
+    {
+        m_memory.detach();
+        return false;
+    }
+    m_header = header;
+    m_data = static_cast<char *>(m_memory.data()) + sizeof(Header);
+    return true;
+}
+
+bool IMSharedRing::write(const QByteArray &data)
+{
+    if (m_header == nullptr)
+        return false;
+
+    const quint64 capacity = m_header->capacity;
+    const quint64 size = quint64(data.size());
+    quint64 head = m_header->head.load();
+    quint64 tail = m_header->tail.loadAcquire();
+    if (capacity - (head - tail) < size)
+        return false;
+
+    // 写到末尾时绕回开头
+    quint64 pos = head % capacity;
+    quint64 first = qMin(size, capacity - pos);
+    memcpy(m_data + pos, data.constData(), size_t(first));
+    memcpy(m_data, data.constData() + first, size_t(size - first));
+
+    // 数据写好后再移动写指针
+    m_header->head.storeRelease(head + size);
+    return true;
+}
+
+QByteArray IMSharedRing::read()
+{
+    if (m_header == nullptr)
+        return QByteArray();
+
+    const quint64 capacity = m_header->capacity;
+    quint64 tail = m_header->tail.load();
+    quint64 head = m_header->head.loadAcquire();
+    quint64 size = head - tail;
+    if (size == 0 || size > capacity)
+        return QByteArray();
+
+    QByteArray data;
+    data.resize(int(size));
+    quint64 pos = tail % capacity;
+    quint64 first = qMin(size, capacity - pos);
+    memcpy(data.data(), m_data + pos, size_t(first));
+    memcpy(data.data() + first, m_data, size_t(size - first));
+
+    // 数据读走后再移动读指针
+    m_header->tail.storeRelease(tail + size);
+    return data;
+}
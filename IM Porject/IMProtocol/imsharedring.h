@@ -0,0 +1,99 @@
+#ifndef IMSHAREDRING_H
+#define IMSHAREDRING_H
+
+#include <QSharedMemory>
+#include <QByteArray>
+#include <QString>
+#include <QAtomicInt>
+
+/***********************************
+ *
+ * Class IMSharedRing
+ * 共享内存中的单生产者单消费者环形缓冲区
+ *
+ * 客户端创建并写入，服务端附加并读取，读写都不加锁：
+ * 写指针只由生产者修改，读指针只由消费者修改，两个指针都是只增不减的字节计数，
+ * 用 acquire/release 语义保证对方看到指针变化时，数据已经写好/已经读走
+ *
+ * 内存布局：[头部][数据区 capacity 字节]
+ *
+ **********************************/
+
+class IMSharedRing
+{
+public:
+    IMSharedRing();
+
+    ~IMSharedRing();
+
+    /**
+     * @brief create 生产者创建共享内存
+     * @param key 共享内存的key
+     * @param capacity 数据区大小
+     * @return 是否成功
+     */
+    bool create(QString key, quint32 capacity);
+
+    /**
+     * @brief attach 消费者附加到已经存在的共享内存
+     * @param key 共享内存的key
+     * @return 是否成功
+     */
+    bool attach(QString key);
+
+    /**
+     * @brief key 共享内存的key
+     */
+    QString key() const { return m_memory.key(); }
+
+    /**
+     * @brief isValid 是否已经创建或附加成功
+     */
+    bool isValid() const { return m_header != nullptr; }
+
+    /**
+     * @brief write 生产者写入数据，剩余空间不够时整段都不写
+     * @param data 数据
+     * @return 是否写入
+     */
+    bool write(const QByteArray &data);
+
+    /**
+     * @brief read 消费者读出当前所有可读的数据
+     * @return 数据，没有时为空
+     */
+    QByteArray read();
+
+    /**
+     * @brief isDrained 写入的数据是否都已经被消费者读走
+     */
+    bool isDrained() const { return m_header == nullptr || m_header->head.loadAcquire() == m_header->tail.loadAcquire(); }
+
+    /**
+     * @brief capacity 数据区大小
+     */
+    quint32 capacity() const { return m_header == nullptr ? 0 : m_header->capacity; }
+
+private:
+    /**
+     * @brief 共享内存的头部，读写指针放在不同的缓存行上，避免互相干扰
+     */
+    struct Header
+    {
+        quint32 magic;
+        quint32 capacity;
+        char padding1[56];
+        QBasicAtomicInteger<quint64> head;
+        char padding2[56];
+        QBasicAtomicInteger<quint64> tail;
+        char padding3[56];
+    };
+
+    static const quint32 Magic = 0x494d5247;
+
+    QSharedMemory m_memory;
+    Header *m_header;
+    char *m_data;
+};
+
+#endif // IMSHAREDRING_H
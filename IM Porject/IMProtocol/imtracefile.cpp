@@ -0,0 +1,133 @@
+#include <QtEndian>
+#include "imtracefile.h"
+
+// 文件头的魔数与版本
+static const quint32 TraceMagic = 0x494D5452;
+static const quint32 TraceVersion = 1;
+
+// 追加一个变长整数，每字节7位，低位在前
+static void appendVarint(QByteArray &out, quint64 value)
+{
+    char bytes[10];
+    int size = 0;
+    while (value >= 0x80)
+    {
+        bytes[size++] = char(0x80 | (value & 0x7F));
+        value >>= 7;
+    }
+    bytes[size++] = char(value);
+    out.append(bytes, size);
+}
+
+QByteArray IMTraceFile::header(qint64 startTime)
+{
+    QByteArray header(HeaderSize, '\0');
+    uchar *p = reinterpret_cast<uchar *>(header.data());
+    qToBigEndian<quint32>(TraceMagic, p);
+    qToBigEndian<quint32>(TraceVersion, p + 4);
+    qToBigEndian<qint64>(startTime, p + 8);
+    return header;
+}
+
+void IMTraceFile::appendRecord(QByteArray &out, IMTraceRecord::Type type, qint64 delta,
+                               quint64 connection, const QByteArray &payload)
+{
+    out.append(char(type));
+    appendVarint(out, quint64(qMax<qint64>(0, delta)));
+    appendVarint(out, connection);
+    if (type == IMTraceRecord::Frame)
+    {
+        appendVarint(out, quint64(payload.size()));
+        out.append(payload);
+    }
+}
+
+IMTraceReader::IMTraceReader()
+    : m_data(nullptr),
+      m_size(0),
+      m_pos(0),
+      m_startTime(0),
+      m_time(0),
+      m_end(false)
+{
+}
+
+bool IMTraceReader::open(const QString &path)
+{
+    this->m_file.setFileName(path);
+    if (!this->m_file.open(QIODevice::ReadOnly))
+    {
+        this->m_error = this->m_file.errorString();
+        return false;
+    }
+    this->m_size = this->m_file.size();
+    // 整个文件映射到内存，由系统按需读入，录制文件再大也不占用进程的堆内存
+    this->m_data = this->m_size > 0 ? this->m_file.map(0, this->m_size) : nullptr;
+    if (this->m_data == nullptr)
+    {
+        this->m_error = this->m_size > 0 ? this->m_file.errorString() : QString("empty file");
+        return false;
+    }
+    if (this->m_size < IMTraceFile::HeaderSize
+            || qFromBigEndian<quint32>(this->m_data) != TraceMagic
+            || qFromBigEndian<quint32>(this->m_data + 4) != TraceVersion)
+    {
+        this->m_error = "not an IM trace";
+        return false;
+    }
+    this->m_startTime = qFromBigEndian<qint64>(this->m_data + 8);
+    this->m_pos = IMTraceFile::HeaderSize;
+    this->m_time = 0;
+    this->m_end = false;
+    return true;
+}
+
+bool IMTraceReader::readVarint(quint64 &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (this->m_pos >= this->m_size)
+            return false;
+        uchar byte = this->m_data[this->m_pos++];
+        value |= quint64(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+bool IMTraceReader::next(IMTraceRecord &record)
+{
+    if (this->m_data == nullptr || this->m_end || this->m_pos >= this->m_size)
+        return false;
+    qint64 start = this->m_pos;
+    int type = this->m_data[this->m_pos++];
+    if (type == IMTraceRecord::End)
+    {
+        this->m_end = true;
+        return false;
+    }
+    quint64 delta = 0;
+    quint64 connection = 0;
+    quint64 length = 0;
+    if (type > IMTraceRecord::Close || !this->readVarint(delta) || !this->readVarint(connection)
+            || (type == IMTraceRecord::Frame && (!this->readVarint(length) || length > quint64(this->m_size - this->m_pos))))
+    {
+        // 服务端异常退出时最后一条可能只写了一半
+        this->m_error = QString("truncated record at %1").arg(start);
+        this->m_pos = this->m_size;
+        return false;
+    }
+    this->m_time += qint64(delta);
+    record.type = IMTraceRecord::Type(type);
+    record.time = this->m_time;
+    record.connection = connection;
+    record.payload.clear();
+    if (type == IMTraceRecord::Frame)
+    {
+        record.payload = QByteArray(reinterpret_cast<const char *>(this->m_data + this->m_pos), int(length));
+        this->m_pos += qint64(length);
+    }
+    return true;
+}
@@ -0,0 +1,166 @@
+#ifndef IMTRACEFILE_H
+#define IMTRACEFILE_H
+
+#include <QString>
+#include <QByteArray>
+#include <QFile>
+
+/**
+ * @brief 录制文件中的一条记录
+ */
+struct IMTraceRecord
+{
+    /**
+     * @brief 记录的类型
+     */
+    enum Type {
+        // 录制结束，正常关闭的文件最后一条是它
+        End = 0,
+
+        // 新连接
+        Open = 1,
+
+        // 连接上收到的一帧命令
+        Frame = 2,
+
+        // 连接断开
+        Close = 3
+    };
+
+    /**
+     * @brief type 记录的类型
+     */
+    Type type = End;
+
+    /**
+     * @brief time 从录制开始起的微秒数，单调时钟
+     */
+    qint64 time = 0;
+
+    /**
+     * @brief connection 服务端的连接编号
+     */
+    quint64 connection = 0;
+
+    /**
+     * @brief payload 命令文本，只有Frame才有
+     */
+    QByteArray payload;
+};
+
+/***********************************
+ *
+ * 服务端录制文件的格式
+ *
+ * [魔数 'IMTR'][版本 quint32][开始录制时的系统时间 qint64 毫秒时间戳]   大端序，共16字节
+ * [记录] [记录] ... [End]                                           没有End的文件是服务端没有正常退出时留下的
+ *
+ * 每条记录：[类型 1字节][距上一条的微秒数 变长][连接编号 变长]，Frame后面再跟 [负载长度 变长][命令文本]
+ * 变长整数每字节7位，低位在前，最高位为1表示后面还有，小的数只占一个字节
+ * 时间取服务端收到这一帧的单调时钟，只记录与上一条的差，一般是一两个字节
+ *
+ * 只记录解出的命令，帧中的时间戳块不记录；转发模式下传输连接上的原始字节不是命令，也不记录
+ *
+ **********************************/
+
+/***********************************
+ *
+ * Class IMTraceFile
+ * 录制文件的编码，服务端用它把记录追加到写缓冲中
+ *
+ **********************************/
+
+class IMTraceFile
+{
+public:
+    /**
+     * @brief HeaderSize 文件头的长度
+     */
+    static const int HeaderSize = 16;
+
+    /**
+     * @brief header 生成文件头
+     * @param startTime 开始录制时的系统时间（毫秒时间戳）
+     */
+    static QByteArray header(qint64 startTime);
+
+    /**
+     * @brief appendRecord 把一条记录编码后追加到out的末尾
+     * @param out 写缓冲
+     * @param type 记录的类型
+     * @param delta 距上一条记录的微秒数，不能小于0
+     * @param connection 连接编号
+     * @param payload 命令文本，只有Frame才写入
+     */
+    static void appendRecord(QByteArray &out, IMTraceRecord::Type type, qint64 delta,
+                             quint64 connection, const QByteArray &payload = QByteArray());
+
+private:
+    IMTraceFile();
+};
+
+/***********************************
+ *
+ * Class IMTraceReader
+ * 把录制文件映射到内存，按顺序读出每一条记录
+ *
+ **********************************/
+
+class IMTraceReader
+{
+public:
+    IMTraceReader();
+    Q_DISABLE_COPY(IMTraceReader)
+
+    /**
+     * @brief open 打开并映射文件，检查文件头
+     * @param path 文件路径
+     * @return 是否成功
+     */
+    bool open(const QString &path);
+
+    /**
+     * @brief next 读出下一条记录，time换算成从录制开始起的微秒数
+     * @return 读到End、文件不完整或者损坏时返回false
+     */
+    bool next(IMTraceRecord &record);
+
+    /**
+     * @brief atEnd 是否读到了End，next返回false后用来区分正常结束和文件不完整
+     */
+    bool atEnd() const { return m_end; }
+
+    /**
+     * @brief startTime 开始录制时的系统时间（毫秒时间戳）
+     */
+    qint64 startTime() const { return m_startTime; }
+
+    /**
+     * @brief errorString 出错的原因
+     */
+    QString errorString() const { return m_error; }
+
+private:
+    /**
+     * @brief readVarint 读取一个变长整数
+     * @return 数据不够或者超过64位时返回false
+     */
+    bool readVarint(quint64 &value);
+
+private:
+    QFile m_file;
+    // 映射的文件内容与大小
+    const uchar *m_data;
+    qint64 m_size;
+    // 下一条记录的位置
+    qint64 m_pos;
+    // 开始录制时的系统时间
+    qint64 m_startTime;
+    // 上一条记录的时间
+    qint64 m_time;
+    // 是否读到了End
+    bool m_end;
+    QString m_error;
+};
+
+#endif // IMTRACEFILE_H
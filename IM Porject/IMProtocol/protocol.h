@@ -0,0 +1,409 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <QByteArray>
+#include <QtEndian>
+#include <cstring>
+#include <chrono>
+
+/************************************************
+ * IM通讯协议规定
+ *
+ * 功能码 [参数]
+ *
+ * 客户端功能码规定：      参数：               例子：                         说明：
+ * 1 = 请求登录          用户昵称 [纪元 版本]    1  张三                       当客户端登录时必须先发送这条命令，告诉服务端自己的昵称
+ *                                              1  张三 lx2k9a 1024            断线重连时带上上次登录得到的在线状态纪元与版本，见下面的重连同步说明
+ * 2 = 发送私聊消息       私聊对象 消息内容      2  李四  你妈喊你回家吃饭        当A向B发送一条私聊消息时，A要向服务器发送这条指令，告诉服务器消息发给谁和发什么消息
+ * 3 = 发送群聊消息       消息内容              3  大家好，我是张三             当A向群聊发送一条消息时，直接告诉服务端需要发什么内容即可
+ * 4 = 请求发送文件       接收者 传输编号 大小 文件名   4  李四 123 1024 a.txt      A要给B发文件时先发送这条指令，传输编号由A随机生成
+ * 5 = 接受文件          发送者 传输编号 偏移        5  张三 123 0                B同意接收时发送，偏移是B已经收到的字节数，断点续传时不为0
+ * 6 = 拒绝/取消文件      对方昵称 传输编号          6  张三 123                  任意一方拒绝或者取消传输
+ * 7 = 连接传输通道       传输编号 角色(0发送 1接收) 昵称  7  123 0 张三      只在单独的传输连接上发送，见下面的传输通道说明
+ * 8 = 启用共享内存       共享内存的key             8  IM_xxx                   只能在本地连接上发送，见下面的本地传输说明
+ * 9 = 发送私聊消息(确认)  序号 私聊对象 消息内容    9  1544000000000001 李四 吃了吗   与2相同，服务端处理后用服务端的9确认，见下面的消息确认说明
+ * 10 = 发送群聊消息(确认) 序号 消息内容            10 1544000000000002 大家好      与3相同，服务端处理后确认
+ * 11 = 查询处理进度       无                      11                       不需要登录，服务端立即用12回复，重放工具用它判断服务端是否处理完，见下面的处理进度说明
+ *
+ * 服务端功能码规定：      参数：               例子：                     说明：
+ * 1 = 发送私聊消息       用户昵称 消息编号 时间 消息内容   1 张三 ... 你妈喊你回家吃饭   当A向B发送一条私聊消息时，B会收到这条指令，其中昵称是指A（发送者）的昵称，编号与时间见下面的消息编号说明
+ * 2 = 发送群聊消息       用户昵称 消息编号 时间 消息内容   2 张三 ... 大家好，我是张三   当A向群聊发送一条消息时，所有人都会收到这条指令，其中昵称是指A（发送者）的昵称
+ * 3 = 某人上线           用户昵称 版本         3 张三 1025                 当A上线时，所有人都会收到这条指令，其中昵称是A（上线者）的昵称
+ * 4 = 某人下线           用户昵称 版本         4 张三 1026                 当A下线时，所有人都会手套这条指令，其中昵称是A（下线者）的昵称
+ * 5 = 文件请求           发送者 传输编号 大小 文件名   5 张三 123 1024 a.txt      转发给接收者B
+ * 6 = 文件被接受         接收者 传输编号 偏移        6 李四 123 0               转发给发送者A，A收到后打开传输通道并从偏移处开始发送
+ * 7 = 文件被拒绝/取消     对方昵称 传输编号          7 李四 123                 转发给另一方
+ * 8 = 传输通道就绪        无                      8                         只在发送方的传输连接上发送，收到后开始发送文件数据
+ * 9 = 消息确认           序号 消息编号 时间        9 1544000000000001 ...      客户端用9、10发送的消息已经放入了接收者连接的发送队列（群聊是处理时所有在线的人），带回服务端分配的编号与时间
+ * 10 = 登录结果          结果(0:成功，1:失败，2:增量同步成功) ...
+ *                                成功时     10 0 4 张三 李四 王五 赵六 纪元 版本    当客户端发送登录请求后，如果登录成功则返回当前在线人数与昵称列表，最后是在线状态的纪元与版本
+ *                                失败时     10 1
+ *                                增量时     10 2 纪元 版本 2 1 张三 0 李四          重连时只返回变化了的人数与 (是否在线 昵称) 对，见下面的重连同步说明
+ * 11 = 消息发送失败       序号 原因(1:对方不在线)    11 1544000000000001 1      客户端用9发送的私聊没有转发，消息没有编号，见下面的消息确认说明
+ * 12 = 处理进度          收到的帧数 待处理的命令数 是否在并行分发   12 10250 0 0    回复11
+ *
+ * 传输通道：
+ * 文件数据不走聊天连接，双方各自再连一次服务器，第一帧发送 7 传输编号 角色 昵称，
+ * 传输连接不登录，服务端只接受昵称是这次传输中这个角色（发送者或接收者）、并且这个人的聊天连接已经登录的连接，否则直接断开
+ * 服务端等两边都连上后把两个连接配对，之后发送方连接上收到的原始字节直接转发给接收方，不再分帧
+ * 发送方收到 8 之后才开始按固定大小的块发送数据，转发时按接收方的积压情况暂停读取，由TCP流量控制让发送方慢下来
+ * 传输通道断开后，接收方可以用已经收到的字节数作为偏移重新发送 5，双方重新连接传输通道继续传输
+ *
+ * 本地传输：
+ * 与服务端在同一台机器上的客户端可以不走TCP，改用本地套接字（Unix域套接字/命名管道）连接，协议完全相同
+ * 发送量大的本地客户端还可以再创建一块共享内存作为环形缓冲区，通过本地连接发送 8 key 告诉服务端，
+ * 之后客户端发出的所有帧都写入环形缓冲区，服务端定时轮询读取，每条消息不再需要一次系统调用，
+ * 服务端发给客户端的数据仍然走本地连接
+ *
+ * 重连同步：
+ * 服务端每次有人上下线都把在线状态的版本加一，并在一个有限长度的日志中记下这次变化，
+ * 纪元是服务端启动时生成的，服务端重启后版本从头开始，纪元也就不同了
+ * 客户端记下登录结果与上下线通知中的纪元和版本，断线重连时在登录命令中带上，
+ * 纪元相同并且日志中还保留着这个版本之后的所有变化时，服务端只返回变化了的人，否则返回完整的在线列表
+ * 服务端不保存聊天消息，断线期间别人发来的消息不会补发
+ *
+ * 消息确认：
+ * 序号由客户端生成，在这个用户的所有消息中唯一，服务端只是原样带回
+ * 客户端把消息先写入本地数据库并标记为待确认，收到服务端的9之后才标记为已送达，
+ * 断线期间以及重启后仍未确认的消息会在重新登录后按序号顺序重新发送，因此服务端可能收到重复的消息
+ * 服务端记住最近一段时间内每个用户的 (序号, 编号, 时间)，重复的消息不再转发，只用原来的编号与时间再确认一次
+ * 服务端不保存消息，私聊对象不在线时不转发也不确认，而是回复11；这条消息不会被记住，客户端保留它的待确认状态，
+ * 对方上线或者重新登录后再发送，直到收到9为止
+ * 9在消息放入接收者连接的发送队列以后才发出，群聊交给工作线程池并行分发时由最后执行完的分发块发出，
+ * 所以收到9时消息已经不会丢在服务端的队列里，但不表示接收者已经收到，接收者的连接随时可能断开
+ *
+ * 处理进度：
+ * 收到的帧数是服务端线程从所有连接上解出的命令总数（不包括11本身），服务端启动后一直累加，
+ * 待处理的命令数是所有连接还没处理的命令总数，是否在并行分发表示还有群发或者排在群发后面的转发交给了工作线程池没有执行完
+ * 11不进入工作队列，在服务端线程收到时立即回复，回复的是这一刻的状态：
+ * 收到的帧数达到已经发出的帧数，并且队列为空、没有在分发时，之前发出的所有命令都已经处理完了
+ * 一个连接上发出的帧在Socket中是有序的，但是不同连接的帧由不同的工作线程解出，到达服务端线程的先后不确定，
+ * 所以只能用计数判断，不能用某个连接上的一条命令作为其他连接的屏障
+ *
+ * 消息编号与时间：
+ * 服务端转发的每条聊天消息都由服务端分配一个64位的消息编号和一个混合逻辑时钟（HLC）时间，都是十进制
+ * 时间：[毫秒时间戳(48位)][逻辑计数(16位)]，按整数比较就是服务端处理的顺序，见IMHybridClock
+ * 编号：[从2020-01-01起的毫秒数(41位)][服务端节点(10位)][同一毫秒内的序号(13位)]，
+ *       节点在 IMService.ini 中配置，几台服务端的编号不会重复，编号的大小也大致是时间顺序
+ * 例如 1 张三 1167385532825600000 112525312000000000 你好    表里的例子中编号与时间写成了...
+ * 客户端用编号去掉重复的消息（本地数据库中编号是唯一索引，重复的插入被忽略，导入其他设备的记录时也一样），
+ * 收到的消息按服务端的时间显示与排序，不再使用本机收到的时间；客户端的时钟跟随收到的时间，
+ * 自己发出的消息在确认之前先用本机的HLC时间，总是排在已经收到的消息之后
+ * 新的客户端与服务端的1、2、9多了编号与时间两个参数，需要一起升级
+ *
+ * 帧格式：
+ * 每条命令都单独封装为一帧，帧头是4字节大端序的负载长度，后面紧跟UTF-8编码的命令文本
+ * [长度(4字节)][功能码 参数...]
+ * 这样一次读取到多条命令或者一条命令被拆成多次读取时，接收方都能正确地还原每一条命令
+ * 长度的最高位为1时，负载后面还跟着一个时间戳块，见下面的延迟跟踪说明
+ * [长度|0x80000000(4字节)][功能码 参数...][时间戳(5×8字节)]
+ *
+ * 优先级：
+ * 登录与上下线属于控制消息，私聊属于交互消息，群聊属于批量消息
+ * 服务端的工作队列与每个连接的发送队列都按优先级分通道，按权重轮流调度，
+ * 保证大量群聊消息堆积时，登录结果与上下线通知不会被堵在后面
+ * 服务端的优先级只在不同连接之间起作用，同一个连接发来的命令总是按发出的顺序处理
+ * 服务端发给同一个接收者的同一优先级的命令按服务端处理的顺序到达，私聊、群聊、上下线也按处理的顺序进入接收者的发送队列，
+ * 群发还在工作线程池中排队时，之后的私聊与消息确认排在它后面，不会越过它；
+ * 但是发送队列按优先级分通道调度，私聊（交互）可能在之前的群聊（批量）之前写入Socket，
+ * 所以同一个发送者的私聊与群聊之间不保证到达的顺序，客户端按消息的服务端时间排序显示
+ *
+ * 延迟跟踪：
+ * 时间戳块依次是 客户端发出、服务端收到、服务端放入发送队列、服务端写入Socket、接收方解出 五个时间，
+ * 每个都是8字节大端序的单调时钟微秒数，还没经过的环节为0
+ * 客户端在配置中打开延迟跟踪后，登录帧带上时间戳块，发出时间是客户端自己的时钟，
+ * 服务端在登录结果中原样带回，并填上收到与写入Socket的时间，客户端按NTP的方法估计两边时钟的偏差
+ * 之后客户端发出的聊天消息都带上换算到服务端时钟的发出时间，服务端转发给同样打开了跟踪的接收者时
+ * 保留时间戳块并填上服务端的时间，接收方解出后换算到服务端时钟，所有时间就都在同一条时间线上了
+ * 没有打开跟踪的客户端不会收到带时间戳块的帧
+ *
+ * 编码与解码：
+ * 每条命令的参数布局与优先级只在 imcodec.h 的 IMSchema 中声明一次，
+ * 客户端与服务端都通过 IMCodec 按声明生成的编码、解码函数收发命令，不再手工拼接与拆分字符串
+ *
+ ***********************************************/
+
+/**
+ * @brief 服务端功能码
+ */
+enum ServerFunctionCode {
+    // 私聊消息
+    PrivateMessage = 1,
+
+    // 群聊消息
+    GroupMessage = 2,
+
+    // 用户上线
+    UserOnline = 3,
+
+    // 用户下线
+    UserOffline = 4,
+
+    // 文件请求
+    FileRequest = 5,
+
+    // 文件被接受
+    FileAccepted = 6,
+
+    // 文件被拒绝/取消
+    FileCancelled = 7,
+
+    // 传输通道就绪
+    TransferReady = 8,
+
+    // 消息确认
+    MessageAck = 9,
+
+    // 登录结果
+    LoginResult = 10,
+
+    // 消息发送失败
+    MessageFailed = 11,
+
+    // 处理进度
+    Progress = 12
+};
+
+/**
+ * @brief 消息发送失败的原因
+ */
+enum MessageFailReason {
+    // 私聊对象不在线
+    PeerOffline = 1
+};
+
+/**
+ * @brief 客户端功能码
+ */
+enum ClientFunctionCode {
+    // 登录
+    Login = 1,
+
+    // 发送私聊消息
+    SendPrivateMessage = 2,
+
+    // 发送群聊消息
+    SendGroupMessage = 3,
+
+    // 请求发送文件
+    SendFileRequest = 4,
+
+    // 接受文件
+    AcceptFile = 5,
+
+    // 拒绝/取消文件
+    CancelFile = 6,
+
+    // 连接传输通道
+    AttachTransfer = 7,
+
+    // 启用共享内存
+    AttachSharedMemory = 8,
+
+    // 发送私聊消息，需要确认
+    SendTrackedPrivateMessage = 9,
+
+    // 发送群聊消息，需要确认
+    SendTrackedGroupMessage = 10,
+
+    // 查询处理进度
+    QueryProgress = 11
+};
+
+/**
+ * @brief 消息优先级，同时也是队列通道的下标
+ */
+enum MessagePriority {
+    // 控制消息：登录、上下线
+    ControlPriority = 0,
+
+    // 交互消息：私聊
+    InteractivePriority = 1,
+
+    // 批量消息：群聊、文件数据
+    BulkPriority = 2,
+
+    // 优先级的数量
+    PriorityCount = 3
+};
+
+/**
+ * @brief 延迟跟踪的各个环节，同时也是时间戳块中的下标
+ */
+enum TraceHop {
+    // 客户端发出
+    TraceClientSend = 0,
+
+    // 服务端收到
+    TraceServerIngress = 1,
+
+    // 服务端放入接收者的发送队列（群发时是放入分发块）
+    TraceFanoutEnqueue = 2,
+
+    // 服务端写入接收者的Socket
+    TraceSocketWrite = 3,
+
+    // 接收方从帧中解出
+    TraceReceiverDecode = 4,
+
+    // 环节的数量
+    TraceHopCount = 5
+};
+
+/**
+ * @brief 一帧的时间戳
+ */
+struct IMFrameTrace
+{
+    /**
+     * @brief stamps 各个环节的单调时钟微秒数，还没经过的环节为0
+     */
+    qint64 stamps[TraceHopCount] = {0, 0, 0, 0, 0};
+
+    /**
+     * @brief present 帧中是否带着时间戳块
+     */
+    bool present = false;
+};
+
+/**
+ * @brief 帧头长度
+ */
+const int FrameHeaderSize = 4;
+
+/**
+ * @brief 单帧负载的最大长度，超过这个长度认为数据非法
+ */
+const int MaxFramePayload = 16 * 1024 * 1024;
+
+/**
+ * @brief 帧头中表示后面带着时间戳块的标志位
+ */
+const quint32 FrameTraceFlag = 0x80000000u;
+
+/**
+ * @brief 时间戳块的长度
+ */
+const int TraceBlockSize = TraceHopCount * 8;
+
+/**
+ * @brief 功能码的最大位数，位数更多的是坏数据
+ */
+const int MaxFunctionCodeDigits = 4;
+
+/**
+ * @brief traceClock 延迟跟踪用的单调时钟（微秒），不受系统时间调整的影响
+ * 不同机器的时钟起点不同，两边的偏差在登录时估计
+ */
+inline qint64 traceClock()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief encodeFrame 将一条命令封装为帧
+ * @param payload 命令文本（UTF-8）
+ * @return 帧数据
+ */
+inline QByteArray encodeFrame(const QByteArray &payload)
+{
+    QByteArray frame;
+    frame.resize(FrameHeaderSize + payload.size());
+    qToBigEndian<quint32>(quint32(payload.size()), reinterpret_cast<uchar *>(frame.data()));
+    memcpy(frame.data() + FrameHeaderSize, payload.constData(), size_t(payload.size()));
+    return frame;
+}
+
+/**
+ * @brief attachFrameTrace 给out末尾的那一帧加上时间戳块
+ * @param out 帧数据，最后一帧从start开始
+ * @param start 最后一帧的开头
+ * @param trace 时间戳
+ */
+inline void attachFrameTrace(QByteArray &out, int start, const IMFrameTrace &trace)
+{
+    uchar *header = reinterpret_cast<uchar *>(out.data() + start);
+    qToBigEndian<quint32>(qFromBigEndian<quint32>(header) | FrameTraceFlag, header);
+    int pos = out.size();
+    out.resize(pos + TraceBlockSize);
+    for (int i = 0; i < TraceHopCount; ++i)
+        qToBigEndian<qint64>(trace.stamps[i], reinterpret_cast<uchar *>(out.data() + pos + 8 * i));
+}
+
+/**
+ * @brief isTracedFrame 一个单独的帧是否带着时间戳块
+ */
+inline bool isTracedFrame(const QByteArray &frame)
+{
+    return frame.size() >= FrameHeaderSize + TraceBlockSize
+            && (qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(frame.constData())) & FrameTraceFlag) != 0;
+}
+
+/**
+ * @brief frameTraceStamp 读取单独的一个带时间戳块的帧中某个环节的时间
+ */
+inline qint64 frameTraceStamp(const QByteArray &frame, TraceHop hop)
+{
+    return qFromBigEndian<qint64>(reinterpret_cast<const uchar *>(frame.constData() + frame.size() - TraceBlockSize + 8 * hop));
+}
+
+/**
+ * @brief stampFrameTrace 修改单独的一个带时间戳块的帧中某个环节的时间，共享的帧会先复制一份
+ */
+inline void stampFrameTrace(QByteArray &frame, TraceHop hop, qint64 time)
+{
+    qToBigEndian<qint64>(time, reinterpret_cast<uchar *>(frame.data() + frame.size() - TraceBlockSize + 8 * hop));
+}
+
+/**
+ * @brief takeFrame 从接收缓冲区中取出一个完整的帧
+ * 取出后只移动offset，调用方处理完所有帧后再一次性从缓冲区删除已处理的部分
+ * @param buffer 接收缓冲区
+ * @param offset 当前读取位置，取出成功后会移动到下一帧的开头
+ * @param payload 取出的命令文本
+ * @param trace 不为nullptr时填入帧中的时间戳，没有时间戳块时全部为0
+ * @return 取出成功返回1，数据不够一帧返回0，数据非法返回-1
+ */
+inline int takeFrame(const QByteArray &buffer, int &offset, QByteArray &payload, IMFrameTrace *trace = nullptr)
+{
+    if (buffer.size() - offset < FrameHeaderSize)
+        return 0;
+    quint32 header = qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(buffer.constData() + offset));
+    quint32 length = header & ~FrameTraceFlag;
+    int traceSize = (header & FrameTraceFlag) != 0 ? TraceBlockSize : 0;
+    if (length > quint32(MaxFramePayload))
+        return -1;
+    if (buffer.size() - offset - FrameHeaderSize - traceSize < int(length))
+        return 0;
+    payload = buffer.mid(offset + FrameHeaderSize, int(length));
+    if (trace != nullptr)
+    {
+        *trace = IMFrameTrace();
+        const uchar *block = reinterpret_cast<const uchar *>(buffer.constData() + offset + FrameHeaderSize + int(length));
+        for (int i = 0; traceSize > 0 && i < TraceHopCount; ++i)
+            trace->stamps[i] = qFromBigEndian<qint64>(block + 8 * i);
+        trace->present = traceSize > 0;
+    }
+    offset += FrameHeaderSize + int(length) + traceSize;
+    return 1;
+}
+
+/**
+ * @brief peekFunctionCode 读取命令文本开头的功能码，不做完整解析
+ * @param payload 命令文本
+ * @return 功能码，位数超过MaxFunctionCodeDigits时返回0（没有这个功能码），不会溢出
+ */
+inline int peekFunctionCode(const QByteArray &payload)
+{
+    int code = 0;
+    for (int i = 0; i < payload.size() && payload.at(i) >= '0' && payload.at(i) <= '9'; ++i)
+    {
+        if (i == MaxFunctionCodeDigits)
+            return 0;
+        code = code * 10 + (payload.at(i) - '0');
+    }
+    return code;
+}
+
+#endif // PROTOCOL_H
@@ -0,0 +1,35 @@
+#-------------------------------------------------
+#
+# 流量重放工具：把IMService录下的命令重放给一个新的服务端
+#
+#-------------------------------------------------
+
+QT      -= gui
+QT      += network
+
+TARGET = IMReplay
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+SOURCES += \
+    main.cpp \
+    imreplay.cpp
+
+HEADERS += \
+    imreplay.h
+
+# 协议静态库，录制文件的格式也在里面
+win32:CONFIG(release, debug|release): LIBS += -L$$OUT_PWD/../IMProtocol/release/ -lIMProtocol
+else:win32:CONFIG(debug, debug|release): LIBS += -L$$OUT_PWD/../IMProtocol/debug/ -lIMProtocol
+else:unix: LIBS += -L$$OUT_PWD/../IMProtocol/ -lIMProtocol
+
+INCLUDEPATH += $$PWD/../IMProtocol
+DEPENDPATH += $$PWD/../IMProtocol
+
+win32-g++:CONFIG(release, debug|release): PRE_TARGETDEPS += $$OUT_PWD/../IMProtocol/release/libIMProtocol.a
+else:win32-g++:CONFIG(debug, debug|release): PRE_TARGETDEPS += $$OUT_PWD/../IMProtocol/debug/libIMProtocol.a
+else:win32:!win32-g++:CONFIG(release, debug|release): PRE_TARGETDEPS += $$OUT_PWD/../IMProtocol/release/IMProtocol.lib
+else:win32:!win32-g++:CONFIG(debug, debug|release): PRE_TARGETDEPS += $$OUT_PWD/../IMProtocol/debug/IMProtocol.lib
+else:unix: PRE_TARGETDEPS += $$OUT_PWD/../IMProtocol/libIMProtocol.a
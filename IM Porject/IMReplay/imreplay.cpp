@@ -0,0 +1,493 @@
+#include <QCoreApplication>
+#include <QTextStream>
+#include <QDebug>
+#include <algorithm>
+#include "imreplay.h"
+#include "imcodec.h"
+
+// 微秒换成毫秒显示
+static QString millis(qint64 micros)
+{
+    return QString::number(double(micros) / 1000.0, 'f', 2) + "ms";
+}
+
+IMReplay::IMReplay(const IMReplayOptions &options, QObject *parent)
+    : QObject(parent),
+      m_options(options),
+      m_hasNext(false),
+      m_firstTime(0),
+      m_probe(nullptr),
+      m_baseFrames(0),
+      m_waitingDrain(false),
+      m_stepTimer(new QTimer(this)),
+      m_timeoutTimer(new QTimer(this)),
+      m_server(nullptr),
+      m_records(0),
+      m_frames(0),
+      m_bytes(0),
+      m_unsentFrames(0),
+      m_opened(0),
+      m_receivedFrames(0),
+      m_receivedBytes(0),
+      m_lateSum(0),
+      m_lateMax(0),
+      m_sendDone(0),
+      m_drained(0)
+{
+    this->m_stepTimer->setSingleShot(true);
+    this->m_stepTimer->setTimerType(Qt::PreciseTimer);
+    connect(this->m_stepTimer, &QTimer::timeout, this, &IMReplay::step);
+    this->m_timeoutTimer->setSingleShot(true);
+    connect(this->m_timeoutTimer, &QTimer::timeout, this, &IMReplay::timedOut);
+}
+
+IMReplay::~IMReplay()
+{
+    qDeleteAll(this->m_connections);
+    delete this->m_probe;
+}
+
+void IMReplay::start()
+{
+    if (!this->m_reader.open(this->m_options.tracePath))
+    {
+        qDebug() << "IMReplay:" << this->m_options.tracePath << this->m_reader.errorString();
+        QCoreApplication::exit(1);
+        return;
+    }
+    this->m_hasNext = this->m_reader.next(this->m_next);
+    if (!this->m_hasNext)
+    {
+        qDebug() << "IMReplay: no records in" << this->m_options.tracePath << this->m_reader.errorString();
+        QCoreApplication::exit(1);
+        return;
+    }
+    this->m_firstTime = this->m_next.time;
+
+    // 服务端的日志每条命令都有一行，丢掉，免得打印拖慢服务端
+    if (!this->m_options.serverProgram.isEmpty())
+    {
+        this->m_server = new QProcess(this);
+        this->m_server->setProgram(this->m_options.serverProgram);
+        this->m_server->setStandardOutputFile(QProcess::nullDevice());
+        this->m_server->setStandardErrorFile(QProcess::nullDevice());
+        this->m_server->start();
+        if (!this->m_server->waitForStarted())
+        {
+            qDebug() << "IMReplay:" << this->m_options.serverProgram << this->m_server->errorString();
+            QCoreApplication::exit(1);
+            return;
+        }
+    }
+
+    this->m_timeoutTimer->start(this->m_options.timeout * 1000);
+    this->connectProbe();
+}
+
+void IMReplay::connectProbe()
+{
+    // 上一次没连上的探测连接
+    if (this->m_probe != nullptr)
+    {
+        this->m_probe->socket->disconnect(this);
+        this->m_probe->socket->deleteLater();
+        delete this->m_probe;
+    }
+    this->m_probe = this->openConnection(0);
+}
+
+void IMReplay::begin()
+{
+    this->m_timeoutTimer->stop();
+    qDebug() << "IMReplay: replay" << this->m_options.tracePath << "recorded at"
+             << QDateTime::fromMSecsSinceEpoch(this->m_reader.startTime()).toString(Qt::ISODate)
+             << "speed" << (this->m_options.speed > 0 ? QString::number(this->m_options.speed) : QString("max"));
+    this->m_clock.start();
+    this->step();
+}
+
+void IMReplay::step()
+{
+    bool fullSpeed = this->m_options.speed <= 0;
+    for (int n = 0; n < MaxStepRecords && this->m_hasNext; ++n)
+    {
+        if (!fullSpeed)
+        {
+            // 还没到这条的时间，定时到时再来
+            qint64 now = this->elapsed();
+            qint64 due = qint64(double(this->m_next.time - this->m_firstTime) / this->m_options.speed);
+            if (due > now)
+            {
+                this->m_stepTimer->start(int(qMin<qint64>((due - now + 999) / 1000, 0x7FFFFFFF)));
+                return;
+            }
+            this->m_lateSum += now - due;
+            this->m_lateMax = qMax(this->m_lateMax, now - due);
+        }
+        else if (this->m_next.type == IMTraceRecord::Frame)
+        {
+            // 全速时这个连接积压太多就等一下，不把整个录制文件都堆在内存里
+            IMReplayConnection *connection = this->m_connections.value(this->m_next.connection);
+            if (connection != nullptr
+                    && connection->socket->bytesToWrite() + connection->pending.size() > MaxPendingBytes)
+            {
+                this->m_stepTimer->start(1);
+                return;
+            }
+        }
+        this->replay(this->m_next);
+        ++this->m_records;
+        this->m_hasNext = this->m_reader.next(this->m_next);
+        if (!this->m_hasNext && !this->m_reader.atEnd())
+            qDebug() << "IMReplay: trace has no end mark, the server did not exit normally" << this->m_reader.errorString();
+    }
+
+    // 还有记录，让出事件循环后继续
+    if (this->m_hasNext)
+    {
+        this->m_stepTimer->start(0);
+        return;
+    }
+    this->waitDrained();
+}
+
+void IMReplay::replay(const IMTraceRecord &record)
+{
+    IMReplayConnection *connection = nullptr;
+    switch (record.type)
+    {
+    case IMTraceRecord::Open:
+        if (!this->m_connections.contains(record.connection))
+        {
+            this->m_connections.insert(record.connection, this->openConnection(record.connection));
+            ++this->m_opened;
+        }
+        break;
+    case IMTraceRecord::Frame:
+    {
+        connection = this->m_connections.value(record.connection);
+        // 录制开始之前就已经建立的连接
+        if (connection == nullptr)
+        {
+            connection = this->openConnection(record.connection);
+            this->m_connections.insert(record.connection, connection);
+            ++this->m_opened;
+        }
+        // 需要确认的消息记下发出的时间，收到确认时算延迟
+        int code = peekFunctionCode(record.payload);
+        if (code == ClientFunctionCode::SendTrackedPrivateMessage || code == ClientFunctionCode::SendTrackedGroupMessage)
+        {
+            const char *p = record.payload.constData();
+            const char *end = p + record.payload.size();
+            quint64 functionCode = 0;
+            quint64 seq = 0;
+            if (IMCodecDetail::readUnsigned(p, end, functionCode) && IMCodecDetail::readUnsigned(p, end, seq))
+                this->m_trackedSent.insert(qMakePair(record.connection, seq), this->elapsed());
+        }
+        this->write(connection, encodeFrame(record.payload));
+        ++this->m_frames;
+        this->m_bytes += quint64(record.payload.size());
+        break;
+    }
+    case IMTraceRecord::Close:
+        connection = this->m_connections.take(record.connection);
+        if (connection != nullptr)
+            this->closeConnection(connection);
+        break;
+    default:
+        break;
+    }
+}
+
+IMReplayConnection *IMReplay::openConnection(quint64 id)
+{
+    IMReplayConnection *connection = new IMReplayConnection;
+    connection->id = id;
+    if (this->m_options.localName.isEmpty())
+    {
+        QTcpSocket *socket = new QTcpSocket(this);
+        connection->socket = socket;
+        connect(socket, &QTcpSocket::connected, this, [this, connection]() { this->connected(connection); });
+        connect(socket, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error),
+                this, [this, connection](QAbstractSocket::SocketError) {
+            this->socketError(connection);
+        });
+        connect(socket, &QIODevice::readyRead, this, [this, connection]() { this->readyRead(connection); });
+        socket->connectToHost(this->m_options.host, this->m_options.port);
+    }
+    else
+    {
+        QLocalSocket *socket = new QLocalSocket(this);
+        connection->socket = socket;
+        connect(socket, &QLocalSocket::connected, this, [this, connection]() { this->connected(connection); });
+        connect(socket, QOverload<QLocalSocket::LocalSocketError>::of(&QLocalSocket::error),
+                this, [this, connection](QLocalSocket::LocalSocketError) {
+            this->socketError(connection);
+        });
+        connect(socket, &QIODevice::readyRead, this, [this, connection]() { this->readyRead(connection); });
+        socket->connectToServer(this->m_options.localName);
+    }
+    return connection;
+}
+
+void IMReplay::closeConnection(IMReplayConnection *connection)
+{
+    // 还没连上，连上后发完放着的数据再断开
+    if (!connection->connected)
+    {
+        connection->closing = true;
+        return;
+    }
+
+    // Socket发完剩下的数据、断开之后自己删除
+    QIODevice *socket = connection->socket;
+    socket->disconnect(this);
+    if (QTcpSocket *tcpSocket = qobject_cast<QTcpSocket *>(socket))
+    {
+        connect(tcpSocket, &QTcpSocket::disconnected, tcpSocket, &QObject::deleteLater);
+        if (tcpSocket->state() == QAbstractSocket::UnconnectedState)
+            tcpSocket->deleteLater();
+        else
+            tcpSocket->disconnectFromHost();
+    }
+    else if (QLocalSocket *localSocket = qobject_cast<QLocalSocket *>(socket))
+    {
+        connect(localSocket, &QLocalSocket::disconnected, localSocket, &QObject::deleteLater);
+        if (localSocket->state() == QLocalSocket::UnconnectedState)
+            localSocket->deleteLater();
+        else
+            localSocket->disconnectFromServer();
+    }
+    delete connection;
+}
+
+void IMReplay::write(IMReplayConnection *connection, const QByteArray &frame)
+{
+    if (connection->failed)
+    {
+        ++this->m_unsentFrames;
+        return;
+    }
+    if (connection->connected)
+        connection->socket->write(frame);
+    else
+    {
+        connection->pending.append(frame);
+        ++connection->pendingFrames;
+    }
+}
+
+void IMReplay::connected(IMReplayConnection *connection)
+{
+    connection->connected = true;
+    // 探测连接第一次连上，服务端已经在监听了，查到起点后开始重放
+    if (connection == this->m_probe && !this->m_clock.isValid())
+    {
+        this->queryProgress();
+        return;
+    }
+    if (!connection->pending.isEmpty())
+    {
+        connection->socket->write(connection->pending);
+        connection->pending.clear();
+        connection->pendingFrames = 0;
+    }
+    if (connection->closing)
+        this->closeConnection(connection);
+}
+
+void IMReplay::socketError(IMReplayConnection *connection)
+{
+    // 开始重放之前只有探测连接，服务端还没启动，隔一会儿再试
+    // 本地套接字可能在connectToServer中就报错，这时m_probe还没有指向它，不能按指针判断
+    if (!this->m_clock.isValid())
+    {
+        QTimer::singleShot(ProbeRetryInterval, this, SLOT(connectProbe()));
+        return;
+    }
+    // 服务端主动断开的连接不算错误，之后的帧发不出去了
+    if (connection->connected)
+    {
+        connection->failed = true;
+        return;
+    }
+    qDebug() << "IMReplay: connection" << connection->id << connection->socket->errorString();
+    // 没连上的连接上放着的帧发不出去了
+    this->m_unsentFrames += quint64(connection->pendingFrames);
+    connection->pending.clear();
+    connection->pendingFrames = 0;
+    connection->failed = true;
+    if (connection->closing)
+    {
+        connection->socket->disconnect(this);
+        connection->socket->deleteLater();
+        delete connection;
+    }
+}
+
+void IMReplay::readyRead(IMReplayConnection *connection)
+{
+    connection->readBuffer.append(connection->socket->readAll());
+
+    // 取出所有完整的帧，剩下不够一帧的数据留到下次
+    int offset = 0;
+    int ret = 0;
+    QByteArray payload;
+    bool isProbe = connection == this->m_probe;
+    bool hasProgress = false;
+    quint64 frames = 0;
+    int queued = 0;
+    int busy = 0;
+    while ((ret = takeFrame(connection->readBuffer, offset, payload)) > 0)
+    {
+        // 探测连接上只有处理进度，不算在统计里
+        if (isProbe)
+        {
+            if (peekFunctionCode(payload) == ServerFunctionCode::Progress
+                    && IMCodec<IMSchema::Progress>::decode(payload, frames, queued, busy))
+                hasProgress = true;
+            continue;
+        }
+        ++this->m_receivedFrames;
+        this->m_receivedBytes += quint64(payload.size());
+        if (peekFunctionCode(payload) != ServerFunctionCode::MessageAck)
+            continue;
+
+        quint64 seq = 0;
+        quint64 msgId = 0;
+        quint64 hlc = 0;
+        if (!IMCodec<IMSchema::MessageAck>::decode(payload, seq, msgId, hlc))
+            continue;
+        auto it = this->m_trackedSent.find(qMakePair(connection->id, seq));
+        if (it != this->m_trackedSent.end())
+        {
+            this->m_ackLatencies.append(this->elapsed() - it.value());
+            this->m_trackedSent.erase(it);
+        }
+    }
+
+    if (ret < 0)
+    {
+        qDebug() << "IMReplay: invalid frame from server on connection" << connection->id;
+        connection->readBuffer.clear();
+    }
+    else
+        connection->readBuffer.remove(0, offset);
+
+    // 结束时会删除连接，不能在这个连接的信号里直接处理
+    if (hasProgress)
+        QTimer::singleShot(0, this, [this, frames, queued, busy]() { this->progressReceived(frames, queued, busy != 0); });
+}
+
+void IMReplay::queryProgress()
+{
+    if (this->m_probe != nullptr)
+        this->write(this->m_probe, IMCodec<IMSchema::QueryProgress>::encodeFrame());
+}
+
+void IMReplay::waitDrained()
+{
+    this->m_sendDone = this->elapsed();
+    this->m_waitingDrain = true;
+    this->m_timeoutTimer->start(this->m_options.timeout * 1000);
+    this->queryProgress();
+}
+
+void IMReplay::progressReceived(quint64 frames, int queued, bool busy)
+{
+    // 第一次查询的结果是起点，服务端之前收到的帧不算
+    if (!this->m_clock.isValid())
+    {
+        this->m_baseFrames = frames;
+        this->begin();
+        return;
+    }
+    if (!this->m_waitingDrain)
+        return;
+    // 发出的帧都被服务端收到了，并且都处理完了
+    quint64 expected = this->m_frames - this->m_unsentFrames;
+    if (frames - this->m_baseFrames >= expected && queued == 0 && !busy)
+    {
+        this->m_drained = this->elapsed();
+        this->m_waitingDrain = false;
+        this->finish(true);
+        return;
+    }
+    QTimer::singleShot(DrainPollInterval, this, &IMReplay::queryProgress);
+}
+
+void IMReplay::timedOut()
+{
+    if (!this->m_clock.isValid())
+        qDebug() << "IMReplay: server not reachable within" << this->m_options.timeout << "seconds";
+    else
+        qDebug() << "IMReplay: server did not finish within" << this->m_options.timeout << "seconds";
+    this->finish(false);
+}
+
+void IMReplay::finish(bool ok)
+{
+    this->m_stepTimer->stop();
+    this->m_timeoutTimer->stop();
+
+    if (this->m_clock.isValid())
+    {
+        // 没等到服务端处理完时用用到现在的时间
+        qint64 total = ok ? this->m_drained : this->elapsed();
+        double seconds = qMax<qint64>(1, total) / 1000000.0;
+        QTextStream out(stdout);
+        out << "trace       " << this->m_options.tracePath << " records " << this->m_records
+            << " connections " << this->m_opened << "\n";
+        out << "speed       " << (this->m_options.speed > 0 ? QString::number(this->m_options.speed) : QString("max"))
+            << (ok ? "" : "  INCOMPLETE") << "\n";
+        out << "sent        " << this->m_frames << " frames " << this->m_bytes << " bytes in " << millis(this->m_sendDone);
+        if (this->m_unsentFrames > 0)
+            out << " (" << this->m_unsentFrames << " frames on failed connections)";
+        out << "\n";
+        out << "drained     " << millis(total) << "\n";
+        out << "throughput  " << QString::number(double(this->m_frames) / seconds, 'f', 1) << " frames/s "
+            << QString::number(double(this->m_bytes) / seconds / (1024.0 * 1024.0), 'f', 2) << " MB/s\n";
+        out << "received    " << this->m_receivedFrames << " frames " << this->m_receivedBytes << " bytes\n";
+        if (this->m_options.speed > 0)
+            out << "lateness    mean " << millis(this->m_records == 0 ? 0 : this->m_lateSum / qint64(this->m_records))
+                << " max " << millis(this->m_lateMax) << "\n";
+
+        // 确认延迟的分布
+        std::sort(this->m_ackLatencies.begin(), this->m_ackLatencies.end());
+        int count = this->m_ackLatencies.size();
+        out << "ack         count " << count << " unanswered " << this->m_trackedSent.size();
+        if (count > 0)
+        {
+            const double percents[] = { 0.5, 0.9, 0.99 };
+            for (double percent : percents)
+                out << " p" << percent * 100 << " " << millis(this->m_ackLatencies.at(qMin(count - 1, int(double(count) * percent))));
+            out << " max " << millis(this->m_ackLatencies.last());
+        }
+        out << "\n";
+        out.flush();
+    }
+
+    // 先断开信号再删除，关闭时触发的错误不再处理
+    for (IMReplayConnection *connection : this->m_connections)
+    {
+        connection->socket->disconnect(this);
+        delete connection->socket;
+        delete connection;
+    }
+    this->m_connections.clear();
+    if (this->m_probe != nullptr)
+    {
+        this->m_probe->socket->disconnect(this);
+        delete this->m_probe->socket;
+        delete this->m_probe;
+        this->m_probe = nullptr;
+    }
+
+    if (this->m_server != nullptr)
+    {
+        this->m_server->terminate();
+        if (!this->m_server->waitForFinished(5000))
+            this->m_server->kill();
+    }
+    QCoreApplication::exit(ok ? 0 : 1);
+}
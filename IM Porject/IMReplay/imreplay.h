@@ -0,0 +1,283 @@
+#ifndef IMREPLAY_H
+#define IMREPLAY_H
+
+#include <QObject>
+#include <QtNetwork>
+#include <QLocalSocket>
+#include <QElapsedTimer>
+#include <QProcess>
+#include <QHash>
+#include <QVector>
+#include "imtracefile.h"
+
+/**
+ * @brief 重放的参数
+ */
+struct IMReplayOptions
+{
+    /**
+     * @brief tracePath 录制文件
+     */
+    QString tracePath;
+
+    /**
+     * @brief host 服务端地址
+     */
+    QString host = "127.0.0.1";
+
+    /**
+     * @brief port 服务端端口
+     */
+    quint16 port = 9876;
+
+    /**
+     * @brief localName 本地套接字的名称，不为空时改走本地套接字
+     */
+    QString localName;
+
+    /**
+     * @brief speed 相对原速的倍数，0表示不等待，尽快发送
+     */
+    double speed = 1.0;
+
+    /**
+     * @brief serverProgram 不为空时由重放工具启动这个服务端，重放完后关闭
+     */
+    QString serverProgram;
+
+    /**
+     * @brief timeout 等待服务端启动与处理完的秒数
+     */
+    int timeout = 30;
+};
+
+/**
+ * @brief 重放时的一个连接，对应录制时服务端的一个连接
+ */
+struct IMReplayConnection
+{
+    /**
+     * @brief id 录制时的连接编号
+     */
+    quint64 id = 0;
+
+    /**
+     * @brief socket Tcp Socket或者本地套接字
+     */
+    QIODevice *socket = nullptr;
+
+    /**
+     * @brief connected 是否已经连上，连上之前发送的帧先放在pending中
+     */
+    bool connected = false;
+
+    /**
+     * @brief pending 连上之前要发送的数据
+     */
+    QByteArray pending;
+
+    /**
+     * @brief closing 还没连上时录制中的连接就断开了，连上后发完pending再断开
+     */
+    bool closing = false;
+
+    /**
+     * @brief readBuffer 接收缓冲区，保存还不够一帧的数据
+     */
+    QByteArray readBuffer;
+
+    /**
+     * @brief pendingFrames pending中的帧数
+     */
+    int pendingFrames = 0;
+
+    /**
+     * @brief failed 没连上或者被服务端断开了，之后的帧发不出去，不再等服务端收到
+     */
+    bool failed = false;
+};
+
+/***********************************
+ *
+ * Class IMReplay
+ * 把IMService录下的流量重放给一个新的服务端
+ *
+ * 录制文件中的每个连接都用一个新的连接代替，按录制的顺序建立连接、发送命令、断开连接，
+ * 同一个连接上的命令顺序与录制时相同
+ * 原速重放时按录制的时间间隔（除以倍数）发送，记下每条比计划晚了多少；
+ * 全速重放时不等待，只在某个连接积压太多时停一下，不同连接之间的先后只保证发出的顺序
+ *
+ * 用一个单独的探测连接向服务端查询处理进度（见protocol.h的处理进度说明），探测连接不登录，不发聊天消息，
+ * 不会收到任何广播，也不算在统计里；它在开始时就连上，兼作等待服务端启动，第一次查询的结果作为起点
+ * 重放完后每隔DrainPollInterval毫秒查询一次，服务端收到的帧数达到发出的帧数并且工作队列为空、没有在分发时，
+ * 认为服务端已经处理完，从开始到这时就是重放的用时；没连上或者被断开的连接上发不出去的帧不计入发出的帧数
+ * 不同连接上的帧由服务端的不同工作线程解出，先后不确定，所以不用某个连接上的一条命令作为屏障
+ * 服务端收到的帧数包括其他客户端的，重放时服务端上不能有别的客户端
+ *
+ * 结果打印到标准输出：条数、字节数、用时、每秒的帧数与字节数、收到的帧数，
+ * 以及需要确认的消息从发出到收到确认的延迟分布，同一个录制文件在不同版本的服务端上的结果可以直接比较
+ *
+ * 帧中的时间戳块没有录制，重放时不打开延迟跟踪；文件传输的原始字节没有录制，传输连接只有第一帧
+ *
+ **********************************/
+
+class IMReplay : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit IMReplay(const IMReplayOptions &options, QObject *parent = nullptr);
+
+    ~IMReplay();
+
+public slots:
+    /**
+     * @brief start 打开录制文件，需要时启动服务端，等服务端能连上后开始重放
+     */
+    void start();
+
+private slots:
+    /**
+     * @brief step 重放到期的记录，没有到期的就定时再来
+     */
+    void step();
+
+    /**
+     * @brief connectProbe 连接探测连接，服务端还没启动时隔一会儿再试
+     */
+    void connectProbe();
+
+    /**
+     * @brief timedOut 服务端在timeout秒内没有启动或者没有处理完
+     */
+    void timedOut();
+
+    /**
+     * @brief queryProgress 用探测连接查询服务端的处理进度
+     */
+    void queryProgress();
+
+private:
+    /**
+     * @brief begin 探测连接连上后开始重放
+     */
+    void begin();
+
+    /**
+     * @brief replay 重放一条记录
+     */
+    void replay(const IMTraceRecord &record);
+
+    /**
+     * @brief openConnection 建立一个新的连接
+     * @param id 录制时的连接编号，探测连接为0
+     */
+    IMReplayConnection *openConnection(quint64 id);
+
+    /**
+     * @brief closeConnection 发完剩下的数据后断开连接
+     */
+    void closeConnection(IMReplayConnection *connection);
+
+    /**
+     * @brief write 发送一帧，还没连上时先放着
+     */
+    void write(IMReplayConnection *connection, const QByteArray &frame);
+
+    /**
+     * @brief connected 连接连上了，发出之前放着的数据
+     */
+    void connected(IMReplayConnection *connection);
+
+    /**
+     * @brief socketError 连接出错，探测连接没连上时重试
+     */
+    void socketError(IMReplayConnection *connection);
+
+    /**
+     * @brief readyRead 取出收到的所有完整的帧，统计帧数并处理消息确认
+     */
+    void readyRead(IMReplayConnection *connection);
+
+    /**
+     * @brief waitDrained 所有记录都重放完后，开始查询服务端是否已经处理完
+     */
+    void waitDrained();
+
+    /**
+     * @brief progressReceived 收到服务端的处理进度，第一次时开始重放，重放完后判断是否已经处理完
+     * @param frames 服务端收到的帧数
+     * @param queued 工作队列中的命令数
+     * @param busy 是否还在并行分发
+     */
+    void progressReceived(quint64 frames, int queued, bool busy);
+
+    /**
+     * @brief finish 打印结果，关闭所有连接与启动的服务端，退出事件循环
+     * @param ok 是否完整地重放并等到了服务端处理完
+     */
+    void finish(bool ok);
+
+    /**
+     * @brief elapsed 从开始重放起的微秒数
+     */
+    qint64 elapsed() const { return m_clock.nsecsElapsed() / 1000; }
+
+private:
+    // 每次step最多重放的记录数，处理完一批后让出事件循环，让Socket能收发数据
+    static const int MaxStepRecords = 1024;
+    // 一个连接积压超过这么多字节时全速重放暂停一下
+    static const qint64 MaxPendingBytes = 4 * 1024 * 1024;
+    // 探测连接没连上时隔多少毫秒再试
+    static const int ProbeRetryInterval = 100;
+    // 重放完后隔多少毫秒查询一次处理进度
+    static const int DrainPollInterval = 10;
+
+    IMReplayOptions m_options;
+    IMTraceReader m_reader;
+    // 下一条要重放的记录
+    IMTraceRecord m_next;
+    bool m_hasNext;
+    // 第一条记录的时间，原速重放时其他记录的计划时间都相对于它
+    qint64 m_firstTime;
+
+    // 重放的连接，key是录制时的连接编号
+    QHash<quint64, IMReplayConnection *> m_connections;
+    // 查询处理进度的探测连接
+    IMReplayConnection *m_probe;
+    // 开始重放前服务端已经收到的帧数
+    quint64 m_baseFrames;
+    // 是否所有记录都重放完了，在等服务端处理完
+    bool m_waitingDrain;
+
+    // 重放开始后的计时
+    QElapsedTimer m_clock;
+    // 下一次step的定时器
+    QTimer *m_stepTimer;
+    // 等待服务端启动与处理完的超时
+    QTimer *m_timeoutTimer;
+    // 重放工具启动的服务端
+    QProcess *m_server;
+
+    // 统计
+    quint64 m_records;
+    quint64 m_frames;
+    quint64 m_bytes;
+    // 没连上或者被断开的连接上发不出去的帧数
+    quint64 m_unsentFrames;
+    quint64 m_opened;
+    quint64 m_receivedFrames;
+    quint64 m_receivedBytes;
+    // 原速重放时比计划晚的微秒数
+    qint64 m_lateSum;
+    qint64 m_lateMax;
+    // 最后一条记录发出与服务端处理完的时间
+    qint64 m_sendDone;
+    qint64 m_drained;
+    // 需要确认的消息发出的时间，key是 (录制时的连接编号, 序号)
+    QHash<QPair<quint64, quint64>, qint64> m_trackedSent;
+    // 收到确认的延迟（微秒）
+    QVector<qint64> m_ackLatencies;
+};
+
+#endif // IMREPLAY_H
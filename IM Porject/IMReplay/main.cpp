@@ -0,0 +1,56 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QTextCodec>
+#include <QTimer>
+#include <QDebug>
+#include "imreplay.h"
+
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QTextCodec *codec = QTextCodec::codecForName("UTF-8");
+    QTextCodec::setCodecForLocale(codec);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("把IMService录下的流量重放给一个新的服务端，打印吞吐量与确认延迟");
+    parser.addHelpOption();
+    parser.addPositionalArgument("trace", "录制文件，服务端配置 [capture] file 后生成");
+    QCommandLineOption hostOption("host", "服务端地址，默认127.0.0.1", "host", "127.0.0.1");
+    QCommandLineOption portOption(QStringList() << "p" << "port", "服务端端口，默认9876", "port", "9876");
+    QCommandLineOption localOption(QStringList() << "l" << "local", "改走本地套接字", "name");
+    QCommandLineOption speedOption(QStringList() << "s" << "speed", "相对原速的倍数，max表示全速，默认1", "factor", "1");
+    QCommandLineOption serverOption("server", "先启动这个服务端程序，重放完后关闭", "program");
+    QCommandLineOption timeoutOption(QStringList() << "t" << "timeout", "等待服务端启动与处理完的秒数，默认30", "seconds", "30");
+    parser.addOption(hostOption);
+    parser.addOption(portOption);
+    parser.addOption(localOption);
+    parser.addOption(speedOption);
+    parser.addOption(serverOption);
+    parser.addOption(timeoutOption);
+    parser.process(a);
+
+    if (parser.positionalArguments().size() != 1)
+        parser.showHelp(1);
+
+    IMReplayOptions options;
+    options.tracePath = parser.positionalArguments().first();
+    options.host = parser.value(hostOption);
+    options.port = parser.value(portOption).toUShort();
+    options.localName = parser.value(localOption);
+    options.serverProgram = parser.value(serverOption);
+    options.timeout = qMax(1, parser.value(timeoutOption).toInt());
+    // max表示全速，否则必须是正数
+    QString speed = parser.value(speedOption);
+    bool ok = true;
+    options.speed = speed == "max" ? 0.0 : speed.toDouble(&ok);
+    if (!ok || options.speed < 0)
+    {
+        qDebug() << "Invalid speed:" << speed;
+        return 1;
+    }
+
+    IMReplay replay(options);
+    QTimer::singleShot(0, &replay, &IMReplay::start);
+    return a.exec();
+}
@@ -1,29 +1,55 @@
-QT      -= gui
-QT      += network
-
-CONFIG += c++11 console
-CONFIG -= app_bundle
-
-# The following define makes your compiler emit warnings if you use
-# any feature of Qt which as been marked deprecated (the exact warnings
-# depend on your compiler). Please consult the documentation of the
-# deprecated API in order to know how to port your code away from it.
-DEFINES += QT_DEPRECATED_WARNINGS
-
-# You can also make your code fail to compile if you use deprecated APIs.
-# In order to do so, uncomment the following line.
-# You can also select to disable deprecated APIs only up to a certain version of Qt.
-#DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
-
-SOURCES += \
-        main.cpp \
-    imservice.cpp
-
-# Default rules for deployment.
-qnx: target.path = /tmp/$${TARGET}/bin
-else: unix:!android: target.path = /opt/$${TARGET}/bin
-!isEmpty(target.path): INSTALLS += target
-
-HEADERS += \
-    imservice.h \
-    protocol.h
+QT      -= gui
+QT      += network
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+# The following define makes your compiler emit warnings if you use
+# any feature of Qt which as been marked deprecated (the exact warnings
+# depend on your compiler). Please consult the documentation of the
+# deprecated API in order to know how to port your code away from it.
+DEFINES += QT_DEPRECATED_WARNINGS
+
+# You can also make your code fail to compile if you use deprecated APIs.
+# In order to do so, uncomment the following line.
+# You can also select to disable deprecated APIs only up to a certain version of Qt.
+#DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
+
+SOURCES += \
+        main.cpp \
+    imservice.cpp \
+    imconnection.cpp \
+    imserviceconfig.cpp \
+    imworkerpool.cpp \
+    imlistener.cpp \
+    imlatencystats.cpp \
+    imtracerecorder.cpp
+
+# Default rules for deployment.
+qnx: target.path = /tmp/$${TARGET}/bin
+else: unix:!android: target.path = /opt/$${TARGET}/bin
+!isEmpty(target.path): INSTALLS += target
+
+HEADERS += \
+    imservice.h \
+    imconnection.h \
+    impriorityqueue.h \
+    imserviceconfig.h \
+    imworkerpool.h \
+    imlistener.h \
+    imlatencystats.h \
+    imtracerecorder.h
+
+# 协议静态库，与客户端共用
+win32:CONFIG(release, debug|release): LIBS += -L$$OUT_PWD/../IMProtocol/release/ -lIMProtocol
+else:win32:CONFIG(debug, debug|release): LIBS += -L$$OUT_PWD/../IMProtocol/debug/ -lIMProtocol
+else:unix: LIBS += -L$$OUT_PWD/../IMProtocol/ -lIMProtocol
+
+INCLUDEPATH += $$PWD/../IMProtocol
+DEPENDPATH += $$PWD/../IMProtocol
+
+win32-g++:CONFIG(release, debug|release): PRE_TARGETDEPS += $$OUT_PWD/../IMProtocol/release/libIMProtocol.a
+else:win32-g++:CONFIG(debug, debug|release): PRE_TARGETDEPS += $$OUT_PWD/../IMProtocol/debug/libIMProtocol.a
+else:win32:!win32-g++:CONFIG(release, debug|release): PRE_TARGETDEPS += $$OUT_PWD/../IMProtocol/release/IMProtocol.lib
+else:win32:!win32-g++:CONFIG(debug, debug|release): PRE_TARGETDEPS += $$OUT_PWD/../IMProtocol/debug/IMProtocol.lib
+else:unix: PRE_TARGETDEPS += $$OUT_PWD/../IMProtocol/libIMProtocol.a
@@ -0,0 +1,378 @@
+#include "imconnection.h"
+#include "imserviceconfig.h"
+#include "imlatencystats.h"
+#include <QDebug>
+
+// 轮询共享内存的最短与最长间隔（毫秒）
+static const int MinRingInterval = 1;
+static const int MaxRingInterval = 16;
+
+IMConnection::IMConnection(quint64 id, QObject *parent)
+    : QObject(parent),
+      m_id(id),
+      m_socket(nullptr),
+      m_local(false),
+      m_ring(nullptr),
+      m_ringTimer(nullptr),
+      m_flushScheduled(0),
+      m_closed(0),
+      m_traceEnabled(0),
+      m_queuedBytes(0),
+      m_relaying(false),
+      m_closeWhenDrained(false)
+{
+    m_sendQueue.setWeights(IMServiceConfig::instance()->laneWeights);
+}
+
+IMConnection::~IMConnection()
+{
+    qDebug() << "~IMConnection" << m_id;
+    delete m_ring;
+}
+
+// 在所属线程中创建Tcp Socket
+void IMConnection::start(qintptr socketDescriptor)
+{
+    QTcpSocket *socket = new QTcpSocket(this);
+    m_socket = socket;
+    m_local = false;
+    // 当连接断开时触发disconnected
+    connect(socket, &QTcpSocket::disconnected, this, &IMConnection::disconnected);
+    this->setupSocket();
+
+    if (!socket->setSocketDescriptor(socketDescriptor))
+    {
+        qDebug() << "IMConnection:" << m_id << socket->errorString();
+        this->disconnected();
+        return;
+    }
+
+    // 连接建立前已经有数据在排队了
+    this->flush();
+}
+
+// 在所属线程中创建本地套接字
+void IMConnection::startLocal(quintptr socketDescriptor)
+{
+    QLocalSocket *socket = new QLocalSocket(this);
+    m_socket = socket;
+    m_local = true;
+    // 当连接断开时触发disconnected
+    connect(socket, &QLocalSocket::disconnected, this, &IMConnection::disconnected);
+    this->setupSocket();
+
+    if (!socket->setSocketDescriptor(socketDescriptor))
+    {
+        qDebug() << "IMConnection:" << m_id << socket->errorString();
+        this->disconnected();
+        return;
+    }
+
+    // 连接建立前已经有数据在排队了
+    this->flush();
+}
+
+void IMConnection::setupSocket()
+{
+    // 当接收到数据时触发readyRead
+    connect(m_socket, &QIODevice::readyRead, this, &IMConnection::readyRead);
+    // 数据写出去后继续发送通道里剩下的数据
+    connect(m_socket, &QIODevice::bytesWritten, this, &IMConnection::flush);
+}
+
+void IMConnection::disconnectSocket()
+{
+    if (QTcpSocket *socket = qobject_cast<QTcpSocket *>(m_socket))
+    {
+        if (socket->state() != QAbstractSocket::UnconnectedState)
+            socket->disconnectFromHost();
+    }
+    else if (QLocalSocket *socket = qobject_cast<QLocalSocket *>(m_socket))
+    {
+        if (socket->state() != QLocalSocket::UnconnectedState)
+            socket->disconnectFromServer();
+    }
+}
+
+void IMConnection::send(MessagePriority priority, const QByteArray &frame)
+{
+    if (this->isClosed())
+        return;
+    {
+        QMutexLocker locker(&m_sendMutex);
+        m_sendQueue.enqueue(priority, frame);
+        m_queuedBytes += frame.size();
+    }
+    // 同一轮事件循环中的多次发送合并成一次写入
+    if (m_flushScheduled.testAndSetOrdered(0, 1))
+        QMetaObject::invokeMethod(this, "flush", Qt::QueuedConnection);
+}
+
+qint64 IMConnection::queuedBytes()
+{
+    QMutexLocker locker(&m_sendMutex);
+    return m_queuedBytes;
+}
+
+void IMConnection::startRelay(const IMConnectionPtr &peer)
+{
+    {
+        QMutexLocker locker(&m_sendMutex);
+        m_relayPeer = peer;
+    }
+    QMetaObject::invokeMethod(this, "beginRelay", Qt::QueuedConnection);
+}
+
+void IMConnection::finishRelay()
+{
+    {
+        QMutexLocker locker(&m_sendMutex);
+        m_closeWhenDrained = true;
+    }
+    if (m_flushScheduled.testAndSetOrdered(0, 1))
+        QMetaObject::invokeMethod(this, "flush", Qt::QueuedConnection);
+}
+
+// 在所属线程中进入转发模式
+void IMConnection::beginRelay()
+{
+    if (m_socket == nullptr)
+        return;
+    m_relaying = true;
+    // 限制Qt的读缓冲，暂停读取时数据才会留在内核里
+    if (QTcpSocket *socket = qobject_cast<QTcpSocket *>(m_socket))
+        socket->setReadBufferSize(IMServiceConfig::instance()->highWatermark);
+    else if (QLocalSocket *socket = qobject_cast<QLocalSocket *>(m_socket))
+        socket->setReadBufferSize(IMServiceConfig::instance()->highWatermark);
+    // 配对前已经收到的数据
+    if (!m_readBuffer.isEmpty())
+    {
+        IMConnectionPtr peer = m_relayPeer.toStrongRef();
+        if (!peer.isNull())
+            peer->send(BulkPriority, m_readBuffer);
+        m_readBuffer.clear();
+    }
+    this->relay();
+}
+
+// 把收到的数据转发给对方
+void IMConnection::relay()
+{
+    if (!m_relaying || m_socket == nullptr)
+        return;
+
+    IMConnectionPtr peer;
+    {
+        QMutexLocker locker(&m_sendMutex);
+        peer = m_relayPeer.toStrongRef();
+    }
+    if (peer.isNull())
+    {
+        this->close();
+        return;
+    }
+    // 对方已经断开了，它断开时会让这边发完后也断开
+    if (peer->isClosed())
+        return;
+
+    // 对方积压太多时先不读，等对方发出去一些后会再调用relay
+    if (peer->queuedBytes() >= 4 * qint64(IMServiceConfig::instance()->highWatermark))
+        return;
+
+    // 读出来的数据直接交给对方的发送队列，不再复制
+    QByteArray data = m_socket->readAll();
+    if (!data.isEmpty())
+        peer->send(BulkPriority, data);
+}
+
+void IMConnection::close()
+{
+    // Socket只能在所属线程中操作
+    if (QThread::currentThread() != this->thread())
+    {
+        QMetaObject::invokeMethod(this, "close", Qt::QueuedConnection);
+        return;
+    }
+
+    {
+        QMutexLocker locker(&m_sendMutex);
+        m_sendQueue.clear();
+        m_queuedBytes = 0;
+    }
+    this->disconnectSocket();
+}
+
+void IMConnection::flush()
+{
+    m_flushScheduled.store(0);
+    // Socket还没有创建，等start之后再发
+    if (m_socket == nullptr)
+        return;
+
+    QMutexLocker locker(&m_sendMutex);
+    if (this->isClosed() || !m_socket->isOpen())
+    {
+        m_sendQueue.clear();
+        m_queuedBytes = 0;
+        return;
+    }
+
+    // 按权重取出数据，直到Socket中待发送的数据达到高水位
+    // 剩下的数据留在队列里，等bytesWritten时再发，这样后来的高优先级数据可以插队
+    const qint64 highWatermark = IMServiceConfig::instance()->highWatermark;
+    QByteArray batch;
+    bool traceEnabled = this->traceEnabled();
+    qint64 now = traceEnabled ? traceClock() : 0;
+    while (!m_sendQueue.isEmpty() && m_socket->bytesToWrite() + batch.size() < highWatermark)
+    {
+        QByteArray frame = m_sendQueue.dequeue();
+        // 带时间戳块的帧填上写入Socket的时间，只有打开了跟踪的聊天连接才会有这种帧，转发的原始数据不会经过这里
+        if (traceEnabled && isTracedFrame(frame))
+        {
+            stampFrameTrace(frame, TraceSocketWrite, now);
+            qint64 enqueued = frameTraceStamp(frame, TraceFanoutEnqueue);
+            if (enqueued != 0)
+                IMLatencyStats::instance()->record(IMLatencyStats::QueueHop, now - enqueued);
+        }
+        batch.append(frame);
+    }
+    m_queuedBytes -= batch.size();
+    bool closeNow = m_closeWhenDrained && m_sendQueue.isEmpty();
+    IMConnectionPtr relaySource = m_relayPeer.toStrongRef();
+    qint64 queuedBytes = m_queuedBytes;
+    locker.unlock();
+
+    if (!batch.isEmpty())
+        m_socket->write(batch);
+
+    // 转发的数据都交给Socket了，disconnectFromHost会等Socket中的数据写完再断开
+    if (closeNow)
+    {
+        this->disconnectSocket();
+        return;
+    }
+
+    // 积压降下来了，让对方继续读取
+    if (!relaySource.isNull() && queuedBytes < highWatermark)
+        QMetaObject::invokeMethod(relaySource.data(), "relay", Qt::QueuedConnection);
+}
+
+// 当接收到数据时触发
+void IMConnection::readyRead()
+{
+    // 转发模式下不再拆帧
+    if (m_relaying)
+    {
+        this->relay();
+        return;
+    }
+
+    m_readBuffer.append(m_socket->readAll());
+    this->processReadBuffer();
+}
+
+void IMConnection::processReadBuffer()
+{
+    // 取出所有完整的帧，剩下不够一帧的数据留到下次
+    int offset = 0;
+    int ret = 0;
+    QByteArray payload;
+    IMFrameTrace trace;
+    // 同一批读到的帧用同一个收到的时间
+    qint64 now = traceClock();
+    while ((ret = takeFrame(m_readBuffer, offset, payload, &trace)) > 0)
+    {
+        // 启用共享内存的命令只和这个连接有关，直接在这里处理
+        if (peekFunctionCode(payload) == ClientFunctionCode::AttachSharedMemory)
+        {
+            int pos = payload.indexOf(' ');
+            this->attachSharedRing(pos < 0 ? QString() : QString::fromUtf8(payload.mid(pos + 1)).trimmed());
+            continue;
+        }
+        trace.stamps[TraceServerIngress] = now;
+        emit frameReceived(m_id, payload, trace);
+    }
+
+    if (ret < 0)
+    {
+        qDebug() << "IMConnection: invalid frame, close connection" << m_id;
+        m_readBuffer.clear();
+        this->close();
+        return;
+    }
+    m_readBuffer.remove(0, offset);
+}
+
+void IMConnection::attachSharedRing(QString key)
+{
+    // 共享内存只允许本地连接使用，并且只能启用一次
+    if (!m_local || m_ring != nullptr || key.isEmpty())
+    {
+        qDebug() << "IMConnection: shared memory refused" << m_id << key;
+        return;
+    }
+
+    m_ring = new IMSharedRing;
+    if (!m_ring->attach(key))
+    {
+        qDebug() << "IMConnection: shared memory attach failed" << m_id << key;
+        delete m_ring;
+        m_ring = nullptr;
+        return;
+    }
+
+    qDebug() << "IMConnection: shared memory attached" << m_id << key;
+    m_ringTimer = new QTimer(this);
+    m_ringTimer->setInterval(MinRingInterval);
+    connect(m_ringTimer, &QTimer::timeout, this, &IMConnection::pollRing);
+    m_ringTimer->start();
+}
+
+// 轮询共享内存环形缓冲区
+void IMConnection::pollRing()
+{
+    if (m_ring == nullptr || this->isClosed())
+        return;
+
+    QByteArray data = m_ring->read();
+    if (data.isEmpty())
+    {
+        // 没有数据时逐渐拉长间隔，减少空转
+        if (m_ringTimer->interval() < MaxRingInterval)
+            m_ringTimer->setInterval(m_ringTimer->interval() * 2);
+        return;
+    }
+
+    m_ringTimer->setInterval(MinRingInterval);
+    m_readBuffer.append(data);
+    this->processReadBuffer();
+}
+
+// 当连接断开时触发
+void IMConnection::disconnected()
+{
+    if (!m_closed.testAndSetOrdered(0, 1))
+        return;
+
+    if (m_ringTimer != nullptr)
+        m_ringTimer->stop();
+
+    IMConnectionPtr peer;
+    {
+        QMutexLocker locker(&m_sendMutex);
+        m_sendQueue.clear();
+        m_queuedBytes = 0;
+        peer = m_relayPeer.toStrongRef();
+    }
+
+    // 转发模式下把剩下的数据转发完，然后让对方发完后也断开
+    if (m_relaying && !peer.isNull())
+    {
+        QByteArray data = m_socket->readAll();
+        if (!data.isEmpty())
+            peer->send(BulkPriority, data);
+        peer->finishRelay();
+    }
+
+    emit closed(m_id);
+}
@@ -0,0 +1,296 @@
+#ifndef IMCONNECTION_H
+#define IMCONNECTION_H
+
+#include <QObject>
+#include <QtNetwork>
+#include <QLocalSocket>
+#include <QSharedPointer>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QTimer>
+#include "protocol.h"
+#include "impriorityqueue.h"
+#include "imsharedring.h"
+
+/***********************************
+ *
+ * Class IMConnection
+ * 服务端的单个客户端连接
+ *
+ * 负责从Socket中拆出完整的帧，以及按优先级发送数据
+ *
+ * 连接由服务端线程创建后移动到某个工作线程中，Socket在工作线程里创建，
+ * 之后所有的读写都在这个工作线程中进行
+ * Socket可以是Tcp Socket，也可以是本地套接字，本地连接还可以启用共享内存环形缓冲区接收数据
+ * send 与 close 可以在任意线程调用
+ *
+ * 发送的数据先放入控制、交互、批量三个通道，
+ * 每次事件循环把能发的帧按权重合并成一次写入，
+ * Socket中待发送的数据超过高水位时暂停，等数据写出去后再继续
+ *
+ * 文件传输通道的连接在配对后进入转发模式：
+ * 收到的原始字节不再拆帧，直接放入对方连接的批量通道，数据本身不会被复制
+ * 对方积压的数据超过高水位的4倍时暂停读取，数据留在内核中，由TCP流量控制让发送方慢下来
+ *
+ * 收到的每一批帧都记下服务端收到的时间，随命令一起交给服务端线程
+ * 打开了延迟跟踪的连接，发送队列中带时间戳块的帧在写入Socket时填上写入的时间
+ *
+ * 发出的信号有：
+ * frameReceived    接收到一帧完整的命令
+ * closed           连接已断开
+ *
+ **********************************/
+
+class IMConnection;
+
+/**
+ * @brief 连接的共享指针，最后一个引用释放时通过deleteLater删除连接
+ */
+typedef QSharedPointer<IMConnection> IMConnectionPtr;
+
+class IMConnection : public QObject
+{
+    Q_OBJECT
+
+// 公开成员函数
+public:
+    /**
+     * @brief IMConnection 构造函数，Socket在start中创建
+     * @param id 连接编号
+     */
+    explicit IMConnection(quint64 id, QObject *parent = nullptr);
+
+    ~IMConnection();
+
+    /**
+     * @brief id 连接编号
+     */
+    quint64 id() const { return m_id; }
+
+    /**
+     * @brief name 登录的用户昵称，没有登录时为空
+     */
+    QString name() const { return m_name; }
+
+    /**
+     * @brief setName 设置登录的用户昵称
+     * @param name 用户昵称
+     */
+    void setName(QString name) { m_name = name; }
+
+    /**
+     * @brief isClosed 连接是否已经断开
+     */
+    bool isClosed() const { return m_closed.load() != 0; }
+
+    /**
+     * @brief traceEnabled 客户端是否打开了延迟跟踪，只有打开了的连接才会收到带时间戳块的帧
+     */
+    bool traceEnabled() const { return m_traceEnabled.load() != 0; }
+
+    /**
+     * @brief setTraceEnabled 登录成功时按登录帧是否带着时间戳块设置
+     */
+    void setTraceEnabled(bool enabled) { m_traceEnabled.store(enabled ? 1 : 0); }
+
+    /**
+     * @brief send 将一帧放入对应优先级的通道，在所属线程的下一次事件循环时发出
+     * 可以在任意线程调用
+     * @param priority 优先级
+     * @param frame 帧数据
+     */
+    void send(MessagePriority priority, const QByteArray &frame);
+
+    /**
+     * @brief queuedBytes 发送队列中还没写入Socket的字节数
+     */
+    qint64 queuedBytes();
+
+    /**
+     * @brief startRelay 进入转发模式，之后收到的数据原样转发给对方，可以在任意线程调用
+     * @param peer 对方连接
+     */
+    void startRelay(const IMConnectionPtr &peer);
+
+    /**
+     * @brief finishRelay 发送队列中的数据全部发出后关闭连接，可以在任意线程调用
+     */
+    void finishRelay();
+
+// 信号
+signals:
+    /**
+     * @brief frameReceived 接收到一帧完整的命令
+     * @param id 连接编号
+     * @param payload 命令文本
+     * @param trace 帧中的时间戳，服务端收到的时间总是有的
+     */
+    void frameReceived(quint64 id, QByteArray payload, IMFrameTrace trace);
+
+    /**
+     * @brief closed 连接已断开
+     * @param id 连接编号
+     */
+    void closed(quint64 id);
+
+// 槽
+public slots:
+    /**
+     * @brief start 在所属线程中用socket描述符创建Tcp Socket
+     * @param socketDescriptor socket描述符
+     */
+    void start(qintptr socketDescriptor);
+
+    /**
+     * @brief startLocal 在所属线程中用socket描述符创建本地套接字
+     * @param socketDescriptor socket描述符
+     */
+    void startLocal(quintptr socketDescriptor);
+
+    /**
+     * @brief close 关闭连接，可以在任意线程调用
+     */
+    void close();
+
+    /**
+     * @brief flush 按权重从各通道取出数据写入Socket，直到达到高水位
+     */
+    void flush();
+
+    /**
+     * @brief relay 把收到的数据转发给对方，对方积压太多时暂停
+     */
+    void relay();
+
+private slots:
+    /**
+     * @brief beginRelay 在所属线程中进入转发模式
+     */
+    void beginRelay();
+
+    /**
+     * @brief pollRing 轮询共享内存环形缓冲区
+     */
+    void pollRing();
+
+    /**
+     * @brief readyRead 当接收到数据时触发
+     */
+    void readyRead();
+
+    /**
+     * @brief disconnected 当连接断开时触发
+     */
+    void disconnected();
+
+// 私有成员函数
+private:
+    /**
+     * @brief setupSocket 连接Socket的信号
+     */
+    void setupSocket();
+
+    /**
+     * @brief disconnectSocket 断开Socket，发送缓冲区中的数据会先写完
+     */
+    void disconnectSocket();
+
+    /**
+     * @brief processReadBuffer 取出接收缓冲区中所有完整的帧
+     */
+    void processReadBuffer();
+
+    /**
+     * @brief attachSharedRing 附加到客户端创建的共享内存，之后定时轮询读取
+     * @param key 共享内存的key
+     */
+    void attachSharedRing(QString key);
+
+// 私有成员变量
+private:
+    /**
+     * @brief m_id 连接编号
+     */
+    quint64 m_id;
+
+    /**
+     * @brief m_name 登录的用户昵称
+     */
+    QString m_name;
+
+    /**
+     * @brief m_socket 客户端的Socket连接，Tcp Socket或者本地套接字
+     */
+    QIODevice *m_socket;
+
+    /**
+     * @brief m_local 是否是本地连接
+     */
+    bool m_local;
+
+    /**
+     * @brief m_ring 共享内存环形缓冲区，没有启用时为nullptr
+     */
+    IMSharedRing *m_ring;
+
+    /**
+     * @brief m_ringTimer 轮询共享内存的定时器，有数据时间隔变短，没数据时逐渐变长
+     */
+    QTimer *m_ringTimer;
+
+    /**
+     * @brief m_readBuffer 接收缓冲区，保存还不够一帧的数据
+     */
+    QByteArray m_readBuffer;
+
+    /**
+     * @brief m_sendQueue 按优先级分通道的发送队列
+     */
+    IMPriorityQueue<QByteArray> m_sendQueue;
+
+    /**
+     * @brief m_sendMutex 保护发送队列，其他线程也会往里面放数据
+     */
+    QMutex m_sendMutex;
+
+    /**
+     * @brief m_flushScheduled 是否已经安排了下一次发送
+     */
+    QAtomicInt m_flushScheduled;
+
+    /**
+     * @brief m_closed 连接是否已经断开
+     */
+    QAtomicInt m_closed;
+
+    /**
+     * @brief m_traceEnabled 客户端是否打开了延迟跟踪
+     */
+    QAtomicInt m_traceEnabled;
+
+    /**
+     * @brief m_queuedBytes 发送队列中的字节数，由m_sendMutex保护
+     */
+    qint64 m_queuedBytes;
+
+    /**
+     * @brief m_relayPeer 转发模式下的对方连接，由m_sendMutex保护
+     * 用弱引用避免两个连接互相持有
+     */
+    QWeakPointer<IMConnection> m_relayPeer;
+
+    /**
+     * @brief m_relaying 是否处于转发模式，只在所属线程中访问
+     */
+    bool m_relaying;
+
+    /**
+     * @brief m_closeWhenDrained 发送队列清空后关闭连接，由m_sendMutex保护
+     */
+    bool m_closeWhenDrained;
+};
+
+Q_DECLARE_METATYPE(IMConnectionPtr)
+Q_DECLARE_METATYPE(IMFrameTrace)
+
+#endif // IMCONNECTION_H
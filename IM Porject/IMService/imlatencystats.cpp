@@ -0,0 +1,71 @@
+#include <QDebug>
+#include "imlatencystats.h"
+
+// 各个环节打印时的名称
+static const char *const HopNames[IMLatencyStats::HopCount] = { "uplink", "dispatch", "queue" };
+
+IMLatencyStats *IMLatencyStats::instance()
+{
+    static IMLatencyStats stats;
+    return &stats;
+}
+
+IMLatencyStats::IMLatencyStats()
+{
+}
+
+void IMLatencyStats::record(Hop hop, qint64 micros)
+{
+    quint64 value = micros < 0 ? 0 : quint64(micros);
+    // 值的二进制位数就是桶的下标，0放在第0个桶
+    int bucket = 0;
+    while (bucket < BucketCount - 1 && (value >> bucket) != 0)
+        ++bucket;
+
+    Histogram &histogram = m_histograms[hop];
+    histogram.buckets[bucket].fetchAndAddRelaxed(1);
+    histogram.count.fetchAndAddRelaxed(1);
+    histogram.sum.fetchAndAddRelaxed(value);
+    quint64 max = histogram.max.loadAcquire();
+    while (value > max && !histogram.max.testAndSetOrdered(max, value, max))
+        ;
+}
+
+// 微秒换成毫秒显示
+static QString millis(quint64 micros)
+{
+    return QString::number(double(micros) / 1000.0, 'f', 2) + "ms";
+}
+
+void IMLatencyStats::report()
+{
+    for (int hop = 0; hop < HopCount; ++hop)
+    {
+        Histogram &histogram = m_histograms[hop];
+        // 取出并清零，打印期间新记录的值算到下一次，各个计数之间可能差一两个，不影响分布
+        quint64 buckets[BucketCount];
+        for (int i = 0; i < BucketCount; ++i)
+            buckets[i] = histogram.buckets[i].fetchAndStoreRelaxed(0);
+        quint64 count = histogram.count.fetchAndStoreRelaxed(0);
+        quint64 sum = histogram.sum.fetchAndStoreRelaxed(0);
+        quint64 max = histogram.max.fetchAndStoreRelaxed(0);
+        if (count == 0)
+            continue;
+
+        // 百分位取所在桶的上界，不超过最大值
+        const double percents[] = { 0.5, 0.9, 0.99 };
+        QString text;
+        for (double percent : percents)
+        {
+            quint64 target = quint64(double(count) * percent + 0.5);
+            quint64 seen = 0;
+            int bucket = 0;
+            while (bucket < BucketCount - 1 && seen + buckets[bucket] < qMax<quint64>(target, 1))
+                seen += buckets[bucket++];
+            quint64 bound = bucket == 0 ? 0 : qMin(max, (quint64(1) << bucket) - 1);
+            text += QString(" p%1<=%2").arg(percent * 100).arg(millis(bound));
+        }
+        qDebug().noquote() << "latency" << HopNames[hop] << "count" << count
+                           << "mean" << millis(sum / count) << text.trimmed() << "max" << millis(max);
+    }
+}
@@ -0,0 +1,78 @@
+#ifndef IMLATENCYSTATS_H
+#define IMLATENCYSTATS_H
+
+#include <QAtomicInteger>
+
+/***********************************
+ *
+ * Class IMLatencyStats
+ * 服务端各个环节的延迟直方图
+ *
+ * 每个环节一个直方图，桶按2的幂划分（微秒），第b个桶放 [2^(b-1), 2^b) 的值，
+ * 记录只是几次原子加法，服务端线程和工作线程都可以直接调用
+ * 服务端定时调用report打印每个环节的次数、平均值、百分位与最大值，打印后清零，
+ * 所以每次打印的都是这一段时间内的分布
+ *
+ * 上行    客户端发出到服务端收到，只有打开了跟踪的客户端发来的消息才有，包含时钟偏差的估计误差
+ * 处理    服务端收到到放入发送队列，包含在工作队列中的等待
+ * 排队    放入发送队列到写入Socket，只有发给打开了跟踪的客户端的消息才有
+ * 下行（写入Socket到接收方解出）只有接收方知道，显示在客户端的调试浮层中
+ *
+ **********************************/
+
+class IMLatencyStats
+{
+public:
+    /**
+     * @brief 服务端能测到的环节
+     */
+    enum Hop {
+        // 客户端发出到服务端收到
+        UplinkHop = 0,
+
+        // 服务端收到到放入发送队列
+        DispatchHop = 1,
+
+        // 放入发送队列到写入Socket
+        QueueHop = 2,
+
+        // 环节的数量
+        HopCount = 3
+    };
+
+    /**
+     * @brief instance 单例对象
+     */
+    static IMLatencyStats *instance();
+
+    /**
+     * @brief record 记录一次延迟，可以在任意线程调用
+     * @param hop 环节
+     * @param micros 延迟（微秒），估计的时钟偏差可能让它小于0，按0记录
+     */
+    void record(Hop hop, qint64 micros);
+
+    /**
+     * @brief report 打印所有环节的分布并清零，没有数据的环节不打印
+     */
+    void report();
+
+private:
+    IMLatencyStats();
+
+    /**
+     * @brief 桶的数量，最后一个桶放所有更大的值
+     */
+    static const int BucketCount = 40;
+
+    struct Histogram {
+        QAtomicInteger<quint64> buckets[BucketCount];
+        QAtomicInteger<quint64> count;
+        QAtomicInteger<quint64> sum;
+        QAtomicInteger<quint64> max;
+    };
+
+    Histogram m_histograms[HopCount];
+};
+
+#endif // IMLATENCYSTATS_H
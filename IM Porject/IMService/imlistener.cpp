@@ -0,0 +1,136 @@
+#include <QDebug>
+#include "imlistener.h"
+
+#ifdef Q_OS_UNIX
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#endif
+
+IMListener::IMListener(const QHostAddress &address, quint16 port, int backlog, bool reusePort, int index, QObject *parent)
+    : QTcpServer(parent),
+      m_address(address),
+      m_port(port),
+      m_backlog(backlog),
+      m_reusePort(reusePort && reusePortSupported()),
+      m_index(index)
+{
+}
+
+bool IMListener::reusePortSupported()
+{
+#if defined(Q_OS_UNIX) && defined(SO_REUSEPORT)
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool IMListener::start()
+{
+#ifdef Q_OS_UNIX
+    return this->listenNative();
+#else
+    // QTcpServer::listen不能设置backlog，这里只能用默认值
+    return this->listen(m_address, m_port);
+#endif
+}
+
+void IMListener::stop()
+{
+    this->close();
+}
+
+bool IMListener::listenNative()
+{
+#ifdef Q_OS_UNIX
+    // QHostAddress::Any 用IPv6的双栈地址，同时接受IPv4连接
+    bool ipv4 = m_address.protocol() == QAbstractSocket::IPv4Protocol;
+    int fd = ::socket(ipv4 ? AF_INET : AF_INET6, SOCK_STREAM, 0);
+    if (fd < 0 && m_address == QHostAddress::Any)
+    {
+        // 系统没有启用IPv6时退回IPv4
+        ipv4 = true;
+        fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    }
+    if (fd < 0)
+    {
+        qDebug() << "IMListener: socket failed" << strerror(errno);
+        return false;
+    }
+
+    int on = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+    if (m_reusePort)
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+
+    sockaddr_storage storage;
+    memset(&storage, 0, sizeof(storage));
+    socklen_t length;
+    if (ipv4)
+    {
+        sockaddr_in *addr = reinterpret_cast<sockaddr_in *>(&storage);
+        addr->sin_family = AF_INET;
+        addr->sin_port = htons(m_port);
+        addr->sin_addr.s_addr = m_address == QHostAddress::Any ? htonl(INADDR_ANY) : htonl(m_address.toIPv4Address());
+        length = sizeof(sockaddr_in);
+    }
+    else
+    {
+        int off = 0;
+        ::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, m_address == QHostAddress::Any ? &off : &on, sizeof(int));
+        sockaddr_in6 *addr = reinterpret_cast<sockaddr_in6 *>(&storage);
+        addr->sin6_family = AF_INET6;
+        addr->sin6_port = htons(m_port);
+        if (m_address == QHostAddress::Any)
+        {
+            addr->sin6_addr = in6addr_any;
+        }
+        else
+        {
+            Q_IPV6ADDR ip = m_address.toIPv6Address();
+            memcpy(&addr->sin6_addr, &ip, sizeof(ip));
+        }
+        length = sizeof(sockaddr_in6);
+    }
+
+    if (::bind(fd, reinterpret_cast<sockaddr *>(&storage), length) != 0
+            || ::listen(fd, m_backlog) != 0)
+    {
+        qDebug() << "IMListener: listen failed" << m_address << m_port << strerror(errno);
+        ::close(fd);
+        return false;
+    }
+
+    // 交给QTcpServer，之后由它在本线程的事件循环中accept
+    if (!this->setSocketDescriptor(fd))
+    {
+        qDebug() << "IMListener:" << this->errorString();
+        ::close(fd);
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+void IMListener::incomingConnection(qintptr socketDescriptor)
+{
+    emit newDescriptor(socketDescriptor);
+}
+
+IMLocalListener::IMLocalListener(QObject *parent)
+    : QLocalServer(parent)
+{
+}
+
+void IMLocalListener::incomingConnection(quintptr socketDescriptor)
+{
+    emit newDescriptor(socketDescriptor);
+}
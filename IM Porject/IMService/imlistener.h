@@ -0,0 +1,118 @@
+#ifndef IMLISTENER_H
+#define IMLISTENER_H
+
+#include <QTcpServer>
+#include <QLocalServer>
+#include <QHostAddress>
+
+/***********************************
+ *
+ * Class IMListener
+ * 监听端口的Tcp Server
+ *
+ * 不在监听线程中创建QTcpSocket，只把新连接的socket描述符交出去，
+ * 由连接所属的工作线程自己创建Socket
+ *
+ * 监听器运行在某个工作线程中，同一个地址可以有多个监听器：
+ * 支持SO_REUSEPORT的系统上每个监听器各自创建监听socket并设置SO_REUSEPORT，
+ * 由内核把新连接分散到各个监听器，accept在多个线程中并行进行
+ * 不支持的系统上同一个地址只能有一个监听器
+ *
+ * 发出的信号有：
+ * newDescriptor    有新连接进入，在监听器所在的线程中发出
+ *
+ **********************************/
+
+class IMListener : public QTcpServer
+{
+    Q_OBJECT
+
+public:
+    /**
+     * @brief IMListener 构造函数，在start中开始监听
+     * @param address 监听地址
+     * @param port 端口
+     * @param backlog 内核中等待accept的连接队列长度
+     * @param reusePort 是否设置SO_REUSEPORT
+     * @param index 监听器所在的工作线程下标
+     */
+    IMListener(const QHostAddress &address, quint16 port, int backlog, bool reusePort, int index, QObject *parent = nullptr);
+
+    /**
+     * @brief index 监听器所在的工作线程下标
+     */
+    int index() const { return m_index; }
+
+    /**
+     * @brief reusePortSupported 当前系统是否支持用SO_REUSEPORT分散accept
+     */
+    static bool reusePortSupported();
+
+public slots:
+    /**
+     * @brief start 开始监听，必须在监听器所在的线程中调用
+     * @return 是否成功
+     */
+    bool start();
+
+    /**
+     * @brief stop 停止监听，必须在监听器所在的线程中调用
+     */
+    void stop();
+
+signals:
+    /**
+     * @brief newDescriptor 有新连接进入
+     * @param socketDescriptor 新连接的socket描述符
+     */
+    void newDescriptor(qintptr socketDescriptor);
+
+protected:
+    void incomingConnection(qintptr socketDescriptor) override;
+
+private:
+    /**
+     * @brief listenNative 自己创建监听socket，设置SO_REUSEPORT与backlog后交给QTcpServer
+     * @return 是否成功
+     */
+    bool listenNative();
+
+private:
+    QHostAddress m_address;
+    quint16 m_port;
+    int m_backlog;
+    bool m_reusePort;
+    int m_index;
+};
+
+/***********************************
+ *
+ * Class IMLocalListener
+ * 监听本地套接字的Local Server
+ *
+ * 与IMListener一样只把新连接的socket描述符交出去
+ *
+ * 发出的信号有：
+ * newDescriptor    有新连接进入
+ *
+ **********************************/
+
+class IMLocalListener : public QLocalServer
+{
+    Q_OBJECT
+
+public:
+    explicit IMLocalListener(QObject *parent = nullptr);
+
+signals:
+    /**
+     * @brief newDescriptor 有新连接进入
+     * @param socketDescriptor 新连接的socket描述符
+     */
+    void newDescriptor(quintptr socketDescriptor);
+
+protected:
+    void incomingConnection(quintptr socketDescriptor) override;
+};
+
+#endif // IMLISTENER_H
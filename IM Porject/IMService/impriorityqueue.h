@@ -0,0 +1,114 @@
+#ifndef IMPRIORITYQUEUE_H
+#define IMPRIORITYQUEUE_H
+
+#include <QQueue>
+#include "protocol.h"
+
+/***********************************
+ *
+ * Class IMPriorityQueue
+ * 按优先级分通道的队列
+ *
+ * 每个优先级一个先进先出的通道，出队时按权重轮流调度：
+ * 轮到某个通道时最多连续取出"权重"个元素，然后轮到下一个通道
+ * 同一个通道内保持先进先出，所以同一优先级的消息顺序不会变
+ *
+ * 连接的发送队列和服务端的工作队列都使用这个类
+ *
+ **********************************/
+
+template <typename T>
+class IMPriorityQueue
+{
+public:
+    IMPriorityQueue()
+        : m_size(0),
+          m_current(PriorityCount - 1),
+          m_credit(0)
+    {
+        for (int i = 0; i < PriorityCount; ++i)
+            m_weights[i] = 1;
+    }
+
+    /**
+     * @brief setWeights 设置各个通道的权重
+     * @param weights 权重数组，长度为PriorityCount，小于1的按1处理
+     */
+    void setWeights(const int *weights)
+    {
+        for (int i = 0; i < PriorityCount; ++i)
+            m_weights[i] = qMax(1, weights[i]);
+    }
+
+    /**
+     * @brief enqueue 入队
+     * @param priority 优先级
+     * @param item 元素
+     */
+    void enqueue(MessagePriority priority, const T &item)
+    {
+        m_lanes[priority].enqueue(item);
+        ++m_size;
+    }
+
+    /**
+     * @brief dequeue 按权重轮流出队，调用前必须保证队列不为空
+     * @return 元素
+     */
+    T dequeue()
+    {
+        Q_ASSERT(m_size > 0);
+        for (;;)
+        {
+            if (m_credit > 0 && !m_lanes[m_current].isEmpty())
+            {
+                --m_credit;
+                --m_size;
+                return m_lanes[m_current].dequeue();
+            }
+            // 当前通道用完了额度或者已经空了，轮到下一个通道
+            m_current = (m_current + 1) % PriorityCount;
+            m_credit = m_weights[m_current];
+        }
+    }
+
+    /**
+     * @brief isEmpty 队列是否为空
+     */
+    bool isEmpty() const { return m_size == 0; }
+
+    /**
+     * @brief size 所有通道的元素总数
+     */
+    int size() const { return m_size; }
+
+    /**
+     * @brief size 指定通道的元素个数
+     * @param priority 优先级
+     */
+    int size(MessagePriority priority) const { return m_lanes[priority].size(); }
+
+    /**
+     * @brief clear 清空所有通道
+     */
+    void clear()
+    {
+        for (int i = 0; i < PriorityCount; ++i)
+            m_lanes[i].clear();
+        m_size = 0;
+    }
+
+private:
+    // 各优先级的通道
+    QQueue<T> m_lanes[PriorityCount];
+    // 各通道的权重
+    int m_weights[PriorityCount];
+    // 元素总数
+    int m_size;
+    // 当前轮到的通道
+    int m_current;
+    // 当前通道剩余的额度
+    int m_credit;
+};
+
+#endif // IMPRIORITYQUEUE_H
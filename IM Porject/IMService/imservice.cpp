@@ -1,229 +1,856 @@
-#include "imservice.h"
-#include "protocol.h"
-#include <QDebug>
-
-// 构造函数
-IMService::IMService(QObject *parent)
-    : QObject(parent),
-      m_server(new QTcpServer),
-      m_clientSocket(new QMap<QString, QTcpSocket *>),
-      m_clientNames(new QMap<QTcpSocket *, QString>)
-{
-    connect(this->m_server, &QTcpServer::newConnection, this, &IMService::newConnection);
-    if (this->m_server->listen(QHostAddress::Any, 9876))
-        qDebug() << "Service open SUCCESS!";
-    else
-        qDebug() << this->m_server->errorString(); //错误信息
-
-}
-
-IMService::~IMService()
-{
-    m_server->close();
-    delete m_server;
-    delete m_clientSocket;
-    delete m_clientNames;
-    qDebug() << "Service Close!";
-}
-
-void IMService::closeService()
-{
-    // 遍历并关闭所有Socket连接
-    for (auto it : *(this->m_clientSocket))
-        it->close();
-    // 清空表
-    this->m_clientSocket->clear();
-    this->m_clientNames->clear();
-}
-
-// 当有新连接进入时
-void IMService::newConnection()
-{
-    // 获取这个连接的Socket
-    QTcpSocket *socketTemp = this->m_server->nextPendingConnection();
-
-    // 当接收到数据时触发readyRead
-    connect(socketTemp, &QTcpSocket::readyRead, this, &IMService::readyRead);
-
-    // 当连接断开时触发disconnected
-    connect(socketTemp, &QTcpSocket::disconnected, this, &IMService::disconnected);
-
-    qDebug() << "newConnection!";
-}
-
-// 当连接断开时触发
-void IMService::disconnected()
-{
-    qDebug() << "disconnected!";
-
-    // 获取断开连接的对象
-    QTcpSocket* sender = static_cast<QTcpSocket*>(QObject::sender());
-    // 释放内存
-    sender->deleteLater();
-
-    // 先查一下这个连接是否存在表中，如果没在，说明这个连接没上线，直接return即可
-    if (!this->m_clientNames->contains(sender))
-        return;
-
-    // 否则说明这是一个在线用户断开连接
-    // 记录这个用户的昵称
-    QString senderName = this->m_clientNames->value(sender);
-
-    // 将这个用户从表中移除
-    this->m_clientSocket->remove(senderName);
-    this->m_clientNames->remove(sender);
-
-    // 通知其他人该用户离线
-    this->userOffline(senderName);
-}
-
-// 当接收到数据时触发
-void IMService::readyRead()
-{
-    // 获取接收到数据的对象
-    QTcpSocket* sender = static_cast<QTcpSocket*>(QObject::sender());
-    // 获取数据
-    QByteArray data = sender->readAll();
-    QTextStream in(data, QIODevice::ReadOnly);
-    qDebug() << "readyread:" << data;
-
-
-    // 进行协议分析与任务调度
-    int functionID = 0;
-    in >> functionID;
-
-    // 如果是登录的功能码
-    if (functionID == ClientFunctionCode::Login)
-    {
-        QString name;
-        in >> name;
-        // 执行登录
-        this->userLogin(name, sender);
-    }
-    // 检测这个连接有没有登录
-    else if (this->m_clientNames->contains(sender))
-    {
-        // 如果是私聊消息
-        if (functionID == ClientFunctionCode::SendPrivateMessage)
-        {
-            // 获取要发送的用户昵称
-            QString toName;
-            in >> toName;
-            in.seek(in.pos() + 1);
-
-            // 将剩下的内容全部发送
-            this->sendPrivateMessage(this->m_clientNames->value(sender), toName, in.readAll());
-        }
-        // 否则如果是群聊消息
-        else if (functionID == ClientFunctionCode::SendGroupMessage)
-        {
-            in.seek(in.pos() + 1);
-            this->sendGroupMessage(this->m_clientNames->value(sender), in.readAll());
-        }
-    }
-}
-
-void IMService::sendData(QTcpSocket *socket, QString data)
-{
-    if (socket != nullptr && socket->isOpen())
-        socket->write(data.toUtf8());
-}
-
-/*
-enum ServerFunctionCode {
-    // 私聊消息
-    PrivateMessage = 1,
-
-    // 群聊消息
-    GroupMessage = 2,
-
-    // 用户上线
-    UserOnline = 3,
-
-    // 用户下线
-    UserOffline = 4,
-
-    // 登录结果
-    LoginResult = 10
-};
-*/
-
-
-// 用户登录
-// 参数：name    用户昵称
-void IMService::userLogin(QString name, QTcpSocket *socket)
-{
-    qDebug() << "userLogin():   user name:" << name << "\tsocket:" << socket;
-    // 如果这个昵称或者连接已经登录了
-    if (this->m_clientSocket->contains(name) || this->m_clientNames->contains(socket))
-    {
-        qDebug() << "Login failed!";
-        // 发送登录结果：登录失败
-        this->sendData(this->m_clientSocket->value(name), QString("%1 1").arg(ServerFunctionCode::LoginResult));
-    }
-    else
-    {
-        qDebug() << "Login success!";
-        // 获取当前在线的用户昵称
-        QList<QString> temp = this->m_clientSocket->keys();
-        this->m_clientSocket->insert(name, socket);
-        this->m_clientNames->insert(socket, name);
-        // 将所有在线用户的昵称组合
-        QString ret = QString("%1 0 %2").arg(ServerFunctionCode::LoginResult).arg(temp.length());
-        QTextStream ts(&ret);
-        for (QString it : temp)
-            ts << ' ' << it;
-        qDebug() << "ret:" << ret;
-        // 发送登录结果：登录成功！ 并返回当前在线人员数据
-        this->sendData(this->m_clientSocket->value(name), ret);
-
-        // 通知其他人改用户上线
-        this->userOnline(name);
-    }
-}
-
-// 发送私聊消息
-// 参数:fromName 发送者昵称
-// 参数:toName   接收者昵称
-// 参数:content  内容
-void IMService::sendPrivateMessage(QString fromName, QString toName, QString content)
-{
-    qDebug() << "sendPrivateMessage():  fromName:" << fromName << "\ttoName" << toName << "\tcontent" << content;
-    // 如果该用户存在才发送
-    if (this->m_clientSocket->contains(toName))
-        this->sendData(this->m_clientSocket->value(toName), QString("%1 %2 %3").arg(ServerFunctionCode::PrivateMessage).arg(fromName).arg(content));
-}
-
-// 发送群聊消息
-// 参数:fromName 发送者昵称
-// 参数:content  内容
-void IMService::sendGroupMessage(QString fromName, QString content)
-{
-    qDebug() << "sendGroupMessage():  fromName:" << fromName << "\tcontent" << content;
-    QString data = QString("%1 %2 %3").arg(ServerFunctionCode::GroupMessage).arg(fromName).arg(content);
-    for (auto it = this->m_clientSocket->begin(); it != this->m_clientSocket->end(); it++)
-        if (it.key() != fromName)
-            this->sendData(it.value(), data);
-}
-
-// 用户上线
-// 参数:name     用户昵称
-void IMService::userOnline(QString name)
-{
-    qDebug() << "userOnline():  name:" << name;
-    QString data = QString("%1 %2").arg(ServerFunctionCode::UserOnline).arg(name);
-    for (auto it = this->m_clientSocket->begin(); it != this->m_clientSocket->end(); it++)
-        if (it.key() != name)
-            this->sendData(it.value(), data);
-}
-
-// 用户离线
-// 参数:name     用户昵称
-void IMService::userOffline(QString name)
-{
-    qDebug() << "userOffline():  name:" << name;
-    QString data = QString("%1 %2").arg(ServerFunctionCode::UserOffline).arg(name);
-    for (auto it = this->m_clientSocket->begin(); it != this->m_clientSocket->end(); it++)
-        if (it.key() != name)
-            this->sendData(it.value(), data);
-}
+#include "imservice.h"
+#include "imserviceconfig.h"
+#include "imlatencystats.h"
+#include <QDebug>
+#include <QLoggingCategory>
+
+// 每条命令与消息内容的日志，默认关闭，用 QT_LOGGING_RULES="im.command.debug=true" 打开
+Q_LOGGING_CATEGORY(lcCommand, "im.command", QtWarningMsg)
+
+// 构造函数
+IMService::IMService(QObject *parent)
+    : QObject(parent),
+      m_localServer(nullptr),
+      m_workerPool(new IMWorkerPool(IMServiceConfig::instance()->workerThreads,
+                                    IMServiceConfig::instance()->fanoutStrandsPerWorker,
+                                    IMServiceConfig::instance()->fanoutChunkSize)),
+      m_clientSocket(new QMap<QString, IMConnectionPtr>),
+      m_pendingWorkCount(0),
+      m_workScheduled(false),
+      m_nextLocalThread(0),
+      m_presenceEpoch(QString::number(QDateTime::currentMSecsSinceEpoch(), 36)),
+      m_presenceVersion(0),
+      m_tracingClients(0),
+      m_traceReportTimer(new QTimer(this)),
+      m_lastIdTime(0),
+      m_idSequence(0),
+      m_recorder(nullptr),
+      m_framesReceived(0)
+{
+    // 跨线程的信号与调用需要用到这两个类型
+    qRegisterMetaType<qintptr>("qintptr");
+    qRegisterMetaType<quintptr>("quintptr");
+    qRegisterMetaType<quint64>("quint64");
+    qRegisterMetaType<IMConnectionPtr>("IMConnectionPtr");
+    qRegisterMetaType<IMFrameTrace>("IMFrameTrace");
+
+    m_workQueue.setWeights(IMServiceConfig::instance()->laneWeights);
+
+    // 定时打印各环节的延迟直方图
+    if (IMServiceConfig::instance()->traceReportInterval > 0)
+    {
+        connect(this->m_traceReportTimer, &QTimer::timeout, []() { IMLatencyStats::instance()->report(); });
+        this->m_traceReportTimer->start(IMServiceConfig::instance()->traceReportInterval * 1000);
+    }
+
+    // 录制要在开始监听之前打开，第一个连接也能录下
+    const IMServiceConfig *config = IMServiceConfig::instance();
+    if (!config->captureFile.isEmpty())
+    {
+        this->m_recorder = new IMTraceRecorder(config->captureBufferSize, config->captureMaxBuffered);
+        if (!this->m_recorder->open(config->captureFile))
+        {
+            delete this->m_recorder;
+            this->m_recorder = nullptr;
+        }
+    }
+
+    this->startListeners();
+
+    // 同一台机器上的客户端可以走本地套接字
+    if (IMServiceConfig::instance()->localEnabled)
+    {
+        this->m_localServer = new IMLocalListener;
+        connect(this->m_localServer, &IMLocalListener::newDescriptor, this, &IMService::newLocalConnection);
+        // 上次异常退出时留下的套接字文件会导致监听失败，先删掉
+        QLocalServer::removeServer(IMServiceConfig::instance()->localName);
+        if (this->m_localServer->listen(IMServiceConfig::instance()->localName))
+            qDebug() << "Local service open SUCCESS!" << this->m_localServer->fullServerName();
+        else
+            qDebug() << this->m_localServer->errorString();
+    }
+}
+
+IMService::~IMService()
+{
+    // 监听器在工作线程中，先在各自的线程中停止监听，等工作线程退出后再删除
+    for (IMListener *listener : m_listeners)
+        QMetaObject::invokeMethod(listener, "stop", Qt::BlockingQueuedConnection);
+    if (m_localServer != nullptr)
+    {
+        m_localServer->close();
+        delete m_localServer;
+    }
+    this->closeService();
+    // 连接都关闭了，写完剩下的录制
+    delete m_recorder;
+    // 关闭连接时释放的连接对象在各自的工作线程中deleteLater，等它们执行完再停止线程
+    m_workerPool->drain();
+    delete m_workerPool;
+    qDeleteAll(m_listeners);
+    delete m_clientSocket;
+    qDebug() << "Service Close!";
+}
+
+void IMService::closeService()
+{
+    // 先清空表，关闭连接时触发的断开通知就不会再广播下线消息
+    QList<IMConnectionPtr> connections = this->m_connections.values();
+    this->m_connections.clear();
+    for (auto it : *(this->m_clientSocket))
+        this->m_workerPool->removeMember(it);
+    this->m_clientSocket->clear();
+    this->m_tracingClients = 0;
+    this->m_workQueue.clear();
+    this->m_pendingWork.clear();
+    this->m_pendingWorkCount = 0;
+    this->m_transfers.clear();
+    this->m_transferStreams.clear();
+    // 遍历并关闭所有连接，在所属的工作线程中同步关闭：服务端退出时工作线程随后就停止，排队的关闭来不及执行
+    for (auto it : connections)
+    {
+        if (it->thread() == QThread::currentThread())
+            it->close();
+        else
+            QMetaObject::invokeMethod(it.data(), "close", Qt::BlockingQueuedConnection);
+    }
+}
+
+void IMService::startListeners()
+{
+    const IMServiceConfig *config = IMServiceConfig::instance();
+    // 不能用SO_REUSEPORT时同一个地址只能监听一次
+    int perEndpoint = config->listenReusePort && IMListener::reusePortSupported() ? config->listenersPerEndpoint : 1;
+
+    for (QString endpoint : config->listenEndpoints)
+    {
+        // 地址:端口，IPv6地址写成[::1]:9876
+        endpoint = endpoint.trimmed();
+        int colon = endpoint.lastIndexOf(':');
+        bool isNumber = false;
+        quint16 port = colon < 0 ? 0 : endpoint.mid(colon + 1).toUShort(&isNumber);
+        QString host = colon < 0 ? QString() : endpoint.left(colon);
+        if (host.startsWith('[') && host.endsWith(']'))
+            host = host.mid(1, host.size() - 2);
+        QHostAddress address = host.isEmpty() || host == "*" ? QHostAddress(QHostAddress::Any) : QHostAddress(host);
+        if (!isNumber || address.isNull())
+        {
+            qDebug() << "Invalid listen endpoint:" << endpoint;
+            continue;
+        }
+
+        int opened = 0;
+        for (int i = 0; i < perEndpoint; ++i)
+        {
+            // 监听器轮流放到各个工作线程中，accept到的连接就属于这个线程
+            int threadIndex = i % this->m_workerPool->threadCount();
+            IMListener *listener = new IMListener(address, port, config->listenBacklog, config->listenReusePort, threadIndex);
+            listener->moveToThread(this->m_workerPool->thread(threadIndex));
+            connect(listener, &IMListener::newDescriptor, listener, [this, threadIndex](qintptr socketDescriptor){
+                this->newConnection(socketDescriptor, threadIndex);
+            }, Qt::DirectConnection);
+
+            // 监听socket必须在监听器所在的线程中创建
+            bool ok = false;
+            QMetaObject::invokeMethod(listener, "start", Qt::BlockingQueuedConnection, Q_RETURN_ARG(bool, ok));
+            if (!ok)
+            {
+                qDebug() << listener->errorString(); //错误信息
+                delete listener;
+                break;
+            }
+            this->m_listeners.append(listener);
+            ++opened;
+        }
+        if (opened > 0)
+            qDebug() << "Service open SUCCESS!" << endpoint << "listeners" << opened;
+    }
+}
+
+// 当有新连接进入时，在监听器所在的工作线程中执行
+void IMService::newConnection(qintptr socketDescriptor, int threadIndex)
+{
+    IMConnectionPtr connection = this->createConnection(threadIndex);
+
+    // 先登记再开始读，登记与之后的frameReceived都是从这个线程投递到服务端线程，顺序不会乱
+    QMetaObject::invokeMethod(this, "registerConnection", Qt::QueuedConnection, Q_ARG(IMConnectionPtr, connection));
+
+    // 连接对象就在本线程中，直接创建Socket
+    connection->start(socketDescriptor);
+
+    qDebug() << "newConnection!" << connection->id();
+}
+
+// 登记监听线程中创建的连接
+void IMService::registerConnection(IMConnectionPtr connection)
+{
+    this->m_connections.insert(connection->id(), connection);
+    if (this->m_recorder != nullptr)
+        this->m_recorder->record(IMTraceRecord::Open, connection->id());
+}
+
+// 当有新的本地连接进入时
+void IMService::newLocalConnection(quintptr socketDescriptor)
+{
+    int threadIndex = this->m_nextLocalThread++ % this->m_workerPool->threadCount();
+    IMConnectionPtr connection = this->createConnection(threadIndex);
+    connection->moveToThread(this->m_workerPool->thread(threadIndex));
+    this->m_connections.insert(connection->id(), connection);
+    if (this->m_recorder != nullptr)
+        this->m_recorder->record(IMTraceRecord::Open, connection->id());
+
+    // 在工作线程中创建本地套接字
+    QMetaObject::invokeMethod(connection.data(), "startLocal", Qt::QueuedConnection, Q_ARG(quintptr, socketDescriptor));
+
+    qDebug() << "newLocalConnection!" << connection->id();
+}
+
+IMConnectionPtr IMService::createConnection(int threadIndex)
+{
+    // 创建连接对象，最后一个引用释放时通过deleteLater删除
+    // 编号满足 id % 线程数 == threadIndex，分发串与threadFor都依赖这一点
+    quint64 id = this->m_workerPool->allocateID(threadIndex);
+    IMConnection *connectionTemp = new IMConnection(id);
+    IMConnectionPtr connection(connectionTemp, &QObject::deleteLater);
+
+    // 当接收到完整的命令时触发frameReceived
+    connect(connectionTemp, &IMConnection::frameReceived, this, &IMService::frameReceived);
+
+    // 当连接断开时触发connectionClosed
+    connect(connectionTemp, &IMConnection::closed, this, &IMService::connectionClosed);
+
+    return connection;
+}
+
+// 当连接断开时触发
+void IMService::connectionClosed(quint64 id)
+{
+    qDebug() << "disconnected!" << id;
+
+    // 从连接表中移除，还没处理的命令不再处理
+    IMConnectionPtr connection = this->m_connections.take(id);
+    if (connection.isNull())
+        return;
+    this->m_pendingWorkCount -= this->m_pendingWork.take(id).size();
+    if (this->m_recorder != nullptr)
+        this->m_recorder->record(IMTraceRecord::Close, id);
+
+    // 如果是传输连接，从传输登记中去掉
+    if (this->m_transferStreams.contains(id))
+    {
+        auto it = this->m_transfers.find(this->m_transferStreams.take(id));
+        if (it != this->m_transfers.end())
+        {
+            if (it->senderStream == connection)
+                it->senderStream.clear();
+            if (it->receiverStream == connection)
+                it->receiverStream.clear();
+        }
+        return;
+    }
+
+    // 如果这个连接没登录，直接return即可
+    QString senderName = connection->name();
+    if (senderName.isEmpty() || this->m_clientSocket->value(senderName) != connection)
+        return;
+
+    // 否则说明这是一个在线用户断开连接，将这个用户从表中移除
+    this->m_clientSocket->remove(senderName);
+    this->m_workerPool->removeMember(connection);
+    if (connection->traceEnabled())
+        --this->m_tracingClients;
+
+    // 取消这个用户参与的所有文件传输
+    QList<quint64> transferIDs;
+    for (auto it = this->m_transfers.begin(); it != this->m_transfers.end(); it++)
+        if (it->fromName == senderName || it->toName == senderName)
+            transferIDs.append(it.key());
+    for (quint64 transferID : transferIDs)
+        this->cancelFile(senderName, transferID);
+
+    // 通知其他人该用户离线
+    this->userOffline(senderName);
+}
+
+// 当接收到一帧命令时触发
+void IMService::frameReceived(quint64 id, QByteArray payload, IMFrameTrace trace)
+{
+    IMConnectionPtr connection = this->m_connections.value(id);
+    if (connection.isNull())
+        return;
+
+    // 查询处理进度不排队，立即回复这一刻的状态，也不计数、不录制
+    if (peekFunctionCode(payload) == ClientFunctionCode::QueryProgress)
+    {
+        this->sendCommand<IMSchema::Progress>(connection, this->m_framesReceived, this->m_pendingWorkCount,
+                                              this->m_workerPool->isBusy() ? 1 : 0);
+        return;
+    }
+    ++this->m_framesReceived;
+
+    // 录下的时间是连接收到这一帧的时间，重放时按它还原原来的节奏
+    if (this->m_recorder != nullptr)
+        this->m_recorder->record(IMTraceRecord::Frame, id, trace.stamps[TraceServerIngress], payload);
+
+    // 放到这个连接的队尾，连接原来没有待处理的命令时按这条命令的优先级放入工作队列
+    IMWorkItem item;
+    item.connection = connection;
+    item.payload = payload;
+    item.trace = trace;
+    QQueue<IMWorkItem> &pending = this->m_pendingWork[id];
+    pending.enqueue(item);
+    ++this->m_pendingWorkCount;
+    if (pending.size() == 1)
+        this->m_workQueue.enqueue(clientCommandPriority(peekFunctionCode(payload)), id);
+
+    if (!this->m_workScheduled)
+    {
+        this->m_workScheduled = true;
+        QMetaObject::invokeMethod(this, "processWork", Qt::QueuedConnection);
+    }
+}
+
+// 按权重处理一批命令
+void IMService::processWork()
+{
+    this->m_workScheduled = false;
+    int n = IMServiceConfig::instance()->workBatchSize;
+    while (n-- > 0 && !this->m_workQueue.isEmpty())
+    {
+        // 连接排队后断开了，命令已经在connectionClosed中丢弃
+        quint64 id = this->m_workQueue.dequeue();
+        auto it = this->m_pendingWork.find(id);
+        if (it == this->m_pendingWork.end())
+            continue;
+        IMWorkItem item = it->dequeue();
+        --this->m_pendingWorkCount;
+        if (it->isEmpty())
+            this->m_pendingWork.erase(it);
+        else
+            this->m_workQueue.enqueue(clientCommandPriority(peekFunctionCode(it->head().payload)), id);
+
+        // 已经断开但断开通知还没到的连接，命令同样丢弃
+        if (item.connection->isClosed())
+            continue;
+        this->processCommand(item.connection, item.payload, item.trace);
+    }
+
+    // 还有没处理完的命令，让出事件循环，下一轮再处理
+    if (!this->m_workQueue.isEmpty())
+    {
+        this->m_workScheduled = true;
+        QMetaObject::invokeMethod(this, "processWork", Qt::QueuedConnection);
+    }
+}
+
+// 进行协议分析与任务调度，参数按命令的声明解码
+void IMService::processCommand(const IMConnectionPtr &connection, const QByteArray &data, const IMFrameTrace &trace)
+{
+    qCDebug(lcCommand) << "processCommand:" << connection->id() << data;
+
+    int functionID = peekFunctionCode(data);
+
+    // 如果是登录的功能码
+    if (functionID == ClientFunctionCode::Login)
+    {
+        QString name;
+        QString epoch;
+        quint64 version = 0;
+        // 重连时后面还有上次的纪元与版本，第一次登录时没有，保持默认值
+        IMCodec<IMSchema::Relogin>::decode(data, name, epoch, version);
+        // 执行登录
+        this->userLogin(name, connection, epoch, version, trace);
+    }
+    // 如果是传输连接的第一帧
+    else if (functionID == ClientFunctionCode::AttachTransfer)
+    {
+        quint64 id = 0;
+        int role = 0;
+        QString name;
+        IMCodec<IMSchema::AttachTransfer>::decode(data, id, role, name);
+        this->attachTransfer(id, role, name, connection);
+    }
+    // 检测这个连接有没有登录
+    else if (!connection->name().isEmpty())
+    {
+        // 如果是私聊消息，发给对方
+        if (functionID == ClientFunctionCode::SendPrivateMessage)
+        {
+            QString toName;
+            QString content;
+            if (IMCodec<IMSchema::SendPrivateMessage>::decode(data, toName, content))
+                this->sendPrivateMessage(connection->name(), toName, content, trace);
+        }
+        // 否则如果是群聊消息
+        else if (functionID == ClientFunctionCode::SendGroupMessage)
+        {
+            QString content;
+            if (IMCodec<IMSchema::SendGroupMessage>::decode(data, content))
+                this->sendGroupMessage(connection->name(), content, trace);
+        }
+        // 否则如果是需要确认的私聊消息，转发后把序号带回给发送者
+        else if (functionID == ClientFunctionCode::SendTrackedPrivateMessage)
+        {
+            quint64 seq = 0;
+            QString toName;
+            QString content;
+            if (!IMCodec<IMSchema::SendTrackedPrivateMessage>::decode(data, seq, toName, content))
+                return;
+            // 重发的消息已经转发过了，用原来的编号再确认一次
+            IMMessageStamp stamp;
+            if (this->findRecentSend(connection->name(), seq, stamp))
+            {
+                this->sendFrame(connection, IMCodec<IMSchema::MessageAck>::encodeFrame(seq, stamp.id, stamp.hlc),
+                                MessagePriority(IMSchema::MessageAck::priority));
+                return;
+            }
+            // 确认在消息放入对方的发送队列以后才发出
+            stamp = this->sendPrivateMessage(connection->name(), toName, content, trace, connection, seq);
+            // 对方不在线，没有转发，不记住也不确认，客户端保留这条消息以后再发
+            if (stamp.id == 0)
+            {
+                this->sendCommand<IMSchema::MessageFailed>(connection, seq, int(MessageFailReason::PeerOffline));
+                return;
+            }
+            this->rememberSend(connection->name(), seq, stamp);
+        }
+        // 否则如果是需要确认的群聊消息
+        else if (functionID == ClientFunctionCode::SendTrackedGroupMessage)
+        {
+            quint64 seq = 0;
+            QString content;
+            if (!IMCodec<IMSchema::SendTrackedGroupMessage>::decode(data, seq, content))
+                return;
+            IMMessageStamp stamp;
+            if (this->findRecentSend(connection->name(), seq, stamp))
+            {
+                this->sendFrame(connection, IMCodec<IMSchema::MessageAck>::encodeFrame(seq, stamp.id, stamp.hlc),
+                                MessagePriority(IMSchema::MessageAck::priority));
+                return;
+            }
+            // 并行分发时确认由最后一个执行完的分发块发出，这时所有在线用户的发送队列里都已经有这条消息了
+            stamp = this->sendGroupMessage(connection->name(), content, trace, connection, seq);
+            this->rememberSend(connection->name(), seq, stamp);
+        }
+        // 否则如果是请求发送文件
+        else if (functionID == ClientFunctionCode::SendFileRequest)
+        {
+            QString toName;
+            quint64 id = 0;
+            qint64 size = 0;
+            QString fileName;
+            if (IMCodec<IMSchema::SendFileRequest>::decode(data, toName, id, size, fileName))
+                this->requestFile(connection->name(), toName, id, size, fileName);
+        }
+        // 否则如果是接受文件
+        else if (functionID == ClientFunctionCode::AcceptFile)
+        {
+            QString fromName;
+            quint64 id = 0;
+            qint64 offset = 0;
+            if (IMCodec<IMSchema::AcceptFile>::decode(data, fromName, id, offset))
+                this->acceptFile(connection->name(), fromName, id, offset);
+        }
+        // 否则如果是拒绝/取消文件
+        else if (functionID == ClientFunctionCode::CancelFile)
+        {
+            QString peerName;
+            quint64 id = 0;
+            if (IMCodec<IMSchema::CancelFile>::decode(data, peerName, id))
+                this->cancelFile(connection->name(), id);
+        }
+    }
+}
+
+void IMService::broadcastFrame(QString exceptName, const QByteArray &frame, MessagePriority priority,
+                               const QByteArray &tracedFrame, const IMFanoutCompletionPtr &completion)
+{
+    // 接收者很多时交给工作线程池并行分发
+    // 如果之前的并行分发还没执行完，也必须走并行分发，保证每个接收者收到的顺序不变
+    if (this->m_clientSocket->size() >= IMServiceConfig::instance()->fanoutThreshold
+            || this->m_workerPool->isBusy())
+    {
+        IMConnectionPtr except = this->m_clientSocket->value(exceptName);
+        this->m_workerPool->fanout(frame, priority, except.isNull() ? 0 : except->id(), tracedFrame, completion);
+        return;
+    }
+
+    for (auto it = this->m_clientSocket->begin(); it != this->m_clientSocket->end(); it++)
+    {
+        if (it.key() == exceptName)
+            continue;
+        bool traced = !tracedFrame.isEmpty() && it.value()->traceEnabled();
+        it.value()->send(priority, traced ? tracedFrame : frame);
+    }
+    if (!completion.isNull())
+        completion->connection->send(completion->priority, completion->frame);
+}
+
+void IMService::sendFrame(const IMConnectionPtr &connection, const QByteArray &frame, MessagePriority priority,
+                          const IMFanoutCompletionPtr &completion)
+{
+    if (this->m_workerPool->isBusy())
+    {
+        this->m_workerPool->send(connection, frame, priority, completion);
+        return;
+    }
+    connection->send(priority, frame);
+    if (!completion.isNull())
+        completion->connection->send(completion->priority, completion->frame);
+}
+
+IMFanoutCompletionPtr IMService::messageAck(const IMConnectionPtr &connection, quint64 seq, const IMMessageStamp &stamp) const
+{
+    if (connection.isNull())
+        return IMFanoutCompletionPtr();
+    IMFanoutCompletionPtr ack(new IMFanoutCompletion);
+    ack->connection = connection;
+    ack->frame = IMCodec<IMSchema::MessageAck>::encodeFrame(seq, stamp.id, stamp.hlc);
+    ack->priority = MessagePriority(IMSchema::MessageAck::priority);
+    return ack;
+}
+
+void IMService::traceMessage(IMFrameTrace &trace)
+{
+    trace.stamps[TraceFanoutEnqueue] = traceClock();
+    // 发出时间已经由客户端换算到服务端的时钟了
+    if (trace.stamps[TraceClientSend] != 0)
+        IMLatencyStats::instance()->record(IMLatencyStats::UplinkHop,
+                                           trace.stamps[TraceServerIngress] - trace.stamps[TraceClientSend]);
+    IMLatencyStats::instance()->record(IMLatencyStats::DispatchHop,
+                                       trace.stamps[TraceFanoutEnqueue] - trace.stamps[TraceServerIngress]);
+}
+
+IMMessageStamp IMService::stampMessage()
+{
+    IMMessageStamp stamp;
+    stamp.hlc = this->m_clock.now();
+    // HLC时间是递增的，编号中的毫秒数只会在序号用完时超前
+    qint64 time = qMax<qint64>(0, IMHybridClock::physical(stamp.hlc) - MessageIdEpoch);
+    if (time > this->m_lastIdTime)
+    {
+        this->m_lastIdTime = time;
+        this->m_idSequence = 0;
+    }
+    else if (++this->m_idSequence >= (1u << 13))
+    {
+        ++this->m_lastIdTime;
+        this->m_idSequence = 0;
+    }
+    stamp.id = (quint64(this->m_lastIdTime) << 23)
+            | (quint64(IMServiceConfig::instance()->messageNodeId) << 13)
+            | this->m_idSequence;
+    return stamp;
+}
+
+bool IMService::findRecentSend(const QString &name, quint64 seq, IMMessageStamp &stamp) const
+{
+    auto it = this->m_recentSends.constFind(qMakePair(name, seq));
+    if (it == this->m_recentSends.constEnd())
+        return false;
+    qDebug() << "duplicate message from" << name << "seq" << seq;
+    stamp = it.value();
+    return true;
+}
+
+void IMService::rememberSend(const QString &name, quint64 seq, const IMMessageStamp &stamp)
+{
+    int window = IMServiceConfig::instance()->messageDedupWindow;
+    if (window <= 0)
+        return;
+    QPair<QString, quint64> key = qMakePair(name, seq);
+    this->m_recentSends.insert(key, stamp);
+    this->m_recentOrder.enqueue(key);
+    while (this->m_recentOrder.size() > window)
+        this->m_recentSends.remove(this->m_recentOrder.dequeue());
+}
+
+/*
+enum ServerFunctionCode {
+    // 私聊消息
+    PrivateMessage = 1,
+
+    // 群聊消息
+    GroupMessage = 2,
+
+    // 用户上线
+    UserOnline = 3,
+
+    // 用户下线
+    UserOffline = 4,
+
+    // 登录结果
+    LoginResult = 10
+};
+*/
+
+
+// 用户登录
+// 参数：name    用户昵称
+void IMService::userLogin(QString name, const IMConnectionPtr &connection, QString epoch, quint64 version,
+                          const IMFrameTrace &trace)
+{
+    qDebug() << "userLogin():   user name:" << name << "\tconnection:" << connection->id();
+    // 连接在命令排队期间已经断开了，不再处理
+    if (connection->isClosed())
+        return;
+    // 如果这个昵称或者连接已经登录了
+    if (name.isEmpty() || this->m_clientSocket->contains(name) || !connection->name().isEmpty())
+    {
+        qDebug() << "Login failed!";
+        // 发送登录结果：登录失败
+        this->sendTracedCommand<IMSchema::LoginFailed>(connection, trace, 1);
+    }
+    else
+    {
+        qDebug() << "Login success!";
+        this->m_clientSocket->insert(name, connection);
+        this->m_workerPool->addMember(connection);
+        connection->setName(name);
+        // 登录帧带着时间戳块说明客户端打开了延迟跟踪，登录结果中原样带回客户端的发出时间，用来估计时钟偏差
+        if (trace.present)
+        {
+            connection->setTraceEnabled(true);
+            ++this->m_tracingClients;
+        }
+
+        QStringList delta;
+        // 断线重连的客户端只同步它错过的上下线
+        if (epoch == this->m_presenceEpoch && this->presenceDelta(version, name, delta))
+        {
+            qDebug() << "presence delta:" << delta.size() / 2 << "changes";
+            this->sendTracedCommand<IMSchema::LoginResynced>(connection, trace, 2, this->m_presenceEpoch, this->m_presenceVersion, delta);
+        }
+        else
+        {
+            // 除自己以外所有在线用户的昵称
+            QStringList names;
+            names.reserve(this->m_clientSocket->size() - 1);
+            for (auto it = this->m_clientSocket->constBegin(); it != this->m_clientSocket->constEnd(); ++it)
+                if (it.key() != name)
+                    names.append(it.key());
+            qDebug() << "online list:" << names.size() << "users";
+            // 发送登录结果：登录成功！ 并返回当前在线人员数据
+            this->sendTracedCommand<IMSchema::LoginSucceeded>(connection, trace, 0, names, this->m_presenceEpoch, this->m_presenceVersion);
+        }
+
+        // 通知其他人改用户上线
+        this->userOnline(name);
+    }
+}
+
+// 发送私聊消息
+// 参数:fromName 发送者昵称
+// 参数:toName   接收者昵称
+// 参数:content  内容
+// 参数:trace    消息的时间戳
+// 参数:ackConnection 需要确认时发送者的连接
+// 参数:ackSeq   需要确认时客户端的序号
+// 返回:分配的编号与时间，接收者不在线时没有转发，编号为0
+IMMessageStamp IMService::sendPrivateMessage(QString fromName, QString toName, QString content, IMFrameTrace trace,
+                                             const IMConnectionPtr &ackConnection, quint64 ackSeq)
+{
+    qCDebug(lcCommand) << "sendPrivateMessage():  fromName:" << fromName << "\ttoName" << toName << "\tcontent" << content;
+    // 如果该用户存在才发送
+    IMConnectionPtr connection = this->m_clientSocket->value(toName);
+    if (connection.isNull())
+        return IMMessageStamp();
+    IMMessageStamp stamp = this->stampMessage();
+    this->traceMessage(trace);
+    QByteArray frame = IMCodec<IMSchema::PrivateMessage>::encodeFrame(fromName, stamp.id, stamp.hlc, content);
+    if (connection->traceEnabled())
+        attachFrameTrace(frame, 0, trace);
+    this->sendFrame(connection, frame, MessagePriority(IMSchema::PrivateMessage::priority),
+                    this->messageAck(ackConnection, ackSeq, stamp));
+    return stamp;
+}
+
+// 发送群聊消息
+// 参数:fromName 发送者昵称
+// 参数:content  内容
+// 参数:trace    消息的时间戳
+// 参数:ackConnection 需要确认时发送者的连接
+// 参数:ackSeq   需要确认时客户端的序号
+// 返回:分配的编号与时间
+IMMessageStamp IMService::sendGroupMessage(QString fromName, QString content, IMFrameTrace trace,
+                                           const IMConnectionPtr &ackConnection, quint64 ackSeq)
+{
+    qCDebug(lcCommand) << "sendGroupMessage():  fromName:" << fromName << "\tcontent" << content;
+    IMMessageStamp stamp = this->stampMessage();
+    this->traceMessage(trace);
+    this->broadcastTraced<IMSchema::GroupMessage>(fromName, trace, this->messageAck(ackConnection, ackSeq, stamp),
+                                                  fromName, stamp.id, stamp.hlc, content);
+    return stamp;
+}
+
+// 请求发送文件
+// 参数:fromName 发送者昵称
+// 参数:toName   接收者昵称
+// 参数:id       传输编号
+// 参数:size     文件大小
+// 参数:fileName 文件名
+void IMService::requestFile(QString fromName, QString toName, quint64 id, qint64 size, QString fileName)
+{
+    qDebug() << "requestFile():  fromName:" << fromName << "\ttoName" << toName << "\tid" << id << "\tsize" << size << "\tfileName" << fileName;
+    // 接收者不在线或者传输编号冲突，直接告诉发送者传输被取消
+    if (!this->m_clientSocket->contains(toName) || id == 0 || this->m_transfers.contains(id))
+    {
+        this->sendCommand<IMSchema::FileCancelled>(this->m_clientSocket->value(fromName), toName, id);
+        return;
+    }
+
+    IMTransferInfo transfer;
+    transfer.fromName = fromName;
+    transfer.toName = toName;
+    this->m_transfers.insert(id, transfer);
+    this->sendCommand<IMSchema::FileRequest>(this->m_clientSocket->value(toName), fromName, id, size, fileName);
+}
+
+// 接受文件
+// 参数:toName   接收者昵称
+// 参数:fromName 发送者昵称
+// 参数:id       传输编号
+// 参数:offset   接收者已经收到的字节数
+void IMService::acceptFile(QString toName, QString fromName, quint64 id, qint64 offset)
+{
+    qDebug() << "acceptFile():  toName:" << toName << "\tfromName" << fromName << "\tid" << id << "\toffset" << offset;
+    auto it = this->m_transfers.find(id);
+    if (it == this->m_transfers.end() || it->toName != toName || it->fromName != fromName)
+        return;
+
+    // 断点续传时旧的传输连接作废，双方重新连接
+    this->closeTransferStreams(*it);
+    this->sendCommand<IMSchema::FileAccepted>(this->m_clientSocket->value(fromName), toName, id, offset);
+}
+
+// 拒绝/取消文件
+// 参数:name     发起取消的用户昵称
+// 参数:id       传输编号
+void IMService::cancelFile(QString name, quint64 id)
+{
+    qDebug() << "cancelFile():  name:" << name << "\tid" << id;
+    auto it = this->m_transfers.find(id);
+    if (it == this->m_transfers.end() || (it->fromName != name && it->toName != name))
+        return;
+
+    QString peerName = it->fromName == name ? it->toName : it->fromName;
+    this->closeTransferStreams(*it);
+    this->m_transfers.erase(it);
+    this->sendCommand<IMSchema::FileCancelled>(this->m_clientSocket->value(peerName), name, id);
+}
+
+// 传输连接登记
+// 参数:id         传输编号
+// 参数:role       角色 0发送 1接收
+// 参数:name       连接传输通道的用户昵称
+// 参数:connection 传输连接
+void IMService::attachTransfer(quint64 id, int role, QString name, const IMConnectionPtr &connection)
+{
+    qDebug() << "attachTransfer():  id:" << id << "\trole" << role << "\tname" << name << "\tconnection" << connection->id();
+    auto it = this->m_transfers.find(id);
+    // 没有这个传输，或者已经登录的聊天连接冒充传输连接
+    if (it == this->m_transfers.end() || !connection->name().isEmpty() || connection->isClosed())
+    {
+        connection->close();
+        return;
+    }
+    // 传输连接不登录，只接受这次传输中这个角色的用户，并且这个用户的聊天连接已经登录
+    if ((role != 0 && role != 1) || name.isEmpty() || name != (role == 0 ? it->fromName : it->toName)
+            || !this->m_clientSocket->contains(name))
+    {
+        qDebug() << "attachTransfer(): rejected, transfer is" << it->fromName << "->" << it->toName;
+        connection->close();
+        return;
+    }
+
+    IMConnectionPtr &stream = role == 0 ? it->senderStream : it->receiverStream;
+    if (!stream.isNull())
+    {
+        this->m_transferStreams.remove(stream->id());
+        stream->close();
+    }
+    stream = connection;
+    this->m_transferStreams.insert(connection->id(), id);
+
+    // 两边都连上了，互相转发，然后通知发送方开始发送
+    if (!it->senderStream.isNull() && !it->receiverStream.isNull())
+    {
+        it->senderStream->startRelay(it->receiverStream);
+        it->receiverStream->startRelay(it->senderStream);
+        this->sendCommand<IMSchema::TransferReady>(it->senderStream);
+    }
+}
+
+void IMService::closeTransferStreams(IMTransferInfo &transfer)
+{
+    if (!transfer.senderStream.isNull())
+    {
+        this->m_transferStreams.remove(transfer.senderStream->id());
+        transfer.senderStream->close();
+        transfer.senderStream.clear();
+    }
+    if (!transfer.receiverStream.isNull())
+    {
+        this->m_transferStreams.remove(transfer.receiverStream->id());
+        transfer.receiverStream->close();
+        transfer.receiverStream.clear();
+    }
+}
+
+// 用户上线
+// 参数:name     用户昵称
+void IMService::userOnline(QString name)
+{
+    qDebug() << "userOnline():  name:" << name;
+    quint64 version = this->logPresence(name, true);
+    this->broadcast<IMSchema::UserOnline>(name, name, version);
+}
+
+// 用户离线
+// 参数:name     用户昵称
+void IMService::userOffline(QString name)
+{
+    qDebug() << "userOffline():  name:" << name;
+    quint64 version = this->logPresence(name, false);
+    this->broadcast<IMSchema::UserOffline>(name, name, version);
+}
+
+quint64 IMService::logPresence(QString name, bool online)
+{
+    ++this->m_presenceVersion;
+    int logSize = IMServiceConfig::instance()->presenceLogSize;
+    if (logSize > 0)
+    {
+        this->m_presenceLog.enqueue(IMPresenceEvent{this->m_presenceVersion, name, online});
+        while (this->m_presenceLog.size() > logSize)
+            this->m_presenceLog.dequeue();
+    }
+    return this->m_presenceVersion;
+}
+
+bool IMService::presenceDelta(quint64 version, QString exceptName, QStringList &delta) const
+{
+    if (version > this->m_presenceVersion)
+        return false;
+    // 日志中最早的一条必须紧接在客户端的版本之后，否则中间有变化已经丢掉了
+    if (version < this->m_presenceVersion
+            && (this->m_presenceLog.isEmpty() || this->m_presenceLog.first().version > version + 1))
+        return false;
+
+    // 同一个人多次上下线只保留最后的状态，顺序按这个人在日志中第一次出现的先后，客户端只看每人最后的状态，与顺序无关
+    QHash<QString, bool> states;
+    QVector<QString> order;
+    for (const IMPresenceEvent &event : this->m_presenceLog)
+    {
+        if (event.version <= version || event.name == exceptName)
+            continue;
+        if (!states.contains(event.name))
+            order.append(event.name);
+        states.insert(event.name, event.online);
+    }
+    delta.clear();
+    delta.reserve(order.size() * 2);
+    for (const QString &name : order)
+        delta << (states.value(name) ? "1" : "0") << name;
+    return true;
+}
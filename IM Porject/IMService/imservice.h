@@ -1,129 +1,579 @@
-#ifndef IMSERVICE_H
-#define IMSERVICE_H
-
-#include <QObject>
-#include <QtNetwork>
-#include <QMap>
-
-/***********************************
- *
- * Class IMService
- * IM服务端类
- *
- * 用于与客户端交互的封装类
- *
- * 公开方法有：
- * login                登录
- * sendPrivateMessage   发送私聊消息
- * sendGroupMessage     发送群聊消息
- *
- * 发出的信号有：
- * receivedPrivateMessage   接收到私聊消息信号
- * receivedGroupMessage     接收到群聊消息信号
- * userOnline               用户上线信号
- * userOffline              用户下线信号
- * serverClose              服务器关闭信号
- *
- **********************************/
-
-class IMService : public QObject
-{
-    Q_OBJECT
-
-// 公开成员函数
-public:
-    explicit IMService(QObject *parent = nullptr);
-
-    ~IMService();
-
-    /**
-     * @brief closeService 关闭服务 断开所有Socket连接
-     */
-    void closeService();
-// 信号
-signals:
-
-
-// 槽
-public slots:
-    /**
-     * @brief newConnection 当有新连接进入时
-     */
-    void newConnection();
-
-    /**
-     * @brief disconnected 当连接断开时触发
-     */
-    void disconnected();
-
-    /**
-     * @brief readyRead 当接收到数据时触发
-     */
-    void readyRead();
-
-// 私有成员函数
-private:
-    // 发送数据到socket对象中
-    /**
-     * @brief sendData 发送数据到socket对象中
-     * @param socket 指定socket对象
-     * @param data 要发送的数据
-     */
-    void sendData(QTcpSocket *socket, QString data);
-
-    /**
-     * @brief userLogin 用户登录
-     * @param name 用户昵称
-     * @param socket socket对象
-     */
-    void userLogin(QString name, QTcpSocket *socket);
-
-    /**
-     * @brief sendPrivateMessage 发送私聊消息
-     * @param fromName 发送者昵称
-     * @param toName 接收者昵称
-     * @param content 内容
-     */
-    void sendPrivateMessage(QString fromName, QString toName, QString content);
-
-    /**
-     * @brief sendGroupMessage 发送群聊消息
-     * @param fromName 发送者昵称
-     * @param content 内容
-     */
-    void sendGroupMessage(QString fromName, QString content);
-
-    /**
-     * @brief userOnline 用户上线
-     * @param name 用户昵称
-     */
-    void userOnline(QString name);
-
-    /**
-     * @brief userOffline 用户离线
-     * @param name 用户昵称
-     */
-    void userOffline(QString name);
-
-// 私有成员变量
-private:
-    /**
-     * @brief m_server 服务端的Tcp Server对象
-     */
-    QTcpServer *m_server;
-
-    // 客户端的Tcp Socket连接列表
-    // QMap是一个键值对容器，在这里key是用户的昵称，value是用户的Socket连接对象
-    // 每当一个新用户上线，将会添加到该容器中
-    // 当用户下线时则从容器中删除
-    /**
-     * @brief m_clientSocket 客户端的Tcp Socket连接列表
-     */
-    QMap<QString, QTcpSocket *> *m_clientSocket;
-    /**
-     * @brief m_clientNames 客户端的昵称列表
-     */
-    QMap<QTcpSocket *, QString> *m_clientNames;
-};
-
-#endif // IMSERVICE_H
+#ifndef IMSERVICE_H
+#define IMSERVICE_H
+
+#include <QObject>
+#include <QtNetwork>
+#include <QMap>
+#include <QHash>
+#include <QVector>
+#include <QQueue>
+#include "imcodec.h"
+#include "imhybridclock.h"
+#include "imconnection.h"
+#include "impriorityqueue.h"
+#include "imlistener.h"
+#include "imworkerpool.h"
+#include "imtracerecorder.h"
+
+/***********************************
+ *
+ * Class IMService
+ * IM服务端类
+ *
+ * 用于与客户端交互的封装类
+ *
+ * 接收到的命令先按优先级放入工作队列，再按权重分批处理，
+ * 每批处理完后让出事件循环，保证登录与上下线不会被大量群聊消息堵住
+ * 同一个连接的命令必须按收到的顺序处理（先发的聊天不能被后发的下线越过），所以每个连接各有一个先进先出的队列，
+ * 按优先级排队的是连接：连接按队首命令的优先级进入工作队列，轮到时只处理队首的一条，还有剩下的再按新的队首重新排队
+ * 优先级只在不同连接之间起作用；连接断开后还没处理的命令直接丢弃，不会在下线通知之后再转发出去
+ *
+ * 监听的地址、端口与backlog来自配置，每个地址在每个工作线程中各有一个监听器，
+ * 用SO_REUSEPORT由内核分散新连接，连接在接受它的线程中直接创建，不经过服务端线程
+ *
+ * 除了Tcp端口，同时监听一个本地套接字，供同一台机器上的客户端使用，协议完全相同
+ *
+ * 连接的读写在工作线程中进行，命令的处理与在线表的维护都在服务端线程中进行，
+ * 接收者很多的群发交给工作线程池并行分发
+ *
+ * 上下线都记入在线状态日志并带上版本号，断线重连的客户端登录时只同步它错过的变化
+ *
+ * 文件传输只在服务端登记双方与传输编号，文件数据走单独的传输连接，
+ * 两边的传输连接配对后由连接自己在工作线程中转发，不经过服务端线程
+ *
+ * 每条命令都带着服务端收到的时间，聊天消息转发时记下上行与处理的延迟，
+ * 发给打开了延迟跟踪的客户端时保留时间戳块，各环节的直方图定时打印，见IMLatencyStats
+ *
+ * 转发的每条聊天消息都分配一个消息编号和一个HLC时间，需要确认的消息在确认中带回给发送者，
+ * 最近确认过的 (发送者, 序号) 记在一个有限长度的窗口中，客户端重发的消息不再转发，只按原来的编号再确认一次
+ *
+ * 配置了录制文件时，连接的建立与断开、收到的每一帧命令都在进入工作队列之前交给IMTraceRecorder录制，
+ * 用IMReplay可以把录下的流量原样重放给另一个服务端
+ *
+ * 公开方法有：
+ * closeService         关闭服务
+ *
+ **********************************/
+
+/**
+ * @brief 工作队列中的一条待处理命令
+ */
+struct IMWorkItem
+{
+    /**
+     * @brief connection 发出命令的连接
+     */
+    IMConnectionPtr connection;
+
+    /**
+     * @brief payload 命令文本
+     */
+    QByteArray payload;
+
+    /**
+     * @brief trace 帧中的时间戳与服务端收到的时间
+     */
+    IMFrameTrace trace;
+};
+
+/**
+ * @brief 一次文件传输的登记信息
+ */
+struct IMTransferInfo
+{
+    /**
+     * @brief fromName 发送者昵称
+     */
+    QString fromName;
+
+    /**
+     * @brief toName 接收者昵称
+     */
+    QString toName;
+
+    /**
+     * @brief senderStream 发送方的传输连接
+     */
+    IMConnectionPtr senderStream;
+
+    /**
+     * @brief receiverStream 接收方的传输连接
+     */
+    IMConnectionPtr receiverStream;
+};
+
+/**
+ * @brief 服务端分配给一条聊天消息的编号与时间
+ */
+struct IMMessageStamp
+{
+    /**
+     * @brief id 消息编号
+     */
+    quint64 id = 0;
+
+    /**
+     * @brief hlc 混合逻辑时钟的时间
+     */
+    quint64 hlc = 0;
+};
+
+/**
+ * @brief 在线状态日志中的一次上下线
+ */
+struct IMPresenceEvent
+{
+    /**
+     * @brief version 这次变化之后的版本
+     */
+    quint64 version;
+
+    /**
+     * @brief name 用户昵称
+     */
+    QString name;
+
+    /**
+     * @brief online 上线还是下线
+     */
+    bool online;
+};
+
+class IMService : public QObject
+{
+    Q_OBJECT
+
+// 公开成员函数
+public:
+    explicit IMService(QObject *parent = nullptr);
+
+    ~IMService();
+
+    /**
+     * @brief closeService 关闭服务 断开所有Socket连接，返回时每个连接都已经在所属的工作线程中断开
+     */
+    void closeService();
+// 信号
+signals:
+
+
+// 槽
+public slots:
+    /**
+     * @brief registerConnection 把监听线程中创建的连接登记到连接表
+     * @param connection 新的连接
+     */
+    void registerConnection(IMConnectionPtr connection);
+
+    /**
+     * @brief newLocalConnection 当有新的本地连接进入时
+     * @param socketDescriptor 新连接的socket描述符
+     */
+    void newLocalConnection(quintptr socketDescriptor);
+
+    /**
+     * @brief connectionClosed 当连接断开时触发
+     * @param id 连接编号
+     */
+    void connectionClosed(quint64 id);
+
+    /**
+     * @brief frameReceived 当接收到一帧命令时触发，将命令放入工作队列
+     * @param id 连接编号
+     * @param payload 命令文本
+     * @param trace 帧中的时间戳与服务端收到的时间
+     */
+    void frameReceived(quint64 id, QByteArray payload, IMFrameTrace trace);
+
+    /**
+     * @brief processWork 按权重处理一批工作队列中的命令
+     */
+    void processWork();
+
+// 私有成员函数
+private:
+    /**
+     * @brief startListeners 按配置在各个工作线程中创建监听器并开始监听
+     */
+    void startListeners();
+
+    /**
+     * @brief newConnection 当有新连接进入时，在监听器所在的工作线程中调用
+     * @param socketDescriptor 新连接的socket描述符
+     * @param threadIndex 监听器所在的工作线程下标
+     */
+    void newConnection(qintptr socketDescriptor, int threadIndex);
+
+    /**
+     * @brief createConnection 创建连接对象，可以在任意线程调用
+     * 连接对象属于调用者所在的线程，不在threadIndex线程中调用时需要调用者自己移动
+     * @param threadIndex 连接所属的工作线程下标
+     * @return 新的连接
+     */
+    IMConnectionPtr createConnection(int threadIndex);
+
+    /**
+     * @brief processCommand 进行协议分析与任务调度
+     * @param connection 发出命令的连接
+     * @param data 命令文本
+     * @param trace 帧中的时间戳与服务端收到的时间
+     */
+    void processCommand(const IMConnectionPtr &connection, const QByteArray &data, const IMFrameTrace &trace);
+
+    /**
+     * @brief sendCommand 按命令的声明编码后发送到指定连接，优先级也来自声明
+     * @param connection 指定连接
+     * @param args 命令的参数，个数和类型在编译时检查
+     */
+    template <typename Schema, typename... Args>
+    void sendCommand(const IMConnectionPtr &connection, const Args &... args)
+    {
+        if (!connection.isNull())
+            connection->send(MessagePriority(Schema::priority), IMCodec<Schema>::encodeFrame(args...));
+    }
+
+    /**
+     * @brief sendTracedCommand 与sendCommand相同，接收者打开了延迟跟踪时带上时间戳块
+     * @param connection 指定连接
+     * @param trace 时间戳
+     * @param args 命令的参数
+     */
+    template <typename Schema, typename... Args>
+    void sendTracedCommand(const IMConnectionPtr &connection, const IMFrameTrace &trace, const Args &... args)
+    {
+        if (connection.isNull())
+            return;
+        QByteArray frame = IMCodec<Schema>::encodeFrame(args...);
+        if (connection->traceEnabled())
+            attachFrameTrace(frame, 0, trace);
+        connection->send(MessagePriority(Schema::priority), frame);
+    }
+
+    /**
+     * @brief broadcast 将一条命令发送给除了某人以外的所有在线用户，命令只编码一次
+     * @param exceptName 不发送的用户昵称
+     * @param args 命令的参数
+     */
+    template <typename Schema, typename... Args>
+    void broadcast(const QString &exceptName, const Args &... args)
+    {
+        this->broadcastFrame(exceptName, IMCodec<Schema>::encodeFrame(args...), MessagePriority(Schema::priority));
+    }
+
+    /**
+     * @brief broadcastTraced 与broadcast相同，有人打开了延迟跟踪时再编码一份带时间戳块的帧发给他们
+     * @param exceptName 不发送的用户昵称
+     * @param trace 时间戳
+     * @param completion 所有接收者的发送队列都放入以后才发出的通知，为空时不通知
+     * @param args 命令的参数
+     */
+    template <typename Schema, typename... Args>
+    void broadcastTraced(const QString &exceptName, const IMFrameTrace &trace, const IMFanoutCompletionPtr &completion,
+                         const Args &... args)
+    {
+        QByteArray frame = IMCodec<Schema>::encodeFrame(args...);
+        QByteArray tracedFrame;
+        if (this->m_tracingClients > 0)
+        {
+            tracedFrame = frame;
+            attachFrameTrace(tracedFrame, 0, trace);
+        }
+        this->broadcastFrame(exceptName, frame, MessagePriority(Schema::priority), tracedFrame, completion);
+    }
+
+    /**
+     * @brief broadcastFrame 将编码好的帧发送给除了某人以外的所有在线用户
+     * 在线人数达到配置的阈值时交给工作线程池并行分发
+     * @param exceptName 不发送的用户昵称
+     * @param frame 帧数据，所有连接共享同一份
+     * @param priority 优先级
+     * @param tracedFrame 带时间戳块的同一帧，发给打开了延迟跟踪的用户，为空时都发frame
+     * @param completion 所有接收者的发送队列都放入以后才发出的通知，为空时不通知
+     */
+    void broadcastFrame(QString exceptName, const QByteArray &frame, MessagePriority priority,
+                        const QByteArray &tracedFrame = QByteArray(),
+                        const IMFanoutCompletionPtr &completion = IMFanoutCompletionPtr());
+
+    /**
+     * @brief sendFrame 将编码好的帧发送到指定连接
+     * 线程池还有没执行完的分发块时排到接收者所属分发串的后面，不越过之前的群发
+     * @param connection 指定连接
+     * @param frame 帧数据
+     * @param priority 优先级
+     * @param completion 这一帧放入发送队列以后才发出的通知，为空时不通知
+     */
+    void sendFrame(const IMConnectionPtr &connection, const QByteArray &frame, MessagePriority priority,
+                   const IMFanoutCompletionPtr &completion = IMFanoutCompletionPtr());
+
+    /**
+     * @brief messageAck 生成消息确认的完成通知，消息放入接收者的发送队列以后才发给发送者
+     * @param connection 发送者的连接，为空时不确认
+     * @param seq 客户端的序号
+     * @param stamp 分配的编号与时间
+     * @return connection为空时返回空
+     */
+    IMFanoutCompletionPtr messageAck(const IMConnectionPtr &connection, quint64 seq, const IMMessageStamp &stamp) const;
+
+    /**
+     * @brief traceMessage 聊天消息放入发送队列之前，填上放入的时间并记录上行与处理的延迟
+     * @param trace 消息的时间戳
+     */
+    void traceMessage(IMFrameTrace &trace);
+
+    /**
+     * @brief userLogin 用户登录
+     * @param name 用户昵称
+     * @param connection 连接对象
+     * @param epoch 重连时客户端已知的在线状态纪元，第一次登录时为空
+     * @param version 重连时客户端已知的在线状态版本
+     * @param trace 登录帧的时间戳，带着时间戳块时打开这个连接的延迟跟踪，并在登录结果中带回
+     */
+    void userLogin(QString name, const IMConnectionPtr &connection, QString epoch, quint64 version,
+                   const IMFrameTrace &trace);
+
+    /**
+     * @brief presenceDelta 生成某个版本之后的在线状态变化
+     * @param version 客户端已知的版本
+     * @param exceptName 登录者自己，不包含在结果中
+     * @param delta 每人只保留最后的状态，按 是否在线、昵称 两个一组排列
+     * @return 日志中已经没有这个版本之后的全部变化时返回false
+     */
+    bool presenceDelta(quint64 version, QString exceptName, QStringList &delta) const;
+
+    /**
+     * @brief logPresence 记下一次上下线，返回新的版本
+     */
+    quint64 logPresence(QString name, bool online);
+
+    /**
+     * @brief stampMessage 给一条聊天消息分配编号与时间
+     * 编号：[从MessageIdEpoch起的毫秒数(41位)][节点(10位)][序号(13位)]，毫秒数取自HLC时间，
+     * 同一毫秒内的序号用完时借用下一毫秒，编号总是递增的
+     */
+    IMMessageStamp stampMessage();
+
+    /**
+     * @brief findRecentSend 查找最近确认过的消息，客户端重发时用
+     * @param name 发送者昵称
+     * @param seq 客户端的序号
+     * @param stamp 找到时填上原来的编号与时间
+     * @return 是否找到
+     */
+    bool findRecentSend(const QString &name, quint64 seq, IMMessageStamp &stamp) const;
+
+    /**
+     * @brief rememberSend 记下一条确认过的消息，超出窗口时忘掉最早的
+     */
+    void rememberSend(const QString &name, quint64 seq, const IMMessageStamp &stamp);
+
+    /**
+     * @brief sendPrivateMessage 发送私聊消息
+     * @param fromName 发送者昵称
+     * @param toName 接收者昵称
+     * @param content 内容
+     * @param trace 消息的时间戳
+     * @param ackConnection 需要确认时发送者的连接，消息放入接收者的发送队列以后确认
+     * @param ackSeq 需要确认时客户端的序号
+     * @return 分配的编号与时间，接收者不在线时不转发也不分配，编号为0
+     */
+    IMMessageStamp sendPrivateMessage(QString fromName, QString toName, QString content, IMFrameTrace trace,
+                                      const IMConnectionPtr &ackConnection = IMConnectionPtr(), quint64 ackSeq = 0);
+
+    /**
+     * @brief sendGroupMessage 发送群聊消息
+     * @param fromName 发送者昵称
+     * @param content 内容
+     * @param trace 消息的时间戳
+     * @param ackConnection 需要确认时发送者的连接，消息放入所有在线用户的发送队列以后确认
+     * @param ackSeq 需要确认时客户端的序号
+     * @return 分配的编号与时间
+     */
+    IMMessageStamp sendGroupMessage(QString fromName, QString content, IMFrameTrace trace,
+                                    const IMConnectionPtr &ackConnection = IMConnectionPtr(), quint64 ackSeq = 0);
+
+    /**
+     * @brief requestFile 请求发送文件，转发给接收者
+     * @param fromName 发送者昵称
+     * @param toName 接收者昵称
+     * @param id 传输编号
+     * @param size 文件大小
+     * @param fileName 文件名
+     */
+    void requestFile(QString fromName, QString toName, quint64 id, qint64 size, QString fileName);
+
+    /**
+     * @brief acceptFile 接受文件，转发给发送者，断点续传时也是这条
+     * @param toName 接收者昵称
+     * @param fromName 发送者昵称
+     * @param id 传输编号
+     * @param offset 接收者已经收到的字节数
+     */
+    void acceptFile(QString toName, QString fromName, quint64 id, qint64 offset);
+
+    /**
+     * @brief cancelFile 拒绝或者取消文件，转发给另一方
+     * @param name 发起取消的用户昵称
+     * @param id 传输编号
+     */
+    void cancelFile(QString name, quint64 id);
+
+    /**
+     * @brief attachTransfer 传输连接登记，两边都连上后开始转发
+     * @param id 传输编号
+     * @param role 角色 0发送 1接收
+     * @param name 连接传输通道的用户昵称，必须是这个角色对应的用户，并且已经登录
+     * @param connection 传输连接
+     */
+    void attachTransfer(quint64 id, int role, QString name, const IMConnectionPtr &connection);
+
+    /**
+     * @brief closeTransferStreams 关闭一次传输的两个传输连接
+     * @param transfer 传输登记信息
+     */
+    void closeTransferStreams(IMTransferInfo &transfer);
+
+    /**
+     * @brief userOnline 用户上线
+     * @param name 用户昵称
+     */
+    void userOnline(QString name);
+
+    /**
+     * @brief userOffline 用户离线
+     * @param name 用户昵称
+     */
+    void userOffline(QString name);
+
+// 私有成员变量
+private:
+    /**
+     * @brief m_listeners 所有Tcp监听器，分别运行在各个工作线程中
+     */
+    QVector<IMListener *> m_listeners;
+
+    /**
+     * @brief m_localServer 本地套接字的Local Server对象，没有启用时为nullptr
+     */
+    IMLocalListener *m_localServer;
+
+    /**
+     * @brief m_workerPool 工作线程池
+     */
+    IMWorkerPool *m_workerPool;
+
+    /**
+     * @brief m_connections 所有连接，key是连接编号
+     */
+    QHash<quint64, IMConnectionPtr> m_connections;
+
+    // 客户端的连接列表
+    // QMap是一个键值对容器，在这里key是用户的昵称，value是用户的连接对象
+    // 每当一个新用户上线，将会添加到该容器中
+    // 当用户下线时则从容器中删除
+    /**
+     * @brief m_clientSocket 已登录客户端的连接列表
+     */
+    QMap<QString, IMConnectionPtr> *m_clientSocket;
+
+    /**
+     * @brief m_transfers 进行中的文件传输，key是传输编号
+     */
+    QHash<quint64, IMTransferInfo> m_transfers;
+
+    /**
+     * @brief m_transferStreams 传输连接对应的传输编号，key是连接编号
+     */
+    QHash<quint64, quint64> m_transferStreams;
+
+    /**
+     * @brief m_workQueue 按优先级分通道的工作队列，元素是有待处理命令的连接编号，每个连接最多排一次
+     */
+    IMPriorityQueue<quint64> m_workQueue;
+
+    /**
+     * @brief m_pendingWork 每个连接待处理的命令，按收到的顺序，key是连接编号
+     */
+    QHash<quint64, QQueue<IMWorkItem>> m_pendingWork;
+
+    /**
+     * @brief m_pendingWorkCount 所有连接待处理的命令总数
+     */
+    int m_pendingWorkCount;
+
+    /**
+     * @brief m_workScheduled 是否已经安排了下一轮处理
+     */
+    bool m_workScheduled;
+
+    /**
+     * @brief m_nextLocalThread 下一个本地连接分到的工作线程
+     */
+    int m_nextLocalThread;
+
+    /**
+     * @brief m_presenceEpoch 在线状态的纪元，服务端每次启动都不同
+     */
+    QString m_presenceEpoch;
+
+    /**
+     * @brief m_presenceVersion 在线状态的版本，每次上下线加一
+     */
+    quint64 m_presenceVersion;
+
+    /**
+     * @brief m_presenceLog 最近的上下线，最多保留presenceLogSize条
+     */
+    QQueue<IMPresenceEvent> m_presenceLog;
+
+    /**
+     * @brief m_tracingClients 打开了延迟跟踪的在线用户数，为0时群发不再编码带时间戳块的帧
+     */
+    int m_tracingClients;
+
+    /**
+     * @brief m_traceReportTimer 定时打印延迟直方图
+     */
+    QTimer *m_traceReportTimer;
+
+    /**
+     * @brief MessageIdEpoch 消息编号中毫秒数的起点，2020-01-01 00:00:00 UTC
+     */
+    static const qint64 MessageIdEpoch = Q_INT64_C(1577836800000);
+
+    /**
+     * @brief m_clock 给聊天消息分配时间的混合逻辑时钟
+     */
+    IMHybridClock m_clock;
+
+    /**
+     * @brief m_lastIdTime 最后一个消息编号中的毫秒数
+     */
+    qint64 m_lastIdTime;
+
+    /**
+     * @brief m_idSequence 最后一个消息编号中的序号
+     */
+    quint32 m_idSequence;
+
+    /**
+     * @brief m_recentSends 最近确认过的消息，key是 (发送者, 序号)
+     */
+    QHash<QPair<QString, quint64>, IMMessageStamp> m_recentSends;
+
+    /**
+     * @brief m_recentOrder m_recentSends中的key按记下的顺序排列，超出窗口时从前面删除
+     */
+    QQueue<QPair<QString, quint64> > m_recentOrder;
+
+    /**
+     * @brief m_recorder 录制收到的命令，没有配置录制文件时为nullptr
+     */
+    IMTraceRecorder *m_recorder;
+
+    /**
+     * @brief m_framesReceived 服务端线程收到的帧数，不包括查询处理进度，用来回复处理进度
+     */
+    quint64 m_framesReceived;
+};
+
+#endif // IMSERVICE_H
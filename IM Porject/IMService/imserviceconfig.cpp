@@ -0,0 +1,86 @@
+#include <QCoreApplication>
+#include <QSettings>
+#include <QThread>
+#include <QDir>
+#include <QDateTime>
+#include <QDebug>
+#include "imserviceconfig.h"
+
+const IMServiceConfig *IMServiceConfig::instance()
+{
+    static IMServiceConfig config;
+    return &config;
+}
+
+IMServiceConfig::IMServiceConfig()
+{
+    QSettings settings(QCoreApplication::applicationDirPath() + "/IMService.ini", QSettings::IniFormat);
+
+    settings.beginGroup("scheduler");
+    laneWeights[ControlPriority] = settings.value("controlWeight", 8).toInt();
+    laneWeights[InteractivePriority] = settings.value("interactiveWeight", 4).toInt();
+    laneWeights[BulkPriority] = settings.value("bulkWeight", 1).toInt();
+    highWatermark = qMax(1, settings.value("highWatermark", 64 * 1024).toInt());
+    workBatchSize = qMax(1, settings.value("workBatchSize", 256).toInt());
+    settings.endGroup();
+
+    settings.beginGroup("workers");
+    workerThreads = qMax(1, settings.value("threads", QThread::idealThreadCount()).toInt());
+    settings.endGroup();
+
+    settings.beginGroup("fanout");
+    fanoutThreshold = qMax(1, settings.value("threshold", 1024).toInt());
+    fanoutChunkSize = qMax(1, settings.value("chunkSize", 512).toInt());
+    fanoutStrandsPerWorker = qMax(1, settings.value("strandsPerWorker", 4).toInt());
+    settings.endGroup();
+
+    settings.beginGroup("listen");
+    listenEndpoints = settings.value("endpoints", QStringList() << "*:9876").toStringList();
+    listenBacklog = qMax(1, settings.value("backlog", 1024).toInt());
+    listenReusePort = settings.value("reusePort", true).toBool();
+    listenersPerEndpoint = settings.value("listenersPerEndpoint", 0).toInt();
+    if (listenersPerEndpoint <= 0)
+        listenersPerEndpoint = workerThreads;
+    settings.endGroup();
+
+    settings.beginGroup("local");
+    localEnabled = settings.value("enabled", true).toBool();
+    localName = settings.value("name", "IMService").toString();
+    settings.endGroup();
+
+    settings.beginGroup("presence");
+    presenceLogSize = qMax(0, settings.value("logSize", 4096).toInt());
+    settings.endGroup();
+
+    settings.beginGroup("trace");
+    traceReportInterval = qMax(0, settings.value("reportInterval", 60).toInt());
+    settings.endGroup();
+
+    settings.beginGroup("message");
+    messageNodeId = qBound(0, settings.value("nodeId", 0).toInt(), 1023);
+    messageDedupWindow = qMax(0, settings.value("dedupWindow", 65536).toInt());
+    settings.endGroup();
+
+    settings.beginGroup("capture");
+    captureFile = settings.value("file").toString().trimmed();
+    if (!captureFile.isEmpty())
+    {
+        captureFile.replace("{time}", QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss"));
+        captureFile = QDir(QCoreApplication::applicationDirPath()).absoluteFilePath(captureFile);
+    }
+    captureBufferSize = qMax(4096, settings.value("bufferSize", 256 * 1024).toInt());
+    captureMaxBuffered = qMax(captureBufferSize, settings.value("maxBuffered", 64 * 1024 * 1024).toInt());
+    settings.endGroup();
+
+    qDebug() << "IMServiceConfig: weights" << laneWeights[ControlPriority]
+             << laneWeights[InteractivePriority] << laneWeights[BulkPriority]
+             << "highWatermark" << highWatermark << "workBatchSize" << workBatchSize
+             << "workerThreads" << workerThreads << "fanoutThreshold" << fanoutThreshold
+             << "fanoutChunkSize" << fanoutChunkSize << "fanoutStrandsPerWorker" << fanoutStrandsPerWorker
+             << "listen" << listenEndpoints << "backlog" << listenBacklog
+             << "reusePort" << listenReusePort << "listenersPerEndpoint" << listenersPerEndpoint
+             << "local" << localEnabled << localName << "presenceLogSize" << presenceLogSize
+             << "traceReportInterval" << traceReportInterval
+             << "messageNodeId" << messageNodeId << "messageDedupWindow" << messageDedupWindow
+             << "capture" << captureFile << captureBufferSize << captureMaxBuffered;
+}
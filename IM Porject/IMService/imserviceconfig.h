@@ -0,0 +1,175 @@
+#ifndef IMSERVICECONFIG_H
+#define IMSERVICECONFIG_H
+
+#include <QString>
+#include <QStringList>
+#include "protocol.h"
+
+/***********************************
+ *
+ * Class IMServiceConfig
+ * IM服务端配置
+ *
+ * 启动时从程序目录下的 IMService.ini 读取，文件不存在或者某项没有配置时使用默认值
+ *
+ * [scheduler]
+ * controlWeight        控制通道权重            默认8
+ * interactiveWeight    交互通道权重            默认4
+ * bulkWeight           批量通道权重            默认1
+ * highWatermark        连接写缓冲的高水位(字节)  默认65536
+ * workBatchSize        工作队列每轮处理的条数    默认256
+ *
+ * [workers]
+ * threads              工作线程数，连接按编号轮流分给各个线程   默认为CPU核心数
+ *
+ * [fanout]
+ * threshold            接收者达到多少人时改为多线程并行分发     默认1024
+ * chunkSize            并行分发时每个分发块的接收者数           默认512
+ * strandsPerWorker     每个工作线程的分发串数                  默认4
+ *
+ * [listen]
+ * endpoints            监听的地址列表，用逗号分隔，每项为 地址:端口    默认*:9876
+ *                      地址为*表示所有网卡，IPv6地址写成[::1]:9876
+ * backlog              内核中等待accept的连接队列长度               默认1024
+ * reusePort            是否用SO_REUSEPORT让多个线程并行accept       默认true
+ * listenersPerEndpoint 每个地址的监听器数，0表示与工作线程数相同      默认0
+ *                      没有启用reusePort或者系统不支持时固定为1
+ *
+ * [local]
+ * enabled              是否同时监听本地套接字                  默认true
+ * name                 本地套接字的名称                       默认IMService
+ *
+ * [presence]
+ * logSize              保留最近多少次上下线，用于断线重连的增量同步   默认4096
+ *
+ * [trace]
+ * reportInterval       每隔多少秒打印一次各环节的延迟直方图，0表示不打印   默认60
+ *
+ * [message]
+ * nodeId               服务端节点编号(0~1023)，写在消息编号中，几台服务端要各不相同   默认0
+ * dedupWindow          记住最近多少条需要确认的消息，重发的消息在这个范围内时不再转发    默认65536
+ *
+ * [capture]
+ * file                 把收到的每条命令录制到这个文件，用IMReplay重放，为空表示不录制   默认为空
+ *                      相对路径在程序目录下，文件名中的{time}换成启动的时间，重启不会覆盖上次的录制
+ * bufferSize           攒够多少字节写一次文件                                       默认262144
+ * maxBuffered          写缓冲的上限(字节)，磁盘跟不上时丢掉新的记录，不拖慢服务端        默认67108864
+ *
+ **********************************/
+
+class IMServiceConfig
+{
+public:
+    /**
+     * @brief instance 单例对象
+     * @return 单例对象指针
+     */
+    static const IMServiceConfig *instance();
+
+    /**
+     * @brief laneWeights 各优先级通道的权重
+     */
+    int laneWeights[PriorityCount];
+
+    /**
+     * @brief highWatermark 连接写缓冲的高水位
+     * Socket中待发送的数据超过这个值时暂停出队，剩下的消息留在优先级队列里，
+     * 这样后来的控制消息才有机会插到批量消息前面
+     */
+    int highWatermark;
+
+    /**
+     * @brief workBatchSize 工作队列每轮最多处理的命令数，处理完一轮后让出事件循环
+     */
+    int workBatchSize;
+
+    /**
+     * @brief workerThreads 工作线程数
+     */
+    int workerThreads;
+
+    /**
+     * @brief fanoutThreshold 接收者达到这个数量时改为多线程并行分发
+     */
+    int fanoutThreshold;
+
+    /**
+     * @brief fanoutChunkSize 并行分发时每个分发块的接收者数
+     */
+    int fanoutChunkSize;
+
+    /**
+     * @brief fanoutStrandsPerWorker 每个工作线程的分发串数
+     */
+    int fanoutStrandsPerWorker;
+
+    /**
+     * @brief listenEndpoints 监听的地址列表，每项为 地址:端口
+     */
+    QStringList listenEndpoints;
+
+    /**
+     * @brief listenBacklog 内核中等待accept的连接队列长度
+     */
+    int listenBacklog;
+
+    /**
+     * @brief listenReusePort 是否用SO_REUSEPORT让多个线程并行accept
+     */
+    bool listenReusePort;
+
+    /**
+     * @brief listenersPerEndpoint 每个地址的监听器数
+     */
+    int listenersPerEndpoint;
+
+    /**
+     * @brief localEnabled 是否同时监听本地套接字
+     */
+    bool localEnabled;
+
+    /**
+     * @brief localName 本地套接字的名称，Unix下是/tmp下的套接字文件，Windows下是命名管道
+     */
+    QString localName;
+
+    /**
+     * @brief presenceLogSize 保留最近多少次上下线，重连的客户端落后得更多时返回完整的在线列表
+     */
+    int presenceLogSize;
+
+    /**
+     * @brief traceReportInterval 打印延迟直方图的间隔（秒），0表示不打印
+     */
+    int traceReportInterval;
+
+    /**
+     * @brief messageNodeId 服务端节点编号，写在消息编号中
+     */
+    int messageNodeId;
+
+    /**
+     * @brief messageDedupWindow 记住最近多少条需要确认的消息，用来识别客户端重发的消息
+     */
+    int messageDedupWindow;
+
+    /**
+     * @brief captureFile 录制文件的完整路径，为空表示不录制
+     */
+    QString captureFile;
+
+    /**
+     * @brief captureBufferSize 攒够多少字节写一次录制文件
+     */
+    int captureBufferSize;
+
+    /**
+     * @brief captureMaxBuffered 录制写缓冲的上限
+     */
+    int captureMaxBuffered;
+
+private:
+    IMServiceConfig();
+};
+
+#endif // IMSERVICECONFIG_H
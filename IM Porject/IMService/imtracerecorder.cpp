@@ -0,0 +1,111 @@
+#include <QDateTime>
+#include <QDebug>
+#include "imtracerecorder.h"
+#include "protocol.h"
+
+IMTraceRecorder::IMTraceRecorder(int bufferSize, int maxBuffered, QObject *parent)
+    : QThread(parent),
+      m_bufferSize(bufferSize),
+      m_maxBuffered(qMax(bufferSize, maxBuffered)),
+      m_stopping(false),
+      m_startClock(0),
+      m_lastTime(0),
+      m_recorded(0),
+      m_dropped(0),
+      m_written(0),
+      m_ok(false)
+{
+}
+
+IMTraceRecorder::~IMTraceRecorder()
+{
+    this->stop();
+}
+
+bool IMTraceRecorder::open(const QString &path)
+{
+    this->m_file.setFileName(path);
+    if (!this->m_file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        qDebug() << "IMTraceRecorder:" << path << this->m_file.errorString();
+        return false;
+    }
+    QByteArray header = IMTraceFile::header(QDateTime::currentMSecsSinceEpoch());
+    this->m_ok = this->m_file.write(header) == header.size();
+    this->m_written = header.size();
+    this->m_startClock = traceClock();
+    this->m_lastTime = this->m_startClock;
+    // 预留容量，写线程交换出去写完后清空时不会释放内存
+    this->m_buffer.reserve(this->m_bufferSize);
+    this->m_stopping = false;
+    this->start(QThread::LowPriority);
+    qDebug() << "IMTraceRecorder: capture to" << path;
+    return this->m_ok;
+}
+
+void IMTraceRecorder::record(IMTraceRecord::Type type, quint64 connection, qint64 time, const QByteArray &payload)
+{
+    if (!this->isRunning())
+        return;
+    // 不同工作线程的帧投递过来的先后可能和收到的先后不同，时间不能倒退
+    qint64 now = qMax(time != 0 ? time : traceClock(), this->m_lastTime);
+
+    QMutexLocker locker(&this->m_mutex);
+    if (this->m_buffer.size() >= this->m_maxBuffered)
+    {
+        ++this->m_dropped;
+        return;
+    }
+    IMTraceFile::appendRecord(this->m_buffer, type, now - this->m_lastTime, connection, payload);
+    this->m_lastTime = now;
+    ++this->m_recorded;
+    // 没攒够时不唤醒，由写线程定时来取
+    if (this->m_buffer.size() >= this->m_bufferSize)
+        this->m_wakeup.wakeOne();
+}
+
+void IMTraceRecorder::stop()
+{
+    if (!this->isRunning())
+        return;
+    {
+        QMutexLocker locker(&this->m_mutex);
+        this->m_buffer.append(char(IMTraceRecord::End));
+        this->m_stopping = true;
+        this->m_wakeup.wakeOne();
+    }
+    this->wait();
+    this->m_file.close();
+    qDebug() << "IMTraceRecorder: recorded" << this->m_recorded << "dropped" << this->m_dropped
+             << "bytes" << this->m_written << (this->m_ok ? "" : "WRITE FAILED");
+}
+
+void IMTraceRecorder::run()
+{
+    QByteArray chunk;
+    chunk.reserve(this->m_bufferSize);
+    bool stopping = false;
+    while (!stopping)
+    {
+        {
+            QMutexLocker locker(&this->m_mutex);
+            if (this->m_buffer.size() < this->m_bufferSize && !this->m_stopping)
+                this->m_wakeup.wait(&this->m_mutex, FlushInterval);
+            // 整块交换出来再写，写文件时服务端线程可以继续往另一块里追加
+            this->m_buffer.swap(chunk);
+            stopping = this->m_stopping;
+        }
+
+        if (!chunk.isEmpty() && this->m_ok)
+        {
+            if (this->m_file.write(chunk) != chunk.size() || !this->m_file.flush())
+            {
+                qDebug() << "IMTraceRecorder:" << this->m_file.errorString();
+                this->m_ok = false;
+            }
+            else
+                this->m_written += chunk.size();
+        }
+        chunk.resize(0);
+    }
+}
@@ -0,0 +1,94 @@
+#ifndef IMTRACERECORDER_H
+#define IMTRACERECORDER_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QFile>
+#include "imtracefile.h"
+
+/***********************************
+ *
+ * Class IMTraceRecorder
+ * 把服务端收到的命令录制到文件，格式见imtracefile.h，用IMReplay重放
+ *
+ * record只在服务端线程中调用，把记录编码后追加到内存中的写缓冲就返回，从不等待磁盘
+ * 写线程在缓冲攒够BufferSize字节或者距上次写入满FlushInterval毫秒时，交换出整块缓冲一次写入
+ * 写线程跟不上、缓冲超过上限时丢掉新的记录并计数，服务端不会因为录制被拖慢，
+ * 丢过记录的录制文件重放的结果不可信，停止时打印丢掉的条数
+ *
+ * 记录的时间取服务端收到这一帧的单调时钟，不同工作线程投递到服务端线程的先后可能与收到的先后不同，
+ * 比上一条早的按上一条的时间记录，文件中的时间总是不减的
+ *
+ **********************************/
+
+class IMTraceRecorder : public QThread
+{
+    Q_OBJECT
+
+public:
+    /**
+     * @brief IMTraceRecorder 构造函数，调用open后开始录制
+     * @param bufferSize 攒够多少字节写一次文件
+     * @param maxBuffered 写缓冲的上限（字节），超过时丢掉新的记录
+     */
+    IMTraceRecorder(int bufferSize, int maxBuffered, QObject *parent = nullptr);
+
+    ~IMTraceRecorder();
+
+    /**
+     * @brief open 创建录制文件，写入文件头并启动写线程
+     * @param path 文件路径
+     * @return 是否成功
+     */
+    bool open(const QString &path);
+
+    /**
+     * @brief record 录制一条记录，只在服务端线程中调用，不会阻塞
+     * @param type 记录的类型
+     * @param connection 连接编号
+     * @param time 服务端收到的单调时钟微秒数，0表示现在
+     * @param payload 命令文本，只有Frame才有
+     */
+    void record(IMTraceRecord::Type type, quint64 connection, qint64 time = 0,
+                const QByteArray &payload = QByteArray());
+
+    /**
+     * @brief stop 写入结束标记与剩下的缓冲，等待写线程退出
+     */
+    void stop();
+
+protected:
+    void run() override;
+
+private:
+    // 距上次写入最多多少毫秒就写一次
+    static const int FlushInterval = 1000;
+
+    QFile m_file;
+    int m_bufferSize;
+    int m_maxBuffered;
+
+    // 以下由m_mutex保护
+    QMutex m_mutex;
+    QWaitCondition m_wakeup;
+    // 还没写入文件的记录
+    QByteArray m_buffer;
+    // 是否需要退出
+    bool m_stopping;
+
+    // 以下只在服务端线程中使用
+    // 开始录制时的单调时钟与上一条记录的时间
+    qint64 m_startClock;
+    qint64 m_lastTime;
+    // 录制与丢掉的记录数
+    quint64 m_recorded;
+    quint64 m_dropped;
+
+    // 以下只在写线程中使用
+    // 写入的字节数，写入失败时不再写
+    qint64 m_written;
+    bool m_ok;
+};
+
+#endif // IMTRACERECORDER_H
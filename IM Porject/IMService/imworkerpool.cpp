@@ -0,0 +1,256 @@
+#include "imworkerpool.h"
+#include <QDebug>
+
+// 每次执行一个分发串时最多执行的分发块数，执行完后让出，防止长时间占住线程
+static const int MaxChunksPerRun = 8;
+
+// 每次runTasks最多执行的分发串数，执行完后让出事件循环，让线程中的连接也能读写
+static const int MaxStrandsPerRun = 16;
+
+IMWorker::IMWorker(IMWorkerPool *pool, int index)
+    : m_pool(pool),
+      m_index(index),
+      m_wakePending(0)
+{
+}
+
+void IMWorker::push(IMFanoutStrand *strand)
+{
+    QMutexLocker locker(&m_mutex);
+    m_tasks.append(strand);
+}
+
+IMFanoutStrand *IMWorker::pop()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_tasks.isEmpty() ? nullptr : m_tasks.takeFirst();
+}
+
+IMFanoutStrand *IMWorker::steal()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_tasks.isEmpty() ? nullptr : m_tasks.takeLast();
+}
+
+void IMWorker::wake()
+{
+    if (m_wakePending.testAndSetOrdered(0, 1))
+        QMetaObject::invokeMethod(this, "runTasks", Qt::QueuedConnection);
+}
+
+void IMWorker::runTasks()
+{
+    m_wakePending.store(0);
+    for (int n = 0; n < MaxStrandsPerRun; ++n)
+    {
+        // 先执行自己的，没有了再去偷别人的
+        IMFanoutStrand *strand = this->pop();
+        if (strand == nullptr)
+            strand = m_pool->steal(m_index);
+        if (strand == nullptr)
+            return;
+        m_pool->runStrand(strand);
+    }
+    // 可能还有任务，下一轮事件循环继续
+    this->wake();
+}
+
+IMWorkerPool::IMWorkerPool(int threadCount, int strandsPerWorker, int chunkSize)
+    : m_sequences(new QAtomicInteger<quint64>[threadCount]),
+      m_chunkSize(chunkSize),
+      m_pendingChunks(0)
+{
+    for (int i = 0; i < threadCount; ++i)
+    {
+        QThread *thread = new QThread;
+        IMWorker *worker = new IMWorker(this, i);
+        worker->moveToThread(thread);
+        m_threads.append(thread);
+        m_workers.append(worker);
+        thread->start();
+    }
+
+    // 分发串数是线程数的整数倍，编号为s的分发串中的连接都属于 s % 线程数 这个线程
+    for (int i = 0; i < threadCount * strandsPerWorker; ++i)
+    {
+        IMFanoutStrand *strand = new IMFanoutStrand;
+        strand->scheduled = false;
+        strand->home = i % threadCount;
+        m_strands.append(strand);
+    }
+    qDebug() << "IMWorkerPool: threads" << threadCount << "strands" << m_strands.size();
+}
+
+IMWorkerPool::~IMWorkerPool()
+{
+    for (QThread *thread : m_threads)
+    {
+        thread->quit();
+        thread->wait();
+    }
+    qDeleteAll(m_workers);
+    qDeleteAll(m_threads);
+    qDeleteAll(m_strands);
+    delete[] m_sequences;
+}
+
+void IMWorkerPool::drain()
+{
+    // 事件按投递的顺序处理，sync返回时之前排队的都处理完了
+    for (IMWorker *worker : m_workers)
+        QMetaObject::invokeMethod(worker, "sync", Qt::BlockingQueuedConnection);
+}
+
+quint64 IMWorkerPool::allocateID(int threadIndex)
+{
+    // 第n个编号为 (n + 1) * 线程数 + 线程下标，各个线程的编号互不重复
+    quint64 sequence = m_sequences[threadIndex].fetchAndAddRelaxed(1);
+    return (sequence + 1) * quint64(m_threads.size()) + quint64(threadIndex);
+}
+
+void IMWorkerPool::addMember(const IMConnectionPtr &connection)
+{
+    this->strandFor(connection->id())->members.append(connection);
+}
+
+void IMWorkerPool::removeMember(const IMConnectionPtr &connection)
+{
+    // 成员的顺序无关紧要，用最后一个填补空位
+    QVector<IMConnectionPtr> &members = this->strandFor(connection->id())->members;
+    int index = members.indexOf(connection);
+    if (index < 0)
+        return;
+    members[index] = members.last();
+    members.removeLast();
+}
+
+void IMWorkerPool::fanout(const QByteArray &frame, MessagePriority priority, quint64 exceptID,
+                          const QByteArray &tracedFrame, const IMFanoutCompletionPtr &completion)
+{
+    // 成员只在服务端线程中修改，先数出分发块的总数，第一个分发块执行之前计数就已经是准的
+    if (!completion.isNull())
+    {
+        int chunks = 0;
+        for (IMFanoutStrand *strand : m_strands)
+            chunks += (strand->members.size() + m_chunkSize - 1) / m_chunkSize;
+        if (chunks == 0)
+        {
+            completion->connection->send(completion->priority, completion->frame);
+            return;
+        }
+        completion->remaining.store(chunks);
+    }
+
+    for (IMFanoutStrand *strand : m_strands)
+    {
+        // 分发块共享同一份成员快照，之后成员变化时会自动分离
+        const QVector<IMConnectionPtr> members = strand->members;
+        for (int begin = 0; begin < members.size(); begin += m_chunkSize)
+        {
+            IMFanoutChunk chunk;
+            chunk.recipients = members;
+            chunk.begin = begin;
+            chunk.end = qMin(begin + m_chunkSize, members.size());
+            chunk.frame = frame;
+            chunk.tracedFrame = tracedFrame;
+            chunk.priority = priority;
+            chunk.exceptID = exceptID;
+            chunk.completion = completion;
+            this->enqueue(strand, chunk);
+        }
+    }
+
+    // 唤醒所有线程，自己队列空了的线程会去偷其他线程的任务
+    for (IMWorker *worker : m_workers)
+        worker->wake();
+}
+
+void IMWorkerPool::send(const IMConnectionPtr &connection, const QByteArray &frame, MessagePriority priority,
+                        const IMFanoutCompletionPtr &completion)
+{
+    if (!completion.isNull())
+        completion->remaining.store(1);
+
+    IMFanoutChunk chunk;
+    chunk.recipients.append(connection);
+    chunk.begin = 0;
+    chunk.end = 1;
+    chunk.frame = frame;
+    chunk.priority = priority;
+    chunk.exceptID = 0;
+    chunk.completion = completion;
+
+    IMFanoutStrand *strand = this->strandFor(connection->id());
+    if (this->enqueue(strand, chunk))
+        m_workers.at(strand->home)->wake();
+}
+
+bool IMWorkerPool::enqueue(IMFanoutStrand *strand, const IMFanoutChunk &chunk)
+{
+    m_pendingChunks.ref();
+
+    bool schedule = false;
+    {
+        QMutexLocker locker(&strand->mutex);
+        strand->chunks.enqueue(chunk);
+        if (!strand->scheduled)
+            schedule = strand->scheduled = true;
+    }
+    if (schedule)
+        m_workers.at(strand->home)->push(strand);
+    return schedule;
+}
+
+IMFanoutStrand *IMWorkerPool::steal(int thief)
+{
+    for (int i = 1; i < m_workers.size(); ++i)
+    {
+        IMFanoutStrand *strand = m_workers.at((thief + i) % m_workers.size())->steal();
+        if (strand != nullptr)
+            return strand;
+    }
+    return nullptr;
+}
+
+void IMWorkerPool::runStrand(IMFanoutStrand *strand)
+{
+    for (int n = 0; n < MaxChunksPerRun; ++n)
+    {
+        IMFanoutChunk chunk;
+        {
+            QMutexLocker locker(&strand->mutex);
+            if (strand->chunks.isEmpty())
+            {
+                strand->scheduled = false;
+                return;
+            }
+            chunk = strand->chunks.dequeue();
+        }
+
+        for (int i = chunk.begin; i < chunk.end; ++i)
+        {
+            const IMConnectionPtr &connection = chunk.recipients.at(i);
+            if (connection->id() == chunk.exceptID)
+                continue;
+            bool traced = !chunk.tracedFrame.isEmpty() && connection->traceEnabled();
+            connection->send(chunk.priority, traced ? chunk.tracedFrame : chunk.frame);
+        }
+        // 最后一个执行完的分发块发出完成通知，此时其他分发块都已经进入了接收者的发送队列
+        if (!chunk.completion.isNull() && !chunk.completion->remaining.deref())
+            chunk.completion->connection->send(chunk.completion->priority, chunk.completion->frame);
+        // 发送完成后才减少计数，isBusy返回false时所有分发块都已经进入了连接的发送队列
+        m_pendingChunks.deref();
+    }
+
+    // 还有没执行的分发块，放回所属线程的队列，scheduled保持为true
+    {
+        QMutexLocker locker(&strand->mutex);
+        if (strand->chunks.isEmpty())
+        {
+            strand->scheduled = false;
+            return;
+        }
+    }
+    m_workers.at(strand->home)->push(strand);
+    m_workers.at(strand->home)->wake();
+}
@@ -0,0 +1,318 @@
+#ifndef IMWORKERPOOL_H
+#define IMWORKERPOOL_H
+
+#include <QObject>
+#include <QThread>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QQueue>
+#include <QVector>
+#include <QList>
+#include "protocol.h"
+#include "imconnection.h"
+
+/***********************************
+ *
+ * Class IMWorkerPool
+ * 工作线程池
+ *
+ * 每个工作线程运行自己的事件循环，连接按编号 id % 线程数 分给各个线程，
+ * 连接的读写都在所属的线程中进行
+ * 连接编号由allocateID按线程分配，监听线程接受的连接就属于监听线程自己
+ *
+ * 同时负责大规模群发的并行分发：
+ * 已登录的连接按编号 id % 分发串数 分到各个分发串中，
+ * 分发串数是线程数的整数倍，所以一个分发串里的连接都属于同一个线程，
+ * 一条群发消息按分发串拆成若干分发块，放到分发串所属线程的任务队列中
+ *
+ * 顺序保证：
+ * 同一个分发串中的分发块按先后顺序执行，同一时间只会被一个线程执行，
+ * 所以每个接收者收到的消息顺序与服务端分发的顺序一致
+ * 还有分发块没执行完时，单独发给某人的帧也用send排到接收者所属分发串的后面，不会越过之前的群发
+ * 完成通知由最后一个执行完的分发块发出，这时整条消息已经进入了所有接收者的发送队列
+ *
+ * 任务窃取：
+ * 线程先执行自己队列头部的分发串，自己的队列空了就从其他线程队列的尾部偷一个来执行，
+ * 连接的发送队列是线程安全的，偷来的分发串也可以直接往其他线程的连接里放数据
+ *
+ **********************************/
+
+class IMWorkerPool;
+
+/**
+ * @brief 一次并行分发的完成通知，最后一个执行完的分发块把frame发给connection
+ */
+struct IMFanoutCompletion
+{
+    /**
+     * @brief remaining 还没执行完的分发块数
+     */
+    QAtomicInt remaining;
+
+    /**
+     * @brief connection 接收通知的连接
+     */
+    IMConnectionPtr connection;
+
+    /**
+     * @brief frame 通知的帧
+     */
+    QByteArray frame;
+
+    /**
+     * @brief priority 通知的优先级
+     */
+    MessagePriority priority;
+};
+
+typedef QSharedPointer<IMFanoutCompletion> IMFanoutCompletionPtr;
+
+/**
+ * @brief 分发块，一条消息发给某个分发串中的一段接收者
+ */
+struct IMFanoutChunk
+{
+    /**
+     * @brief recipients 分发时分发串成员的快照，与分发串共享同一份数据
+     */
+    QVector<IMConnectionPtr> recipients;
+
+    /**
+     * @brief begin 本块负责的第一个接收者下标
+     */
+    int begin;
+
+    /**
+     * @brief end 本块负责的最后一个接收者的下一个下标
+     */
+    int end;
+
+    /**
+     * @brief frame 已经编码好的帧，所有接收者共享同一份
+     */
+    QByteArray frame;
+
+    /**
+     * @brief tracedFrame 带时间戳块的同一帧，发给打开了延迟跟踪的接收者，为空时都发frame
+     */
+    QByteArray tracedFrame;
+
+    /**
+     * @brief priority 优先级
+     */
+    MessagePriority priority;
+
+    /**
+     * @brief exceptID 不发送的连接编号，0表示都发送
+     */
+    quint64 exceptID;
+
+    /**
+     * @brief completion 所属分发的完成通知，为空时不通知
+     */
+    IMFanoutCompletionPtr completion;
+};
+
+/**
+ * @brief 分发串，串中的分发块按顺序执行
+ */
+struct IMFanoutStrand
+{
+    /**
+     * @brief mutex 保护chunks和scheduled
+     */
+    QMutex mutex;
+
+    /**
+     * @brief chunks 等待执行的分发块
+     */
+    QQueue<IMFanoutChunk> chunks;
+
+    /**
+     * @brief scheduled 是否已经在某个线程的任务队列中或者正在执行
+     */
+    bool scheduled;
+
+    /**
+     * @brief members 分发串的成员，只在服务端线程中修改
+     */
+    QVector<IMConnectionPtr> members;
+
+    /**
+     * @brief home 所属的工作线程下标
+     */
+    int home;
+};
+
+/**
+ * @brief 工作线程中的任务执行者
+ */
+class IMWorker : public QObject
+{
+    Q_OBJECT
+
+public:
+    IMWorker(IMWorkerPool *pool, int index);
+
+    /**
+     * @brief push 将一个分发串放到任务队列尾部
+     */
+    void push(IMFanoutStrand *strand);
+
+    /**
+     * @brief pop 自己取任务，从队列头部取
+     * @return 没有任务时返回nullptr
+     */
+    IMFanoutStrand *pop();
+
+    /**
+     * @brief steal 被其他线程偷任务，从队列尾部取
+     * @return 没有任务时返回nullptr
+     */
+    IMFanoutStrand *steal();
+
+    /**
+     * @brief wake 唤醒这个线程执行任务，可以在任意线程调用
+     */
+    void wake();
+
+public slots:
+    /**
+     * @brief runTasks 执行自己的任务，没有了就去偷别人的
+     */
+    void runTasks();
+
+    /**
+     * @brief sync 什么都不做，用BlockingQueuedConnection调用时返回前这个线程已经处理完之前排队的事件
+     */
+    void sync() {}
+
+private:
+    IMWorkerPool *m_pool;
+    int m_index;
+    QMutex m_mutex;
+    QList<IMFanoutStrand *> m_tasks;
+    QAtomicInt m_wakePending;
+};
+
+class IMWorkerPool
+{
+public:
+    /**
+     * @brief IMWorkerPool 构造函数，启动所有工作线程
+     * @param threadCount 线程数
+     * @param strandsPerWorker 每个线程的分发串数
+     * @param chunkSize 每个分发块的接收者数
+     */
+    IMWorkerPool(int threadCount, int strandsPerWorker, int chunkSize);
+
+    /**
+     * @brief ~IMWorkerPool 停止并等待所有工作线程
+     * 线程停止后排队的调用不会再执行，删除之前先drain
+     */
+    ~IMWorkerPool();
+
+    /**
+     * @brief drain 等每个工作线程处理完已经排队的事件（排队的调用、deleteLater等），只能在服务端线程调用
+     */
+    void drain();
+
+    /**
+     * @brief threadCount 线程数
+     */
+    int threadCount() const { return m_threads.size(); }
+
+    /**
+     * @brief threadFor 连接所属的工作线程
+     * @param connectionID 连接编号
+     */
+    QThread *threadFor(quint64 connectionID) const { return m_threads.at(int(connectionID % quint64(m_threads.size()))); }
+
+    /**
+     * @brief thread 下标为index的工作线程
+     */
+    QThread *thread(int index) const { return m_threads.at(index); }
+
+    /**
+     * @brief allocateID 为属于某个线程的新连接分配编号，可以在任意线程调用
+     * 分配出的编号满足 id % 线程数 == threadIndex，且不为0
+     * @param threadIndex 工作线程下标
+     * @return 连接编号
+     */
+    quint64 allocateID(int threadIndex);
+
+    /**
+     * @brief addMember 把一个已登录的连接加入分发串，只能在服务端线程调用
+     */
+    void addMember(const IMConnectionPtr &connection);
+
+    /**
+     * @brief removeMember 把一个连接移出分发串，只能在服务端线程调用
+     */
+    void removeMember(const IMConnectionPtr &connection);
+
+    /**
+     * @brief fanout 并行地把一帧发给所有成员，只能在服务端线程调用
+     * @param frame 已经编码好的帧
+     * @param priority 优先级
+     * @param exceptID 不发送的连接编号，0表示都发送
+     * @param tracedFrame 带时间戳块的同一帧，发给打开了延迟跟踪的接收者，为空时都发frame
+     * @param completion 所有分发块都执行完以后才发出的通知，为空时不通知，没有成员时立即发出
+     */
+    void fanout(const QByteArray &frame, MessagePriority priority, quint64 exceptID,
+                const QByteArray &tracedFrame = QByteArray(),
+                const IMFanoutCompletionPtr &completion = IMFanoutCompletionPtr());
+
+    /**
+     * @brief send 把一帧排在接收者所属分发串已有的分发块后面发出，只能在服务端线程调用
+     * 线程池忙时单独发给某人的帧也要走这里，否则会跑到之前排队的群发前面去
+     * @param connection 接收者
+     * @param frame 已经编码好的帧
+     * @param priority 优先级
+     * @param completion 这一帧放入发送队列以后才发出的通知，为空时不通知
+     */
+    void send(const IMConnectionPtr &connection, const QByteArray &frame, MessagePriority priority,
+              const IMFanoutCompletionPtr &completion = IMFanoutCompletionPtr());
+
+    /**
+     * @brief isBusy 是否还有没执行完的分发块
+     * 有的话后续的群发与单独的转发也必须走线程池，否则可能跑到前面去
+     */
+    bool isBusy() const { return m_pendingChunks.load() > 0; }
+
+private:
+    friend class IMWorker;
+
+    /**
+     * @brief steal 从其他线程那里偷一个分发串
+     * @param thief 偷任务的线程下标
+     */
+    IMFanoutStrand *steal(int thief);
+
+    /**
+     * @brief enqueue 把一个分发块放到分发串的尾部，分发串还没有排队时放进所属线程的任务队列
+     * @return 分发串是否刚刚放进任务队列，是的话调用者负责唤醒线程
+     */
+    bool enqueue(IMFanoutStrand *strand, const IMFanoutChunk &chunk);
+
+    /**
+     * @brief runStrand 执行一个分发串中的分发块
+     */
+    void runStrand(IMFanoutStrand *strand);
+
+    /**
+     * @brief strandFor 连接所属的分发串
+     */
+    IMFanoutStrand *strandFor(quint64 connectionID) const { return m_strands.at(int(connectionID % quint64(m_strands.size()))); }
+
+private:
+    QVector<QThread *> m_threads;
+    QVector<IMWorker *> m_workers;
+    QVector<IMFanoutStrand *> m_strands;
+    // 每个线程已经分配出去的连接编号个数
+    QAtomicInteger<quint64> *m_sequences;
+    int m_chunkSize;
+    QAtomicInt m_pendingChunks;
+};
+
+#endif // IMWORKERPOOL_H